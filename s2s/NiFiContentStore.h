@@ -0,0 +1,58 @@
+/*
+ * Copyright 2017 Hortonworks, Inc.
+ * All rights reserved.
+ *
+ *   Hortonworks, Inc. licenses this file to you under the Apache License, Version 2.0
+ *   (the "License"); you may not use this file except in compliance with
+ *   the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ * See the associated NOTICE file for additional information regarding copyright ownership.
+ */
+
+#ifndef NiFiContentStore_h
+#define NiFiContentStore_h
+
+/* Visibility: Internal / Private
+ *
+ * This header declares classes and functionality that is only for use
+ * internally in the site to site library implementation and not designed
+ * for users of the site to site library.
+ */
+
+#import <Foundation/Foundation.h>
+
+/* A content-addressed file store for data packet content that is too large to keep inline in the queue database.
+ * Each distinct content is written once, to a file named by the SHA-256 digest of its bytes, and that digest is the
+ * content reference kept in the database row. The store does not track references; the database decides when a
+ * reference is no longer used and removes it. */
+@interface NiFiContentStore : NSObject
+
+@property (nonatomic, readonly, nonnull) NSString *directoryPath;
+
+- (nullable instancetype)initWithDirectoryPath:(nonnull NSString *)directoryPath;
+
+/* Writes the content if it is not already stored, and returns its reference */
+- (nullable NSString *)storeData:(nonnull NSData *)data error:(NSError *_Nullable *_Nullable)error;
+
+/* Returns the content, memory-mapped rather than read into memory */
+- (nullable NSData *)dataForContentRef:(nonnull NSString *)contentRef;
+
+- (BOOL)hasContentRef:(nonnull NSString *)contentRef;
+
+/* Returns the reference of every content in the store */
+- (nonnull NSArray<NSString *> *)allContentRefs;
+
+- (void)removeContentRef:(nonnull NSString *)contentRef;
+
+/* Removes the store directory and all content in it */
+- (void)removeAllContent;
+
+@end
+
+#endif /* NiFiContentStore_h */
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2017 Hortonworks, Inc.
+ * All rights reserved.
+ *
+ *   Hortonworks, Inc. licenses this file to you under the Apache License, Version 2.0
+ *   (the "License"); you may not use this file except in compliance with
+ *   the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ * See the associated NOTICE file for additional information regarding copyright ownership.
+ */
+
+#import <Foundation/Foundation.h>
+#import <CommonCrypto/CommonDigest.h>
+#import "NiFiContentStore.h"
+
+/********** ContentStore Implementation **********/
+
+@implementation NiFiContentStore
+
+- (nullable instancetype)initWithDirectoryPath:(nonnull NSString *)directoryPath {
+    self = [super init];
+    if (self) {
+        _directoryPath = directoryPath;
+        NSError *createError = nil;
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:directoryPath
+                                       withIntermediateDirectories:YES
+                                                        attributes:nil
+                                                             error:&createError]) {
+            NSLog(@"Could not create SiteToSite content store at '%@'. %@", directoryPath, createError.localizedDescription);
+            return nil;
+        }
+    }
+    return self;
+}
+
++ (nonnull NSString *)contentRefForData:(nonnull NSData *)data {
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(data.bytes, (CC_LONG)data.length, digest);
+    NSMutableString *contentRef = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        [contentRef appendFormat:@"%02x", digest[i]];
+    }
+    return contentRef;
+}
+
+- (nonnull NSString *)pathForContentRef:(nonnull NSString *)contentRef {
+    // content refs are hex digests, so they are always safe to use as file names
+    return [_directoryPath stringByAppendingPathComponent:contentRef];
+}
+
+- (nullable NSString *)storeData:(nonnull NSData *)data error:(NSError *_Nullable *_Nullable)error {
+    NSString *contentRef = [[self class] contentRefForData:data];
+    NSString *path = [self pathForContentRef:contentRef];
+    if ([[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        return contentRef; // same content is already stored
+    }
+    // atomic write, so a reader never sees a partial file under the final name
+    if (![data writeToFile:path options:NSDataWritingAtomic error:error]) {
+        return nil;
+    }
+    return contentRef;
+}
+
+- (nullable NSData *)dataForContentRef:(nonnull NSString *)contentRef {
+    NSError *readError = nil;
+    NSData *data = [NSData dataWithContentsOfFile:[self pathForContentRef:contentRef]
+                                          options:NSDataReadingMappedIfSafe
+                                            error:&readError];
+    if (!data) {
+        NSLog(@"Could not read SiteToSite content '%@'. %@", contentRef, readError.localizedDescription);
+    }
+    return data;
+}
+
+- (BOOL)hasContentRef:(nonnull NSString *)contentRef {
+    return [[NSFileManager defaultManager] fileExistsAtPath:[self pathForContentRef:contentRef]];
+}
+
+- (nonnull NSArray<NSString *> *)allContentRefs {
+    return [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_directoryPath error:nil] ?: @[];
+}
+
+- (void)removeContentRef:(nonnull NSString *)contentRef {
+    // an open mapping of the file stays valid after it is removed
+    [[NSFileManager defaultManager] removeItemAtPath:[self pathForContentRef:contentRef] error:nil];
+}
+
+- (void)removeAllContent {
+    [[NSFileManager defaultManager] removeItemAtPath:_directoryPath error:nil];
+}
+
+@end
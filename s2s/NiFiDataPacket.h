@@ -28,13 +28,44 @@
 #import <Foundation/Foundation.h>
 #import "NiFiSiteToSite.h"
 
+/* CRC32 (IEEE 802.3 polynomial, as used by zlib and the NiFi server) of length bytes, continuing from crc.
+ * Uses the CPU's CRC32 instructions when the target supports them, and zlib otherwise.
+ * Pass 0 for crc to start a new checksum. */
+FOUNDATION_EXPORT uint32_t NiFiCrc32Update(uint32_t crc, const void *_Nullable bytes, NSUInteger length);
+
+/* Returns the CRC32 of two concatenated byte sequences, given the CRC32 of each and the length of the second. */
+FOUNDATION_EXPORT uint32_t NiFiCrc32Combine(uint32_t crc1, uint32_t crc2, NSUInteger length2);
+
+/* Block called for each chunk of encoded data when enumerating the encoder output.
+ * Return NO to stop the enumeration early (e.g., on a write error). */
+typedef BOOL (^NiFiEncodedDataChunkBlock)(NSData *_Nonnull chunk);
+
+/* Encodes data packets into the wire format of the StandardFlowFileCodec.
+ *
+ * By default, the encoder buffers the entire encoded batch in memory.
+ * An encoder created with initWithStreamingChunkSize: instead only keeps the (small) per-packet
+ * headers and a reference to each packet's content stream. Content is read from the packets'
+ * input streams and emitted chunk by chunk as the encoded data is consumed, so peak memory
+ * is bounded by the chunk size rather than the batch size. In streaming mode, the encoded
+ * data can only be consumed once, and the CRC checksum is only complete after it has been.
+ *
+ * The CRC checksum is maintained incrementally, so getEncodedDataCrcChecksum does not depend on the batch size. */
 @interface NiFiDataPacketEncoder : NSObject
-// + (nonnull NSData *)encodeDataPacket:(nonnull NiFiDataPacket *)dataPacket;
++ (nonnull NSData *)encodeDataPacket:(nonnull NiFiDataPacket *)dataPacket // the wire format of a single packet, e.g., to queue it pre-encoded,
+                          crcChecksum:(nullable uint32_t *)crcChecksum;   // and the CRC32 of those bytes, for appendEncodedData:crcChecksum:dataPacketCount:
++ (nullable NiFiDataPacket *)decodeDataPacket:(nonnull NSData *)encodedData; // inverse of encodeDataPacket:, nil unless the bytes are exactly one packet
 - (nonnull instancetype)init;
+- (nonnull instancetype)initWithStreamingChunkSize:(NSUInteger)chunkSize; // pass 0 for the default, buffered encoder
+- (BOOL)isStreaming;
 - (void)appendDataPacket:(nonnull NiFiDataPacket *)dataPacket;
 - (void)appendData:(nonnull NSData *)data; // used by socket transaction send data
-- (nonnull NSData *)getEncodedData;
+- (void)appendEncodedData:(nonnull NSData *)encodedData   // appends bytes that were encoded separately, e.g., by another encoder,
+               crcChecksum:(uint32_t)crcChecksum         // whose checksum is combined rather than recomputed
+           dataPacketCount:(NSUInteger)dataPacketCount;
+- (nonnull NSData *)getEncodedData; // in streaming mode, this materializes (and consumes) the whole batch
 - (nonnull NSInputStream *)getEncodedDataStream;
+- (BOOL)enumerateEncodedDataChunksUsingBlock:(nonnull NiFiEncodedDataChunkBlock)block
+                                       error:(NSError *_Nullable *_Nullable)error;
 - (NSUInteger)getDataPacketCount;
 - (NSUInteger)getEncodedDataCrcChecksum;
 - (NSUInteger)getEncodedDataByteLength;
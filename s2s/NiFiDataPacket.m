@@ -17,8 +17,12 @@
 
 #import <Foundation/Foundation.h>
 #import <zlib.h>
+#if defined(__ARM_FEATURE_CRC32)
+#import <arm_acle.h>
+#endif
 #import "NiFiSiteToSiteClient.h"
 #import "NiFiDataPacket.h"
+#import "NiFiError.h"
 
 /********** NiFiDataPacket Class Cluster Implementation **********/
 
@@ -150,6 +154,9 @@
     
     NSMutableData* result = [NSMutableData dataWithCapacity:_dataLength];
     @try {
+        if ([_dataStream streamStatus] == NSStreamStatusNotOpen) {
+            [_dataStream open];
+        }
         while (true) {
             NSInteger n = [_dataStream read:buf maxLength:bufsize];
             if (n < 0) {
@@ -214,24 +221,148 @@
 @end
 
 
+/********** CRC32 Implementation **********/
+
+uint32_t NiFiCrc32Update(uint32_t crc, const void *_Nullable bytes, NSUInteger length) {
+    if (bytes == NULL || length == 0) {
+        return crc;
+    }
+    const uint8_t *p = bytes;
+#if defined(__ARM_FEATURE_CRC32)
+    // ARMv8 CRC32 instructions use the same (IEEE 802.3) polynomial as zlib and NiFi's java.util.zip.CRC32,
+    // and need no lookup tables, so they stay fast even when the tables would not be in cache.
+    crc = ~crc;
+    while (length > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32b(crc, *p++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = __crc32d(crc, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = __crc32b(crc, *p++);
+        length--;
+    }
+    return ~crc;
+#else
+    // No usable CRC instruction for this polynomial (e.g., the x86 SSE4.2 instruction is CRC32-C), so use zlib.
+    while (length > 0) {
+        uInt n = (uInt)MIN(length, (NSUInteger)UINT_MAX);
+        crc = (uint32_t)crc32(crc, p, n);
+        p += n;
+        length -= n;
+    }
+    return crc;
+#endif
+}
+
+uint32_t NiFiCrc32Combine(uint32_t crc1, uint32_t crc2, NSUInteger length2) {
+    return (uint32_t)crc32_combine(crc1, crc2, (z_off_t)length2);
+}
+
+
 /********** DataPacketWriter/Encoder Implementations **********/
 
 @interface NiFiDataPacketEncoder()
-@property (nonatomic, retain, nonnull) NSMutableData *encodedData;
+@property (nonatomic, retain, nonnull) NSMutableData *encodedData; // in streaming mode, only holds header bytes not yet added to segments
+@property (nonatomic, retain, nullable) NSMutableArray *segments;  // streaming mode only. NSData (headers) and NiFiDataPacket (content) in wire order
+@property (nonatomic) NSUInteger segmentsByteLength;
+@property (nonatomic) NSUInteger chunkSize;
+@property (nonatomic) BOOL hasBeenConsumed;
+@property (nonatomic) uint32_t crcChecksum; // kept up to date as bytes are appended (buffered) or emitted (streaming)
 @property (nonatomic) NSUInteger dataPacketCount;
 @end
 
 @implementation NiFiDataPacketEncoder
 
 - (nonnull instancetype) init {
+    return [self initWithStreamingChunkSize:0];
+}
+
+- (nonnull instancetype) initWithStreamingChunkSize:(NSUInteger)chunkSize {
     self = [super init];
     if(self != nil) {
         _encodedData = [[NSMutableData alloc] init];
         _dataPacketCount = 0;
+        _chunkSize = chunkSize;
+        _segments = chunkSize > 0 ? [NSMutableArray array] : nil;
+        _segmentsByteLength = 0;
+        _hasBeenConsumed = NO;
+        _crcChecksum = 0;
     }
     return self;
 }
 
+- (BOOL) isStreaming {
+    return _segments != nil;
+}
+
++ (nonnull NSData *)encodeDataPacket:(nonnull NiFiDataPacket *)dataPacket crcChecksum:(nullable uint32_t *)crcChecksum {
+    NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+    [encoder appendDataPacket:dataPacket];
+    if (crcChecksum) {
+        *crcChecksum = encoder.crcChecksum;
+    }
+    return encoder.encodedData;
+}
+
++ (nullable NiFiDataPacket *)decodeDataPacket:(nonnull NSData *)encodedData {
+    const uint8_t *bytes = encodedData.bytes;
+    NSUInteger length = encodedData.length;
+    NSUInteger offset = 0;
+
+    uint32_t wireInt32;
+    uint64_t wireInt64;
+    if (offset + 4 > length) {
+        return nil;
+    }
+    memcpy(&wireInt32, bytes + offset, 4);
+    offset += 4;
+    int32_t attributeCount = (int32_t)CFSwapInt32BigToHost(wireInt32);
+    if (attributeCount < 0) {
+        return nil;
+    }
+
+    NSMutableDictionary *attributes = [NSMutableDictionary dictionaryWithCapacity:attributeCount];
+    for (int32_t i = 0; i < attributeCount; i++) {
+        NSString *keyAndValue[2];
+        for (int j = 0; j < 2; j++) {
+            if (offset + 4 > length) {
+                return nil;
+            }
+            memcpy(&wireInt32, bytes + offset, 4);
+            offset += 4;
+            int32_t stringLength = (int32_t)CFSwapInt32BigToHost(wireInt32);
+            if (stringLength < 0 || offset + stringLength > length) {
+                return nil;
+            }
+            keyAndValue[j] = [[NSString alloc] initWithBytes:(bytes + offset) length:stringLength encoding:NSUTF8StringEncoding];
+            offset += stringLength;
+            if (!keyAndValue[j]) {
+                return nil;
+            }
+        }
+        attributes[keyAndValue[0]] = keyAndValue[1];
+    }
+
+    if (offset + 8 > length) {
+        return nil;
+    }
+    memcpy(&wireInt64, bytes + offset, 8);
+    offset += 8;
+    int64_t dataLength = (int64_t)CFSwapInt64BigToHost(wireInt64);
+    if (dataLength < 0 || offset + dataLength != length) {
+        return nil;
+    }
+
+    NSData *data = [encodedData subdataWithRange:NSMakeRange(offset, (NSUInteger)dataLength)];
+    return [NiFiDataPacket dataPacketWithAttributes:attributes data:data];
+}
+
 - (void) appendDataPacket:(nonnull NiFiDataPacket *)dataPacket {
     // Append number of data packet attributes that will follow
     int32_t attributeCount = (int32_t)dataPacket.attributes.count;
@@ -245,39 +376,230 @@
     // Append size of data packet content that will follow
     [self appendInt64:[dataPacket dataLength]];
     // Append data packet content
-    [_encodedData appendData:[dataPacket data]];
+    if ([self isStreaming]) {
+        // defer reading the content until the encoded data is consumed
+        [self flushPendingHeaderSegment];
+        if ([dataPacket dataLength] > 0) {
+            [_segments addObject:dataPacket];
+            _segmentsByteLength += [dataPacket dataLength];
+        }
+    } else {
+        NSData *content = [dataPacket data];
+        if (content) {
+            [self appendBytes:content.bytes length:content.length];
+        }
+    }
     
     _dataPacketCount++;
 }
 
 - (void) appendData:(NSData *)data {
     if (data) {
-        [_encodedData appendData:data];
+        [self appendBytes:data.bytes length:data.length];
+    }
+}
+
+- (void) appendEncodedData:(nonnull NSData *)encodedData
+               crcChecksum:(uint32_t)crcChecksum
+           dataPacketCount:(NSUInteger)dataPacketCount {
+    if (!encodedData) {
+        return;
+    }
+    if ([self isStreaming]) {
+        // kept as its own segment, e.g., memory-mapped stored content, and copied a chunk at a time when consumed
+        [self flushPendingHeaderSegment];
+        if (encodedData.length > 0) {
+            [_segments addObject:[encodedData copy]];
+            _segmentsByteLength += encodedData.length;
+        }
+    } else {
+        [_encodedData appendData:encodedData];
+        // the checksum of the separately encoded chunk is folded in without re-reading its bytes
+        _crcChecksum = NiFiCrc32Combine(_crcChecksum, crcChecksum, encodedData.length);
+    }
+    _dataPacketCount += dataPacketCount;
+}
+
+- (void) appendBytes:(const void *)bytes length:(NSUInteger)length {
+    [_encodedData appendBytes:bytes length:length];
+    if (![self isStreaming]) {
+        _crcChecksum = NiFiCrc32Update(_crcChecksum, bytes, length);
     }
 }
 
 - (void) appendInt32:(uint32_t)value {
     uint32_t wireValue = CFSwapInt32HostToBig(value); // converts to network order if necessary
-    [_encodedData appendBytes:&wireValue length:4];
+    [self appendBytes:&wireValue length:4];
 }
 
 - (void) appendInt64:(int64_t)value {
     uint64_t wireValue = CFSwapInt64HostToBig(value); // converts to network order if necessary
-    [_encodedData appendBytes:&wireValue length:8];
+    [self appendBytes:&wireValue length:8];
 }
 
 - (void) appendString:(NSString *)value {
-    int32_t length = (int32_t)value.length;
+    // length prefix is the UTF-8 byte length, which differs from value.length for non-ASCII strings
+    int32_t length = (int32_t)[value lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
     [self appendInt32:length];
-    [_encodedData appendBytes:[value UTF8String] length:length];
+    [self appendBytes:[value UTF8String] length:length];
+}
+
+- (void) flushPendingHeaderSegment {
+    if (_encodedData.length > 0) {
+        [_segments addObject:[_encodedData copy]];
+        _segmentsByteLength += _encodedData.length;
+        [_encodedData setLength:0];
+    }
 }
 
 - (nonnull NSData *)getEncodedData {
-    return _encodedData;
+    if (![self isStreaming]) {
+        return _encodedData;
+    }
+    NSMutableData *materializedData = [NSMutableData dataWithCapacity:[self getEncodedDataByteLength]];
+    [self enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) {
+        [materializedData appendData:chunk];
+        return YES;
+    } error:nil];
+    return materializedData;
 }
 
 - (nonnull NSInputStream *)getEncodedDataStream {
-    return [NSInputStream inputStreamWithData:_encodedData];
+    if (![self isStreaming]) {
+        return [NSInputStream inputStreamWithData:_encodedData];
+    }
+    
+    // Pump the encoded data through a bound stream pair from a background task.
+    // The writes block once the pair's buffer is full, until the consumer of the input stream reads from it.
+    NSInputStream *inputStream = nil;
+    NSOutputStream *outputStream = nil;
+    [NSStream getBoundStreamsWithBufferSize:_chunkSize inputStream:&inputStream outputStream:&outputStream];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [outputStream open];
+        NSError *streamError = nil;
+        BOOL success = [self enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) {
+            return [[self class] writeData:chunk toOutputStream:outputStream];
+        } error:&streamError];
+        if (!success) {
+            NSLog(@"Error streaming encoded data packets. %@", streamError ? streamError.localizedDescription : @"");
+        }
+        [outputStream close];
+    });
+    return inputStream;
+}
+
+- (BOOL)enumerateEncodedDataChunksUsingBlock:(nonnull NiFiEncodedDataChunkBlock)block
+                                       error:(NSError *_Nullable *_Nullable)error {
+    if (![self isStreaming]) {
+        return _encodedData.length > 0 ? block(_encodedData) : YES;
+    }
+    
+    if (_hasBeenConsumed) {
+        if (error) {
+            *error = [NSError errorWithDomain:NiFiErrorDomain
+                                         code:NiFiErrorSiteToSiteTransactionDataPacketStreamFailed
+                                     userInfo:@{NSLocalizedDescriptionKey: @"Streaming encoded data can only be consumed once."}];
+        }
+        return NO;
+    }
+    _hasBeenConsumed = YES;
+    [self flushPendingHeaderSegment];
+    
+    uint8_t *buf = malloc(_chunkSize);
+    if (buf == NULL) {
+        if (error) {
+            *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteTransactionDataPacketStreamFailed userInfo:nil];
+        }
+        return NO;
+    }
+    
+    NSUInteger bufLength = 0;
+    BOOL success = YES;
+    BOOL contentStreamFailed = NO;
+    for (id segment in _segments) {
+        if ([segment isKindOfClass:[NSData class]]) {
+            NSData *header = segment;
+            NSUInteger offset = 0;
+            while (success && offset < header.length) {
+                NSUInteger n = MIN(_chunkSize - bufLength, header.length - offset);
+                memcpy(buf + bufLength, (const uint8_t *)header.bytes + offset, n);
+                bufLength += n;
+                offset += n;
+                if (bufLength == _chunkSize) {
+                    success = [self emitChunk:buf length:bufLength toBlock:block];
+                    bufLength = 0;
+                }
+            }
+        } else {
+            NiFiDataPacket *dataPacket = segment;
+            NSInputStream *contentStream = [dataPacket dataStream];
+            NSUInteger remaining = [dataPacket dataLength];
+            if (!contentStream) {
+                contentStreamFailed = YES;
+                success = NO;
+                break;
+            }
+            @try {
+                if ([contentStream streamStatus] == NSStreamStatusNotOpen) {
+                    [contentStream open];
+                }
+                while (success && remaining > 0) {
+                    NSInteger n = [contentStream read:(buf + bufLength) maxLength:MIN(_chunkSize - bufLength, remaining)];
+                    if (n <= 0) {
+                        // the stream ended before the advertised dataLength, so the wire format would be corrupt
+                        contentStreamFailed = YES;
+                        success = NO;
+                        break;
+                    }
+                    bufLength += n;
+                    remaining -= n;
+                    if (bufLength == _chunkSize) {
+                        success = [self emitChunk:buf length:bufLength toBlock:block];
+                        bufLength = 0;
+                    }
+                }
+            }
+            @catch (NSException * exn) {
+                contentStreamFailed = YES;
+                success = NO;
+            }
+            [contentStream close];
+        }
+        if (!success) {
+            break;
+        }
+    }
+    if (success && bufLength > 0) {
+        success = [self emitChunk:buf length:bufLength toBlock:block];
+    }
+    free(buf);
+    
+    if (contentStreamFailed && error) {
+        *error = [NSError errorWithDomain:NiFiErrorDomain
+                                     code:NiFiErrorSiteToSiteTransactionDataPacketStreamFailed
+                                 userInfo:@{NSLocalizedDescriptionKey: @"Could not read data packet content from its input stream."}];
+    }
+    return success;
+}
+
+- (BOOL)emitChunk:(const uint8_t *)bytes length:(NSUInteger)length toBlock:(nonnull NiFiEncodedDataChunkBlock)block {
+    @synchronized(self) {
+        _crcChecksum = NiFiCrc32Update(_crcChecksum, bytes, length);
+    }
+    return block([NSData dataWithBytes:bytes length:length]);
+}
+
++ (BOOL)writeData:(nonnull NSData *)data toOutputStream:(nonnull NSOutputStream *)outputStream {
+    const uint8_t *bytes = data.bytes;
+    NSUInteger offset = 0;
+    while (offset < data.length) {
+        NSInteger n = [outputStream write:(bytes + offset) maxLength:(data.length - offset)];
+        if (n <= 0) {
+            return NO;
+        }
+        offset += n;
+    }
+    return YES;
 }
 
 - (NSUInteger)getDataPacketCount {
@@ -285,11 +607,15 @@
 }
 
 - (NSUInteger)getEncodedDataCrcChecksum {
-    NSUInteger crcChecksum = crc32(0, _encodedData.bytes, (uint)_encodedData.length);
-    return crcChecksum;
+    @synchronized(self) {
+        return _crcChecksum;
+    }
 }
 
 - (NSUInteger)getEncodedDataByteLength {
+    if ([self isStreaming]) {
+        return _segmentsByteLength + _encodedData.length;
+    }
     return _encodedData.length;
 }
 
@@ -51,10 +51,12 @@ NS_ENUM(NSInteger)
     NiFiErrorSiteToSiteClientCouldNotLookupSiteToSiteInfo = 2002,
     NiFiErrorSiteToSiteClientCouldNotLookupInputPorts = 2003,
     NiFiErrorSiteToSiteClientCouldNotLookupPeers= 2004,
+    NiFiErrorSiteToSiteClientDestinationFull = 2005, // every peer reported its destination is full and is backing off
     
     // Site-to-Site Transaction
     NiFiErrorSiteToSiteTransaction = 3000,
     NiFiErrorSiteToSiteTransactionInvalidServerResponse = 3001,
+    NiFiErrorSiteToSiteTransactionDataPacketStreamFailed = 3002,
 
     // Site-to-Site Database
     NiFiErrorSiteToSiteDatabase = 4000,
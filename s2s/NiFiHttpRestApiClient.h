@@ -62,6 +62,13 @@
 
 - (nullable NSURL *)baseUrl;
 
+// How long controller info from getSiteToSiteInfo is reused by every client in the process for the same server and user.
+// Concurrent lookups share one request regardless. Defaults to 0, which does not reuse it once the request completes.
+@property (nonatomic, readwrite) NSTimeInterval siteToSiteInfoCacheTTL;
+
+// Drops the cached controller info for this server and user, so the next lookup fetches it from the server.
+- (void)invalidateCachedSiteToSiteInfo;
+
 - (nullable NSDictionary *)getSiteToSiteInfoOrError:(NSError *_Nullable *_Nullable)error;
 
 - (nullable NSDictionary *)getRemoteInputPortsOrError:(NSError *_Nullable *_Nullable)error;
@@ -81,6 +88,31 @@
                                       responseCode:(NiFiTransactionResponseCode)responseCode
                                              error:(NSError *_Nullable *_Nullable)error;
 
+// MARK: Non-blocking variants
+// The methods above block the calling thread until the server responds, and are implemented by waiting on these.
+// These return immediately, and call the completion handler exactly once, when the request completes or times out,
+// without a thread waiting in between. Completion handlers may run on the URL session's delegate queue, so should not block.
+
+- (void)getSiteToSiteInfoWithCompletionHandler:(void (^_Nonnull)(NSDictionary *_Nullable siteToSiteInfo, NSError *_Nullable error))completionHandler;
+
+- (void)getRemoteInputPortsWithCompletionHandler:(void (^_Nonnull)(NSDictionary *_Nullable portIdsByName, NSError *_Nullable error))completionHandler;
+
+- (void)getPeersWithCompletionHandler:(void (^_Nonnull)(NSArray<NiFiPeer *> *_Nullable peers, NSError *_Nullable error))completionHandler;
+
+- (void)initiateSendTransactionToPortId:(nonnull NSString *)portId
+                      completionHandler:(void (^_Nonnull)(NiFiTransactionResource *_Nullable transactionResource, NSError *_Nullable error))completionHandler;
+
+- (void)extendTTLForTransaction:(nonnull NSString *)transactionUrl
+              completionHandler:(void (^_Nonnull)(NSError *_Nullable error))completionHandler;
+
+- (void)sendFlowFiles:(nonnull NiFiDataPacketEncoder *)dataPacketEncoder
+      withTransaction:(nonnull NiFiTransactionResource *)transactionResource
+    completionHandler:(void (^_Nonnull)(NSInteger serverCrc, NSError *_Nullable error))completionHandler; // serverCrc is -1 if an error occured
+
+- (void)endTransaction:(nonnull NSString *)transactionUrl
+          responseCode:(NiFiTransactionResponseCode)responseCode
+     completionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler;
+
 @end
 
 #endif /* NiFiHttpRestApiClient_h */
@@ -76,14 +76,115 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
 @end
 
 
+/********** AuthTokenCache **********/
+
+static const double AUTH_TOKEN_REFRESH_FRACTION = 0.8; // refresh a token once this fraction of its lifetime has passed
+
+/* A cached auth token for one server and user. Entries are shared by every NiFiHttpRestApiClient in the process,
+ * so clients created per transaction or per peer refresh do not each have to fetch a token. */
+@interface NiFiAuthTokenCacheEntry : NSObject
+@property (nonatomic, retain, readwrite, nullable) NSString *authToken;
+@property (nonatomic, retain, readwrite, nullable) NSDate *expiration;
+@property (nonatomic, retain, readwrite, nullable) NSDate *refreshTime;
+@property (nonatomic, readwrite) BOOL isRefreshing;
+@property (nonatomic, retain, readonly, nonnull) NSObject *fetchLock; // held while fetching a token, so fetches are single-flight
+                                                                      // without blocking readers of a token that is still valid
++ (nonnull instancetype)entryForKey:(nonnull NSString *)key;
+- (void)updateWithEntry:(nonnull NiFiAuthTokenCacheEntry *)entry;
+- (BOOL)hasUnexpiredToken;
+@end
+
+@implementation NiFiAuthTokenCacheEntry
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _fetchLock = [[NSObject alloc] init];
+    }
+    return self;
+}
+
++ (nonnull instancetype)entryForKey:(nonnull NSString *)key {
+    static NSMutableDictionary<NSString *, NiFiAuthTokenCacheEntry *> *entries = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        entries = [NSMutableDictionary dictionary];
+    });
+    @synchronized(entries) {
+        NiFiAuthTokenCacheEntry *entry = entries[key];
+        if (!entry) {
+            entry = [[self alloc] init];
+            entries[key] = entry;
+        }
+        return entry;
+    }
+}
+
+- (void)updateWithEntry:(nonnull NiFiAuthTokenCacheEntry *)entry {
+    _authToken = entry.authToken;
+    _expiration = entry.expiration;
+    _refreshTime = entry.refreshTime;
+}
+
+- (BOOL)hasUnexpiredToken {
+    return _authToken && _expiration && [[NSDate date] compare:_expiration] == NSOrderedAscending;
+}
+
+@end
+
+
+/********** SiteToSiteInfoCache **********/
+
+/* Cached controller info (the response to GET /site-to-site) for one server and user. Like auth tokens, entries are
+ * shared by every NiFiHttpRestApiClient in the process. While a fetch is in flight, the completion handlers of other
+ * callers are queued on the entry and all are called with the result of that one request. */
+@interface NiFiSiteToSiteInfoCacheEntry : NSObject
+@property (nonatomic, retain, readwrite, nullable) NSDictionary *siteToSiteInfo;
+@property (nonatomic, retain, readwrite, nullable) NSDate *expiration;
+@property (nonatomic, retain, readwrite, nullable) NSMutableArray *pendingCompletionHandlers; // non-nil while a fetch is in flight
+@property (nonatomic, readwrite) NSUInteger generation; // incremented on invalidation, so a fetch started before it is not cached
++ (nonnull instancetype)entryForKey:(nonnull NSString *)key;
+@end
+
+@implementation NiFiSiteToSiteInfoCacheEntry
+
++ (nonnull instancetype)entryForKey:(nonnull NSString *)key {
+    static NSMutableDictionary<NSString *, NiFiSiteToSiteInfoCacheEntry *> *entries = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        entries = [NSMutableDictionary dictionary];
+    });
+    @synchronized(entries) {
+        NiFiSiteToSiteInfoCacheEntry *entry = entries[key];
+        if (!entry) {
+            entry = [[self alloc] init];
+            entries[key] = entry;
+        }
+        return entry;
+    }
+}
+
+@end
+
+
 /********** HttpRestApiClient **********/
 
+/* Runs asyncCall, which must call done exactly once, and waits for it.
+ * A call to this function will block. It is only designed to be called from a background thread, not a UI thread,
+ * and never from a completion handler, which would keep the URL session from completing the call. */
+static void NiFiWaitForAsyncCall(void (^asyncCall)(dispatch_block_t done)) {
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    asyncCall(^{
+        dispatch_semaphore_signal(semaphore);
+    });
+    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+}
+
+
 @interface NiFiHttpRestApiClient()
 @property (nonatomic, retain, readwrite, nonnull) NSURLComponents *baseUrlComponents;
 @property (nonatomic, retain, nonnull) NSObject<NSURLSessionProtocol> *urlSession;
 @property (nonatomic, retain, readwrite, nullable) NSURLCredential *credential;
-@property (nonatomic, retain, readwrite, nullable) NSString *authToken;
-@property (nonatomic, retain, readwrite, nullable) NSDate *authExpiration;
 @end
 
 @implementation NiFiHttpRestApiClient
@@ -110,7 +211,7 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
         _urlSession = urlSession;
         _baseUrlComponents = [NSURLComponents componentsWithURL:baseUrl resolvingAgainstBaseURL:false];
         _credential = credendtial;
-        _authToken = nil;
+        _siteToSiteInfoCacheTTL = 0.0;
         
         // Set base url path if none is specified
         if (nil == _baseUrlComponents.path || [_baseUrlComponents.path isEqualToString:@""]) {
@@ -129,6 +230,70 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
 // MARK: - Discovery
 
 - (nullable NSDictionary *)getSiteToSiteInfoOrError:(NSError *_Nullable *_Nullable)error {
+    __block NSDictionary *siteToSiteInfo = nil;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self getSiteToSiteInfoWithCompletionHandler:^(NSDictionary *result, NSError *resultError) {
+            siteToSiteInfo = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+    return siteToSiteInfo;
+}
+
+- (void)getSiteToSiteInfoWithCompletionHandler:(void (^_Nonnull)(NSDictionary *_Nullable siteToSiteInfo, NSError *_Nullable error))completionHandler {
+    NiFiSiteToSiteInfoCacheEntry *entry = [self siteToSiteInfoCacheEntry];
+    NSDictionary *cachedSiteToSiteInfo = nil;
+    NSUInteger generation;
+    @synchronized(entry) {
+        if (entry.siteToSiteInfo && entry.expiration && [entry.expiration timeIntervalSinceNow] > 0) {
+            cachedSiteToSiteInfo = entry.siteToSiteInfo;
+        } else if (entry.pendingCompletionHandlers) {
+            // another caller is already fetching, wait for its result instead of sending another request
+            [entry.pendingCompletionHandlers addObject:[completionHandler copy]];
+            return;
+        } else {
+            entry.pendingCompletionHandlers = [NSMutableArray arrayWithObject:[completionHandler copy]];
+        }
+        generation = entry.generation;
+    }
+    if (cachedSiteToSiteInfo) {
+        completionHandler(cachedSiteToSiteInfo, nil);
+        return;
+    }
+    
+    NSTimeInterval ttl = _siteToSiteInfoCacheTTL;
+    [self fetchSiteToSiteInfoWithCompletionHandler:^(NSDictionary *siteToSiteInfo, NSError *error) {
+        NSArray *completionHandlers;
+        @synchronized(entry) {
+            completionHandlers = entry.pendingCompletionHandlers;
+            entry.pendingCompletionHandlers = nil;
+            if (siteToSiteInfo && ttl > 0.0 && entry.generation == generation) {
+                entry.siteToSiteInfo = siteToSiteInfo;
+                entry.expiration = [NSDate dateWithTimeIntervalSinceNow:ttl];
+            }
+        }
+        for (void (^pendingCompletionHandler)(NSDictionary *, NSError *) in completionHandlers) {
+            pendingCompletionHandler(siteToSiteInfo, error);
+        }
+    }];
+}
+
+- (void)invalidateCachedSiteToSiteInfo {
+    NiFiSiteToSiteInfoCacheEntry *entry = [self siteToSiteInfoCacheEntry];
+    @synchronized(entry) {
+        entry.siteToSiteInfo = nil;
+        entry.expiration = nil;
+        entry.generation++;
+    }
+}
+
+/* Sends GET /site-to-site, bypassing the cache. */
+- (void)fetchSiteToSiteInfoWithCompletionHandler:(void (^_Nonnull)(NSDictionary *_Nullable siteToSiteInfo, NSError *_Nullable error))completionHandler {
     NSURLComponents * urlComponents = [_baseUrlComponents copy];
     urlComponents.path = [NSString stringWithFormat:@"%@/site-to-site", urlComponents.path];
     NSURL *url = urlComponents.URL;
@@ -140,94 +305,106 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
     NSDictionary *headers = @{@"Accept": @"application/json"};
     [request setAllHTTPHeaderFields:headers];
     
-    [self addAuthTokenHeaderToRequest:&request error:error];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    NSError *dataTaskError;
-    
-    [self synchronousDataTaskWithRequest:request
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:&dataTaskError];
-    
-    if (response == nil) {
-        if (error) {
-            *error = dataTaskError ?: [NSError errorWithDomain:NiFiErrorDomain
-                                                          code:NiFiErrorSiteToSiteClientCouldNotLookupSiteToSiteInfo
-                                                      userInfo:nil];
+    [self sendRequest:request completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        if (response == nil) {
+            NSLog(@"Unable to discover site-to-site info. Error communicating with peer.");
+            completionHandler(nil, requestError ?: [NSError errorWithDomain:NiFiErrorDomain
+                                                                       code:NiFiErrorSiteToSiteClientCouldNotLookupSiteToSiteInfo
+                                                                   userInfo:nil]);
+            return;
+        } else if (response.statusCode != 200) {
+            NSLog(@"Unable to discover site-to-site info. Server returned status code '%ld'.", (long)response.statusCode);
+            completionHandler(nil, [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorHttpStatusCode + response.statusCode userInfo:nil]);
+            return;
         }
-        NSLog(@"Unable to discover site-to-site info. Error communicating with peer.");
-        return nil;
-    } else if (response.statusCode != 200) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorHttpStatusCode + response.statusCode userInfo:nil];
-        }
-        NSLog(@"Unable to discover site-to-site info. Server returned status code '%ld'.", (long)response.statusCode);
-        return nil;
-    }
-    
-    // Response body should be JSON with site-to-site info
-    NSError *jsonError;
-    NSDictionary *siteToSiteInfo = [NSJSONSerialization JSONObjectWithData:data
-                                                                   options:0
-                                                                     error:&jsonError];
-    if (jsonError) {
-        if (error) {
-            *error = jsonError;
+        
+        // Response body should be JSON with site-to-site info
+        NSError *jsonError;
+        NSDictionary *siteToSiteInfo = [NSJSONSerialization JSONObjectWithData:data
+                                                                       options:0
+                                                                         error:&jsonError];
+        if (jsonError) {
             NSLog(@"Unable to discover site-to-site info. Error deserializing JSON response.");
-            return nil;
+            completionHandler(nil, jsonError);
+            return;
         }
-    }
-    
-    return siteToSiteInfo;
+        
+        completionHandler(siteToSiteInfo, nil);
+    }];
 }
 
 - (nullable NSDictionary *)getRemoteInputPortsOrError:(NSError *_Nullable *_Nullable)error {
-    
-    NSError *siteToSiteInfoError;
-    NSDictionary *siteToSiteInfo = [self getSiteToSiteInfoOrError:&siteToSiteInfoError];
-    
-    if (!siteToSiteInfo) {
-        if (siteToSiteInfoError && *error) {
-            *error = siteToSiteInfoError;
-        }
-        return nil;
+    __block NSDictionary *portIdsByName = nil;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self getRemoteInputPortsWithCompletionHandler:^(NSDictionary *result, NSError *resultError) {
+            portIdsByName = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
     }
+    return portIdsByName;
+}
 
-    NSMutableDictionary *portIdsByName = nil;
-    if (siteToSiteInfo && siteToSiteInfo[@"controller"]) {
-        NSArray *inputPorts = siteToSiteInfo[@"controller"][@"inputPorts"];
-        if (inputPorts) {
-            portIdsByName = [NSMutableDictionary dictionary];
-            for (NSDictionary *inputPort in inputPorts) {
-                if (inputPort[@"id"] && inputPort[@"name"]) {
-                    NSString *existingIdValue = [portIdsByName objectForKey:inputPort[@"name"]];
-                    if (!existingIdValue) {
-                        [portIdsByName setValue:inputPort[@"id"] forKey:inputPort[@"name"]];
-                    } else {
-                        NSLog(@"WARNING: NiFI peer API reporting duplicate input ports named '%@'. '%@' and '%@' both found. Using '%@'",
-                              inputPort[@"name"],
-                              existingIdValue, inputPort[@"id"],
-                              existingIdValue);
+- (void)getRemoteInputPortsWithCompletionHandler:(void (^_Nonnull)(NSDictionary *_Nullable portIdsByName, NSError *_Nullable error))completionHandler {
+    
+    [self getSiteToSiteInfoWithCompletionHandler:^(NSDictionary *siteToSiteInfo, NSError *siteToSiteInfoError) {
+        if (!siteToSiteInfo) {
+            completionHandler(nil, siteToSiteInfoError);
+            return;
+        }
+        
+        NSMutableDictionary *portIdsByName = nil;
+        if (siteToSiteInfo[@"controller"]) {
+            NSArray *inputPorts = siteToSiteInfo[@"controller"][@"inputPorts"];
+            if (inputPorts) {
+                portIdsByName = [NSMutableDictionary dictionary];
+                for (NSDictionary *inputPort in inputPorts) {
+                    if (inputPort[@"id"] && inputPort[@"name"]) {
+                        NSString *existingIdValue = [portIdsByName objectForKey:inputPort[@"name"]];
+                        if (!existingIdValue) {
+                            [portIdsByName setValue:inputPort[@"id"] forKey:inputPort[@"name"]];
+                        } else {
+                            NSLog(@"WARNING: NiFI peer API reporting duplicate input ports named '%@'. '%@' and '%@' both found. Using '%@'",
+                                  inputPort[@"name"],
+                                  existingIdValue, inputPort[@"id"],
+                                  existingIdValue);
+                        }
                     }
                 }
             }
         }
-    }
-    if (!portIdsByName) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain
-                                         code:NiFiErrorSiteToSiteClientCouldNotLookupInputPorts userInfo:nil];
+        if (!portIdsByName) {
+            NSLog(@"Unable to discover remote input ports. No input ports found in JSON response. Possible protocol error.");
+            completionHandler(nil, [NSError errorWithDomain:NiFiErrorDomain
+                                                       code:NiFiErrorSiteToSiteClientCouldNotLookupInputPorts userInfo:nil]);
+            return;
         }
-        NSLog(@"Unable to discover remote input ports. No input ports found in JSON response. Possible protocol error.");
-        return nil;
-    }
-    
-    return portIdsByName;
+        
+        completionHandler(portIdsByName, nil);
+    }];
 }
 
 - (nullable NSArray<NiFiPeer *> *)getPeersOrError:(NSError *_Nullable *_Nullable)error {
+    __block NSArray<NiFiPeer *> *peers = nil;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self getPeersWithCompletionHandler:^(NSArray<NiFiPeer *> *result, NSError *resultError) {
+            peers = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+    return peers;
+}
+
+- (void)getPeersWithCompletionHandler:(void (^_Nonnull)(NSArray<NiFiPeer *> *_Nullable peers, NSError *_Nullable error))completionHandler {
     
     NSURLComponents * urlComponents = [_baseUrlComponents copy];
     urlComponents.path = [NSString stringWithFormat:@"%@/site-to-site/peers", urlComponents.path];
@@ -241,87 +418,87 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
                               HTTP_HEADER_PROTOCOL_VERSION: HTTP_SITE_TO_SITE_PROTOCOL_VERSION};
     [request setAllHTTPHeaderFields:headers];
     
-    [self addAuthTokenHeaderToRequest:&request error:error];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    NSError *dataTaskError;
-    
-    [self synchronousDataTaskWithRequest:request
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:&dataTaskError];
-    
-    if (response == nil) {
-        if (error) {
-            *error = dataTaskError ?: [NSError errorWithDomain:NiFiErrorDomain
-                                                          code:NiFiErrorSiteToSiteClientCouldNotLookupPeers
-                                                      userInfo:nil];
-        }
-        NSLog(@"Unable to discover peers in remote cluster.");
-        return nil;
-    } else if (response.statusCode != 200) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorHttpStatusCode + response.statusCode userInfo:nil];
+    [self sendRequest:request completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        if (response == nil) {
+            NSLog(@"Unable to discover peers in remote cluster.");
+            completionHandler(nil, requestError ?: [NSError errorWithDomain:NiFiErrorDomain
+                                                                       code:NiFiErrorSiteToSiteClientCouldNotLookupPeers
+                                                                   userInfo:nil]);
+            return;
+        } else if (response.statusCode != 200) {
+            NSLog(@"Unable to discover peers in remote cluster. Server returned status code '%ld'.", (long)response.statusCode);
+            completionHandler(nil, [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorHttpStatusCode + response.statusCode userInfo:nil]);
+            return;
         }
-        NSLog(@"Unable to discover peers in remote cluster. Server returned status code '%ld'.", (long)response.statusCode);
-        return nil;
-    }
-    
-    // Response body should be JSON with site-to-site info
-    NSError *jsonError;
-    NSDictionary *bodyJson = [NSJSONSerialization JSONObjectWithData:data
-                                                             options:0
-                                                               error:&jsonError];
-    if (jsonError) {
-        if (error) {
-            *error = jsonError;
+        
+        // Response body should be JSON with site-to-site info
+        NSError *jsonError;
+        NSDictionary *bodyJson = [NSJSONSerialization JSONObjectWithData:data
+                                                                 options:0
+                                                                   error:&jsonError];
+        if (jsonError) {
             NSLog(@"Unable to discover peers in remote cluster. Error deserializing JSON response.");
-            return nil;
+            completionHandler(nil, jsonError);
+            return;
         }
-    }
-    
-    NSMutableArray *peers = nil;
-    if (bodyJson && bodyJson[@"peers"]) {
-        peers = [NSMutableArray arrayWithCapacity:[bodyJson[@"peers"] count]];
-        for (NSDictionary *peerJson in bodyJson[@"peers"]) {
-            
-            NiFiPeer *peer = nil;
-            if (peerJson[@"hostname"]) {
+        
+        NSMutableArray *peers = nil;
+        if (bodyJson && bodyJson[@"peers"]) {
+            peers = [NSMutableArray arrayWithCapacity:[bodyJson[@"peers"] count]];
+            for (NSDictionary *peerJson in bodyJson[@"peers"]) {
                 
-                NSURLComponents *peerUrlComponents = [[NSURLComponents alloc] init];
-                peerUrlComponents.host = peerJson[@"hostname"];
-                peerUrlComponents.port = peerJson[@"port"];
-                BOOL isSecurePeer = (peerJson[@"secure"] && [peerJson[@"secure"] boolValue]);
-                peerUrlComponents.scheme = isSecurePeer ? @"https" : @"http";
-                NSURL *peerUrl = peerUrlComponents.URL;
-                if (peerUrl) {
-                    peer = [NiFiPeer peerWithUrl:peerUrl];
-                    if (peerJson[@"flowFileCount"]) {
-                        peer.flowFileCount = [peerJson[@"flowFileCount"] integerValue];
+                NiFiPeer *peer = nil;
+                if (peerJson[@"hostname"]) {
+                    
+                    NSURLComponents *peerUrlComponents = [[NSURLComponents alloc] init];
+                    peerUrlComponents.host = peerJson[@"hostname"];
+                    peerUrlComponents.port = peerJson[@"port"];
+                    BOOL isSecurePeer = (peerJson[@"secure"] && [peerJson[@"secure"] boolValue]);
+                    peerUrlComponents.scheme = isSecurePeer ? @"https" : @"http";
+                    NSURL *peerUrl = peerUrlComponents.URL;
+                    if (peerUrl) {
+                        peer = [NiFiPeer peerWithUrl:peerUrl];
+                        if (peerJson[@"flowFileCount"]) {
+                            peer.flowFileCount = [peerJson[@"flowFileCount"] integerValue];
+                        }
+                        [peers addObject:peer];
                     }
-                    [peers addObject:peer];
                 }
             }
         }
-    }
-    if (!peers) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain
-                                         code:NiFiErrorSiteToSiteClientCouldNotLookupPeers
-                                     userInfo:nil];
+        if (!peers) {
+            NSLog(@"Unable to discover peers in remote cluster. No peers found in JSON response. Possible protocol error.");
+            completionHandler(nil, [NSError errorWithDomain:NiFiErrorDomain
+                                                       code:NiFiErrorSiteToSiteClientCouldNotLookupPeers
+                                                   userInfo:nil]);
+            return;
         }
-        NSLog(@"Unable to discover peers in remote cluster. No peers found in JSON response. Possible protocol error.");
-        return nil;
-    }
-    
-    return peers;
+        
+        completionHandler(peers, nil);
+    }];
 }
 
 // MARK: - S2S HTTP Transaction
 
 - (nullable NiFiTransactionResource *)initiateSendTransactionToPortId:(nonnull NSString *)portId
                                                                 error:(NSError **)error {
+    __block NiFiTransactionResource *transactionResource = nil;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self initiateSendTransactionToPortId:portId completionHandler:^(NiFiTransactionResource *result, NSError *resultError) {
+            transactionResource = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+    return transactionResource;
+}
+
+- (void)initiateSendTransactionToPortId:(nonnull NSString *)portId
+                      completionHandler:(void (^_Nonnull)(NiFiTransactionResource *_Nullable transactionResource, NSError *_Nullable error))completionHandler {
     
     NSURLComponents * urlComponents = [_baseUrlComponents copy];
     urlComponents.path = [NSString stringWithFormat:@"%@/data-transfer/input-ports/%@/transactions", urlComponents.path, portId];
@@ -336,87 +513,96 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
                               HTTP_HEADER_PROTOCOL_VERSION: HTTP_SITE_TO_SITE_PROTOCOL_VERSION};
     [request setAllHTTPHeaderFields:headers];
     
-    [self addAuthTokenHeaderToRequest:&request error:error];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    NSError *dataTaskError;
-    
-    [self synchronousDataTaskWithRequest:request
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:&dataTaskError];
-    
-    NiFiTransactionResource *transactionResource = nil;
-    if(!dataTaskError) {
-        switch (response.statusCode) {
-            case 200: // applying Postel's Principle to server response code
-            case 201: {
-                // Process response headers
-                NSDictionary *headers = response.allHeaderFields;
-                NSString *locationUriIntent = [headers objectForKey:HTTP_HEADER_LOCATION_URI_INTENT_NAME];
-                if (locationUriIntent && [locationUriIntent isEqualToString:HTTP_HEADER_LOCATION_URI_INTENT_VALUE]) {
-                    NSString *transactionUrl = [headers objectForKey:HTTP_HEADER_LOCATION];
-                    NSString *transactionId = [[transactionUrl componentsSeparatedByString:@"/"] lastObject];
-                    
-                    if (transactionId) {
-                        transactionResource = [[NiFiTransactionResource alloc] initWithTransactionId:transactionId];
-                        transactionResource.transactionUrl = transactionUrl;
-                        
-                        NSString *serverSideTtl = [headers objectForKey:HTTP_HEADER_SERVER_SIDE_TRANSACTION_TTL];
-                        if (serverSideTtl) {
-                            transactionResource.serverSideTtl = [serverSideTtl integerValue];
-                        }
+    [self sendRequest:request completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        NiFiTransactionResource *transactionResource = nil;
+        NSError *error = nil;
+        if(!requestError) {
+            switch (response.statusCode) {
+                case 200: // applying Postel's Principle to server response code
+                case 201: {
+                    // Process response headers
+                    NSDictionary *headers = response.allHeaderFields;
+                    NSString *locationUriIntent = [headers objectForKey:HTTP_HEADER_LOCATION_URI_INTENT_NAME];
+                    if (locationUriIntent && [locationUriIntent isEqualToString:HTTP_HEADER_LOCATION_URI_INTENT_VALUE]) {
+                        NSString *transactionUrl = [headers objectForKey:HTTP_HEADER_LOCATION];
+                        NSString *transactionId = [[transactionUrl componentsSeparatedByString:@"/"] lastObject];
                         
-                        // Process response body, which we expect to be in the form:
-                        // {"flowFileSent":0,
-                        //  "responseCode":1,
-                        //   "message":"Handshake properties are valid, and port is running.\
-                        //              A transaction is created:XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX"
-                        // }
-                        NSError *jsonError;
-                        NSDictionary *transactionJson = [NSJSONSerialization JSONObjectWithData:data options:kNilOptions error:&jsonError];
-                        if (!jsonError) {
-                            //flowFileSent
-                            NSNumber *flowFileSent = [transactionJson objectForKey:@"flowFileSent"];
-                            if (flowFileSent) {
-                                transactionResource.flowFilesSent = [flowFileSent unsignedIntegerValue];
+                        if (transactionId) {
+                            transactionResource = [[NiFiTransactionResource alloc] initWithTransactionId:transactionId];
+                            transactionResource.transactionUrl = transactionUrl;
+                            
+                            NSString *serverSideTtl = [headers objectForKey:HTTP_HEADER_SERVER_SIDE_TRANSACTION_TTL];
+                            if (serverSideTtl) {
+                                transactionResource.serverSideTtl = [serverSideTtl integerValue];
                             }
-                            //responseCode
-                            NSNumber *responseCode = [transactionJson objectForKey:@"responseCode"];
-                            if (responseCode) {
-                                transactionResource.lastResponseCode = (NiFiTransactionResponseCode)[responseCode integerValue];
+                            
+                            // Process response body, which we expect to be in the form:
+                            // {"flowFileSent":0,
+                            //  "responseCode":1,
+                            //   "message":"Handshake properties are valid, and port is running.\
+                            //              A transaction is created:XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX"
+                            // }
+                            NSError *jsonError;
+                            NSDictionary *transactionJson = [NSJSONSerialization JSONObjectWithData:data options:kNilOptions error:&jsonError];
+                            if (!jsonError) {
+                                //flowFileSent
+                                NSNumber *flowFileSent = [transactionJson objectForKey:@"flowFileSent"];
+                                if (flowFileSent) {
+                                    transactionResource.flowFilesSent = [flowFileSent unsignedIntegerValue];
+                                }
+                                //responseCode
+                                NSNumber *responseCode = [transactionJson objectForKey:@"responseCode"];
+                                if (responseCode) {
+                                    transactionResource.lastResponseCode = (NiFiTransactionResponseCode)[responseCode integerValue];
+                                }
+                                //message
+                                transactionResource.lastResponseMessage = [transactionJson objectForKey:@"message"];
+                            } else {
+                                // Note parsing the body can fail but if the response code was 201 the transaction was still created.
+                                // We will log it and return a transaction and an error output.
+                                error = jsonError;
                             }
-                            //message
-                            transactionResource.lastResponseMessage = [transactionJson objectForKey:@"message"];
-                        } else {
-                            // Note parsing the body can fail but if the response code was 201 the transaction was still created.
-                            // We will log it and return a transaction and an error output.
-                            *error = jsonError;
                         }
                     }
+                    
+                    break;
+                }
+                default: {
+                    NSMutableDictionary *errorDetail = [NSMutableDictionary dictionary];
+                    NSString *localizedDescription = [NSString stringWithFormat:@"Server responded with HTTP status code %ld", (long)response.statusCode];
+                    [errorDetail setValue:localizedDescription forKey:NSLocalizedDescriptionKey];
+                    error = [NSError errorWithDomain:NiFiErrorDomain
+                                                code:NiFiErrorHttpStatusCode + response.statusCode
+                                            userInfo:errorDetail];
                 }
-                
-                break;
-            }
-            default: {
-                NSMutableDictionary *errorDetail = [NSMutableDictionary dictionary];
-                NSString *localizedDescription = [NSString stringWithFormat:@"Server responded with HTTP status code %ld", (long)response.statusCode];
-                [errorDetail setValue:localizedDescription forKey:NSLocalizedDescriptionKey];
-                *error = [NSError errorWithDomain:@"NiFiSiteToSite" code:100 userInfo:errorDetail];
             }
+        } else {
+            error = requestError;
         }
-    } else {
-        *error = dataTaskError;
-    }
-    
-    if (!transactionResource || !transactionResource.transactionUrl) {
-        return nil;
-    }
-    return transactionResource;
+        
+        if (!transactionResource || !transactionResource.transactionUrl) {
+            completionHandler(nil, error);
+            return;
+        }
+        completionHandler(transactionResource, error);
+    }];
 }
 
 - (void)extendTTLForTransaction:(nonnull NSString *)transactionUrl error:(NSError **)error {
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self extendTTLForTransaction:transactionUrl completionHandler:^(NSError *resultError) {
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+}
+
+- (void)extendTTLForTransaction:(nonnull NSString *)transactionUrl
+              completionHandler:(void (^_Nonnull)(NSError *_Nullable error))completionHandler {
     NSURL *url = [NSURL URLWithString:transactionUrl];
     NSMutableURLRequest *ttlExtendRequest = [NSMutableURLRequest requestWithURL:url
                                                                     cachePolicy:NSURLRequestUseProtocolCachePolicy
@@ -426,85 +612,104 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
     NSDictionary *headers = @{HTTP_HEADER_PROTOCOL_VERSION: HTTP_SITE_TO_SITE_PROTOCOL_VERSION};
     [ttlExtendRequest setAllHTTPHeaderFields:headers];
     
-    [self addAuthTokenHeaderToRequest:&ttlExtendRequest error:error];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    
-    [self synchronousDataTaskWithRequest:ttlExtendRequest
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:error];
-    
-    if (response != nil) {
-        if (response.statusCode < 200 || response.statusCode > 299) {
-            if(error) {
-                *error = [NSError errorWithDomain:NiFiErrorDomain
-                                             code:NiFiErrorHttpStatusCode + response.statusCode
-                                         userInfo:nil];
+    [self sendRequest:ttlExtendRequest completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        if (response != nil) {
+            if (response.statusCode < 200 || response.statusCode > 299) {
+                // NSLog(@"Extending TTL failed for transaction. transactionURL=%@, responseCode=%ld", transactionUrl, (long)response.statusCode);
+                completionHandler([NSError errorWithDomain:NiFiErrorDomain
+                                                      code:NiFiErrorHttpStatusCode + response.statusCode
+                                                  userInfo:nil]);
+                return;
             }
-            // NSLog(@"Extending TTL failed for transaction. transactionURL=%@, responseCode=%ld", transactionUrl, (long)response.statusCode);
-        }
-        else {
             // NSLog(@"Successfully extended TTL for transaction. transactionURL=%@, responseCode=%ld", transactionUrl, (long)response.statusCode);
         }
-    }
+        completionHandler(requestError);
+    }];
 }
 
 - (NSInteger)sendFlowFiles:(nonnull NiFiDataPacketEncoder *)dataPacketEncoder
             withTransaction:(nonnull NiFiTransactionResource *)transactionResource
                       error:(NSError *_Nullable *_Nullable)error {
+    __block NSInteger serverCrc = -1;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self sendFlowFiles:dataPacketEncoder withTransaction:transactionResource completionHandler:^(NSInteger result, NSError *resultError) {
+            serverCrc = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+    return serverCrc;
+}
+
+- (void)sendFlowFiles:(nonnull NiFiDataPacketEncoder *)dataPacketEncoder
+      withTransaction:(nonnull NiFiTransactionResource *)transactionResource
+    completionHandler:(void (^_Nonnull)(NSInteger serverCrc, NSError *_Nullable error))completionHandler {
     
     NSMutableURLRequest *flowFilesRequest = [transactionResource flowFilesUrlRequest];
     
     if (!flowFilesRequest) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain
-                                         code:NiFiErrorHttpRestApiClientCouldNotFormURL
-                                     userInfo:nil];
-        }
+        completionHandler(-1, [NSError errorWithDomain:NiFiErrorDomain
+                                                  code:NiFiErrorHttpRestApiClientCouldNotFormURL
+                                              userInfo:nil]);
+        return;
     }
     
-    [self addAuthTokenHeaderToRequest:&flowFilesRequest error:error];
-    
-    [flowFilesRequest setHTTPBodyStream:[dataPacketEncoder getEncodedDataStream]];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    NSError *dataTaskError;
-    
-    [self synchronousDataTaskWithRequest:flowFilesRequest
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:&dataTaskError];
-    
-    if (error && response == nil) {
-        *error = dataTaskError;
-        return -1;
+    if ([dataPacketEncoder isStreaming]) {
+        // The total length is known up front, even though the content has not been read yet
+        [flowFilesRequest setValue:[NSString stringWithFormat:@"%lu", (unsigned long)[dataPacketEncoder getEncodedDataByteLength]]
+                forHTTPHeaderField:@"Content-Length"];
     }
+    [flowFilesRequest setHTTPBodyStream:[dataPacketEncoder getEncodedDataStream]];
     
-    switch (response.statusCode) {
-        case 200: // applying Postel's Principle to server response code
-        case 202:
-        {
-            // Response body should be server-calculated CRC checksum
-            NSString *responseBody = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-            return [responseBody integerValue];
-        }
-        default:
-            if (error) {
-                *error = [NSError errorWithDomain:NiFiErrorDomain
-                                             code:NiFiErrorHttpStatusCode + response.statusCode
-                                         userInfo:nil];
+    [self sendRequest:flowFilesRequest completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        if (response == nil) {
+            completionHandler(-1, requestError);
+            return;
+        }
+        
+        switch (response.statusCode) {
+            case 200: // applying Postel's Principle to server response code
+            case 202:
+            {
+                // Response body should be server-calculated CRC checksum
+                NSString *responseBody = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+                completionHandler([responseBody integerValue], nil);
+                break;
             }
-            return -1;
-    }
-    
+            default:
+                completionHandler(-1, [NSError errorWithDomain:NiFiErrorDomain
+                                                          code:NiFiErrorHttpStatusCode + response.statusCode
+                                                      userInfo:nil]);
+                break;
+        }
+    }];
 }
 
 - (nullable NiFiTransactionResult *)endTransaction:(nonnull NSString *)transactionUrl
                                      responseCode:(NiFiTransactionResponseCode)responseCode
                                             error:(NSError *_Nullable *_Nullable)error {
+    __block NiFiTransactionResult *transactionResult = nil;
+    __block NSError *asyncError = nil;
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self endTransaction:transactionUrl responseCode:responseCode completionHandler:^(NiFiTransactionResult *result, NSError *resultError) {
+            transactionResult = result;
+            asyncError = resultError;
+            done();
+        }];
+    });
+    if (error && asyncError) {
+        *error = asyncError;
+    }
+    return transactionResult;
+}
+
+- (void)endTransaction:(nonnull NSString *)transactionUrl
+          responseCode:(NiFiTransactionResponseCode)responseCode
+     completionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler {
     NSURLComponents *urlComponents = [NSURLComponents componentsWithString:transactionUrl];
     
     NSMutableArray *queryItems = urlComponents.queryItems != nil ? [[NSMutableArray alloc] initWithArray:urlComponents.queryItems] : [[NSMutableArray alloc] initWithCapacity:1];
@@ -521,48 +726,83 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
                               HTTP_HEADER_PROTOCOL_VERSION: HTTP_SITE_TO_SITE_PROTOCOL_VERSION};
     [request setAllHTTPHeaderFields:headers];
     
-    [self addAuthTokenHeaderToRequest:&request error:error];
-    
-    NSData *data;
-    NSHTTPURLResponse *response;
-    NSError *dataTaskError;
-    
-    [self synchronousDataTaskWithRequest:request
-                              dataOutput:&data
-                          responseOutput:&response
-                             errorOutput:&dataTaskError];
-    
-    if (response == nil) {
-        if (error) {
-            *error = dataTaskError;
+    [self sendRequest:request completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *requestError) {
+        if (response == nil) {
+            completionHandler(nil, requestError);
+            return;
         }
-        return nil;
-    }
+        
+        NSError *jsonParseError;
+        NSDictionary *transactionResultJson = data ? [NSJSONSerialization JSONObjectWithData:data
+                                                                                     options:NSJSONReadingMutableContainers
+                                                                                       error:&jsonParseError] : nil;
+        if (!transactionResultJson) {
+            completionHandler(nil, jsonParseError);
+            return;
+        }
+        
+        NiFiTransactionResult *transactionResult = [[NiFiTransactionResult alloc] init];
+        NSString *flowFileSentVal = transactionResultJson[@"flowFileSent"];
+        NSString *responseCodeVal = transactionResultJson[@"responseCode"];
+        transactionResult.message = transactionResultJson[@"message"];
+        if (flowFileSentVal) {
+            transactionResult.dataPacketsTransferred = [flowFileSentVal integerValue];
+        }
+        if (responseCodeVal) {
+            transactionResult.responseCode = (NiFiTransactionResponseCode)[responseCodeVal integerValue];
+        }
+        completionHandler(transactionResult, nil);
+    }];
+}
+
+// MARK: - Helper functions
+
+/* Adds the auth token header, then runs the request without blocking a thread while it is in flight. */
+- (void) sendRequest:(nonnull NSMutableURLRequest *)request
+   completionHandler:(void (^_Nonnull)(NSData *_Nullable data, NSHTTPURLResponse *_Nullable response, NSError *_Nullable error))completionHandler {
+    [self addAuthTokenHeaderToRequest:request completionHandler:^(NSError *authError) {
+        [self dataTaskWithRequest:request completionHandler:^(NSData *data, NSHTTPURLResponse *response, NSError *dataTaskError) {
+            // without a response, the failure to get a token may explain the failure of the request
+            completionHandler(data, response, response ? dataTaskError : (dataTaskError ?: authError));
+        }];
+    }];
+}
+
+/* Runs a data task, calling the completion handler exactly once: when the task completes, or with
+ * an NSURLErrorTimedOut error if it has not completed within the request's timeout interval.
+ * Requests that stream a body, i.e., flow files, have no such deadline, as a large batch on a slow link can take longer
+ * while still making progress. For those, the session's timeout applies, which only fails a request that has gone idle. */
+- (void) dataTaskWithRequest:(nonnull NSURLRequest *)request
+           completionHandler:(void (^_Nonnull)(NSData *_Nullable data, NSHTTPURLResponse *_Nullable response, NSError *_Nullable error))completionHandler {
+    NSObject *completionLock = [[NSObject alloc] init];
+    __block BOOL isCompleted = NO;
+    BOOL (^markCompleted)(void) = ^BOOL {
+        @synchronized(completionLock) {
+            BOOL wasCompleted = isCompleted;
+            isCompleted = YES;
+            return !wasCompleted;
+        }
+    };
     
-    NSError *jsonParseError;
-    NSDictionary *transactionResultJson = [NSJSONSerialization JSONObjectWithData:data
-                                                                          options:NSJSONReadingMutableContainers
-                                                                            error:&jsonParseError];
-    if (!transactionResultJson) {
-        *error = jsonParseError;
-        return nil;
-    }
+    NSURLSessionDataTask *dataTask = [self.urlSession dataTaskWithRequest:request completionHandler:^(NSData *d, NSURLResponse *r, NSError *e) {
+        if (markCompleted()) {
+            completionHandler(d, (NSHTTPURLResponse *)r, e);
+        }
+    }];
+    [dataTask resume];
     
-    NiFiTransactionResult *transactionResult = [[NiFiTransactionResult alloc] init];
-    NSString *flowFileSentVal = transactionResultJson[@"flowFileSent"];
-    NSString *responseCodeVal = transactionResultJson[@"responseCode"];
-    transactionResult.message = transactionResultJson[@"message"];
-    if (flowFileSentVal) {
-        transactionResult.dataPacketsTransferred = [flowFileSentVal integerValue];
+    if (request.HTTPBodyStream) {
+        return;
     }
-    if (responseCodeVal) {
-        transactionResult.responseCode = (NiFiTransactionResponseCode)[responseCodeVal integerValue];
-    }
-    return transactionResult;
+    dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, request.timeoutInterval * NSEC_PER_SEC);
+    dispatch_after(timeout, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        if (markCompleted()) {
+            [dataTask cancel];
+            completionHandler(nil, nil, [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil]);
+        }
+    });
 }
 
-// MARK: - Helper functions
-
 /* A call to this method will block.
  * It is only desinged to be called from a background thread, not a UI thread. */
 - (void) synchronousDataTaskWithRequest:(NSURLRequest *_Nonnull)request
@@ -572,110 +812,203 @@ static NSString *const HTTP_HEADER_LOCATION_URI_INTENT_VALUE = @"transaction-url
     __block NSData * blockData = nil;
     __block NSURLResponse * blockResponse = nil;
     __block NSError * blockError = nil;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-    NSURLSessionDataTask *dataTask = [self.urlSession dataTaskWithRequest:request completionHandler:^(NSData *d, NSURLResponse *r, NSError *e) {
-        blockData = d;
-        blockResponse = r;
-        blockError = e;
-        dispatch_semaphore_signal(semaphore);
-    }];
-    [dataTask resume];
-    dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, request.timeoutInterval * NSEC_PER_SEC);
-    long didTimeout = dispatch_semaphore_wait(semaphore, timeout);
-    
-    if(!didTimeout) {
-        *data = blockData;
-        *response = blockResponse;
-        if (error) {
-            *error = blockError;
-        }
+    NiFiWaitForAsyncCall(^(dispatch_block_t done) {
+        [self dataTaskWithRequest:request completionHandler:^(NSData *d, NSHTTPURLResponse *r, NSError *e) {
+            blockData = d;
+            blockResponse = r;
+            blockError = e;
+            done();
+        }];
+    });
+    *data = blockData;
+    *response = blockResponse;
+    if (error) {
+        *error = blockError;
     }
-    else {
-        if (error) {
-            *error = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+}
+
+/* Like addAuthTokenHeaderToRequest:error:, but only blocks a thread if a token has to be fetched first,
+ * which happens once per token lifetime for each server and user. */
+- (void)addAuthTokenHeaderToRequest:(nonnull NSMutableURLRequest *)request
+                  completionHandler:(void (^_Nonnull)(NSError *_Nullable error))completionHandler {
+    NiFiAuthTokenCacheEntry *entry = [self authTokenCacheEntry];
+    if (!entry) {
+        completionHandler(nil);
+        return;
+    }
+    NSString *authToken = nil;
+    @synchronized(entry) {
+        if (entry.authToken && [[NSDate date] compare:entry.refreshTime] == NSOrderedAscending) {
+            authToken = entry.authToken;
         }
     }
+    if (authToken) {
+        [request setValue:authToken forHTTPHeaderField:@"Authorization"];
+        completionHandler(nil);
+        return;
+    }
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSMutableURLRequest *mutableRequest = request;
+        NSError *authError = nil;
+        [self addAuthTokenHeaderToRequest:&mutableRequest error:&authError];
+        completionHandler(authError);
+    });
 }
 
 - (void)addAuthTokenHeaderToRequest:(NSMutableURLRequest **)request
                               error:(NSError **)error {
-    if (_credential) {
-        NSDate *startTime = [NSDate date];
-        if (!_authToken || !_authExpiration || [startTime compare:_authExpiration] == NSOrderedDescending) {
-            NSString *user = _credential.user;
-            NSString *password = _credential.password; // may prompt user
-            
-            if (user && password) {
-                NSURLComponents * urlComponents = [_baseUrlComponents copy];
-                urlComponents.path = [NSString stringWithFormat:@"%@/access/token", urlComponents.path];
-                NSMutableURLRequest *authTokenRequest = [NSMutableURLRequest requestWithURL:urlComponents.URL
-                                                                                cachePolicy:NSURLRequestReloadIgnoringCacheData
-                                                                            timeoutInterval:DEFAULT_HTTP_TIMEOUT];
-                [authTokenRequest setHTTPMethod:@"POST"];
-                
-                NSString *formData = [NSString stringWithFormat:@"username=%@&password=%@", user, password];
-                NSData *encodedFormData = [formData dataUsingEncoding:NSASCIIStringEncoding allowLossyConversion:YES];
-                NSString *contentLength = [NSString stringWithFormat:@"%lu", (unsigned long)encodedFormData.length];
-                [authTokenRequest setHTTPBody:encodedFormData];
-                
-                NSDictionary *headers = @{@"Accept": @"text/plain",
-                                          @"Content-Type": @"application/x-www-form-urlencoded",
-                                          @"Content-Length": contentLength};
-                [authTokenRequest setAllHTTPHeaderFields:headers];
-                
-                NSData *data;
-                NSHTTPURLResponse *response;
-                
-                [self synchronousDataTaskWithRequest:authTokenRequest
-                                          dataOutput:&data
-                                      responseOutput:&response
-                                         errorOutput:error];
-                
-                if (response == nil) {
-                    _authToken = nil;
-                    return;
-                }
-                
-                if (response.statusCode < 200 || response.statusCode > 299) {
-                    _authToken = nil;
-                    return;
+    NiFiAuthTokenCacheEntry *entry = [self authTokenCacheEntry];
+    if (entry) {
+        NSString *authToken = nil;
+        BOOL shouldRefreshInBackground = NO;
+        @synchronized(entry) {
+            if ([entry hasUnexpiredToken]) {
+                authToken = entry.authToken;
+                if (!entry.isRefreshing && [[NSDate date] compare:entry.refreshTime] != NSOrderedAscending) {
+                    entry.isRefreshing = YES;
+                    shouldRefreshInBackground = YES;
                 }
-                
-                // Response body should be JWT in form base64(header).base64(payload).base64(signature)
-                NSString *responseBody = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
-                if (responseBody) {
-                    _authToken = [@"Bearer " stringByAppendingString:responseBody];
-                } else {
-                    _authToken = nil;
+            }
+        }
+        
+        if (!authToken) {
+            // Holding the fetch lock makes the fetch single-flight: concurrent requests for the same server and user
+            // wait for it and then share the token. The entry's own lock is only held to read or update it.
+            @synchronized(entry.fetchLock) {
+                @synchronized(entry) {
+                    if ([entry hasUnexpiredToken]) {
+                        authToken = entry.authToken; // fetched while this request waited
+                    }
                 }
-                
-                // Determine expiry
-                NSArray *jwtComponents = [responseBody componentsSeparatedByString:@"."];
-                NSString *base64EncodedJWTPayload = jwtComponents[1];
-                int padLength = (4 - (base64EncodedJWTPayload.length % 4)) % 4;
-                NSString *paddedBase64EncodedJWTPayload = [NSString stringWithFormat:@"%s%.*s", [base64EncodedJWTPayload UTF8String], padLength, "=="];
-                NSData *decodedJWTPayload = [[NSData alloc] initWithBase64EncodedString:paddedBase64EncodedJWTPayload options:0];
-                NSDictionary *decodedJson = [NSJSONSerialization JSONObjectWithData:decodedJWTPayload
-                                                                            options:NSJSONReadingMutableContainers
-                                                                              error:error];
-                if (decodedJson) {
-                    NSInteger exp = [decodedJson[@"exp"] integerValue];
-                    NSInteger iat = [decodedJson[@"iat"] integerValue];
-                    NSTimeInterval validDuration = ((double)exp - (double)iat) - 30.0; // seconds.
-                    if (validDuration < 0.0) {
-                        NSLog(@"Authentication token valid duration is < 30 seconds");
-                        _authToken = nil;
+                if (!authToken) {
+                    NiFiAuthTokenCacheEntry *fetchedEntry = [self fetchAuthTokenOrError:error];
+                    @synchronized(entry) {
+                        if (fetchedEntry) {
+                            [entry updateWithEntry:fetchedEntry];
+                        }
+                        if ([entry hasUnexpiredToken]) {
+                            authToken = entry.authToken; // never send an expired token, e.g., if fetching a new one failed
+                        }
                     }
-                    _authExpiration = [NSDate dateWithTimeInterval:validDuration sinceDate:startTime];
                 }
             }
         }
-        if (_authToken) {
-            [*request setValue:_authToken forHTTPHeaderField:@"Authorization"];
+        
+        if (shouldRefreshInBackground) {
+            // the current token is still valid, so use it while a new one is fetched ahead of its expiry
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+                @synchronized(entry.fetchLock) {
+                    NiFiAuthTokenCacheEntry *fetchedEntry = [self fetchAuthTokenOrError:nil];
+                    @synchronized(entry) {
+                        if (fetchedEntry) {
+                            [entry updateWithEntry:fetchedEntry];
+                        }
+                        entry.isRefreshing = NO;
+                    }
+                }
+            });
+        }
+        
+        if (authToken) {
+            [*request setValue:authToken forHTTPHeaderField:@"Authorization"];
         }
     }
 }
 
+/* The key of shared cache entries for this server and credential. The whole credential is part of it, so that a client
+ * with a wrong or stale password does not use a token or info fetched by another. The password is only kept as a digest. */
+- (nonnull NSString *)sharedCacheKey {
+    NSURLComponents *cacheKeyComponents = [_baseUrlComponents copy];
+    cacheKeyComponents.user = _credential.user;
+    NSString *credentialDigest = _credential ? [NiFiSiteToSiteUtil digestForUsername:_credential.user password:_credential.password] : @"";
+    return [NSString stringWithFormat:@"%@|%@", cacheKeyComponents.string ?: @"", credentialDigest];
+}
+
+/* The shared token cache entry for this server and credential, or nil if no credential is set. */
+- (nullable NiFiAuthTokenCacheEntry *)authTokenCacheEntry {
+    if (!_credential || !_credential.user) {
+        return nil;
+    }
+    return [NiFiAuthTokenCacheEntry entryForKey:[self sharedCacheKey]];
+}
+
+/* The shared controller info cache entry for this server and credential. */
+- (nonnull NiFiSiteToSiteInfoCacheEntry *)siteToSiteInfoCacheEntry {
+    return [NiFiSiteToSiteInfoCacheEntry entryForKey:[self sharedCacheKey]];
+}
+
+/* Fetches a new token. Returns an entry that is not shared, holding the token and when to refresh it, or nil on failure.
+ * Does not touch the shared entry, so that no lock on it is held while waiting for the server. */
+- (nullable NiFiAuthTokenCacheEntry *)fetchAuthTokenOrError:(NSError **)error {
+    NSDate *startTime = [NSDate date];
+    NSString *user = _credential.user;
+    NSString *password = _credential.password; // may prompt user
+    if (!user || !password) {
+        return nil;
+    }
+    
+    NSURLComponents * urlComponents = [_baseUrlComponents copy];
+    urlComponents.path = [NSString stringWithFormat:@"%@/access/token", urlComponents.path];
+    NSMutableURLRequest *authTokenRequest = [NSMutableURLRequest requestWithURL:urlComponents.URL
+                                                                    cachePolicy:NSURLRequestReloadIgnoringCacheData
+                                                                timeoutInterval:DEFAULT_HTTP_TIMEOUT];
+    [authTokenRequest setHTTPMethod:@"POST"];
+    
+    NSString *formData = [NSString stringWithFormat:@"username=%@&password=%@", user, password];
+    NSData *encodedFormData = [formData dataUsingEncoding:NSASCIIStringEncoding allowLossyConversion:YES];
+    NSString *contentLength = [NSString stringWithFormat:@"%lu", (unsigned long)encodedFormData.length];
+    [authTokenRequest setHTTPBody:encodedFormData];
+    
+    NSDictionary *headers = @{@"Accept": @"text/plain",
+                              @"Content-Type": @"application/x-www-form-urlencoded",
+                              @"Content-Length": contentLength};
+    [authTokenRequest setAllHTTPHeaderFields:headers];
+    
+    NSData *data;
+    NSHTTPURLResponse *response;
+    
+    [self synchronousDataTaskWithRequest:authTokenRequest
+                              dataOutput:&data
+                          responseOutput:&response
+                             errorOutput:error];
+    
+    if (response == nil || response.statusCode < 200 || response.statusCode > 299) {
+        return nil;
+    }
+    
+    // Response body should be JWT in form base64(header).base64(payload).base64(signature)
+    NSString *responseBody = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+    NSArray *jwtComponents = [responseBody componentsSeparatedByString:@"."];
+    if (!responseBody || jwtComponents.count < 2) {
+        NSLog(@"Authentication token response is not a JWT");
+        return nil;
+    }
+    
+    // Determine expiry
+    NSString *base64EncodedJWTPayload = jwtComponents[1];
+    int padLength = (4 - (base64EncodedJWTPayload.length % 4)) % 4;
+    NSString *paddedBase64EncodedJWTPayload = [NSString stringWithFormat:@"%s%.*s", [base64EncodedJWTPayload UTF8String], padLength, "=="];
+    NSData *decodedJWTPayload = [[NSData alloc] initWithBase64EncodedString:paddedBase64EncodedJWTPayload options:0];
+    NSDictionary *decodedJson = decodedJWTPayload ? [NSJSONSerialization JSONObjectWithData:decodedJWTPayload
+                                                                                    options:NSJSONReadingMutableContainers
+                                                                                      error:error] : nil;
+    if (!decodedJson) {
+        return nil;
+    }
+    NSInteger exp = [decodedJson[@"exp"] integerValue];
+    NSInteger iat = [decodedJson[@"iat"] integerValue];
+    NSTimeInterval lifetime = (double)exp - (double)iat; // seconds. Relative to startTime, so the local clock need not match the server's.
+    NSTimeInterval validDuration = lifetime - 30.0;
+    if (validDuration < 0.0) {
+        NSLog(@"Authentication token valid duration is < 30 seconds");
+        return nil;
+    }
+    NiFiAuthTokenCacheEntry *fetchedEntry = [[NiFiAuthTokenCacheEntry alloc] init];
+    fetchedEntry.authToken = [@"Bearer " stringByAppendingString:responseBody];
+    fetchedEntry.expiration = [NSDate dateWithTimeInterval:validDuration sinceDate:startTime];
+    fetchedEntry.refreshTime = [NSDate dateWithTimeInterval:MIN(validDuration, lifetime * AUTH_TOKEN_REFRESH_FRACTION) sinceDate:startTime];
+    return fetchedEntry;
+}
+
 @end
 
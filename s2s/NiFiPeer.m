@@ -20,6 +20,9 @@
 
 /********** Peer/Communicant Implementation **********/
 
+// weight of the latest transaction in averageTransactionDuration
+static const double TRANSACTION_DURATION_EWMA_ALPHA = 0.3;
+
 @implementation NiFiPeer
 
 + (nullable instancetype)peerWithUrl:(NSURL *)url {
@@ -38,16 +41,60 @@
         _rawIsSecure = secure;
         _flowFileCount = 0;
         _lastFailure = 0.0;
+        _averageTransactionDuration = 0.0;
+        _backoffUntil = 0.0;
+        _consecutiveBackoffCount = 0;
     }
     return self;
 }
 
 - (void)markFailure {
-    _lastFailure = [NSDate timeIntervalSinceReferenceDate];
+    self.lastFailure = [NSDate timeIntervalSinceReferenceDate];
+}
+
+- (BOOL)hasFailedWithinInterval:(NSTimeInterval)interval {
+    NSTimeInterval lastFailure = self.lastFailure;
+    return lastFailure > 0.0 && [NSDate timeIntervalSinceReferenceDate] - lastFailure < interval;
+}
+
+- (void)recordTransactionDuration:(NSTimeInterval)duration dataPacketCount:(NSUInteger)dataPacketCount {
+    @synchronized(self) {
+        NSTimeInterval average = self.averageTransactionDuration;
+        self.averageTransactionDuration = average > 0.0 ?
+            TRANSACTION_DURATION_EWMA_ALPHA * duration + (1.0 - TRANSACTION_DURATION_EWMA_ALPHA) * average :
+            duration;
+        self.flowFileCount += dataPacketCount;
+    }
+}
+
+- (NSTimeInterval)markDestinationFullWithInitialBackoff:(NSTimeInterval)initialBackoff maxBackoff:(NSTimeInterval)maxBackoff {
+    @synchronized(self) {
+        NSTimeInterval ceiling = initialBackoff;
+        for (NSUInteger i = 0; i < self.consecutiveBackoffCount && ceiling < maxBackoff; i++) {
+            ceiling *= 2.0;
+        }
+        ceiling = MIN(ceiling, maxBackoff);
+        // "equal jitter": at least half the ceiling, so a saturated peer is not retried right away
+        NSTimeInterval backoff = ceiling / 2.0 + (ceiling / 2.0) * ((double)arc4random() / UINT32_MAX);
+        self.consecutiveBackoffCount += 1;
+        self.backoffUntil = [NSDate timeIntervalSinceReferenceDate] + backoff;
+        return backoff;
+    }
+}
+
+- (void)clearBackoff {
+    @synchronized(self) {
+        self.consecutiveBackoffCount = 0;
+        self.backoffUntil = 0.0;
+    }
+}
+
+- (BOOL)isBackingOff {
+    return [NSDate timeIntervalSinceReferenceDate] < self.backoffUntil;
 }
 
 - (id)peerKey {
-    // flowFileCount and lastFailure are not part of the key.
+    // flowFileCount, lastFailure, and backoff state are not part of the key.
     // currently, the key is just the url, made absolute because we always want to treat resolved locations as equal.
     return [_url absoluteURL];
 }
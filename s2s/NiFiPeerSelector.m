@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017 Hortonworks, Inc.
+ * All rights reserved.
+ *
+ *   Hortonworks, Inc. licenses this file to you under the Apache License, Version 2.0
+ *   (the "License"); you may not use this file except in compliance with
+ *   the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ * See the associated NOTICE file for additional information regarding copyright ownership.
+ */
+
+#import <Foundation/Foundation.h>
+#import "NiFiPeerSelector.h"
+
+/********** PeerSelector Implementation **********/
+
+/* Orders peers with equal load by the flow files queued at each, then by host and port so that the choice is stable.
+ * Unlike -[NiFiPeer compare:], this ignores past failures, which only exclude a peer during the failure cooldown. */
+static NSComparisonResult NiFiComparePeersForTieBreak(NiFiPeer *peer, NiFiPeer *other) {
+    if (peer.flowFileCount != other.flowFileCount) {
+        return peer.flowFileCount < other.flowFileCount ? NSOrderedAscending : NSOrderedDescending;
+    }
+    NSComparisonResult hostCompare = [(peer.url.host ?: @"") compare:(other.url.host ?: @"")];
+    if (hostCompare != NSOrderedSame) {
+        return hostCompare;
+    }
+    return [(peer.url.port ?: @0) compare:(other.url.port ?: @0)];
+}
+
+@implementation NiFiPeerSelector
+
++ (nonnull NSObject <NiFiPeerSelector> *)peerSelectorWithStrategy:(NiFiPeerSelectionStrategy)strategy {
+    switch (strategy) {
+        case PEER_SELECTION_ROUND_ROBIN:
+            return [[NiFiRoundRobinPeerSelector alloc] init];
+        case PEER_SELECTION_LATENCY_AWARE:
+            return [[NiFiLatencyAwarePeerSelector alloc] init];
+        case PEER_SELECTION_LEAST_LOADED:
+        default:
+            return [[NiFiLeastLoadedPeerSelector alloc] init];
+    }
+}
+
+- (nonnull NiFiPeer *)selectPeerFromPeers:(nonnull NSArray<NiFiPeer *> *)peers
+                  activeTransactionCounts:(nonnull NSCountedSet *)activeTransactionCounts {
+    @throw [NSException
+            exceptionWithName:NSInternalInconsistencyException
+            reason:[NSString stringWithFormat:@"You must override %@ in a subclass", NSStringFromSelector(_cmd)]
+            userInfo:nil];
+}
+
+@end
+
+
+@implementation NiFiLeastLoadedPeerSelector
+
+- (nonnull NiFiPeer *)selectPeerFromPeers:(nonnull NSArray<NiFiPeer *> *)peers
+                  activeTransactionCounts:(nonnull NSCountedSet *)activeTransactionCounts {
+    // a single pass rather than a sort, as this runs for every transaction
+    NiFiPeer *selectedPeer = nil;
+    NSUInteger selectedActiveTransactions = 0;
+    for (NiFiPeer *peer in peers) {
+        NSUInteger activeTransactions = [activeTransactionCounts countForObject:[peer peerKey]];
+        if (!selectedPeer ||
+                activeTransactions < selectedActiveTransactions ||
+                (activeTransactions == selectedActiveTransactions && NiFiComparePeersForTieBreak(peer, selectedPeer) == NSOrderedAscending)) {
+            selectedPeer = peer;
+            selectedActiveTransactions = activeTransactions;
+        }
+    }
+    return selectedPeer;
+}
+
+@end
+
+
+@interface NiFiRoundRobinPeerSelector()
+@property (nonatomic) NSUInteger nextIndex;
+@end
+
+@implementation NiFiRoundRobinPeerSelector
+
+- (nonnull NiFiPeer *)selectPeerFromPeers:(nonnull NSArray<NiFiPeer *> *)peers
+                  activeTransactionCounts:(nonnull NSCountedSet *)activeTransactionCounts {
+    // The peer list keeps its order between peer updates, so walking it by index visits every peer in turn
+    @synchronized(self) {
+        NiFiPeer *selectedPeer = peers[_nextIndex % peers.count];
+        _nextIndex++;
+        return selectedPeer;
+    }
+}
+
+@end
+
+
+@implementation NiFiLatencyAwarePeerSelector
+
+- (nonnull NiFiPeer *)selectPeerFromPeers:(nonnull NSArray<NiFiPeer *> *)peers
+                  activeTransactionCounts:(nonnull NSCountedSet *)activeTransactionCounts {
+    // Expected time to complete a transaction at each peer, if transactions in progress there are served in turn.
+    // Peers without a completed transaction score 0, so each peer is tried before settling on the fastest.
+    NiFiPeer *selectedPeer = nil;
+    NSTimeInterval selectedExpectedDuration = 0.0;
+    NSUInteger selectedActiveTransactions = 0;
+    for (NiFiPeer *peer in peers) {
+        NSUInteger activeTransactions = [activeTransactionCounts countForObject:[peer peerKey]];
+        NSTimeInterval expectedDuration = peer.averageTransactionDuration * (activeTransactions + 1);
+        if (!selectedPeer ||
+                expectedDuration < selectedExpectedDuration ||
+                (expectedDuration == selectedExpectedDuration && activeTransactions < selectedActiveTransactions) ||
+                (expectedDuration == selectedExpectedDuration && activeTransactions == selectedActiveTransactions &&
+                    NiFiComparePeersForTieBreak(peer, selectedPeer) == NSOrderedAscending)) {
+            selectedPeer = peer;
+            selectedExpectedDuration = expectedDuration;
+            selectedActiveTransactions = activeTransactions;
+        }
+    }
+    return selectedPeer;
+}
+
+@end
@@ -34,6 +34,13 @@ typedef enum {
 } NiFiSiteToSiteTransportProtocol;
 
 
+typedef enum {
+    PEER_SELECTION_LEAST_LOADED,    // fewest transactions in progress from this client, then fewest flow files queued at the peer
+    PEER_SELECTION_ROUND_ROBIN,     // each peer in turn
+    PEER_SELECTION_LATENCY_AWARE    // lowest moving average transaction duration, weighted by transactions in progress
+} NiFiPeerSelectionStrategy;
+
+
 typedef enum {
     TRANSACTION_STARTED,
     DATA_EXCHANGED,
@@ -76,6 +83,29 @@ typedef enum {
                                                                        // Optional, not needed if portName is set.
 @property (nonatomic, readwrite) NSTimeInterval timeout;               // Client-side timeout when communicating with peer. Defaults to 30 seconds.
 @property (nonatomic, readwrite) NSTimeInterval peerUpdateInterval;    // Update interval for refreshing peer list if remote is a multi-instance NiFi cluster. Set to 0 to disable. Defaults to 0 (disabled)
+@property (nonatomic, readwrite) NSTimeInterval peerUpdateRetryInterval; // After a peer list refresh fails on every known peer, it is not retried for this long.
+                                                                       // Transactions use the last known peer list meanwhile. Defaults to 10 seconds
+@property (nonatomic, readwrite) NSUInteger streamingChunkSize;        // If > 0, data packets are encoded and sent in chunks of at most this many bytes,
+                                                                       // read from each data packet's dataStream as they are sent, rather than buffering the
+                                                                       // whole batch in memory. Useful for large file-backed packets. Defaults to 0 (disabled)
+@property (nonatomic, readwrite) NSUInteger socketWriteQueueDepth;     // Raw socket transactions write each data packet to the socket as it is sent, with at most this
+                                                                       // many writes outstanding before sendData: blocks. Set to 0 to write the whole batch at confirm
+                                                                       // time instead. Defaults to 8
+@property (nonatomic, readwrite) NSTimeInterval socketIdleConnectionExpiration; // Raw socket connections are kept open after a transaction completes and reused by
+                                                                       // the next transaction to the same peer and port, skipping the connection and protocol
+                                                                       // handshake. Connections idle for longer than this are closed. Set to 0 to disable reuse.
+                                                                       // Defaults to 10 seconds
+@property (nonatomic, readwrite) NiFiPeerSelectionStrategy peerSelectionStrategy; // How to choose the peer of a cluster for each transaction.
+                                                                       // Defaults to PEER_SELECTION_LEAST_LOADED
+@property (nonatomic, readwrite) NSTimeInterval peerFailureCooldown;   // A peer is not selected for this long after a failure, unless every peer of the cluster
+                                                                       // has failed recently. Defaults to 10 seconds
+@property (nonatomic, readwrite) NSTimeInterval peerBackoffInitialInterval; // A peer that reports its destination is full is not selected for about this long,
+                                                                       // doubling with each consecutive report, until a transaction to it completes normally.
+                                                                       // Defaults to 1 second
+@property (nonatomic, readwrite) NSTimeInterval peerBackoffMaxInterval; // Upper bound of the peer backoff interval. Defaults to 60 seconds
+@property (nonatomic, readwrite) NSTimeInterval siteToSiteInfoCacheTTL; // How long the remote controller info (raw port, input ports) is reused before it is
+                                                                       // looked up again. It is also looked up again after a port or peer error.
+                                                                       // Set to 0 to look it up for every transaction. Defaults to 60 seconds
 + (nullable instancetype) configWithRemoteCluster:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteClusterConfig;
 + (nullable instancetype) configWithRemoteClusters:(nonnull NSArray<NiFiSiteToSiteRemoteClusterConfig *> *)remoteClusterConfigs;
 
@@ -111,14 +141,29 @@ typedef enum {
 @property (nonatomic, retain, readwrite, nonnull) NSURL *url;
 @property (nonatomic, retain, readwrite, nullable) NSNumber *rawPort; // if peer supports raw socket protocol, this should be set to the port used for that protocol
 @property (nonatomic, readwrite) BOOL rawIsSecure; // if peer supports raw socket protocol, should SSL be used for raw socket protocol/
-@property (nonatomic, readwrite) NSUInteger flowFileCount;
-@property (nonatomic, readwrite) NSTimeInterval lastFailure; // TimeIntervalSinceReferenceDate, should be updated using markFailure
+@property (atomic, readwrite) NSUInteger flowFileCount;
+@property (atomic, readwrite) NSTimeInterval lastFailure; // TimeIntervalSinceReferenceDate, should be updated using markFailure
+@property (atomic, readwrite) NSTimeInterval averageTransactionDuration; // moving average of completed transactions, 0 until one completes,
+                                                                          // should be updated using recordTransactionDuration:dataPacketCount:
+@property (atomic, readwrite) NSTimeInterval backoffUntil; // TimeIntervalSinceReferenceDate, 0 unless the peer reported its destination is full,
+                                                          // should be updated using markDestinationFullWithInitialBackoff:maxBackoff: and clearBackoff
+@property (atomic, readwrite) NSUInteger consecutiveBackoffCount; // times the destination was reported full since the last normal completion
 
 + (nullable instancetype)peerWithUrl:(nonnull NSURL *)url;
 + (nullable instancetype)peerWithUrl:(nonnull NSURL *)url rawPort:(nullable NSNumber *)rawPort rawIsSecure:(BOOL)secure;
 - (nullable instancetype)initWithUrl:(nonnull NSURL *)url rawPort:(nullable NSNumber *)rawPort rawIsSecure:(BOOL)secure;
 
 - (void)markFailure;
+- (BOOL)hasFailedWithinInterval:(NSTimeInterval)interval;
+
+// updates averageTransactionDuration, and adds the sent packets to flowFileCount until it is next reported by the cluster
+- (void)recordTransactionDuration:(NSTimeInterval)duration dataPacketCount:(NSUInteger)dataPacketCount;
+
+// backs off from the peer for an interval that doubles with each consecutive report, up to maxBackoff, with jitter so that
+// clients backing off from the same peer do not retry in lockstep. Returns the interval chosen.
+- (NSTimeInterval)markDestinationFullWithInitialBackoff:(NSTimeInterval)initialBackoff maxBackoff:(NSTimeInterval)maxBackoff;
+- (void)clearBackoff;
+- (BOOL)isBackingOff;
 
 // returns an object that implements hash/isEqual for the Peer instance, so can be used in NSDictionary, HashSet, etc.
 - (nonnull id)peerKey;
@@ -151,8 +196,12 @@ typedef enum {
 
 @interface NiFiSiteToSiteClient : NSObject
 + (nonnull instancetype)clientWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config;
++ (nullable instancetype)sharedClientWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config; // long-lived client shared by all callers with an
+                                                                                       // equivalent config, which keeps its peer and port discovery state.
+                                                                                       // A bounded number of clients is kept for sharing
 - (nullable NSObject <NiFiTransaction> *)createTransaction;
 - (nullable NSObject <NiFiTransaction> *)createTransactionWithURLSession:(NSURLSession *_Nonnull)urlSession;
+- (BOOL)isBackingOff; // YES if every peer reported its destination is full, in which case no transaction is created until a backoff passes
 @end
 
 
@@ -39,6 +39,23 @@
 @property (atomic, readwrite) bool shouldKeepAlive;
 @property (nonatomic, readwrite, nonnull) NiFiDataPacketEncoder *dataPacketEncoder;
 @property (nonatomic, readwrite, nullable) NiFiPeer *peer;
+@property (nonatomic, retain, readwrite, nullable) NiFiSiteToSiteClientConfig *config; // peer backoff settings, defaults are used if nil
+@property (atomic, copy, readwrite, nullable) void (^finishedHandler)(void); // called once, when the transaction completes, is canceled,
+                                                                            // fails, or is released, whichever happens first
+
+// Sends data packets that were already encoded in the wire format, e.g., by +[NiFiDataPacketEncoder encodeDataPacket:crcChecksum:],
+// without decoding and re-encoding them. crcChecksum is the CRC32 of encodedData.
+- (void)sendEncodedData:(nonnull NSData *)encodedData
+            crcChecksum:(uint32_t)crcChecksum
+        dataPacketCount:(NSUInteger)dataPacketCount;
+
+// Non-blocking variant of confirmAndCompleteOrError:. Subclasses that can confirm without a thread waiting on the peer
+// override this, otherwise confirmAndCompleteOrError: is called on a background queue.
+- (void)confirmAndCompleteWithCompletionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler;
+
+// Records the outcome of a completed transaction for the peer, which backs off if the result says its destination is full
+- (void)recordTransactionResult:(nonnull NiFiTransactionResult *)transactionResult;
+- (void)markPeerDestinationFull;
 
 @end
 
@@ -54,6 +71,13 @@
                       httpRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
                                    peer:(nullable NiFiPeer *)peer;
 
+// Non-blocking variant of the initializer, which leaves no thread waiting while the request to the peer is in flight.
+// Together with confirmAndCompleteWithCompletionHandler:, this lets many transactions be in progress at once.
++ (void) transactionWithPortId:(nonnull NSString *)portId
+             httpRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
+                          peer:(nullable NiFiPeer *)peer
+             completionHandler:(void (^_Nonnull)(NiFiHttpTransaction *_Nullable transaction, NSError *_Nullable error))completionHandler;
+
 @end
 
 
@@ -66,4 +90,14 @@
 
 @end
 
+
+@interface NiFiSiteToSiteClient()
+
+// Non-blocking variant of createTransaction, which calls the completion handler with nil if no transaction was created.
+// HTTP clients leave no thread waiting while the peer creates the transaction, other clients create it on a background queue.
+- (void)createTransactionWithCompletionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler;
+
+@end
+
+
 #endif /* NiFiSiteToSiteClient_h */
@@ -24,6 +24,7 @@
 #import "NiFiSiteToSiteTransaction.h"
 #import "NiFiDataPacket.h"
 #import "NiFiSocket.h"
+#import "NiFiPeerSelector.h"
 #import "NiFiError.h"
 
 
@@ -40,11 +41,16 @@
 // An abstract base class for clients that want to implement a client for a given protocol to a given cluster
 @interface NiFiSiteToSiteUniClusterClient : NiFiSiteToSiteClient
 @property (nonatomic, retain, readwrite, nonnull) NiFiSiteToSiteRemoteClusterConfig *remoteClusterConfig;
-@property (nonatomic, readwrite, nullable)NSArray *prioritizedRemoteInputPortIdList;
+@property (atomic, readwrite, nullable)NSArray *prioritizedRemoteInputPortIdList;
 @property (atomic, readwrite, nonnull)NSSet *initialPeerKeySet; // key of every peer in initial config
 @property (atomic, readwrite, nonnull)NSArray<NiFiPeer *> *currentPeerList;
 @property (nonatomic, readwrite) NSTimeInterval nextPeerUpdateTimeIntervalSinceReferenceDate;
-@property (nonatomic, readwrite) BOOL isPeerUpdateNecessary;
+@property (atomic, readwrite) BOOL isPeerUpdateNecessary;
+@property (atomic, readwrite) BOOL isPeerUpdateInFlight;
+@property (nonatomic, readwrite) NSTimeInterval peerUpdateRetryTimeIntervalSinceReferenceDate; // no update is attempted before this after one fails
+@property (atomic, readwrite, nullable) NSURLSession *urlSession; // created on first use, then reused for the life of the client
+@property (nonatomic, retain, readwrite, nonnull) NSCountedSet *activeTransactionPeerKeys; // peer key of each transaction in progress
+@property (atomic, retain, readwrite, nonnull) NSObject <NiFiPeerSelector> *peerSelector; // defaults to the config's peerSelectionStrategy
 - (nullable instancetype) initWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config
                           remoteCluster:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteClusterConfig;
 @end
@@ -53,7 +59,10 @@
 @interface NiFiHttpSiteToSiteClient : NiFiSiteToSiteUniClusterClient
 @end
 
+@class NiFiSocketConnectionPool;
+
 @interface NiFiSocketSiteToSiteClient : NiFiSiteToSiteUniClusterClient
+@property (nonatomic, retain, readwrite, nullable) NiFiSocketConnectionPool *connectionPool; // nil if connection reuse is disabled
 @end
 
 
@@ -152,6 +161,36 @@
     return nil;
 }
 
+- (void)createTransactionWithCompletionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler {
+    [self createTransactionWithClientAtIndex:0 completionHandler:completionHandler];
+}
+
+/* Tries each cluster's client in turn, as createTransaction does, without waiting for any of them. */
+- (void)createTransactionWithClientAtIndex:(NSUInteger)index
+                         completionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler {
+    if (index >= [_clusterClients count]) {
+        completionHandler(nil);
+        return;
+    }
+    NiFiSiteToSiteClient *client = _clusterClients[index];
+    [client createTransactionWithCompletionHandler:^(NSObject <NiFiTransaction> *transaction) {
+        if (transaction) {
+            completionHandler(transaction);
+            return;
+        }
+        [self createTransactionWithClientAtIndex:index + 1 completionHandler:completionHandler];
+    }];
+}
+
+- (BOOL)isBackingOff {
+    for (NiFiSiteToSiteClient *client in _clusterClients) {
+        if (![client isBackingOff]) {
+            return NO;
+        }
+    }
+    return [_clusterClients count] > 0;
+}
+
 @end
 
 
@@ -178,15 +217,46 @@
             userInfo:nil];
 }
 
+- (void)dealloc {
+    [self invokeFinishedHandler];
+}
+
 - (NiFiTransactionState)transactionState {
     return _transactionState;
 }
 
+- (void)setTransactionState:(NiFiTransactionState)transactionState {
+    _transactionState = transactionState;
+    if (transactionState == TRANSACTION_COMPLETED ||
+            transactionState == TRANSACTION_CANCELED ||
+            transactionState == TRANSACTION_ERROR) {
+        [self invokeFinishedHandler];
+    }
+}
+
+- (void)invokeFinishedHandler {
+    void (^finishedHandler)(void) = nil;
+    @synchronized(self) {
+        finishedHandler = _finishedHandler;
+        _finishedHandler = nil;
+    }
+    if (finishedHandler) {
+        finishedHandler();
+    }
+}
+
 - (void)sendData:(nonnull NiFiDataPacket *)data {
     [self.dataPacketEncoder appendDataPacket:data];
     self.transactionState = DATA_EXCHANGED;
 }
 
+- (void)sendEncodedData:(nonnull NSData *)encodedData
+            crcChecksum:(uint32_t)crcChecksum
+        dataPacketCount:(NSUInteger)dataPacketCount {
+    [self.dataPacketEncoder appendEncodedData:encodedData crcChecksum:crcChecksum dataPacketCount:dataPacketCount];
+    self.transactionState = DATA_EXCHANGED;
+}
+
 - (void)cancel {
     self.transactionState = TRANSACTION_CANCELED;
     // subclasses can implement cancel interaction with server
@@ -206,19 +276,77 @@
             userInfo:nil];
 }
 
+- (void)confirmAndCompleteWithCompletionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler {
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSError *error = nil;
+        NiFiTransactionResult *transactionResult = [self confirmAndCompleteOrError:&error];
+        completionHandler(transactionResult, error);
+    });
+}
+
 - (nullable NiFiPeer *)getPeer {
     return self.peer;
 }
 
+- (void)recordTransactionResult:(nonnull NiFiTransactionResult *)transactionResult {
+    NiFiPeer *peer = self.peer;
+    if (!peer) {
+        return;
+    }
+    [peer recordTransactionDuration:transactionResult.duration dataPacketCount:transactionResult.dataPacketsTransferred];
+    if ([transactionResult shouldBackoff]) {
+        [self markPeerDestinationFull];
+    } else {
+        [peer clearBackoff];
+    }
+}
+
+- (void)markPeerDestinationFull {
+    NiFiPeer *peer = self.peer;
+    if (!peer) {
+        return;
+    }
+    NiFiSiteToSiteClientConfig *config = self.config ?: [[NiFiSiteToSiteClientConfig alloc] init];
+    NSTimeInterval backoff = [peer markDestinationFullWithInitialBackoff:config.peerBackoffInitialInterval
+                                                             maxBackoff:config.peerBackoffMaxInterval];
+    NSLog(@"Peer reported its destination is full, backing off. peer='%@', backoff=%.3fs", peer.url, backoff);
+}
+
 @end
 
 
 @implementation NiFiSiteToSiteClient
 
+static const NSUInteger SHARED_CLIENT_REGISTRY_LIMIT = 8; // distinct configs whose clients are kept for sharing
+
 + (nonnull instancetype) clientWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config {
     return [NiFiSiteToSiteMultiClusterClient clientWithConfig:config];
 }
 
++ (nullable instancetype) sharedClientWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config {
+    // Bounded, so that an app creating many distinct configs does not keep a client, URL session and socket pool alive
+    // for each. An evicted client stays alive for as long as its callers hold it, and the next caller gets a new one.
+    static NSCache<NSString *, NiFiSiteToSiteClient *> *sharedClients = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedClients = [[NSCache alloc] init];
+        sharedClients.countLimit = SHARED_CLIENT_REGISTRY_LIMIT;
+    });
+    
+    NSString *key = [config clientRegistryKey];
+    @synchronized(sharedClients) {
+        NiFiSiteToSiteClient *client = [sharedClients objectForKey:key];
+        if (!client) {
+            // the client keeps a copy, so later changes to the caller's config object do not affect it
+            client = [NiFiSiteToSiteMultiClusterClient clientWithConfig:[config copy]];
+            if (client) {
+                [sharedClients setObject:client forKey:key];
+            }
+        }
+        return client;
+    }
+}
+
 - (nonnull instancetype) initWithConfig:(nonnull NiFiSiteToSiteClientConfig *) config {
     self = [super init];
     if(self != nil) {
@@ -241,6 +369,16 @@
             userInfo:nil];
 }
 
+- (void)createTransactionWithCompletionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler {
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        completionHandler([self createTransaction]);
+    });
+}
+
+- (BOOL)isBackingOff {
+    return NO;
+}
+
 @end
 
 
@@ -253,58 +391,118 @@
     self = [super initWithConfig:config];
     if (self) {
         _remoteClusterConfig = remoteClusterConfig;
+        _activeTransactionPeerKeys = [NSCountedSet set];
+        _peerSelector = [NiFiPeerSelector peerSelectorWithStrategy:config.peerSelectionStrategy];
         [self resetPeersFromInitialPeerConfig];
         if (! _currentPeerList || _currentPeerList.count <= 0) {
             self = nil;
         }
         self.isPeerUpdateNecessary = YES;
+        self.isPeerUpdateInFlight = NO;
         self.nextPeerUpdateTimeIntervalSinceReferenceDate = [NSDate timeIntervalSinceReferenceDate];
+        self.peerUpdateRetryTimeIntervalSinceReferenceDate = 0.0;
     }
     return self;
 }
 
 - (nullable NSObject <NiFiTransaction> *)createTransaction {
-    return [self createTransactionWithURLSession:[self createUrlSession]];
+    return [self createTransactionWithURLSession:[self sharedUrlSession]];
 }
 
 // This is an abstract class. createTransactionWithURLSession:urlSession must be implemented by subclass
 
-- (nullable NiFiPeer *)getPreferredPeer {
-    NSArray *sortedPeerList = [self getSortedPeerList];
-    if (!sortedPeerList) {
+/* Chooses the peer for a new transaction using the peerSelector, skipping peers that failed within the
+ * configured cool-down, and counts it as having one more transaction in progress until releasePeer: is called.
+ * If every peer failed recently, the one that failed longest ago is used. Peers backing off because their
+ * destination is full are never used, so nil is returned if every peer is backing off. */
+- (nullable NiFiPeer *)acquirePreferredPeer {
+    NSArray<NiFiPeer *> *currentPeerList = self.currentPeerList; // snapshot, as the list may be replaced by a peer update
+    if (!currentPeerList || currentPeerList.count == 0) {
         return nil;
     }
-    return sortedPeerList[0];
+    NSMutableArray<NiFiPeer *> *availablePeers = [NSMutableArray arrayWithCapacity:currentPeerList.count];
+    NiFiPeer *leastRecentlyFailedPeer = nil;
+    for (NiFiPeer *peer in currentPeerList) {
+        if ([peer isBackingOff]) {
+            continue;
+        } else if (![peer hasFailedWithinInterval:self.config.peerFailureCooldown]) {
+            [availablePeers addObject:peer];
+        } else if (!leastRecentlyFailedPeer || peer.lastFailure < leastRecentlyFailedPeer.lastFailure) {
+            leastRecentlyFailedPeer = peer;
+        }
+    }
+    @synchronized(_activeTransactionPeerKeys) {
+        NiFiPeer *preferredPeer = leastRecentlyFailedPeer;
+        if (availablePeers.count > 0) {
+            preferredPeer = [self.peerSelector selectPeerFromPeers:availablePeers
+                                           activeTransactionCounts:_activeTransactionPeerKeys];
+        }
+        if (preferredPeer) {
+            [_activeTransactionPeerKeys addObject:[preferredPeer peerKey]];
+        }
+        return preferredPeer;
+    }
 }
 
-- (NSArray<NiFiPeer *> *)getSortedPeerList {
-    if (!_currentPeerList) {
-        return nil;
+- (BOOL)isBackingOff {
+    NSArray<NiFiPeer *> *currentPeerList = self.currentPeerList;
+    if (!currentPeerList || currentPeerList.count == 0) {
+        return NO;
+    }
+    for (NiFiPeer *peer in currentPeerList) {
+        if (![peer isBackingOff]) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)releasePeer:(nullable NiFiPeer *)peer {
+    if (peer) {
+        @synchronized(_activeTransactionPeerKeys) {
+            [_activeTransactionPeerKeys removeObject:[peer peerKey]];
+        }
+    }
+}
+
+/* Releases the peer acquired for the transaction once the transaction is finished,
+ * or right away if the transaction could not be created. */
+- (void)releasePeer:(nullable NiFiPeer *)peer whenTransactionFinishes:(nullable NiFiTransaction *)transaction {
+    if (!transaction) {
+        [self releasePeer:peer];
+        return;
     }
-    NSArray *sortedPeerList = [_currentPeerList sortedArrayUsingSelector:@selector(compare:)];
-    return sortedPeerList;
+    __weak NiFiSiteToSiteUniClusterClient *weakSelf = self;
+    transaction.finishedHandler = ^{
+        [weakSelf releasePeer:peer];
+    };
 }
 
 - (void)resetPeersFromInitialPeerConfig {
     if (_remoteClusterConfig.urls && _remoteClusterConfig.urls.count > 0) {
-        _currentPeerList = [NSMutableArray arrayWithCapacity:_remoteClusterConfig.urls.count];
-        _initialPeerKeySet = [NSMutableSet setWithCapacity:_remoteClusterConfig.urls.count];
+        NSMutableArray<NiFiPeer *> *peerList = [NSMutableArray arrayWithCapacity:_remoteClusterConfig.urls.count];
+        NSMutableSet *peerKeySet = [NSMutableSet setWithCapacity:_remoteClusterConfig.urls.count];
         for (NSURL *url in _remoteClusterConfig.urls) {
             NiFiPeer *peer = [NiFiPeer peerWithUrl:url];
             if (peer) {
-                [(NSMutableArray *)_currentPeerList addObject:peer];
-                [(NSMutableSet *)_initialPeerKeySet addObject:[peer peerKey]];
+                [peerList addObject:peer];
+                [peerKeySet addObject:[peer peerKey]];
             }
         }
+        self.initialPeerKeySet = peerKeySet;
+        self.currentPeerList = peerList;
     }
 }
 
+/* Asks each known peer for the cluster's peers until one answers, and swaps in the new peer list. This blocks on
+ * the network, so it only runs on the background refresher started by updatePeersIfNecessary. */
 - (void)updatePeers {
-    NSURLSession *urlSession = [self createUrlSession];
-    if (! _currentPeerList || _currentPeerList.count < 1) {
+    NSURLSession *urlSession = [self sharedUrlSession];
+    if (! self.currentPeerList || self.currentPeerList.count < 1) {
         [self resetPeersFromInitialPeerConfig];
     }
-    for (NiFiPeer *peer in _currentPeerList) {
+    NSArray<NiFiPeer *> *currentPeerList = self.currentPeerList; // snapshot, as transactions may read the list while it is replaced
+    for (NiFiPeer *peer in currentPeerList) {
         NiFiHttpRestApiClient *apiClient = [self createRestApiClientWithBaseUrl:peer.url
                                                                      urlSession:(NSObject<NSURLSessionProtocol> *)urlSession];
         NSError *getPeersError = nil;
@@ -318,7 +516,6 @@
         } else {
             [self addPeers:newPeers];
             NSLog(@"Successfully updated peers for remote NiFi cluster.");
-            self.isPeerUpdateNecessary = NO;
             if (self.config.peerUpdateInterval > 0.0) {
                 self.nextPeerUpdateTimeIntervalSinceReferenceDate =
                     [NSDate timeIntervalSinceReferenceDate] + self.config.peerUpdateInterval;
@@ -328,21 +525,41 @@
         
     }
     NSLog(@"Error: Failed to update peers for remote NiFi cluster.");
+    self.isPeerUpdateNecessary = YES;
+    self.peerUpdateRetryTimeIntervalSinceReferenceDate = [NSDate timeIntervalSinceReferenceDate] + self.config.peerUpdateRetryInterval;
 }
 
 - (void)updatePeersIfNecessary {
     
-    if (!self.isPeerUpdateNecessary) {
-        // has the configured refresh interval (if set to > 0.0) elapsed?
-        self.isPeerUpdateNecessary = (self.config.peerUpdateInterval > 0.0 ?
-                                      [NSDate timeIntervalSinceReferenceDate] > self.nextPeerUpdateTimeIntervalSinceReferenceDate :
-                                      NO);
-    }
-    
-    if (self.isPeerUpdateNecessary) {
-        [self updatePeers];
+    // A client may be shared by several threads (see sharedClientWithConfig:). Peer updates run in the background,
+    // one at a time, so creating a transaction never waits for one: it uses the last known peer list.
+    @synchronized(self) {
+        if (!self.isPeerUpdateNecessary) {
+            // has the configured refresh interval (if set to > 0.0) elapsed?
+            self.isPeerUpdateNecessary = (self.config.peerUpdateInterval > 0.0 ?
+                                          [NSDate timeIntervalSinceReferenceDate] > self.nextPeerUpdateTimeIntervalSinceReferenceDate :
+                                          NO);
+        }
+        
+        if (!self.isPeerUpdateNecessary ||
+                self.isPeerUpdateInFlight ||
+                [NSDate timeIntervalSinceReferenceDate] < self.peerUpdateRetryTimeIntervalSinceReferenceDate) {
+            return;
+        }
+        // cleared before the update starts, so that a failure reported while it is in flight asks for another one
+        self.isPeerUpdateNecessary = NO;
+        self.isPeerUpdateInFlight = YES;
     }
     
+    __weak NiFiSiteToSiteUniClusterClient *weakSelf = self;
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        NiFiSiteToSiteUniClusterClient *strongSelf = weakSelf;
+        if (!strongSelf) {
+            return;
+        }
+        [strongSelf updatePeers];
+        strongSelf.isPeerUpdateInFlight = NO;
+    });
 }
 
 - (void)addPeers:(NSArray<NiFiPeer *> *)newPeerList {
@@ -351,21 +568,33 @@
         id newPeerKey = [peer.url absoluteURL];
         [newPeerMap setObject:peer forKey:newPeerKey];
     }
-    for (NiFiPeer *peer in _currentPeerList) {
+    for (NiFiPeer *peer in self.currentPeerList) {
         id oldPeerKey = [peer.url absoluteURL];
         if (newPeerMap[oldPeerKey]) {
             newPeerMap[oldPeerKey].lastFailure = peer.lastFailure;
+            newPeerMap[oldPeerKey].averageTransactionDuration = peer.averageTransactionDuration;
+            newPeerMap[oldPeerKey].backoffUntil = peer.backoffUntil;
+            newPeerMap[oldPeerKey].consecutiveBackoffCount = peer.consecutiveBackoffCount;
         } else if ([_initialPeerKeySet containsObject:oldPeerKey]) {
             [newPeerMap setObject:peer forKey:oldPeerKey];
         }
     }
     if (newPeerMap && newPeerMap.count > 0) {
-        _currentPeerList = [newPeerMap allValues];
+        self.currentPeerList = [newPeerMap allValues];
     }
 }
 
 // MARK: Helper functions 
 
+- (NSURLSession *)sharedUrlSession {
+    @synchronized(self) {
+        if (!self.urlSession) {
+            self.urlSession = [self createUrlSession];
+        }
+        return self.urlSession;
+    }
+}
+
 - (NSURLSession *)createUrlSession {
     NSURLSession *urlSession;
     if (self.remoteClusterConfig.urlSessionConfiguration ||
@@ -434,10 +663,19 @@
     NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:apiBaseUrl
                                                                          clientCredential:credential
                                                                                urlSession:urlSession];
+    restApiClient.siteToSiteInfoCacheTTL = self.config.siteToSiteInfoCacheTTL;
     
     return restApiClient;
 }
 
+- (void) updatePrioritizedPortListIfNecessary:(nonnull NiFiHttpRestApiClient *)restApiClient {
+    @synchronized(self) {
+        if (!self.prioritizedRemoteInputPortIdList) {
+            [self updatePrioritizedPortList:restApiClient];
+        }
+    }
+}
+
 - (void) updatePrioritizedPortList:(nonnull NiFiHttpRestApiClient *)restApiClient {
 
     NSError *portIdLookupError;
@@ -450,6 +688,9 @@
          portIdLookupError.localizedDescription] :
         @"When looking up port ID by name, encountered error";
         NSLog(@"%@", errMsg);
+    } else if (self.config.portName && !portIdsByName[self.config.portName]) {
+        // the port may have been created since the controller info was cached
+        [restApiClient invalidateCachedSiteToSiteInfo];
     }
     
     // The priority of port resolution is currently:
@@ -479,7 +720,7 @@
     }
     
     if (prioritizedPortList && [prioritizedPortList count] > 0) {
-        _prioritizedRemoteInputPortIdList = prioritizedPortList;
+        self.prioritizedRemoteInputPortIdList = prioritizedPortList;
     }
 }
 
@@ -496,6 +737,135 @@ NSString *const HTTP_SITE_TO_SITE_PROTOCOL_VERSION = @"5";
 typedef void(^TtlExtenderBlock)(NSString * transactionId);
 
 
+// keep-alives that fall due within this long of each other are sent together
+static const NSTimeInterval KEEP_ALIVE_BATCH_WINDOW = 1.0;
+
+@interface NiFiHttpKeepAlive : NSObject
+@property (nonatomic) NSTimeInterval interval;
+@property (nonatomic) NSTimeInterval nextDue; // TimeIntervalSinceReferenceDate
+@end
+
+@implementation NiFiHttpKeepAlive
+@end
+
+/* Extends the server-side TTL of every open HTTP transaction, every half TTL, from one timer on one utility queue
+ * rather than a timer per transaction. Transactions are held weakly, and are dropped as soon as they stop keeping
+ * alive (when they complete, are canceled, or fail) or are released. */
+@interface NiFiHttpKeepAliveScheduler : NSObject
++ (nonnull instancetype)sharedScheduler;
+- (void)scheduleKeepAliveForTransaction:(nonnull NiFiHttpTransaction *)transaction ttl:(NSTimeInterval)ttl;
+- (void)removeTransaction:(nonnull NiFiHttpTransaction *)transaction;
+@end
+
+@implementation NiFiHttpKeepAliveScheduler {
+    dispatch_queue_t _queue;
+    dispatch_source_t _timer;
+    NSMapTable<NiFiHttpTransaction *, NiFiHttpKeepAlive *> *_keepAlives; // only accessed on _queue
+}
+
++ (nonnull instancetype)sharedScheduler {
+    static NiFiHttpKeepAliveScheduler *sharedScheduler = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedScheduler = [[self alloc] init];
+    });
+    return sharedScheduler;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _queue = dispatch_queue_create("org.apache.nifi.s2s.http.keepalive",
+                                       dispatch_queue_attr_make_with_qos_class(DISPATCH_QUEUE_SERIAL, QOS_CLASS_UTILITY, 0));
+        _keepAlives = [NSMapTable mapTableWithKeyOptions:(NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality)
+                                            valueOptions:NSPointerFunctionsStrongMemory];
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        __weak NiFiHttpKeepAliveScheduler *weakSelf = self;
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf sendDueKeepAlives];
+        });
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_resume(_timer);
+    }
+    return self;
+}
+
+- (void)scheduleKeepAliveForTransaction:(nonnull NiFiHttpTransaction *)transaction ttl:(NSTimeInterval)ttl {
+    if (ttl <= 0.0) {
+        NSLog(@"Server did not specify a transaction TTL, not scheduling keep-alives. transactionId=%@", transaction.transactionId);
+        return;
+    }
+    NiFiHttpKeepAlive *keepAlive = [[NiFiHttpKeepAlive alloc] init];
+    keepAlive.interval = ttl / 2;
+    keepAlive.nextDue = [NSDate timeIntervalSinceReferenceDate] + keepAlive.interval;
+    dispatch_async(_queue, ^{
+        [_keepAlives setObject:keepAlive forKey:transaction];
+        [self armTimer];
+    });
+}
+
+- (void)removeTransaction:(nonnull NiFiHttpTransaction *)transaction {
+    __weak NiFiHttpTransaction *weakTransaction = transaction;
+    dispatch_async(_queue, ^{
+        NiFiHttpTransaction *strongTransaction = weakTransaction;
+        if (strongTransaction) {
+            [_keepAlives removeObjectForKey:strongTransaction];
+            [self armTimer];
+        }
+    });
+}
+
+/* Runs on _queue. Sends every keep-alive that is due, or almost due, without waiting for the responses. */
+- (void)sendDueKeepAlives {
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableArray<NiFiHttpTransaction *> *dueTransactions = [NSMutableArray array];
+    for (NiFiHttpTransaction *transaction in _keepAlives) {
+        if (transaction && [_keepAlives objectForKey:transaction].nextDue <= now + KEEP_ALIVE_BATCH_WINDOW) {
+            [dueTransactions addObject:transaction];
+        }
+    }
+    for (NiFiHttpTransaction *transaction in dueTransactions) {
+        NiFiHttpRestApiClient *restApiClient = transaction.restApiClient;
+        NSString *transactionUrl = transaction.transactionResource.transactionUrl;
+        if (![transaction shouldKeepAlive] || !restApiClient || !transactionUrl) {
+            [_keepAlives removeObjectForKey:transaction];
+            continue;
+        }
+        NiFiHttpKeepAlive *keepAlive = [_keepAlives objectForKey:transaction];
+        keepAlive.nextDue = now + keepAlive.interval;
+        NSString *transactionId = transaction.transactionId;
+        [restApiClient extendTTLForTransaction:transactionUrl completionHandler:^(NSError *error) {
+            if (error) {
+                NSLog(@"Error extended transaction with id=%@: %@", transactionId, error.localizedDescription);
+            }
+        }];
+    }
+    [self armTimer];
+}
+
+/* Runs on _queue. Sets the timer for the earliest keep-alive that is due, or disarms it if there are none. */
+- (void)armTimer {
+    NSTimeInterval nextDue = 0.0;
+    for (NiFiHttpTransaction *transaction in _keepAlives) {
+        NiFiHttpKeepAlive *keepAlive = transaction ? [_keepAlives objectForKey:transaction] : nil;
+        if (keepAlive && (nextDue == 0.0 || keepAlive.nextDue < nextDue)) {
+            nextDue = keepAlive.nextDue;
+        }
+    }
+    if (nextDue == 0.0) {
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    NSTimeInterval delay = MAX(0.0, nextDue - [NSDate timeIntervalSinceReferenceDate]);
+    dispatch_source_set_timer(_timer,
+                              dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+                              DISPATCH_TIME_FOREVER,
+                              (uint64_t)(KEEP_ALIVE_BATCH_WINDOW * NSEC_PER_SEC));
+}
+
+@end
+
+
 @implementation NiFiHttpTransaction
 
 - (nonnull instancetype) initWithPortId:(nonnull NSString *)portId
@@ -506,23 +876,53 @@ typedef void(^TtlExtenderBlock)(NSString * transactionId);
 - (nonnull instancetype) initWithPortId:(nonnull NSString *)portId
                       httpRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
                                    peer:(nullable NiFiPeer *)peer {
+    NSError *error;
+    NiFiTransactionResource *transactionResource = [restApiClient initiateSendTransactionToPortId:portId error:&error];
+    if (!transactionResource) {
+        NSLog(@"ERROR  %@", [error localizedDescription]);
+        [peer markFailure];
+        return nil;
+    }
+    return [self initWithTransactionResource:transactionResource httpRestApiClient:restApiClient peer:peer];
+}
+
++ (void) transactionWithPortId:(nonnull NSString *)portId
+             httpRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
+                          peer:(nullable NiFiPeer *)peer
+             completionHandler:(void (^_Nonnull)(NiFiHttpTransaction *_Nullable transaction, NSError *_Nullable error))completionHandler {
+    [restApiClient initiateSendTransactionToPortId:portId completionHandler:^(NiFiTransactionResource *transactionResource, NSError *error) {
+        if (!transactionResource) {
+            NSLog(@"ERROR  %@", [error localizedDescription]);
+            [peer markFailure];
+            completionHandler(nil, error ?: [NSError errorWithDomain:NiFiErrorDomain
+                                                                code:NiFiErrorSiteToSiteClientCouldNotCreateTransaction
+                                                            userInfo:nil]);
+            return;
+        }
+        completionHandler([[self alloc] initWithTransactionResource:transactionResource httpRestApiClient:restApiClient peer:peer], nil);
+    }];
+}
+
+- (nonnull instancetype) initWithTransactionResource:(nonnull NiFiTransactionResource *)transactionResource
+                                   httpRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
+                                                peer:(nullable NiFiPeer *)peer {
     self = [super initWithPeer:peer];
     if (self != nil) {
         _restApiClient = restApiClient;
-        NSError *error;
-        _transactionResource = [_restApiClient initiateSendTransactionToPortId:portId error:&error];
-        if (_transactionResource) {
-            self.shouldKeepAlive = true;
-            [self scheduleNextKeepAliveWithTTL:(_transactionResource.serverSideTtl)];
-        } else {
-            NSLog(@"ERROR  %@", [error localizedDescription]);
-            [self error];
-            self = nil;
-        }
+        _transactionResource = transactionResource;
+        self.shouldKeepAlive = true;
+        [[NiFiHttpKeepAliveScheduler sharedScheduler] scheduleKeepAliveForTransaction:self ttl:_transactionResource.serverSideTtl];
     }
     return self;
 }
 
+- (void)setShouldKeepAlive:(bool)shouldKeepAlive {
+    [super setShouldKeepAlive:shouldKeepAlive];
+    if (!shouldKeepAlive) {
+        [[NiFiHttpKeepAliveScheduler sharedScheduler] removeTransaction:self];
+    }
+}
+
 - (NSString *)transactionId {
     return self.transactionResource.transactionId;
 }
@@ -572,37 +972,60 @@ typedef void(^TtlExtenderBlock)(NSString * transactionId);
         [self error];
         return nil;
     }
+    return [self completeWithTransactionResult:transactionResult];
+}
+
+- (void)confirmAndCompleteWithCompletionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler {
+    
+    // 1. Send encoded flow file data
+    [self.restApiClient sendFlowFiles:self.dataPacketEncoder
+                      withTransaction:self.transactionResource
+                    completionHandler:^(NSInteger serverCrc, NSError *sendError) {
+        
+        NSUInteger expectedCrc = [self.dataPacketEncoder getEncodedDataCrcChecksum];
+        
+        NSLog(@"NiFi Peer returned CRC code: %ld, expected CRC was: %ld",
+              (unsigned long)serverCrc, (unsigned long)expectedCrc);
+        
+        if ((NSUInteger)serverCrc != expectedCrc) {
+            [self.restApiClient endTransaction:self.transactionResource.transactionUrl
+                                  responseCode:BAD_CHECKSUM
+                             completionHandler:^(NiFiTransactionResult *badChecksumResult, NSError *endError) {
+                [self error];
+                completionHandler(nil, sendError ?: [NSError errorWithDomain:NiFiErrorDomain
+                                                                        code:NiFiErrorSiteToSiteTransactionInvalidServerResponse
+                                                                    userInfo:nil]);
+            }];
+            return;
+        }
+        
+        // 2. Commit the flow files on the remote end
+        self.transactionState = TRANSACTION_CONFIRMED;
+        [self.restApiClient endTransaction:self.transactionResource.transactionUrl
+                              responseCode:CONFIRM_TRANSACTION
+                         completionHandler:^(NiFiTransactionResult *transactionResult, NSError *endError) {
+            if (endError || !transactionResult) {
+                [self error];
+                completionHandler(nil, endError ?: [NSError errorWithDomain:NiFiErrorDomain
+                                                                       code:NiFiErrorSiteToSiteTransaction
+                                                                   userInfo:nil]);
+                return;
+            }
+            completionHandler([self completeWithTransactionResult:transactionResult], nil);
+        }];
+    }];
+}
+
+- (nonnull NiFiTransactionResult *)completeWithTransactionResult:(nonnull NiFiTransactionResult *)transactionResult {
     self.transactionState = TRANSACTION_COMPLETED;
     transactionResult.duration = [[NSDate date] timeIntervalSinceDate:self.startTime];
+    [self recordTransactionResult:transactionResult];
     NSLog(@"Completed transaction. flowfiles_sent=%llu, transactionId=%@", transactionResult.dataPacketsTransferred, [self transactionId]);
     self.shouldKeepAlive = false;
     return transactionResult;
 }
 
 
-- (void)scheduleNextKeepAliveWithTTL:(NSTimeInterval)ttl {
-    // schedule another keep alive if needed
-    if (self.shouldKeepAlive) {
-        NSLog(@"Scheduling background task to extend transaction TTL");
-        dispatch_time_t nextKeepAlive = dispatch_time(DISPATCH_TIME_NOW, (ttl / 2) * NSEC_PER_SEC);
-        dispatch_after(nextKeepAlive, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(void){
-            if (self &&
-                    [self shouldKeepAlive] &&
-                    [self restApiClient] &&
-                    [self transactionResource] &&
-                    [self transactionResource].transactionUrl) {
-                NSError *error;
-                [_restApiClient extendTTLForTransaction:_transactionResource.transactionUrl error:&error];
-                if (error) {
-                    NSLog(@"Error extended transaction with id=%@: %@",
-                          _transactionResource.transactionId, error.localizedDescription);
-                }
-                [self scheduleNextKeepAliveWithTTL:ttl]; // this will put the next "keep-alive heartbeat" task on an async queue
-            }
-        });
-    }
-}
-
 + (bool)assertExpectedState:(NiFiTransactionState)expectedState equalsActualState:(NiFiTransactionState)actualState {
     if (expectedState != actualState) {
         NSLog(@"NiFiTransaction encountered internal state error. Expected to be in state %@, actually in state %@",
@@ -616,40 +1039,133 @@ typedef void(^TtlExtenderBlock)(NSString * transactionId);
 @end
 
 
+// NiFi responds 503 Service Unavailable when the port's destination is full
+static BOOL NiFiIsDestinationFullError(NSError *error) {
+    return [error.domain isEqualToString:NiFiErrorDomain] && error.code == NiFiErrorHttpStatusCode + 503;
+}
+
 @implementation NiFiHttpSiteToSiteClient
 
 - (nullable NSObject <NiFiTransaction> *)createTransactionWithURLSession:(NSURLSession *)urlSession {
     
     [self updatePeersIfNecessary];
-    NiFiPeer *peer = [self getPreferredPeer];
+    NiFiPeer *peer = [self acquirePreferredPeer];
+    if (!peer) {
+        NSLog(@"Could not create NiFi s2s transaction, as no peer is available. Every peer may be backing off.");
+        return nil;
+    }
     
     NiFiHttpRestApiClient *restApiClient = [self createRestApiClientWithBaseUrl:peer.url
                                                                      urlSession:(NSObject<NSURLSessionProtocol> *)urlSession];
     
-    if (!self.prioritizedRemoteInputPortIdList) {
-        [self updatePrioritizedPortList:restApiClient];
-    }
+    [self updatePrioritizedPortListIfNecessary:restApiClient];
     
-    NiFiHttpTransaction *transaction = nil;
-    if (self.prioritizedRemoteInputPortIdList) {
-        for (NSString *portId in self.prioritizedRemoteInputPortIdList) {
-            NSLog(@"Attempting to initiate transaction. portId=%@", portId);
-            transaction = [[NiFiHttpTransaction alloc] initWithPortId:portId httpRestApiClient:restApiClient];
-            if (transaction) {
-                NSLog(@"Successfully initiated transaction. transactionId=%@, portId=%@",
-                      transaction.transactionId, portId);
-                break;
-            }
+    BOOL destinationFull = NO;
+    for (NSString *portId in self.prioritizedRemoteInputPortIdList) {
+        NSLog(@"Attempting to initiate transaction. portId=%@", portId);
+        NSError *initiateError = nil;
+        NiFiTransactionResource *transactionResource = [restApiClient initiateSendTransactionToPortId:portId error:&initiateError];
+        if (transactionResource) {
+            NiFiHttpTransaction *transaction = [[NiFiHttpTransaction alloc] initWithTransactionResource:transactionResource
+                                                                                      httpRestApiClient:restApiClient
+                                                                                                   peer:nil];
+            [self didInitiateTransaction:transaction withPeer:peer portId:portId];
+            return transaction;
         }
+        NSLog(@"ERROR  %@", [initiateError localizedDescription]);
+        destinationFull = destinationFull || NiFiIsDestinationFullError(initiateError);
     }
+    [self didFailToInitiateTransactionWithPeer:peer restApiClient:restApiClient destinationFull:destinationFull];
+    return nil;
+}
+
+- (void)createTransactionWithCompletionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler {
     
-    if (!transaction) {
+    [self updatePeersIfNecessary];
+    NiFiPeer *peer = [self acquirePreferredPeer];
+    if (!peer) {
+        NSLog(@"Could not create NiFi s2s transaction, as no peer is available. Every peer may be backing off.");
+        completionHandler(nil);
+        return;
+    }
+    
+    NiFiHttpRestApiClient *restApiClient = [self createRestApiClientWithBaseUrl:peer.url
+                                                                     urlSession:(NSObject<NSURLSessionProtocol> *)[self sharedUrlSession]];
+    
+    // only blocks until the port list is first known, after that it is reused by every transaction
+    [self updatePrioritizedPortListIfNecessary:restApiClient];
+    
+    [self initiateTransactionWithRestApiClient:restApiClient
+                                          peer:peer
+                                       portIds:self.prioritizedRemoteInputPortIdList
+                                     portIndex:0
+                               destinationFull:NO
+                             completionHandler:completionHandler];
+}
+
+/* Asks the peer for a transaction on each port in turn until one is created, as createTransactionWithURLSession: does,
+ * without a thread waiting for the responses. */
+- (void)initiateTransactionWithRestApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
+                                        peer:(nonnull NiFiPeer *)peer
+                                     portIds:(nullable NSArray *)portIds
+                                   portIndex:(NSUInteger)portIndex
+                             destinationFull:(BOOL)destinationFull
+                           completionHandler:(void (^_Nonnull)(NSObject <NiFiTransaction> *_Nullable transaction))completionHandler {
+    if (portIndex >= [portIds count]) {
+        [self didFailToInitiateTransactionWithPeer:peer restApiClient:restApiClient destinationFull:destinationFull];
+        completionHandler(nil);
+        return;
+    }
+    NSString *portId = portIds[portIndex];
+    NSLog(@"Attempting to initiate transaction. portId=%@", portId);
+    [NiFiHttpTransaction transactionWithPortId:portId
+                             httpRestApiClient:restApiClient
+                                          peer:nil
+                             completionHandler:^(NiFiHttpTransaction *transaction, NSError *initiateError) {
+        if (!transaction) {
+            [self initiateTransactionWithRestApiClient:restApiClient
+                                                  peer:peer
+                                               portIds:portIds
+                                             portIndex:portIndex + 1
+                                       destinationFull:destinationFull || NiFiIsDestinationFullError(initiateError)
+                                     completionHandler:completionHandler];
+            return;
+        }
+        [self didInitiateTransaction:transaction withPeer:peer portId:portId];
+        completionHandler(transaction);
+    }];
+}
+
+/* The peer is only set once the transaction is initiated, so that a port rejecting the transaction does not mark the peer failed.
+ * The peer is released once the transaction finishes. */
+- (void)didInitiateTransaction:(nonnull NiFiHttpTransaction *)transaction
+                      withPeer:(nonnull NiFiPeer *)peer
+                        portId:(nonnull NSString *)portId {
+    transaction.peer = peer;
+    transaction.config = self.config;
+    if (self.config.streamingChunkSize > 0) {
+        transaction.dataPacketEncoder = [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:self.config.streamingChunkSize];
+    }
+    NSLog(@"Successfully initiated transaction. transactionId=%@, portId=%@",
+          transaction.transactionId, portId);
+    [self releasePeer:peer whenTransactionFinishes:transaction];
+}
+
+- (void)didFailToInitiateTransactionWithPeer:(nonnull NiFiPeer *)peer
+                               restApiClient:(nonnull NiFiHttpRestApiClient *)restApiClient
+                             destinationFull:(BOOL)destinationFull {
+    if (destinationFull) {
+        [peer markDestinationFullWithInitialBackoff:self.config.peerBackoffInitialInterval
+                                         maxBackoff:self.config.peerBackoffMaxInterval];
+        NSLog(@"Could not create NiFi s2s transaction, as the destination is full. peer='%@'", peer.url);
+    } else {
         [peer markFailure];
         self.isPeerUpdateNecessary = YES;
+        [restApiClient invalidateCachedSiteToSiteInfo];
         NSLog(@"Could not create NiFi s2s transaction. Check NiFi s2s configuration. "
               "Is the correct url and s2s portName/portId set?");
     }
-    return transaction;
+    [self releasePeer:peer whenTransactionFinishes:nil];
 }
 
 @end
@@ -669,12 +1185,155 @@ typedef enum {
     TagResponseCodeRead,
 } NiFiSocketGCDTags;
 
+@class NiFiSocketConnection;
+
 @interface NiFiSocketTransaction ()
 @property (nonatomic, retain, readwrite, nonnull) NSString *transactionId;
-@property (nonatomic, retain, readwrite, nonnull) NiFiSiteToSiteClientConfig *config;
 @property (nonatomic, retain, readwrite, nonnull) NiFiSocket *socket;
+@property (nonatomic, retain, readwrite, nullable) NiFiSocketConnection *connection;
+@property (nonatomic, weak, readwrite, nullable) NiFiSocketConnectionPool *connectionPool;
 @property NSInteger protocolVersion;
 @property BOOL firstPacketSend;
+@property (nonatomic, nullable) dispatch_semaphore_t writeQueueSlots; // nil unless data packets are pipelined to the socket
+@property (nonatomic) NSUInteger pipelinedDataPacketCount;
+@property (atomic, nullable) NSError *pipelinedWriteError;
+- (nonnull instancetype) initWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config
+                    remoteClusterConfig:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteCluster
+                                   peer:(nonnull NiFiPeer *)peer
+                                 portId:(nonnull NSString *)portId
+                         connectionPool:(nullable NiFiSocketConnectionPool *)connectionPool;
++ (nonnull NSData *) javaUTFDataForString:(nonnull NSString*)str;
+@end
+
+
+/* A raw site-to-site connection to a peer that has completed the protocol handshake for a given port.
+ * Once a transaction on it completes, the connection can carry further transactions without a new handshake. */
+@interface NiFiSocketConnection : NSObject
+@property (nonatomic, retain, readonly, nonnull) NiFiSocket *socket;
+@property (nonatomic, retain, readonly, nonnull) NiFiPeer *peer;
+@property (nonatomic, retain, readonly, nonnull) NSString *portId;
+@property (nonatomic, readwrite) NSTimeInterval lastUsedTimeIntervalSinceReferenceDate;
++ (nonnull NSString *)keyForPeer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId;
+- (nonnull instancetype) initWithSocket:(nonnull NiFiSocket *)socket peer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId;
+- (nonnull NSString *)key;
+- (void) closeWithTimeout:(NSTimeInterval)timeout;
+@end
+
+@implementation NiFiSocketConnection
+
++ (nonnull NSString *)keyForPeer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId {
+    return [NSString stringWithFormat:@"%@|%@|%@", [peer.url absoluteString], peer.rawPort, portId];
+}
+
+- (nonnull instancetype) initWithSocket:(nonnull NiFiSocket *)socket peer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId {
+    self = [super init];
+    if (self) {
+        _socket = socket;
+        _peer = peer;
+        _portId = portId;
+        _lastUsedTimeIntervalSinceReferenceDate = [NSDate timeIntervalSinceReferenceDate];
+    }
+    return self;
+}
+
+- (nonnull NSString *)key {
+    return [[self class] keyForPeer:_peer portId:_portId];
+}
+
+- (void) closeWithTimeout:(NSTimeInterval)timeout {
+    [_socket writeData:[NiFiSocketTransaction javaUTFDataForString:@"SHUTDOWN"] withTimeout:timeout callback:nil];
+    // The queued bytes are still written before the socket closes, but pending write callbacks fail right away
+    [_socket disconnect];
+}
+
+@end
+
+
+/* Idle, handshaken connections, per peer and port. Connections idle for longer than the expiration
+ * are closed when the pool is next used. A connection is checked before it is handed out, and discarded if the server
+ * has closed or reset it while it was idle, so that the transaction falls back to a new connection instead of failing. */
+@interface NiFiSocketConnectionPool : NSObject
+@property (nonatomic, readonly) NSTimeInterval idleExpiration;
+@property (nonatomic, readonly) NSTimeInterval timeout;
+@property (nonatomic, retain, nonnull) NSMutableDictionary<NSString *, NSMutableArray<NiFiSocketConnection *> *> *idleConnections;
+- (nonnull instancetype) initWithIdleExpiration:(NSTimeInterval)idleExpiration timeout:(NSTimeInterval)timeout;
+- (nullable NiFiSocketConnection *) checkOutConnectionForPeer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId;
+- (void) checkInConnection:(nonnull NiFiSocketConnection *)connection;
+@end
+
+@implementation NiFiSocketConnectionPool
+
+- (nonnull instancetype) initWithIdleExpiration:(NSTimeInterval)idleExpiration timeout:(NSTimeInterval)timeout {
+    self = [super init];
+    if (self) {
+        _idleExpiration = idleExpiration;
+        _timeout = timeout;
+        _idleConnections = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    for (NSArray<NiFiSocketConnection *> *connections in [_idleConnections allValues]) {
+        for (NiFiSocketConnection *connection in connections) {
+            [connection closeWithTimeout:_timeout];
+        }
+    }
+}
+
+- (nullable NiFiSocketConnection *) checkOutConnectionForPeer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId {
+    NSMutableArray<NiFiSocketConnection *> *expiredConnections = [NSMutableArray array];
+    NiFiSocketConnection *connection = nil;
+    @synchronized(self) {
+        [self removeExpiredConnectionsInto:expiredConnections];
+        NSMutableArray<NiFiSocketConnection *> *connections = _idleConnections[[NiFiSocketConnection keyForPeer:peer portId:portId]];
+        while (!connection && connections.count > 0) {
+            NiFiSocketConnection *candidate = [connections lastObject]; // most recently used
+            [connections removeLastObject];
+            if ([candidate.socket isAlive]) {
+                connection = candidate;
+            } else {
+                [expiredConnections addObject:candidate];
+            }
+        }
+    }
+    for (NiFiSocketConnection *expiredConnection in expiredConnections) {
+        [expiredConnection closeWithTimeout:_timeout];
+    }
+    return connection;
+}
+
+- (void) checkInConnection:(nonnull NiFiSocketConnection *)connection {
+    connection.lastUsedTimeIntervalSinceReferenceDate = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableArray<NiFiSocketConnection *> *expiredConnections = [NSMutableArray array];
+    @synchronized(self) {
+        [self removeExpiredConnectionsInto:expiredConnections];
+        NSString *key = [connection key];
+        if (!_idleConnections[key]) {
+            _idleConnections[key] = [NSMutableArray array];
+        }
+        [_idleConnections[key] addObject:connection];
+    }
+    for (NiFiSocketConnection *expiredConnection in expiredConnections) {
+        [expiredConnection closeWithTimeout:_timeout];
+    }
+}
+
+- (void) removeExpiredConnectionsInto:(nonnull NSMutableArray<NiFiSocketConnection *> *)expiredConnections {
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    for (NSString *key in [_idleConnections allKeys]) {
+        NSMutableArray<NiFiSocketConnection *> *connections = _idleConnections[key];
+        NSIndexSet *expiredIndexes = [connections indexesOfObjectsPassingTest:^BOOL(NiFiSocketConnection *connection, NSUInteger idx, BOOL *stop) {
+            return now - connection.lastUsedTimeIntervalSinceReferenceDate > self.idleExpiration;
+        }];
+        [expiredConnections addObjectsFromArray:[connections objectsAtIndexes:expiredIndexes]];
+        [connections removeObjectsAtIndexes:expiredIndexes];
+        if (connections.count == 0) {
+            [_idleConnections removeObjectForKey:key];
+        }
+    }
+}
+
 @end
 
 
@@ -684,12 +1343,43 @@ typedef enum {
                     remoteClusterConfig:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteCluster
                                    peer:(nonnull NiFiPeer *)peer
                                  portId:(nonnull NSString *)portId {
+    return [self initWithConfig:config remoteClusterConfig:remoteCluster peer:peer portId:portId connectionPool:nil];
+}
+
+- (nonnull instancetype) initWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config
+                    remoteClusterConfig:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteCluster
+                                   peer:(nonnull NiFiPeer *)peer
+                                 portId:(nonnull NSString *)portId
+                         connectionPool:(nullable NiFiSocketConnectionPool *)connectionPool {
     self = [super initWithPeer:peer];
     if (self) {
         self.firstPacketSend = YES;
         self.transactionId = [[NSUUID UUID] UUIDString];
         self.config = config;
+        if (config.streamingChunkSize > 0) {
+            self.dataPacketEncoder = [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:config.streamingChunkSize];
+        }
+        if (config.socketWriteQueueDepth > 0) {
+            // Created empty and filled by signalling, as libdispatch requires a semaphore's count to be
+            // back at its initial value when it is released, which is not guaranteed if the socket fails.
+            _writeQueueSlots = dispatch_semaphore_create(0);
+            for (NSUInteger i = 0; i < config.socketWriteQueueDepth; i++) {
+                dispatch_semaphore_signal(_writeQueueSlots);
+            }
+        }
         self.peer = peer;
+        self.connectionPool = connectionPool;
+        
+        // Reuse an idle connection that has already been through the handshake if there is one
+        NiFiSocketConnection *pooledConnection = [connectionPool checkOutConnectionForPeer:peer portId:portId];
+        if (pooledConnection) {
+            NSLog(@"Reusing socket connection. host=%@, port=%@", peer.url.host, peer.rawPort);
+            self.connection = pooledConnection;
+            _socket = pooledConnection.socket;
+            [_socket writeData:[[self class] javaUTFDataForString:@"SEND_FLOWFILES"] withTimeout:self.config.timeout callback:nil];
+            return self;
+        }
+        
         uint32_t port = self.peer.rawPort ? [self.peer.rawPort unsignedIntValue] : 0;
         if (!port) {
             NSLog(@"Cannot create socket sitetosite connection without raw port configured for peer.");
@@ -707,16 +1397,29 @@ typedef enum {
             
             [_socket writeData:[NSData dataWithBytes:MAGIC_BYTES length:MAGIC_BYTES_LEN] withTimeout:self.config.timeout callback:nil];
             
+            // A connection that fails any step of the handshake is closed rather than used, so it never reaches the connection pool
             NSInteger clientProtocolVersions[] = {6, 5, 4, 3, 2, 1};
             self.protocolVersion = [self negotiateProtocolVersion:clientProtocolVersions len:6];
-            [self protocolHandshake:self.protocolVersion portId:portId];
+            if (self.protocolVersion < 0) {
+                NSLog(@"NiFi Peer does not support a compatible Site-to-Site Protocol Version as this SiteToSite client.");
+                [_socket disconnect];
+                return nil;
+            }
+            if (![self protocolHandshake:self.protocolVersion portId:portId]) {
+                // either the handshake failed, or the port cannot accept data right now and there is no point in sending any
+                [_socket disconnect];
+                return nil;
+            }
             
             NSInteger clientCodecVersions[] = {1};
             NSInteger codecVersion = [self negotiateFlowFileCodecVersion:clientCodecVersions len:1];
             if (codecVersion != 1) {
                 NSLog(@"NiFi Peer does not support a compatible Flow File Codec Version as this SiteToSite client.");
+                [_socket disconnect];
+                return nil;
             }
             
+            self.connection = [[NiFiSocketConnection alloc] initWithSocket:_socket peer:peer portId:portId];
             [_socket writeData:[[self class] javaUTFDataForString:@"SEND_FLOWFILES"] withTimeout:self.config.timeout callback:nil];
         } else {
             NSLog(@"Error with socket s2s configuration.");
@@ -745,18 +1448,67 @@ static const int RESOURCE_OK_CODE = 20;
 static const int DIFFERENT_RESOURCE_VERSION_CODE = 21;
 static const int ABORT_CODE = 255;
 
+/* The last version successfully negotiated for each peer and resource, shared by all connections in the process,
+ * so that a new connection can usually finish negotiation in one round trip. */
+static NSMutableDictionary<NSString *, NSNumber *> *negotiatedVersionCache = nil;
+
++ (NSString *) negotiatedVersionCacheKeyForResource:(nonnull NSString *)resourceKey peer:(nonnull NiFiPeer *)peer {
+    return [NSString stringWithFormat:@"%@:%@|%@", peer.url.host, peer.rawPort, resourceKey];
+}
+
++ (NSInteger) cachedVersionForResource:(nonnull NSString *)resourceKey peer:(nonnull NiFiPeer *)peer {
+    @synchronized([NiFiSocketTransaction class]) {
+        NSNumber *version = negotiatedVersionCache[[self negotiatedVersionCacheKeyForResource:resourceKey peer:peer]];
+        return version ? [version integerValue] : -1;
+    }
+}
+
++ (void) cacheVersion:(NSInteger)version forResource:(nonnull NSString *)resourceKey peer:(nonnull NiFiPeer *)peer {
+    @synchronized([NiFiSocketTransaction class]) {
+        if (!negotiatedVersionCache) {
+            negotiatedVersionCache = [NSMutableDictionary dictionary];
+        }
+        NSString *key = [self negotiatedVersionCacheKeyForResource:resourceKey peer:peer];
+        if (version > 0) {
+            negotiatedVersionCache[key] = @(version);
+        } else {
+            [negotiatedVersionCache removeObjectForKey:key];
+        }
+    }
+}
+
 - (NSInteger) negotiateVersionForResource:(NSString *)resourceKey
-                      prioritizedVersions:(NSInteger[])versions
+                      prioritizedVersions:(NSInteger[])prioritizedVersions
                                       len:(NSInteger)versionsLength {
     
+    if (versionsLength <= 0) {
+        return -1;
+    }
+    
     NSInteger negotiatedVersion = -1;
     int32_t serverMaxVersion = INT_MAX; // we don't know until we as the server,
                                         // so for now assume the server supports any version of this resource
     
+    // Try the version last negotiated with this peer first, followed by the rest in order of preference
+    NSInteger versions[versionsLength];
+    NSInteger cachedVersion = [[self class] cachedVersionForResource:resourceKey peer:self.peer];
+    NSInteger orderedCount = 0;
+    for (int i=0; i < versionsLength; i++) {
+        if (prioritizedVersions[i] == cachedVersion) {
+            versions[orderedCount++] = cachedVersion;
+            break;
+        }
+    }
+    for (int i=0; i < versionsLength; i++) {
+        if (orderedCount == 0 || prioritizedVersions[i] != versions[0]) {
+            versions[orderedCount++] = prioritizedVersions[i];
+        }
+    }
+    
     for (int i=0; i < versionsLength; i++) {
         
         int32_t clientRequestedVersion = (int32_t)versions[i];
-        if (clientRequestedVersion < serverMaxVersion) {
+        if (clientRequestedVersion <= serverMaxVersion) {
             NSLog(@"Negotiating '%@' version with peer. version=%i", resourceKey, clientRequestedVersion);
             
             // we initiate the request by sending the resource key and the version (encoding/protocol/etc) the client wants to use.
@@ -781,8 +1533,10 @@ static const int ABORT_CODE = 255;
             if (serverResponse == RESOURCE_OK_CODE) {
                 NSLog(@"Server responded RESOURCE_OK. code=%li", (long)serverResponse);
                 negotiatedVersion = clientRequestedVersion;
+                [[self class] cacheVersion:negotiatedVersion forResource:resourceKey peer:self.peer];
                 break;
             } else if (serverResponse == DIFFERENT_RESOURCE_VERSION_CODE) {
+                [[self class] cacheVersion:-1 forResource:resourceKey peer:self.peer]; // the peer may have been downgraded
                 if (dataLength >= 5) {
                     int32_t buf;
                     memcpy(&buf, &responseBytes[1], 4); // index 1-4 is an int32 in big endian
@@ -795,6 +1549,7 @@ static const int ABORT_CODE = 255;
                 }
             } else if (serverResponse == ABORT_CODE) {
                 NSLog(@"Server responded with ABORT. code=%li", (long)serverResponse);
+                [[self class] cacheVersion:-1 forResource:resourceKey peer:self.peer];
                 if (dataLength > 1) {
                     NSData *messageData = [responseData subdataWithRange:NSMakeRange(1, dataLength-1)];
                     NSString *message = [[self class] stringForjavaUTFData:messageData];
@@ -859,6 +1614,9 @@ static const int ABORT_CODE = 255;
     }
     if (responseCode != PROPERTIES_OK) {
         NSLog(@"Error during sitetotsite protocol handshake. Server responded with response code='%i', message='%@'", responseCode, responseMessage ?: @"");
+        if (responseCode == PORTS_DESTINATION_FULL) {
+            [self markPeerDestinationFull];
+        }
         return NO;
     }
     
@@ -866,6 +1624,10 @@ static const int ABORT_CODE = 255;
 }
 
 - (void) sendData:(NiFiDataPacket *)data {
+    if (self.writeQueueSlots) {
+        [self pipelineData:data];
+        return;
+    }
     if (!self.firstPacketSend) {
         Byte rcBytes[] = {'R', 'C', CONTINUE_TRANSACTION};
         NSData *rcData = [NSData dataWithBytes:rcBytes length:3];
@@ -876,6 +1638,123 @@ static const int ABORT_CODE = 255;
     [super sendData:data]; /* NiFiTransaction */
 }
 
+/* Each packet after the first is preceded by a CONTINUE_TRANSACTION marker, so encodedData must hold exactly one packet. */
+- (void) sendEncodedData:(nonnull NSData *)encodedData
+             crcChecksum:(uint32_t)crcChecksum
+         dataPacketCount:(NSUInteger)dataPacketCount {
+    Byte rcBytes[] = {'R', 'C', CONTINUE_TRANSACTION};
+    if (self.writeQueueSlots) {
+        self.transactionState = DATA_EXCHANGED;
+        if (self.pipelinedWriteError) {
+            return; // the transaction has already failed, there is no point in sending more data
+        }
+        BOOL queued = YES;
+        if (!self.firstPacketSend) {
+            queued = [self queueWriteData:[NSData dataWithBytes:rcBytes length:3]];
+        } else {
+            self.firstPacketSend = NO; // change value for next call to this function
+        }
+        if (queued && [self queueWriteData:encodedData]) {
+            self.pipelinedDataPacketCount += dataPacketCount;
+        }
+        return;
+    }
+    if (!self.firstPacketSend) {
+        [self.dataPacketEncoder appendData:[NSData dataWithBytes:rcBytes length:3]];
+    } else {
+        self.firstPacketSend = NO; // change value for next call to this function
+    }
+    [super sendEncodedData:encodedData crcChecksum:crcChecksum dataPacketCount:dataPacketCount]; /* NiFiTransaction */
+}
+
+/* Encodes the data packet (preceded by its CONTINUE_TRANSACTION marker if it is not the first one) and queues it
+ * on the socket right away, so that encoding overlaps with network transfer rather than the whole batch being
+ * written at confirm time. Blocks while socketWriteQueueDepth writes are outstanding. A write error is recorded
+ * and reported by confirmAndCompleteOrError:, since sendData: cannot return one. */
+- (void) pipelineData:(NiFiDataPacket *)data {
+    self.transactionState = DATA_EXCHANGED;
+    if (self.pipelinedWriteError) {
+        return; // the transaction has already failed, there is no point in sending more data
+    }
+    
+    NiFiDataPacketEncoder *packetEncoder = self.config.streamingChunkSize > 0 ?
+            [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:self.config.streamingChunkSize] :
+            [[NiFiDataPacketEncoder alloc] init];
+    if (!self.firstPacketSend) {
+        Byte rcBytes[] = {'R', 'C', CONTINUE_TRANSACTION};
+        [packetEncoder appendData:[NSData dataWithBytes:rcBytes length:3]];
+    } else {
+        self.firstPacketSend = NO; // change value for next call to this function
+    }
+    [packetEncoder appendDataPacket:data];
+    
+    NSError *streamError = nil;
+    BOOL queued = [packetEncoder enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) {
+        return [self queueWriteData:chunk];
+    } error:&streamError];
+    if (queued) {
+        self.pipelinedDataPacketCount++;
+    } else if (streamError) {
+        [self recordPipelinedWriteError:streamError];
+    }
+}
+
+- (BOOL) queueWriteData:(nonnull NSData *)data {
+    dispatch_semaphore_t writeQueueSlots = self.writeQueueSlots;
+    dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.config.timeout * NSEC_PER_SEC));
+    if (dispatch_semaphore_wait(writeQueueSlots, timeout) != 0) {
+        NSLog(@"Timed out waiting for socket writes to complete. transactionId=%@", self.transactionId);
+        [self recordPipelinedWriteError:[NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorTimeout userInfo:nil]];
+        return NO;
+    }
+    __weak NiFiSocketTransaction *weakSelf = self;
+    [self.socket writeData:data withTimeout:self.config.timeout callback:^(NSError *writeError) {
+        if (writeError) {
+            [weakSelf recordPipelinedWriteError:writeError];
+        }
+        dispatch_semaphore_signal(writeQueueSlots);
+    }];
+    return self.pipelinedWriteError == nil;
+}
+
+- (void) recordPipelinedWriteError:(nonnull NSError *)error {
+    @synchronized(self) {
+        if (!self.pipelinedWriteError) { // keep the first error, later ones are usually a consequence of it
+            self.pipelinedWriteError = error;
+        }
+    }
+}
+
+/* Waits for all queued writes to complete, returning NO if any of them failed. */
+- (BOOL) drainWriteQueueOrError:(NSError *_Nullable *_Nullable)error {
+    NSUInteger acquiredSlots = 0;
+    dispatch_time_t timeout = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.config.timeout * NSEC_PER_SEC));
+    while (acquiredSlots < self.config.socketWriteQueueDepth) {
+        if (dispatch_semaphore_wait(self.writeQueueSlots, timeout) != 0) {
+            [self recordPipelinedWriteError:[NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorTimeout userInfo:nil]];
+            break;
+        }
+        acquiredSlots++;
+    }
+    for (NSUInteger i = 0; i < acquiredSlots; i++) {
+        dispatch_semaphore_signal(self.writeQueueSlots);
+    }
+    
+    NSError *writeError = self.pipelinedWriteError;
+    if (writeError) {
+        NSLog(@"Error sending encoded flow files: %@", writeError.localizedDescription);
+        if (error) {
+            *error = writeError;
+        }
+        return NO;
+    }
+    return YES;
+}
+
+- (NSUInteger) dataPacketsSentCount {
+    return self.writeQueueSlots ? self.pipelinedDataPacketCount : self.dataPacketEncoder.getDataPacketCount;
+}
+
 - (void) cancel {
     [super cancel]; /* NiFiTransaction */
     [self.socket disconnect];
@@ -884,7 +1763,34 @@ static const int ABORT_CODE = 255;
 - (nullable NiFiTransactionResult *)confirmAndCompleteOrError:(NSError *_Nullable *_Nullable)error {
     self.transactionState = DATA_EXCHANGED;
     // 1. Send encoded flow files
-    [self.socket writeData:self.dataPacketEncoder.getEncodedData withTimeout:self.config.timeout callback:nil];
+    if (self.writeQueueSlots) {
+        // Data packets have already been queued on the socket by sendData:, just make sure they were written
+        if (![self drainWriteQueueOrError:error]) {
+            [self error];
+            return nil;
+        }
+    } else if ([self.dataPacketEncoder isStreaming]) {
+        // Write each chunk synchronously, so that at most one chunk is held in memory by the socket at a time
+        __block NSError *socketWriteError = nil;
+        NSError *streamError = nil;
+        BOOL streamed = [self.dataPacketEncoder enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) {
+            NSError *writeError = nil;
+            [self.socket writeData:chunk withTimeout:self.config.timeout error:&writeError];
+            socketWriteError = writeError;
+            return writeError == nil;
+        } error:&streamError];
+        if (!streamed) {
+            NSError *sendError = socketWriteError ?: streamError;
+            NSLog(@"Error sending encoded flow files: %@", sendError ? sendError.localizedDescription : @"");
+            if (error) {
+                *error = sendError;
+            }
+            [self error];
+            return nil;
+        }
+    } else {
+        [self.socket writeData:self.dataPacketEncoder.getEncodedData withTimeout:self.config.timeout callback:nil];
+    }
     
     // 2. Send FINISH_TRANSACTION, Receive CRC checksum
     
@@ -932,6 +1838,7 @@ static const int ABORT_CODE = 255;
     }
     
     transactionResult.duration = [[NSDate date] timeIntervalSinceDate:self.startTime];
+    [self recordTransactionResult:transactionResult];
     NSLog(@"Completed transaction. flowfiles_sent=%llu, transactionId=%@", transactionResult.dataPacketsTransferred, [self transactionId]);
     return transactionResult;
 }
@@ -969,11 +1876,22 @@ static const int ABORT_CODE = 255;
         return nil;
     }
     
-    [_socket writeData:[[self class] javaUTFDataForString:@"SHUTDOWN"] withTimeout:self.config.timeout callback:nil];
+    // Only a transaction the server finished normally leaves the connection in a known state for the next one
+    BOOL isConnectionReusable = (serverResponseCode == TRANSACTION_FINISHED ||
+                                 serverResponseCode == TRANSACTION_FINISHED_BUT_DESTINATION_FULL);
+    NiFiSocketConnectionPool *connectionPool = self.connectionPool;
+    if (connectionPool && self.connection && isConnectionReusable) {
+        // keep the connection open for the next transaction rather than shutting it down
+        [connectionPool checkInConnection:self.connection];
+    } else {
+        [_socket writeData:[[self class] javaUTFDataForString:@"SHUTDOWN"] withTimeout:self.config.timeout callback:nil];
+        [_socket disconnect];
+    }
+    self.connection = nil;
     self.transactionState = TRANSACTION_COMPLETED;
     NSTimeInterval transactionDuration = [[NSDate date] timeIntervalSinceDate:self.startTime];
     return [[NiFiTransactionResult alloc] initWithResponseCode:serverResponseCode
-                                        dataPacketsTransferred:self.dataPacketEncoder.getDataPacketCount
+                                        dataPacketsTransferred:[self dataPacketsSentCount]
                                                        message:serverResponseMessage
                                                       duration:transactionDuration];
 }
@@ -1068,11 +1986,24 @@ static const int ABORT_CODE = 255;
 
 @implementation NiFiSocketSiteToSiteClient
 
+- (nullable instancetype) initWithConfig:(nonnull NiFiSiteToSiteClientConfig *)config
+                          remoteCluster:(nonnull NiFiSiteToSiteRemoteClusterConfig *)remoteClusterConfig {
+    self = [super initWithConfig:config remoteCluster:remoteClusterConfig];
+    if (self && config.socketIdleConnectionExpiration > 0.0) {
+        _connectionPool = [[NiFiSocketConnectionPool alloc] initWithIdleExpiration:config.socketIdleConnectionExpiration
+                                                                           timeout:config.timeout];
+    }
+    return self;
+}
+
 - (nullable NSObject <NiFiTransaction> *)createTransactionWithURLSession:(NSURLSession *)urlSession {
     
     [self updatePeersIfNecessary];
-    NiFiPeer *peer = [self getPreferredPeer];
-    
+    NiFiPeer *peer = [self acquirePreferredPeer];
+    if (!peer) {
+        NSLog(@"Could not create NiFi s2s transaction, as no peer is available. Every peer may be backing off.");
+        return nil;
+    }
 
     NiFiHttpRestApiClient *restApiClient = [self createRestApiClientWithBaseUrl:peer.url
                                                                      urlSession:(NSObject<NSURLSessionProtocol> *)urlSession];
@@ -1092,9 +2023,7 @@ static const int ABORT_CODE = 255;
         }
     }
     
-    if (!self.prioritizedRemoteInputPortIdList) {
-        [self updatePrioritizedPortList:restApiClient];
-    }
+    [self updatePrioritizedPortListIfNecessary:restApiClient];
     
     NiFiSocketTransaction *transaction = nil;
     if (self.prioritizedRemoteInputPortIdList && [self.prioritizedRemoteInputPortIdList count] > 0) {
@@ -1103,7 +2032,8 @@ static const int ABORT_CODE = 255;
         transaction = [[NiFiSocketTransaction alloc] initWithConfig:self.config
                                                 remoteClusterConfig:self.remoteClusterConfig
                                                                peer:peer
-                                                             portId:(NSString *)portId];
+                                                             portId:(NSString *)portId
+                                                     connectionPool:self.connectionPool];
         if (transaction) {
             NSLog(@"Successfully initiated transaction. transactionId=%@, portId=%@",
                   transaction.transactionId, portId);
@@ -1112,12 +2042,16 @@ static const int ABORT_CODE = 255;
         NSLog(@"Could not discover remote s2s input portId. Please configure either portName or portId.");
     }
     
-    if (!transaction) {
+    if (!transaction && [peer isBackingOff]) {
+        NSLog(@"Could not create NiFi s2s transaction, as the destination is full. peer='%@'", peer.url);
+    } else if (!transaction) {
         [peer markFailure];
         self.isPeerUpdateNecessary = YES;
+        [restApiClient invalidateCachedSiteToSiteInfo];
         NSLog(@"Could not create NiFi s2s transaction. Check NiFi s2s configuration. "
               "Is the correct url and s2s portName/portId set?");
     }
+    [self releasePeer:peer whenTransactionFinishes:transaction];
     return transaction;
     
     
@@ -55,6 +55,15 @@
 @end
 
 
+@interface NiFiSiteToSiteClientConfig()
+
+// A key that is equal for configs that would produce equivalent site-to-site clients.
+// Used to share long-lived clients, see +[NiFiSiteToSiteClient sharedClientWithConfig:].
+- (nonnull NSString *) clientRegistryKey;
+
+@end
+
+
 #endif /* NiFiSiteToSiteConfig_h */
 
 
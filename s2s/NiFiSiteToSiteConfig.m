@@ -18,6 +18,7 @@
 #import <Foundation/Foundation.h>
 #import "NiFiSiteToSite.h"
 #import "NiFiSiteToSiteConfig.h"
+#import "NiFiSiteToSiteUtil.h"
 
 /********** ProxyConfig Implementation **********/
 
@@ -96,6 +97,7 @@
     ((NiFiSiteToSiteRemoteClusterConfig *)copy).password = _password ? [_password copyWithZone:zone] : nil;
     ((NiFiSiteToSiteRemoteClusterConfig *)copy).urlSessionConfiguration = _urlSessionConfiguration ? [_urlSessionConfiguration copyWithZone:zone] : nil;
     ((NiFiSiteToSiteRemoteClusterConfig *)copy).urlSessionDelegate = _urlSessionDelegate; // shallow copy
+    ((NiFiSiteToSiteRemoteClusterConfig *)copy).socketTLSSettings = _socketTLSSettings ? [_socketTLSSettings copyWithZone:zone] : nil;
 
     return copy;
 }
@@ -139,6 +141,15 @@
         _portId = nil;
         _timeout = 30.0;
         _peerUpdateInterval = 0.0;
+        _peerUpdateRetryInterval = 10.0;
+        _streamingChunkSize = 0;
+        _socketWriteQueueDepth = 8;
+        _socketIdleConnectionExpiration = 10.0;
+        _peerSelectionStrategy = PEER_SELECTION_LEAST_LOADED;
+        _peerFailureCooldown = 10.0;
+        _peerBackoffInitialInterval = 1.0;
+        _peerBackoffMaxInterval = 60.0;
+        _siteToSiteInfoCacheTTL = 60.0;
     }
     return self;
 }
@@ -154,10 +165,80 @@
     ((NiFiSiteToSiteClientConfig *)copy).portId = _portId ? [_portId copyWithZone:zone] : nil;
     ((NiFiSiteToSiteClientConfig *)copy).timeout = _timeout;
     ((NiFiSiteToSiteClientConfig *)copy).peerUpdateInterval = _peerUpdateInterval;
+    ((NiFiSiteToSiteClientConfig *)copy).peerUpdateRetryInterval = _peerUpdateRetryInterval;
+    ((NiFiSiteToSiteClientConfig *)copy).streamingChunkSize = _streamingChunkSize;
+    ((NiFiSiteToSiteClientConfig *)copy).socketWriteQueueDepth = _socketWriteQueueDepth;
+    ((NiFiSiteToSiteClientConfig *)copy).socketIdleConnectionExpiration = _socketIdleConnectionExpiration;
+    ((NiFiSiteToSiteClientConfig *)copy).peerSelectionStrategy = _peerSelectionStrategy;
+    ((NiFiSiteToSiteClientConfig *)copy).peerFailureCooldown = _peerFailureCooldown;
+    ((NiFiSiteToSiteClientConfig *)copy).peerBackoffInitialInterval = _peerBackoffInitialInterval;
+    ((NiFiSiteToSiteClientConfig *)copy).peerBackoffMaxInterval = _peerBackoffMaxInterval;
+    ((NiFiSiteToSiteClientConfig *)copy).siteToSiteInfoCacheTTL = _siteToSiteInfoCacheTTL;
     
     return copy;
 }
 
+/* The settings of a URL session configuration that affect a client. NSURLSessionConfiguration only compares by identity,
+ * and a new one is returned by each call to +defaultSessionConfiguration. The storage objects it refers to are compared
+ * by identity, which is safe as the copy a shared client keeps retains them, so their addresses cannot be reused. */
+static NSString *NiFiURLSessionConfigurationKey(NSURLSessionConfiguration *configuration) {
+    if (!configuration) {
+        return @"";
+    }
+    return [NSString stringWithFormat:@"%@|%@|%@|%@|%f|%f|%lu|%li|%i|%i|%i|%i|%li|%li|%li|%p|%p|%p",
+            configuration.identifier ?: @"",
+            configuration.sharedContainerIdentifier ?: @"",
+            configuration.HTTPAdditionalHeaders ?: @{},
+            configuration.connectionProxyDictionary ?: @{},
+            configuration.timeoutIntervalForRequest,
+            configuration.timeoutIntervalForResource,
+            (unsigned long)configuration.networkServiceType,
+            (long)configuration.requestCachePolicy,
+            configuration.allowsCellularAccess,
+            configuration.discretionary,
+            configuration.HTTPShouldUsePipelining,
+            configuration.HTTPShouldSetCookies,
+            (long)configuration.HTTPMaximumConnectionsPerHost,
+            (long)configuration.TLSMinimumSupportedProtocol,
+            (long)configuration.TLSMaximumSupportedProtocol,
+            configuration.URLCache,
+            configuration.URLCredentialStorage,
+            configuration.HTTPCookieStorage];
+}
+
+- (nonnull NSString *) clientRegistryKey {
+    NSMutableString *key = [NSMutableString string];
+    for (NiFiSiteToSiteRemoteClusterConfig *cluster in _remoteClusters) {
+        NSArray *sortedUrls = [[[cluster.urls allObjects] valueForKey:@"absoluteString"] sortedArrayUsingSelector:@selector(compare:)];
+        // Credentials are only kept as a digest. The delegate is compared by identity, which is safe as the config a shared
+        // client keeps retains it, so its address cannot be reused by another object while the client is registered.
+        [key appendFormat:@"cluster(%@|%li|%@|%@|%@|%@|%p|%@);",
+         [sortedUrls componentsJoinedByString:@","],
+         (long)cluster.transportProtocol,
+         [NiFiSiteToSiteUtil digestForUsername:cluster.username password:cluster.password],
+         cluster.proxyConfig ? [cluster.proxyConfig.url absoluteString] : @"",
+         cluster.proxyConfig ? [NiFiSiteToSiteUtil digestForUsername:cluster.proxyConfig.username password:cluster.proxyConfig.password] : @"",
+         NiFiURLSessionConfigurationKey(cluster.urlSessionConfiguration),
+         cluster.urlSessionDelegate,
+         (id)cluster.socketTLSSettings ?: @""];
+    }
+    [key appendFormat:@"port(%@|%@);timeout(%f);peerUpdateInterval(%f|%f);streamingChunkSize(%lu);socketWriteQueueDepth(%lu);socketIdleConnectionExpiration(%f);peerSelectionStrategy(%li);peerFailureCooldown(%f);peerBackoff(%f|%f);siteToSiteInfoCacheTTL(%f)",
+     _portName ?: @"",
+     _portId ?: @"",
+     _timeout,
+     _peerUpdateInterval,
+     _peerUpdateRetryInterval,
+     (unsigned long)_streamingChunkSize,
+     (unsigned long)_socketWriteQueueDepth,
+     _socketIdleConnectionExpiration,
+     (long)_peerSelectionStrategy,
+     _peerFailureCooldown,
+     _peerBackoffInitialInterval,
+     _peerBackoffMaxInterval,
+     _siteToSiteInfoCacheTTL];
+    return key;
+}
+
 - (void) addRemoteCluster:(nonnull NiFiSiteToSiteRemoteClusterConfig *)clusterConfig {
     if (clusterConfig) {
         if (!_remoteClusters) {
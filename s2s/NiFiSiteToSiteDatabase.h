@@ -33,6 +33,9 @@
 @property (nonatomic, nullable) NSNumber *packetId;
 @property (nonatomic, nullable) NSData *attributes;
 @property (nonatomic, nullable) NSData *content;
+@property (nonatomic, nullable) NSString *contentRef;  // set if content is stored outside the database, see NiFiContentStore
+@property (nonatomic, nullable) NSNumber *encodedCrc;  // set if content holds the whole packet in the wire format (attributes is then nil),
+                                                      // to the CRC32 of content
 @property (nonatomic, nullable) NSNumber *estimatedSize;
 @property (nonatomic, nullable) NSNumber *createdAtMillisSinceReferenceDate;
 @property (nonatomic, nullable) NSNumber *expiresAtMillisSinceReferenceDate;
@@ -43,6 +46,12 @@
                             packetPrioritizer:(nullable NSObject <NiFiDataPacketPrioritizer> *)prioritizer
                                         error:(NSError *_Nullable *_Nullable)error;
 
+/* If encoded is YES, the packet is stored in the StandardFlowFileCodec wire format, so it can be sent without being re-encoded */
++ (nullable instancetype)entityWithDataPacket:(nonnull NiFiDataPacket *)dataPacket
+                            packetPrioritizer:(nullable NSObject <NiFiDataPacketPrioritizer> *)prioritizer
+                                      encoded:(BOOL)encoded
+                                        error:(NSError *_Nullable *_Nullable)error;
+
 - (nullable NiFiDataPacket *)dataPacket;
 
 @end
@@ -75,6 +84,14 @@ typedef void (^NiFiQueuedDataPacketEntityEnumeratorBlock)(NiFiQueuedDataPacketEn
 
 -(NSArray<NiFiQueuedDataPacketEntity *> *_Nullable)getPacketsWithTransactionId:(nonnull NSString *)transactionId;
 
+/* Calls block with each packet of the transaction, in priority order, reading them a page at a time,
+ * so that only a page of packets is held in memory however large the batch is.
+ * The default implementation reads the whole batch with getPacketsWithTransactionId:.
+ * Returns NO if the packets could not be read, in which case block may have been called for some of them. */
+-(BOOL)enumeratePacketsWithTransactionId:(nonnull NSString *)transactionId
+                              usingBlock:(nonnull NiFiQueuedDataPacketEntityEnumeratorBlock)block
+                                   error:(NSError *_Nullable *_Nullable)error;
+
 -(void)deletePacketsWithTransactionId:(nonnull NSString *)transactionId;
 
 -(void)markPacketsForRetryWithTransactionId:(nonnull NSString *)transactionId;
@@ -96,6 +113,33 @@ typedef void (^NiFiQueuedDataPacketEntityEnumeratorBlock)(NiFiQueuedDataPacketEn
  * Priority is order by (priority, created, packetId) ascending */
 -(void)truncateQueuedDataPacketsMaxBytes:(NSUInteger)maxBytesToKeepSize error:(NSError *_Nullable *_Nullable)error;
 
+/* Write any packets that have been inserted but not yet committed to storage.
+ * The default implementation writes inserts through immediately, so there is nothing to flush. */
+-(void)flushOrError:(NSError *_Nullable *_Nullable)error;
+
+@end
+
+
+/* A write-behind buffer in front of another NiFiSiteToSiteDatabase.
+ * Inserted packets are staged in memory and written to the backing database in one transaction (a group commit)
+ * once groupCommitPacketCount packets are staged, or durabilityWindow seconds after the first packet was staged,
+ * whichever comes first. Staged packets are lost if the process exits before they are written.
+ * Packets that fail to write stay staged and are retried after durabilityWindow; a packet that fails on its own
+ * while others write is discarded. Write errors are logged, and returned by flushOrError:.
+ * Counts and sizes include staged packets. Operations that select queued packets (batching, truncation) flush first,
+ * and go ahead with the packets already written if the flush fails. */
+@interface NiFiBufferedSiteToSiteDatabase : NiFiSiteToSiteDatabase
+
+/* Returns a buffer in front of the shared database, shared by all callers using the same settings */
++ (nonnull instancetype)sharedDatabaseWithDurabilityWindow:(NSTimeInterval)durabilityWindow
+                                    groupCommitPacketCount:(NSUInteger)groupCommitPacketCount;
+
+- (nonnull instancetype)initWithDatabase:(nonnull NiFiSiteToSiteDatabase *)database
+                        durabilityWindow:(NSTimeInterval)durabilityWindow
+                  groupCommitPacketCount:(NSUInteger)groupCommitPacketCount;
+
+- (NSUInteger)stagedPacketCount;
+
 @end
 
 
@@ -16,13 +16,13 @@
  */
 
 #import <Foundation/Foundation.h>
+#import <sqlite3.h>
 #import "fmdb/FMDB.h"
 #import "NiFiError.h"
 #import "NiFiSiteToSiteService.h"
+#import "NiFiDataPacket.h"
 #import "NiFiSiteToSiteDatabaseFMDB.h"
-
-// Reasonably sized batches for bulk DB operations
-static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
+#import "NiFiContentStore.h"
 
 /********** QueuedDataPacketEntity Implementation **********/
 
@@ -31,6 +31,13 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
 + (instancetype)entityWithDataPacket:(nonnull NiFiDataPacket *)dataPacket
                    packetPrioritizer:(nullable NSObject <NiFiDataPacketPrioritizer> *)prioritizer
                                error:(NSError *_Nullable *_Nullable)error {
+    return [self entityWithDataPacket:dataPacket packetPrioritizer:prioritizer encoded:NO error:error];
+}
+
++ (instancetype)entityWithDataPacket:(nonnull NiFiDataPacket *)dataPacket
+                   packetPrioritizer:(nullable NSObject <NiFiDataPacketPrioritizer> *)prioritizer
+                             encoded:(BOOL)encoded
+                               error:(NSError *_Nullable *_Nullable)error {
     
     if (!dataPacket) {
         return nil;
@@ -43,22 +50,31 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
     NiFiQueuedDataPacketEntity *entity = [[self alloc] init];
     entity.packetId = nil; // will be set on insert
     
-    NSError *serializationError = nil;
-    NSData *serializedAttributes = [NSJSONSerialization dataWithJSONObject:dataPacket.attributes options:0 error:&serializationError];
-    if (!serializationError && serializedAttributes) {
-        entity.attributes = serializedAttributes;
+    if (encoded) {
+        // attributes and content are encoded together, once, in the form they will be sent in
+        uint32_t crcChecksum = 0;
+        entity.attributes = nil;
+        entity.content = [NiFiDataPacketEncoder encodeDataPacket:dataPacket crcChecksum:&crcChecksum];
+        entity.encodedCrc = [NSNumber numberWithUnsignedInt:crcChecksum];
+        entity.estimatedSize = [NSNumber numberWithUnsignedLong:entity.content.length];
     } else {
-        if (error && serializationError) {
-            NSLog(@"Error serializing data packet attributes. %@", serializationError.localizedDescription);
-            *error = serializationError;
+        NSError *serializationError = nil;
+        NSData *serializedAttributes = [NSJSONSerialization dataWithJSONObject:dataPacket.attributes options:0 error:&serializationError];
+        if (!serializationError && serializedAttributes) {
+            entity.attributes = serializedAttributes;
+        } else {
+            if (error && serializationError) {
+                NSLog(@"Error serializing data packet attributes. %@", serializationError.localizedDescription);
+                *error = serializationError;
+            }
+        }
+        if (!dataPacket.data) {
+            entity.content = nil;
+            entity.estimatedSize = [NSNumber numberWithUnsignedLong:entity.attributes.length];
+        } else {
+            entity.content = [dataPacket.data copy]; // does not copy the bytes unless the data is mutable
+            entity.estimatedSize = [NSNumber numberWithUnsignedLong:(entity.attributes.length + entity.content.length)];
         }
-    }
-    if (!dataPacket.data) {
-        entity.content = nil;
-        entity.estimatedSize = [NSNumber numberWithUnsignedLong:entity.attributes.length];
-    } else {
-        entity.content = [NSData dataWithData:dataPacket.data];
-        entity.estimatedSize = [NSNumber numberWithUnsignedLong:(entity.attributes.length + entity.content.length)];
     }
     NSUInteger createdAtMillisSinceReferenceDate = [NSDate timeIntervalSinceReferenceDate] * 1000L;
     entity.createdAtMillisSinceReferenceDate = [NSNumber numberWithLong:createdAtMillisSinceReferenceDate];
@@ -78,6 +94,13 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
 }
 
 - (nullable NiFiDataPacket *)dataPacket {
+    if (_encodedCrc) {
+        NiFiDataPacket *dataPacket = _content ? [NiFiDataPacketEncoder decodeDataPacket:_content] : nil;
+        if (!dataPacket) {
+            NSLog(@"Unexpected error decoding data packet from database. The stored wire format bytes are incomplete.");
+        }
+        return dataPacket;
+    }
     NSError *jsonDecodingError;
     NSDictionary *attributes = _attributes ? [NSJSONSerialization JSONObjectWithData:_attributes
                                                                              options:0
@@ -139,6 +162,22 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
             userInfo:nil];
 }
 
+-(BOOL)enumeratePacketsWithTransactionId:(nonnull NSString *)transactionId
+                              usingBlock:(nonnull NiFiQueuedDataPacketEntityEnumeratorBlock)block
+                                   error:(NSError *_Nullable *_Nullable)error {
+    NSArray<NiFiQueuedDataPacketEntity *> *packets = [self getPacketsWithTransactionId:transactionId];
+    if (!packets) {
+        if (error) {
+            *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+        }
+        return NO;
+    }
+    for (NiFiQueuedDataPacketEntity *entity in packets) {
+        block(entity);
+    }
+    return YES;
+}
+
 -(void)deletePacketsWithTransactionId:(nonnull NSString *)transactionId {
     @throw [NSException
             exceptionWithName:NSInternalInconsistencyException
@@ -195,6 +234,301 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
             userInfo:nil];
 }
 
+-(void)flushOrError:(NSError *_Nullable *_Nullable)error {
+    // inserts are written through, nothing to do
+}
+
+@end
+
+
+
+
+/********** SiteToSiteDatabase Write-Behind Buffer Implementation **********/
+
+@interface NiFiBufferedSiteToSiteDatabase()
+@property (nonatomic, nonnull) NiFiSiteToSiteDatabase *database;
+@property (nonatomic) NSTimeInterval durabilityWindow;
+@property (nonatomic) NSUInteger groupCommitPacketCount;
+@property (nonatomic, nonnull) dispatch_queue_t flushQueue; // serializes writes to the backing database
+@end
+
+@implementation NiFiBufferedSiteToSiteDatabase {
+    // guarded by @synchronized(self)
+    NSMutableArray<NiFiQueuedDataPacketEntity *> *_stagedEntities;
+    NSUInteger _stagedSize;
+    NSUInteger _writingCount;  // packets taken from the stage by a flush that is still writing them
+    NSUInteger _writingSize;
+    BOOL _isCountFlushPending; // a flush triggered by groupCommitPacketCount is queued and has not started
+    BOOL _isTimedFlushPending; // a flush is waiting for the durability window to elapse
+    BOOL _didLastWriteFail;    // retries wait for the durability window instead of the commit count
+}
+
++ (nonnull instancetype)sharedDatabaseWithDurabilityWindow:(NSTimeInterval)durabilityWindow
+                                    groupCommitPacketCount:(NSUInteger)groupCommitPacketCount {
+    static NSMutableDictionary<NSString *, NiFiBufferedSiteToSiteDatabase *> *sharedDatabases = nil;
+    static dispatch_once_t oncePredicate;
+    dispatch_once(&oncePredicate, ^{
+        sharedDatabases = [NSMutableDictionary dictionary];
+    });
+    
+    NSString *key = [NSString stringWithFormat:@"%f|%lu", durabilityWindow, (unsigned long)groupCommitPacketCount];
+    @synchronized(sharedDatabases) {
+        NiFiBufferedSiteToSiteDatabase *sharedDatabase = sharedDatabases[key];
+        if (!sharedDatabase) {
+            sharedDatabase = [[self alloc] initWithDatabase:[NiFiSiteToSiteDatabase sharedDatabase]
+                                           durabilityWindow:durabilityWindow
+                                     groupCommitPacketCount:groupCommitPacketCount];
+            sharedDatabases[key] = sharedDatabase;
+        }
+        return sharedDatabase;
+    }
+}
+
+- (nonnull instancetype)initWithDatabase:(nonnull NiFiSiteToSiteDatabase *)database
+                        durabilityWindow:(NSTimeInterval)durabilityWindow
+                  groupCommitPacketCount:(NSUInteger)groupCommitPacketCount {
+    self = [super init];
+    if (self) {
+        _database = database;
+        _durabilityWindow = durabilityWindow;
+        _groupCommitPacketCount = MAX(groupCommitPacketCount, 1);
+        _flushQueue = dispatch_queue_create("org.apache.nifi.s2s.database.flush", DISPATCH_QUEUE_SERIAL);
+        _stagedEntities = [NSMutableArray arrayWithCapacity:_groupCommitPacketCount];
+        _stagedSize = 0;
+        _writingCount = 0;
+        _writingSize = 0;
+        _isCountFlushPending = NO;
+        _isTimedFlushPending = NO;
+        _didLastWriteFail = NO;
+    }
+    return self;
+}
+
+- (NSUInteger)stagedPacketCount {
+    @synchronized(self) {
+        return [_stagedEntities count];
+    }
+}
+
+- (void)insertQueuedDataPacket:(NiFiQueuedDataPacketEntity *)entity error:(NSError *_Nullable *_Nullable)error {
+    [self insertQueuedDataPackets:[NSArray arrayWithObject:entity] error:error];
+}
+
+- (void)insertQueuedDataPackets:(NSArray *)entities error:(NSError *_Nullable *_Nullable)error {
+    if ([entities count] == 0) {
+        return;
+    }
+    if (_durabilityWindow <= 0.0) {
+        [_database insertQueuedDataPackets:entities error:error];
+        return;
+    }
+    
+    @synchronized(self) {
+        [_stagedEntities addObjectsFromArray:entities];
+        for (NiFiQueuedDataPacketEntity *entity in entities) {
+            _stagedSize += [entity.estimatedSize unsignedIntegerValue];
+        }
+        [self scheduleFlush];
+    }
+}
+
+/* Must be called while synchronized on self.
+ * A flush writes everything staged, so a timer that fires after an earlier flush only writes newer packets sooner. */
+- (void)scheduleFlush {
+    if ([_stagedEntities count] == 0) {
+        return;
+    }
+    if ([_stagedEntities count] >= _groupCommitPacketCount && !_didLastWriteFail) {
+        if (!_isCountFlushPending) {
+            _isCountFlushPending = YES;
+            dispatch_async(_flushQueue, ^{
+                @synchronized(self) {
+                    self->_isCountFlushPending = NO;
+                }
+                [self writeStagedEntitiesAndRescheduleOrError:nil];
+            });
+        }
+    } else if (!_isTimedFlushPending) {
+        _isTimedFlushPending = YES;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_durabilityWindow * NSEC_PER_SEC)), _flushQueue, ^{
+            @synchronized(self) {
+                self->_isTimedFlushPending = NO;
+            }
+            [self writeStagedEntitiesAndRescheduleOrError:nil];
+        });
+    }
+}
+
+/* Must be called on the flush queue. Packets that could not be written stay staged and are retried after the durability window. */
+- (void)writeStagedEntitiesAndRescheduleOrError:(NSError *_Nullable *_Nullable)error {
+    BOOL didWrite = [self writeStagedEntitiesOrError:error];
+    @synchronized(self) {
+        _didLastWriteFail = !didWrite;
+        [self scheduleFlush];
+    }
+}
+
+/* Must be called on the flush queue. Returns NO if packets were left staged because they could not be written. */
+- (BOOL)writeStagedEntitiesOrError:(NSError *_Nullable *_Nullable)error {
+    NSMutableArray<NiFiQueuedDataPacketEntity *> *entities;
+    @synchronized(self) {
+        if ([_stagedEntities count] == 0) {
+            return YES;
+        }
+        entities = _stagedEntities;
+        _writingCount = [entities count];
+        _writingSize = _stagedSize;
+        _stagedEntities = [NSMutableArray arrayWithCapacity:_groupCommitPacketCount];
+        _stagedSize = 0;
+    }
+    
+    NSError *writeError = nil;
+    [_database insertQueuedDataPackets:entities error:&writeError];
+    
+    NSMutableArray<NiFiQueuedDataPacketEntity *> *unwrittenEntities = [NSMutableArray array];
+    if (writeError && [entities count] > 1) {
+        // write the packets one at a time so a packet that can never be written does not hold back the rest
+        NSUInteger writtenCount = 0;
+        for (NiFiQueuedDataPacketEntity *entity in entities) {
+            NSError *entityError = nil;
+            [_database insertQueuedDataPacket:entity error:&entityError];
+            if (entityError) {
+                [unwrittenEntities addObject:entity];
+            } else {
+                writtenCount++;
+            }
+        }
+        if (writtenCount > 0 && [unwrittenEntities count] > 0) {
+            // the database accepts other packets, so these ones will fail on every retry
+            NSLog(@"Discarding %lu staged data packets that could not be written with domain='%@' code='%ld'",
+                  (unsigned long)[unwrittenEntities count], [writeError domain], (long)[writeError code]);
+            [unwrittenEntities removeAllObjects];
+        } else if (writtenCount > 0) {
+            writeError = nil;
+        }
+    } else if (writeError) {
+        [unwrittenEntities addObjectsFromArray:entities];
+    }
+    
+    @synchronized(self) {
+        if ([unwrittenEntities count] > 0) {
+            // keep the packets staged, ahead of anything staged since, so the next flush retries them
+            for (NiFiQueuedDataPacketEntity *entity in unwrittenEntities) {
+                _stagedSize += [entity.estimatedSize unsignedIntegerValue];
+            }
+            [unwrittenEntities addObjectsFromArray:_stagedEntities];
+            _stagedEntities = unwrittenEntities;
+        }
+        _writingCount = 0;
+        _writingSize = 0;
+    }
+    
+    if (writeError) {
+        NSLog(@"Encountered error writing staged data packets with domain='%@' code='%ld'", [writeError domain], (long)[writeError code]);
+        if (error) {
+            *error = writeError;
+        }
+    }
+    return [unwrittenEntities count] == 0;
+}
+
+-(void)flushOrError:(NSError *_Nullable *_Nullable)error {
+    __block NSError *flushError = nil;
+    dispatch_sync(_flushQueue, ^{
+        [self writeStagedEntitiesAndRescheduleOrError:&flushError];
+    });
+    if (flushError && error) {
+        *error = flushError;
+    }
+}
+
+-(void)createBatchWithTransactionId:(nonnull NSString *)transactionId
+                         countLimit:(NSUInteger)countLimit
+                      byteSizeLimit:(NSUInteger)sizeLimit
+                              error:(NSError *_Nullable *_Nullable)error {
+    // packets that could not be flushed stay staged for a retry; they should not stop packets already written from draining
+    [self flushOrError:nil];
+    [_database createBatchWithTransactionId:transactionId countLimit:countLimit byteSizeLimit:sizeLimit error:error];
+}
+
+-(NSArray<NiFiQueuedDataPacketEntity *> *_Nullable)getPacketsWithTransactionId:(nonnull NSString *)transactionId {
+    return [_database getPacketsWithTransactionId:transactionId];
+}
+
+-(BOOL)enumeratePacketsWithTransactionId:(nonnull NSString *)transactionId
+                              usingBlock:(nonnull NiFiQueuedDataPacketEntityEnumeratorBlock)block
+                                   error:(NSError *_Nullable *_Nullable)error {
+    return [_database enumeratePacketsWithTransactionId:transactionId usingBlock:block error:error];
+}
+
+-(void)deletePacketsWithTransactionId:(nonnull NSString *)transactionId {
+    [_database deletePacketsWithTransactionId:transactionId];
+}
+
+-(void)markPacketsForRetryWithTransactionId:(nonnull NSString *)transactionId {
+    [_database markPacketsForRetryWithTransactionId:transactionId];
+}
+
+-(NSUInteger)countQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
+    NSUInteger count = [_database countQueuedDataPacketsOrError:error];
+    @synchronized(self) {
+        return count + [_stagedEntities count] + _writingCount;
+    }
+}
+
+-(NSUInteger)sumSizeQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
+    NSUInteger size = [_database sumSizeQueuedDataPacketsOrError:error];
+    @synchronized(self) {
+        return size + _stagedSize + _writingSize;
+    }
+}
+
+-(NSUInteger)averageSizeQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
+    NSError *dbError = nil;
+    NSUInteger count = [self countQueuedDataPacketsOrError:&dbError];
+    NSUInteger size = dbError ? 0 : [self sumSizeQueuedDataPacketsOrError:&dbError];
+    if (dbError) {
+        if (error) {
+            *error = dbError;
+        }
+        return 0;
+    }
+    return count ? size / count : 0;
+}
+
+-(void)ageOffExpiredQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
+    [_database ageOffExpiredQueuedDataPacketsOrError:error];
+    
+    // staged packets are aged off in memory, without a flush
+    NSInteger nowMillis = (NSInteger)([NSDate timeIntervalSinceReferenceDate] * 1000.0);
+    @synchronized(self) {
+        NSIndexSet *expired = [_stagedEntities indexesOfObjectsPassingTest:^BOOL(NiFiQueuedDataPacketEntity *entity, NSUInteger idx, BOOL *stop) {
+            return entity.expiresAtMillisSinceReferenceDate && [entity.expiresAtMillisSinceReferenceDate integerValue] < nowMillis;
+        }];
+        if ([expired count] > 0) {
+            for (NiFiQueuedDataPacketEntity *entity in [_stagedEntities objectsAtIndexes:expired]) {
+                _stagedSize -= [entity.estimatedSize unsignedIntegerValue];
+            }
+            [_stagedEntities removeObjectsAtIndexes:expired];
+        }
+    }
+}
+
+-(void)truncateQueuedDataPacketsMaxRows:(NSUInteger)maxRowsToKeepCount error:(NSError *_Nullable *_Nullable)error {
+    [self flushOrError:nil];
+    [_database truncateQueuedDataPacketsMaxRows:maxRowsToKeepCount error:error];
+}
+
+-(void)truncateQueuedDataPacketsMaxBytes:(NSUInteger)maxBytesToKeepSize error:(NSError *_Nullable *_Nullable)error {
+    [self flushOrError:nil];
+    [_database truncateQueuedDataPacketsMaxBytes:maxBytesToKeepSize error:error];
+}
+
+-(void)dealloc {
+    // pending flushes retain self, so nothing else can be writing at this point
+    [self writeStagedEntitiesOrError:nil];
+}
+
 @end
 
 
@@ -216,9 +550,78 @@ static const NSUInteger DATABASE_BATCH_SIZE = 2000L;
 
 static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db";
 
+static const NSInteger FMDB_PROFILE_DEFAULT_CACHE_SIZE_KIB = 4096L; // 4 MB
+static const NSInteger SQLITE_DEFAULT_CACHE_SIZE_KIB = 2000L;       // the compiled-in SQLite default
+static const NSUInteger FMDB_PROFILE_DEFAULT_EXTERNAL_CONTENT_THRESHOLD_BYTES = 64L * 1024L; // 64 KiB
+
+// SQLite 3.25.0 is the first release with window functions
+static const int SQLITE_WINDOW_FUNCTIONS_MIN_VERSION_NUMBER = 3025000;
+
+// Number of packets read at a time when enumerating a batch
+static const NSUInteger DATABASE_CURSOR_PAGE_SIZE = 64L;
+
+
+@interface NiFiFMDBDatabaseProfile()
+- (nonnull NSString *)pragmaStatements;
+@end
+
+@implementation NiFiFMDBDatabaseProfile
+
++ (nonnull instancetype)defaultProfile {
+    return [[self alloc] init];
+}
+
++ (nonnull instancetype)legacyProfile {
+    NiFiFMDBDatabaseProfile *profile = [[self alloc] init];
+    profile.writeAheadLogging = NO;
+    profile.synchronousLevel = SYNCHRONOUS_FULL;
+    profile.cacheSizeKiB = SQLITE_DEFAULT_CACHE_SIZE_KIB;
+    profile.mmapSizeBytes = 0;
+    profile.cacheStatements = NO;
+    profile.externalContentThresholdBytes = 0;
+    return profile;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _writeAheadLogging = YES;
+        _synchronousLevel = SYNCHRONOUS_NORMAL;
+        _cacheSizeKiB = FMDB_PROFILE_DEFAULT_CACHE_SIZE_KIB;
+        _mmapSizeBytes = 0;
+        _cacheStatements = YES;
+        _externalContentThresholdBytes = FMDB_PROFILE_DEFAULT_EXTERNAL_CONTENT_THRESHOLD_BYTES;
+    }
+    return self;
+}
+
+- (nonnull NSString *)pragmaStatements {
+    NSString *synchronous;
+    switch (_synchronousLevel) {
+        case SYNCHRONOUS_OFF:
+            synchronous = @"OFF";
+            break;
+        case SYNCHRONOUS_NORMAL:
+            synchronous = @"NORMAL";
+            break;
+        case SYNCHRONOUS_FULL:
+        default:
+            synchronous = @"FULL";
+            break;
+    }
+    // a negative cache_size is in KiB rather than pages
+    return [NSString stringWithFormat:@"PRAGMA journal_mode = %@; PRAGMA synchronous = %@; PRAGMA cache_size = -%ld; PRAGMA mmap_size = %ld;",
+            _writeAheadLogging ? @"WAL" : @"DELETE", synchronous, (long)_cacheSizeKiB, (long)_mmapSizeBytes];
+}
+
+@end
+
 
 @interface NiFiFMDBSiteToSiteDatabase()
 @property (atomic) FMDatabaseQueue *fmdbQueue;
+@property (nonatomic, nullable) NiFiContentStore *contentStore;
+@property (nonatomic) NSUInteger externalContentThreshold;
+@property (nonatomic) BOOL removeContentStoreOnDealloc;
 @end
 
 
@@ -235,14 +638,42 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 }
 
 - (nullable instancetype)initWithDatabaseFilePath:(NSString *)path {
+    return [self initWithDatabaseFilePath:path profile:[NiFiFMDBDatabaseProfile defaultProfile]];
+}
+
+- (nullable instancetype)initWithDatabaseFilePath:(NSString *)path profile:(nonnull NiFiFMDBDatabaseProfile *)profile {
     self = [super init];
     if (self) {
         // if db file does not exist, it will get created (i.e., on first launch)
         // _fmdb = [FMDatabase databaseWithPath:[self databaseFilePath]];
         _fmdbQueue = [FMDatabaseQueue databaseQueueWithPath:path];
         
+        // FMDatabaseQueue holds a single connection, so settings applied here last for the life of the queue
+        [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
+            db.shouldCacheStatements = profile.cacheStatements;
+            if (![db executeStatements:[profile pragmaStatements]]) {
+                NSLog(@"Could not apply SiteToSite database profile: %@", [db lastErrorMessage]);
+            }
+        }];
+        
+        // The content store is opened even if new content is kept inline, so that content stored out of line earlier can be read.
+        // If it cannot be opened, all content is kept inline.
+        NSString *contentStorePath;
+        if ([path length] > 0) {
+            contentStorePath = [path stringByAppendingString:@"-content"];
+        } else {
+            // temporary and in-memory databases get a temporary content store that is removed along with them
+            contentStorePath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                                [NSString stringWithFormat:@"nifi_sitetosite_content_%@", [[NSUUID UUID] UUIDString]]];
+            _removeContentStoreOnDealloc = YES;
+        }
+        _contentStore = [[NiFiContentStore alloc] initWithDirectoryPath:contentStorePath];
+        _externalContentThreshold = _contentStore ? profile.externalContentThresholdBytes : 0;
+        
         if (![self createOrUpdateSchema]) {
             self = nil;
+        } else {
+            [self removeOrphanedContent];
         }
     }
     return self;
@@ -303,6 +734,43 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
     // Schema vNEXT
     // [schemaUpdates addObjectsFromArray:@[@"ALTER TABLE ADD COLUMN ..."]]
     
+    // Schema v2
+    // Covering index for claiming a batch: unclaimed packets in priority order, with their sizes, without touching the table rows
+    [schemaUpdates addObjectsFromArray:@[
+     @"CREATE INDEX IF NOT EXISTS site_to_site_queued_packet_claim_index ON site_to_site_queued_packet (transaction_id, priority, created, packet_id, estimated_size)",
+     ]];
+    
+    // Schema v3
+    // Single-row summary of the queue, kept current by triggers in the same transaction as every insert and delete,
+    // so that count and size lookups do not scan the queue. The triggers are created before the row is seeded,
+    // so packets written concurrently by another handle are counted exactly once.
+    [schemaUpdates addObjectsFromArray:@[
+     @"CREATE TABLE IF NOT EXISTS site_to_site_queue_summary ("
+        "summary_id INTEGER PRIMARY KEY CHECK (summary_id = 0), "  // there is only ever one row
+        "packet_count INTEGER NOT NULL, "                          // number of queued packets
+        "total_size INTEGER NOT NULL )",                           // sum of estimated_size of queued packets
+     @"CREATE TRIGGER IF NOT EXISTS site_to_site_queued_packet_insert_trigger "
+        "AFTER INSERT ON site_to_site_queued_packet BEGIN "
+        "UPDATE site_to_site_queue_summary SET packet_count = packet_count + 1, total_size = total_size + IFNULL(NEW.estimated_size, 0) WHERE summary_id = 0; "
+        "END",
+     @"CREATE TRIGGER IF NOT EXISTS site_to_site_queued_packet_delete_trigger "
+        "AFTER DELETE ON site_to_site_queued_packet BEGIN "
+        "UPDATE site_to_site_queue_summary SET packet_count = packet_count - 1, total_size = total_size - IFNULL(OLD.estimated_size, 0) WHERE summary_id = 0; "
+        "END",
+     @"CREATE TRIGGER IF NOT EXISTS site_to_site_queued_packet_update_size_trigger "
+        "AFTER UPDATE OF estimated_size ON site_to_site_queued_packet BEGIN "
+        "UPDATE site_to_site_queue_summary SET total_size = total_size - IFNULL(OLD.estimated_size, 0) + IFNULL(NEW.estimated_size, 0) WHERE summary_id = 0; "
+        "END",
+     @"INSERT OR IGNORE INTO site_to_site_queue_summary (summary_id, packet_count, total_size) "
+        "SELECT 0, COUNT(*), IFNULL(SUM(estimated_size), 0) FROM site_to_site_queued_packet",
+     ]];
+    
+    // Schema v4
+    // Covering index for truncation: all packets in priority order, with their sizes, without touching the table rows
+    [schemaUpdates addObjectsFromArray:@[
+     @"CREATE INDEX IF NOT EXISTS site_to_site_queued_packet_sort_size_index ON site_to_site_queued_packet (priority, created, packet_id, estimated_size)",
+     ]];
+    
     [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
         // Log output that is useful for development / testing to find the location of the DB in use in case you want to inspect that directly
         NSString *databasePath = [db databasePath] ?: @"nil";
@@ -311,6 +779,28 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
         for (NSString *update in schemaUpdates) {
             [db executeUpdate:update];
         }
+        
+        // Schema v5
+        // Large content can be stored out of line in a NiFiContentStore, referenced by content_ref.
+        // Deleted rows record their content_ref, so that content no longer referenced by any row can be removed.
+        // ALTER TABLE ... ADD COLUMN cannot be repeated, so it is guarded by a check for the column.
+        if (![db columnExists:@"content_ref" inTableWithName:@"site_to_site_queued_packet"]) {
+            [db executeUpdate:@"ALTER TABLE site_to_site_queued_packet ADD COLUMN content_ref CHAR(64)"];
+        }
+        [db executeUpdate:@"CREATE INDEX IF NOT EXISTS site_to_site_queued_packet_content_ref_index "
+                           "ON site_to_site_queued_packet (content_ref) WHERE content_ref IS NOT NULL"];
+        [db executeUpdate:@"CREATE TABLE IF NOT EXISTS site_to_site_released_content (content_ref CHAR(64))"];
+        [db executeUpdate:@"CREATE TRIGGER IF NOT EXISTS site_to_site_queued_packet_release_content_trigger "
+                           "AFTER DELETE ON site_to_site_queued_packet WHEN OLD.content_ref IS NOT NULL BEGIN "
+                           "INSERT INTO site_to_site_released_content (content_ref) VALUES (OLD.content_ref); "
+                           "END"];
+        
+        // Schema v6
+        // Packets can be stored already encoded in the wire format, in content (or content_ref), with the CRC32 of the encoded bytes.
+        // attributes is NULL for these rows, and rows written before this version have no CRC and are decoded as before.
+        if (![db columnExists:@"encoded_crc" inTableWithName:@"site_to_site_queued_packet"]) {
+            [db executeUpdate:@"ALTER TABLE site_to_site_queued_packet ADD COLUMN encoded_crc INTEGER"];
+        }
     }];
     return true;
 }
@@ -323,14 +813,30 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 - (void)insertQueuedDataPackets:(NSArray *)entities error:(NSError *_Nullable *_Nullable)error {
     
     __block BOOL success;
+    NSMutableSet<NSString *> *storedContentRefs = [NSMutableSet set];
     
     [_fmdbQueue inTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
         for (NiFiQueuedDataPacketEntity *entity in entities) {
+            // Content is written to the store inside the database transaction, so it cannot race with removal of released content
+            NSData *content = entity.content;
+            NSString *contentRef = nil;
+            if (self.externalContentThreshold && content.length >= self.externalContentThreshold) {
+                NSError *storeError = nil;
+                contentRef = [self.contentStore storeData:content error:&storeError];
+                if (contentRef) {
+                    content = nil;
+                    [storedContentRefs addObject:contentRef];
+                } else {
+                    NSLog(@"Could not store data packet content out of line, keeping it in the database. %@", storeError.localizedDescription);
+                }
+            }
             success = [db executeUpdate:@"INSERT INTO site_to_site_queued_packet "
-                       "(attributes, content, estimated_size, created, expires, priority, transaction_id)"
-                       "VALUES (?, ?, ?, ?, ?, ?, ?)",
+                       "(attributes, content, content_ref, encoded_crc, estimated_size, created, expires, priority, transaction_id)"
+                       "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)",
                        entity.attributes ?: [NSNull null],
-                       entity.content ?: [NSNull null],
+                       content ?: [NSNull null],
+                       contentRef ?: [NSNull null],
+                       entity.encodedCrc ?: [NSNull null],
                        entity.estimatedSize ?: [NSNull null],
                        entity.createdAtMillisSinceReferenceDate ?: [NSNull null],
                        entity.expiresAtMillisSinceReferenceDate ?: [NSNull null],
@@ -345,6 +851,10 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
         }
     }];
     
+    if (!success && [storedContentRefs count] > 0) {
+        [self removeUnreferencedContentRefs:storedContentRefs];
+    }
+    
     if (!success && error) {
         *error = [NSError errorWithDomain:NiFiErrorDomain
                                      code:NiFiErrorSiteToSiteDatabaseTransactionFailed
@@ -352,6 +862,49 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
     }
 }
 
+/* Removes stored content that no row references, e.g., content stored by an insert that was rolled back.
+ * Exclusive, because inserts write content before their row, so content that is not referenced yet may be in use
+ * by an insert on another handle until it commits. */
+- (void)removeUnreferencedContentRefs:(nonnull NSSet<NSString *> *)contentRefs {
+    [_fmdbQueue inExclusiveTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        for (NSString *contentRef in contentRefs) {
+            FMResultSet *resultSet = [db executeQuery:@"SELECT 1 FROM site_to_site_queued_packet WHERE content_ref = ? LIMIT 1", contentRef];
+            if (resultSet == nil) {
+                return; // unknown whether it is referenced, so keep it
+            }
+            BOOL isReferenced = [resultSet next];
+            [resultSet close];
+            if (!isReferenced) {
+                [self.contentStore removeContentRef:contentRef];
+            }
+        }
+    }];
+}
+
+/* Removes stored content left without a row, e.g., by a crash between writing content and committing its row */
+- (void)removeOrphanedContent {
+    if (!_contentStore) {
+        return;
+    }
+    [_fmdbQueue inExclusiveTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        FMResultSet *resultSet = [db executeQuery:@"SELECT DISTINCT content_ref FROM site_to_site_queued_packet WHERE content_ref IS NOT NULL"];
+        if (resultSet == nil) {
+            return;
+        }
+        NSMutableSet<NSString *> *referencedContentRefs = [NSMutableSet set];
+        while ([resultSet next]) {
+            [referencedContentRefs addObject:[resultSet stringForColumnIndex:0]];
+        }
+        [resultSet close];
+        
+        for (NSString *contentRef in [self.contentStore allContentRefs]) {
+            if (![referencedContentRefs containsObject:contentRef]) {
+                [self.contentStore removeContentRef:contentRef];
+            }
+        }
+    }];
+}
+
 ///* Enumerate each queued packet in priority order and call the caller's block function.
 // * Continue until count limit or byte size limit is reached.
 // * Pass '0' (or max long) for each limit to disable/ignore if you do no want to impose any limit, i.e. every packet will be enumerated.
@@ -390,78 +943,70 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 //    }
 //}
 
+/* Claims the next batch of unclaimed packets, in priority order, by setting their transaction id.
+ * A packet is included if the packets ahead of it total less than the size limit,
+ * so the last packet in the batch is the one that reaches or crosses the limit.
+ * Only the claim index is read and the claim is a single UPDATE, so the cost does not depend on packet content size. */
 -(void)createBatchWithTransactionId:(nonnull NSString *)transactionId
                          countLimit:(NSUInteger)countLimit
                       byteSizeLimit:(NSUInteger)sizeLimit
                               error:(NSError *_Nullable *_Nullable)error {
     __block NSError *blockError;
     
+    // In SQLite, a negative LIMIT means no limit
+    NSNumber *countLimitArg = countLimit ? [NSNumber numberWithUnsignedLong:countLimit] : @(-1);
+    
     [_fmdbQueue inTransaction:^(FMDatabase *_Nonnull db, BOOL *_Nonnull rollback) {
-        FMResultSet *resultSet;
-        if (countLimit) {
-            resultSet = [db executeQuery:@"SELECT * FROM site_to_site_queued_packet "
-                                            "WHERE transaction_id IS NULL "
-                                            "ORDER BY priority, created, packet_id ASC "
-                                            "LIMIT ?", [NSNumber numberWithLong:countLimit]];
+        BOOL success;
+        if (!sizeLimit) {
+            success = [db executeUpdate:@"UPDATE site_to_site_queued_packet SET transaction_id = ? "
+                                         "WHERE packet_id IN ( "
+                                         "SELECT packet_id FROM site_to_site_queued_packet "
+                                         "WHERE transaction_id IS NULL "
+                                         "ORDER BY priority, created, packet_id ASC "
+                                         "LIMIT ? )", transactionId, countLimitArg];
+        } else if (sqlite3_libversion_number() >= SQLITE_WINDOW_FUNCTIONS_MIN_VERSION_NUMBER) {
+            success = [db executeUpdate:@"UPDATE site_to_site_queued_packet SET transaction_id = ? "
+                                         "WHERE packet_id IN ( "
+                                         "SELECT packet_id FROM ( "
+                                         "SELECT packet_id, "
+                                         "SUM(IFNULL(estimated_size, 0)) OVER (ORDER BY priority, created, packet_id ASC ROWS UNBOUNDED PRECEDING) "
+                                         "- IFNULL(estimated_size, 0) AS preceding_size "
+                                         "FROM site_to_site_queued_packet "
+                                         "WHERE transaction_id IS NULL "
+                                         "ORDER BY priority, created, packet_id ASC "
+                                         "LIMIT ? ) "
+                                         "WHERE preceding_size < ? )",
+                       transactionId, countLimitArg, [NSNumber numberWithUnsignedLong:sizeLimit]];
         } else {
-            resultSet = [db executeQuery:@"SELECT * FROM site_to_site_queued_packet "
-                                            "WHERE transaction_id IS NULL "
-                                            "ORDER BY priority, created, packet_id ASC "];
-        }
-        if (resultSet == nil) {
-            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
-            return;
-        }
-        
-        NSMutableArray *transactionPackets = countLimit ? [NSMutableArray arrayWithCapacity:countLimit] : [NSMutableArray arrayWithCapacity:DATABASE_BATCH_SIZE];
-        NSUInteger batchSize = 0;
-        while ([resultSet next]) {
-            NiFiQueuedDataPacketEntity *entity = [[self class] queuedDataPacketEntityWithFMResult:resultSet];
-            if (!entity || !entity.packetId) {
-                NSLog(@"Unexpected error converting FMResultSet to NiFiQueuedDataPacketEntity in %@", NSStringFromSelector(_cmd));
-                continue;
+            // No window functions: find how many packets fit by scanning sizes only, then claim that many
+            FMResultSet *resultSet = [db executeQuery:@"SELECT estimated_size FROM site_to_site_queued_packet "
+                                                       "WHERE transaction_id IS NULL "
+                                                       "ORDER BY priority, created, packet_id ASC "
+                                                       "LIMIT ?", countLimitArg];
+            if (resultSet == nil) {
+                blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+                return;
             }
-            
-            // put each packet id in an array for a batch update below that will set the transaction id on all of them.
-            [transactionPackets addObject:entity.packetId];
-            
-            if (sizeLimit) {
-                batchSize += [entity.estimatedSize unsignedIntegerValue];
-                if (batchSize >= sizeLimit) {
-                    break;
-                }
+            NSUInteger batchCount = 0;
+            NSUInteger batchSize = 0;
+            while (batchSize < sizeLimit && [resultSet next]) {
+                batchSize += [resultSet unsignedLongLongIntForColumnIndex:0];
+                batchCount++;
             }
+            [resultSet close]; // explicit close recommended here as the loop may stop before the end of the results
+            
+            success = [db executeUpdate:@"UPDATE site_to_site_queued_packet SET transaction_id = ? "
+                                         "WHERE packet_id IN ( "
+                                         "SELECT packet_id FROM site_to_site_queued_packet "
+                                         "WHERE transaction_id IS NULL "
+                                         "ORDER BY priority, created, packet_id ASC "
+                                         "LIMIT ? )", transactionId, [NSNumber numberWithUnsignedLong:batchCount]];
         }
-        [resultSet close]; // explicit close recommended here due to break statement in while loop
         
-        NSMutableArray *updateBatches = [NSMutableArray array];
-        NSUInteger itemsRemaining = [transactionPackets count];
-        int i = 0;
-        while (itemsRemaining) {
-            NSRange range = NSMakeRange(i, MIN(DATABASE_BATCH_SIZE, itemsRemaining));
-            NSMutableArray *subarray = [NSMutableArray arrayWithArray:[transactionPackets subarrayWithRange:range]];
-            [updateBatches addObject:subarray];
-            itemsRemaining -= range.length;
-            i += range.length;
-        }
-        for (NSMutableArray *updateBatch in updateBatches) {
-            NSMutableArray *placeholders = [NSMutableArray arrayWithCapacity:[updateBatch count] + 1];
-            for (int i=0; i<[updateBatch count]; i++) {
-                [placeholders addObject:@"?"];
-            }
-            NSString *placeholderString = [placeholders componentsJoinedByString:@", "];
-            
-            NSString *updateStatement = [NSString stringWithFormat:
-                                         @"UPDATE site_to_site_queued_packet SET transaction_id = ? WHERE packet_id IN (%@)", placeholderString];
-            
-            [updateBatch insertObject:transactionId atIndex:0]; // this is the value for the 'SET transaction_id = ?' part of the update statement
-            
-            Boolean success = [db executeUpdate:updateStatement withArgumentsInArray:updateBatch];
-            if (!success) {
-                *rollback = YES; // something went wrong. rollback the marked packets so that they get picked up in a future transaction
-                blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseWriteFailed userInfo:nil];
-                return;
-            }
+        if (!success) {
+            *rollback = YES; // something went wrong. rollback the marked packets so that they get picked up in a future transaction
+            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseWriteFailed userInfo:nil];
         }
     }];
     
@@ -491,13 +1036,121 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
         }
     }];
     
+    NSMutableArray<NiFiQueuedDataPacketEntity *> *unreadableEntities = [NSMutableArray array];
+    for (NiFiQueuedDataPacketEntity *entity in transactionPackets) {
+        if (![self readContentForEntity:entity]) {
+            [unreadableEntities addObject:entity];
+        }
+    }
+    if ([unreadableEntities count] > 0) {
+        // a packet without its content must not be sent, so the batch fails as a read error does
+        [self removePacketsWithMissingContent:unreadableEntities];
+        return nil;
+    }
+    
     return transactionPackets;
 }
 
+/* Reads out-of-line content into the entity. Returns NO if the entity references content that could not be read. */
+- (BOOL)readContentForEntity:(nonnull NiFiQueuedDataPacketEntity *)entity {
+    if (entity.contentRef && !entity.content) {
+        entity.content = [self.contentStore dataForContentRef:entity.contentRef];
+        return entity.content != nil;
+    }
+    return YES;
+}
+
+/* Removes packets whose out-of-line content no longer exists. They can never be sent, and would fail every batch that claims them.
+ * Packets whose content exists but could not be read (e.g., while the device is locked) are kept, to be retried. */
+- (void)removePacketsWithMissingContent:(nonnull NSArray<NiFiQueuedDataPacketEntity *> *)entities {
+    if (!_contentStore) {
+        return;
+    }
+    NSMutableArray<NSNumber *> *packetIds = [NSMutableArray array];
+    for (NiFiQueuedDataPacketEntity *entity in entities) {
+        if (entity.packetId && ![self.contentStore hasContentRef:entity.contentRef]) {
+            NSLog(@"Removing queued data packet %@, its content '%@' is missing from the SiteToSite content store", entity.packetId, entity.contentRef);
+            [packetIds addObject:entity.packetId];
+        }
+    }
+    if ([packetIds count] == 0) {
+        return;
+    }
+    [_fmdbQueue inTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        for (NSNumber *packetId in packetIds) {
+            if (![db executeUpdate:@"DELETE FROM site_to_site_queued_packet WHERE packet_id = ?", packetId]) {
+                *rollback = YES;
+                return;
+            }
+        }
+    }];
+    [self removeReleasedContent];
+}
+
+/* Reads the batch in pages, continuing after the last packet of the previous page in priority order (keyset pagination on the claim index).
+ * The database is only held while a page is read, not while block runs, so enqueues and other drain workers are not held up by sending. */
+-(BOOL)enumeratePacketsWithTransactionId:(nonnull NSString *)transactionId
+                              usingBlock:(nonnull NiFiQueuedDataPacketEntityEnumeratorBlock)block
+                                   error:(NSError *_Nullable *_Nullable)error {
+    __block BOOL success = YES;
+    NiFiQueuedDataPacketEntity *lastEntity = nil;
+    NSUInteger pageCount = 0;
+    
+    do {
+        NSMutableArray<NiFiQueuedDataPacketEntity *> *page = [NSMutableArray arrayWithCapacity:DATABASE_CURSOR_PAGE_SIZE];
+        [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
+            FMResultSet *resultSet = lastEntity ?
+                [db executeQuery:@"SELECT * FROM site_to_site_queued_packet WHERE transaction_id = ? "
+                                  "AND (priority > ? OR (priority = ? AND (created > ? OR (created = ? AND packet_id > ?)))) "
+                                  "ORDER BY priority, created, packet_id ASC LIMIT ?",
+                                  transactionId, lastEntity.priority, lastEntity.priority,
+                                  lastEntity.createdAtMillisSinceReferenceDate, lastEntity.createdAtMillisSinceReferenceDate,
+                                  lastEntity.packetId, @(DATABASE_CURSOR_PAGE_SIZE)] :
+                [db executeQuery:@"SELECT * FROM site_to_site_queued_packet WHERE transaction_id = ? "
+                                  "ORDER BY priority, created, packet_id ASC LIMIT ?",
+                                  transactionId, @(DATABASE_CURSOR_PAGE_SIZE)];
+            if (resultSet == nil) {
+                success = NO;
+                return;
+            }
+            while ([resultSet next]) {
+                NiFiQueuedDataPacketEntity *entity = [[self class] queuedDataPacketEntityWithFMResult:resultSet];
+                if (entity) {
+                    [page addObject:entity];
+                }
+            }
+            [resultSet close];
+        }];
+        if (!success) {
+            break;
+        }
+        
+        pageCount = page.count;
+        lastEntity = [page lastObject];
+        for (NiFiQueuedDataPacketEntity *entity in page) {
+            @autoreleasepool {
+                if (![self readContentForEntity:entity]) {
+                    // a packet without its content must not be sent, so the batch fails as a read error does
+                    [self removePacketsWithMissingContent:@[entity]];
+                    success = NO;
+                    break;
+                }
+                block(entity);
+            }
+        }
+    } while (success && pageCount == DATABASE_CURSOR_PAGE_SIZE);
+    
+    if (!success && error) {
+        *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+    }
+    return success;
+}
+
 -(void)deletePacketsWithTransactionId:(nonnull NSString *)transactionId {
     [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
         [db executeUpdate:@"DELETE FROM site_to_site_queued_packet WHERE transaction_id = ?", transactionId];
     }];
+    [self removeReleasedContent];
 }
 
 -(void)markPacketsForRetryWithTransactionId:(NSString *)transactionId {
@@ -511,10 +1164,10 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 -(NSUInteger)countQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
     
     __block BOOL success;
-    __block NSInteger rowCount;
+    __block NSInteger rowCount = 0;
     
     [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
-        FMResultSet *resultSet = [db executeQuery:@"SELECT COUNT(*) as count FROM site_to_site_queued_packet"];
+        FMResultSet *resultSet = [db executeQuery:@"SELECT packet_count as count FROM site_to_site_queue_summary WHERE summary_id = 0"];
         success = (resultSet != nil);
         
         if (success && [resultSet next]) {
@@ -535,10 +1188,10 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 -(NSUInteger)sumSizeQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
     
     __block BOOL success;
-    __block NSInteger size;
+    __block NSInteger size = 0;
     
     [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
-        FMResultSet *resultSet = [db executeQuery:@"SELECT sum(estimated_size) as total_size FROM site_to_site_queued_packet"];
+        FMResultSet *resultSet = [db executeQuery:@"SELECT total_size FROM site_to_site_queue_summary WHERE summary_id = 0"];
         success = (resultSet != nil);
         
         if (success && [resultSet next]) {
@@ -559,10 +1212,11 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
 -(NSUInteger)averageSizeQueuedDataPacketsOrError:(NSError *_Nullable *_Nullable)error {
     
     __block BOOL success;
-    __block NSInteger size;
+    __block NSInteger size = 0;
     
     [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
-        FMResultSet *resultSet = [db executeQuery:@"SELECT avg(estimated_size) as average_size FROM site_to_site_queued_packet"];
+        FMResultSet *resultSet = [db executeQuery:@"SELECT CASE WHEN packet_count > 0 THEN total_size / packet_count ELSE 0 END as average_size "
+                                                   "FROM site_to_site_queue_summary WHERE summary_id = 0"];
         success = (resultSet != nil);
         
         if (success && [resultSet next]) {
@@ -589,6 +1243,7 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
         NSNumber *nowMillis = [NSNumber  numberWithLong:([NSDate timeIntervalSinceReferenceDate] * 1000.0)];
         success = [db executeUpdate:@"DELETE FROM site_to_site_queued_packet WHERE expires < ?", nowMillis];
     }];
+    [self removeReleasedContent];
     
     if (!success && error) {
         *error = [NSError errorWithDomain:NiFiErrorDomain
@@ -602,108 +1257,158 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
  * Priority is order by (priority, created, packetId) ascending */
 -(void)truncateQueuedDataPacketsMaxRows:(NSUInteger)maxRowsToKeepCount error:(NSError *_Nullable *_Nullable)error {
     
-    __block BOOL success;
+    __block NSError *blockError = nil;
     
-    [_fmdbQueue inDatabase:^(FMDatabase * _Nonnull db) {
-        NSNumber *rowsToKeepCount = [NSNumber numberWithLong:maxRowsToKeepCount];
+    [_fmdbQueue inTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        BOOL success;
+        
+        // Check if the queue row count exceeds maxRowsToKeepCount
+        FMResultSet *resultSet = [db executeQuery:@"SELECT packet_count FROM site_to_site_queue_summary WHERE summary_id = 0"];
+        if (resultSet == nil || ![resultSet next]) {
+            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+            [resultSet close];
+            return;
+        }
+        NSUInteger rowCount = [resultSet unsignedLongLongIntForColumn:@"packet_count"];
+        [resultSet close];
+        if (rowCount <= maxRowsToKeepCount) {
+            return;
+        }
+        
+        // Delete everything after the first maxRowsToKeepCount packets in priority order
+        NSNumber *rowsToKeepCount = [NSNumber numberWithUnsignedLong:maxRowsToKeepCount];
         success = [db executeUpdate:@"DELETE FROM site_to_site_queued_packet "
-                                        "WHERE packet_id NOT IN ( "
-                                        "SELECT packet_id FROM site_to_site_queued_packet "
-                                        "ORDER BY priority, created, packet_id ASC "
-                                        "LIMIT ? )", rowsToKeepCount];
+                                     "WHERE packet_id IN ( "
+                                     "SELECT packet_id FROM site_to_site_queued_packet "
+                                     "ORDER BY priority, created, packet_id ASC "
+                                     "LIMIT -1 OFFSET ? )", rowsToKeepCount];
+        if (!success) {
+            *rollback = YES;
+            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseWriteFailed userInfo:nil];
+        }
     }];
+    [self removeReleasedContent];
     
-    if (!success && error) {
-        *error = [NSError errorWithDomain:NiFiErrorDomain
-                                     code:NiFiErrorSiteToSiteDatabaseWriteFailed
-                                 userInfo:nil];
+    if (blockError && error) {
+        *error = blockError;
     }
 
 }
 
 /* Keep a maximum number of data packets, ordered by priority.
- * Priority is order by (priority, created, packetId) ascending */
+ * Priority is order by (priority, created, packetId) ascending.
+ * A packet is kept if the packets ahead of it total less than the size limit,
+ * so the last packet kept is the one that reaches or crosses the limit. */
 -(void)truncateQueuedDataPacketsMaxBytes:(NSUInteger)maxBytesToKeepSize error:(NSError *_Nullable *_Nullable)error {
     
-    __block Boolean success;
     __block NSError *blockError = nil;
     
     [_fmdbQueue inTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        BOOL success;
         
         // Check if the queue size exceeds maxBytesToKeepSize
-        FMResultSet *resultSet = [db executeQuery:@"SELECT sum(estimated_size) as total_size FROM site_to_site_queued_packet"];
-        if (resultSet != nil && [resultSet next]) {
-            NSInteger totalByteSize = [resultSet longForColumn:@"total_size"];
-            if (totalByteSize <= maxBytesToKeepSize) {
-                success = TRUE;
-                [resultSet close];
-                return;
-            }
-        } else {
+        FMResultSet *resultSet = [db executeQuery:@"SELECT total_size FROM site_to_site_queue_summary WHERE summary_id = 0"];
+        if (resultSet == nil || ![resultSet next]) {
             blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
             [resultSet close];
             return;
         }
+        NSUInteger totalByteSize = [resultSet unsignedLongLongIntForColumn:@"total_size"];
         [resultSet close];
-        
-        NSMutableArray *deleteBatches = [NSMutableArray arrayWithCapacity:1L];
-        NSInteger currentBatchIndex = 0;
-        deleteBatches[currentBatchIndex] = [NSMutableSet setWithCapacity:DATABASE_BATCH_SIZE];
-        NSUInteger sizeAggregator = 0;
-        
-        resultSet = [db executeQuery:@"SELECT * FROM site_to_site_queued_packet "
-                                        "ORDER BY priority, created, packet_id ASC"];
-        success = (resultSet != nil);
-        if (!success) {
-            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+        if (totalByteSize <= maxBytesToKeepSize) {
             return;
         }
-        Boolean haveReachedMaxCapacity = false;
-        while ([resultSet next]) {
-            NiFiQueuedDataPacketEntity *entity = [[self class] queuedDataPacketEntityWithFMResult:resultSet];
-            if (!entity || !entity.packetId) {
-                NSLog(@"Unexpected entity read error in %@", NSStringFromSelector(_cmd));
-                continue;
+        
+        NSNumber *bytesToKeepSize = [NSNumber numberWithUnsignedLong:maxBytesToKeepSize];
+        if (sqlite3_libversion_number() >= SQLITE_WINDOW_FUNCTIONS_MIN_VERSION_NUMBER) {
+            success = [db executeUpdate:@"DELETE FROM site_to_site_queued_packet "
+                                         "WHERE packet_id IN ( "
+                                         "SELECT packet_id FROM ( "
+                                         "SELECT packet_id, "
+                                         "SUM(IFNULL(estimated_size, 0)) OVER (ORDER BY priority, created, packet_id ASC ROWS UNBOUNDED PRECEDING) "
+                                         "- IFNULL(estimated_size, 0) AS preceding_size "
+                                         "FROM site_to_site_queued_packet ) "
+                                         "WHERE preceding_size >= ? )", bytesToKeepSize];
+        } else {
+            // No window functions: find how many packets fit by scanning sizes only, then delete the rest
+            resultSet = [db executeQuery:@"SELECT estimated_size FROM site_to_site_queued_packet "
+                                          "ORDER BY priority, created, packet_id ASC"];
+            if (resultSet == nil) {
+                blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseReadFailed userInfo:nil];
+                return;
             }
-            if (!haveReachedMaxCapacity) {
-                sizeAggregator += [entity.estimatedSize unsignedIntegerValue];
-                haveReachedMaxCapacity = sizeAggregator >= maxBytesToKeepSize;
-            } else {
-                [deleteBatches[currentBatchIndex] addObject:[entity.packetId stringValue]];
-                if ( [deleteBatches[currentBatchIndex] count] >= DATABASE_BATCH_SIZE ) {
-                    currentBatchIndex++;
-                    deleteBatches[currentBatchIndex] = [NSMutableSet setWithCapacity:DATABASE_BATCH_SIZE];
-                }
+            NSUInteger keepCount = 0;
+            NSUInteger sizeAggregator = 0;
+            while (sizeAggregator < maxBytesToKeepSize && [resultSet next]) {
+                sizeAggregator += [resultSet unsignedLongLongIntForColumnIndex:0];
+                keepCount++;
             }
+            [resultSet close]; // explicit close recommended here as the loop may stop before the end of the results
             
+            success = [db executeUpdate:@"DELETE FROM site_to_site_queued_packet "
+                                         "WHERE packet_id IN ( "
+                                         "SELECT packet_id FROM site_to_site_queued_packet "
+                                         "ORDER BY priority, created, packet_id ASC "
+                                         "LIMIT -1 OFFSET ? )", [NSNumber numberWithUnsignedLong:keepCount]];
         }
-        [resultSet close];
-        for (NSMutableSet *delBatch in deleteBatches) {
-            NSInteger count = [delBatch count];
-            if (count > 0) {
-                NSMutableString *bindPlaceholderBuilder = [NSMutableString string];
-                for (int i = 0; i < [delBatch count]; i++) {
-                    [bindPlaceholderBuilder appendString:@"?, "];
-                }
-                NSString *bindPlaceholder = [bindPlaceholderBuilder substringToIndex:[bindPlaceholderBuilder length]-2]; // remove the final ", "
-                [db executeUpdate:[NSString stringWithFormat:@"DELETE FROM site_to_site_queued_packet WHERE packet_id in (%@)", bindPlaceholder]
-                           values:[delBatch allObjects]
-                            error:&blockError];
-            }
+        if (!success) {
+            *rollback = YES;
+            blockError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseWriteFailed userInfo:nil];
         }
     }];
+    [self removeReleasedContent];
      
-    if ((!success || blockError) && error) {
+    if (blockError && error) {
         *error = blockError;
     }
 }
 
+/* Removes stored content that was referenced by deleted rows and is no longer referenced by any row */
+- (void)removeReleasedContent {
+    if (!_contentStore) {
+        return;
+    }
+    // deferred, so that when nothing was released (the usual case) no write lock is taken
+    [_fmdbQueue inDeferredTransaction:^(FMDatabase * _Nonnull db, BOOL * _Nonnull rollback) {
+        FMResultSet *resultSet = [db executeQuery:@"SELECT DISTINCT content_ref, NOT EXISTS ( "
+                                                   "SELECT 1 FROM site_to_site_queued_packet "
+                                                   "WHERE site_to_site_queued_packet.content_ref = site_to_site_released_content.content_ref ) "
+                                                   "FROM site_to_site_released_content"];
+        if (resultSet == nil) {
+            return;
+        }
+        BOOL hasReleasedContent = NO;
+        NSMutableArray<NSString *> *unreferencedContentRefs = [NSMutableArray array];
+        while ([resultSet next]) {
+            hasReleasedContent = YES;
+            NSString *contentRef = [resultSet stringForColumnIndex:0];
+            if (contentRef && [resultSet boolForColumnIndex:1]) {
+                [unreferencedContentRefs addObject:contentRef];
+            }
+        }
+        [resultSet close];
+        if (!hasReleasedContent) {
+            return;
+        }
+        if (![db executeUpdate:@"DELETE FROM site_to_site_released_content"]) {
+            return; // e.g., another handle wrote since the read, so the content may be referenced again; retried on the next delete
+        }
+        
+        // removed while holding the database, so a concurrent insert cannot reuse the content in between
+        for (NSString *contentRef in unreferencedContentRefs) {
+            [self.contentStore removeContentRef:contentRef];
+        }
+    }];
+}
+
 + (NiFiQueuedDataPacketEntity *)queuedDataPacketEntityWithFMResult:(FMResultSet *)result {
     
     NiFiQueuedDataPacketEntity *entity = [[NiFiQueuedDataPacketEntity alloc] init];
     entity.packetId = [result objectOrNilForColumn:@"packet_id"];
     entity.attributes = [result objectOrNilForColumn:@"attributes"];
     entity.content = [result objectOrNilForColumn:@"content"];
+    entity.contentRef = [result objectOrNilForColumn:@"content_ref"];
+    entity.encodedCrc = [result objectOrNilForColumn:@"encoded_crc"];
     entity.estimatedSize = [result objectOrNilForColumn:@"estimated_size"];
     entity.createdAtMillisSinceReferenceDate = [result objectOrNilForColumn:@"created"];
     entity.expiresAtMillisSinceReferenceDate = [result objectOrNilForColumn:@"expires"];
@@ -718,6 +1423,9 @@ static NSString * const NIFI_SITETOSITE_DB_FILE_LOCATION = @"nifi_sitetosite.db"
     if (_fmdbQueue) {
         _fmdbQueue = nil;
     }
+    if (_removeContentStoreOnDealloc) {
+        [_contentStore removeAllContent];
+    }
 }
 
 @end
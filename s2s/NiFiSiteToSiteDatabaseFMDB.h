@@ -36,12 +36,34 @@ typedef enum {
     VOLATILE_IN_MEMORY    // Volatile, only an in-memory database. Useful for testing purposes only.
 } FMDBPersistenceType;
 
+typedef enum {
+    SYNCHRONOUS_OFF,      // No fsync. Fastest, but a power loss or OS crash can corrupt the database.
+    SYNCHRONOUS_NORMAL,   // With WAL, fsync only at checkpoints. A power loss can roll back the most recent commits, but never corrupts.
+    SYNCHRONOUS_FULL      // fsync on every commit. This is the SQLite default.
+} FMDBSynchronousLevel;
+
+
+/* SQLite tuning applied to each connection when the database is opened */
+@interface NiFiFMDBDatabaseProfile : NSObject
+@property (nonatomic) BOOL writeAheadLogging;                // defaults to YES (journal_mode=WAL), otherwise the rollback journal is used
+@property (nonatomic) FMDBSynchronousLevel synchronousLevel; // defaults to SYNCHRONOUS_NORMAL
+@property (nonatomic) NSInteger cacheSizeKiB;                // page cache size, defaults to 4096 KiB
+@property (nonatomic) NSInteger mmapSizeBytes;               // memory-mapped I/O size, defaults to 0 (disabled)
+@property (nonatomic) BOOL cacheStatements;                  // defaults to YES, reusing prepared statements for repeated SQL
+@property (nonatomic) NSUInteger externalContentThresholdBytes; // defaults to 64 KiB. Content at least this large is kept in a NiFiContentStore
+                                                             // next to the database file rather than in the database. 0 keeps all content inline
++ (nonnull instancetype)defaultProfile;
++ (nonnull instancetype)legacyProfile;                       // SQLite defaults, i.e., the behavior before profiles were added
+@end
+
 
 /* A concrete implementation of the NiFiSiteToSiteDatabase abstract class that leverages FMDB, a SQLite wrapper */
 @interface NiFiFMDBSiteToSiteDatabase : NiFiSiteToSiteDatabase
 - (nullable instancetype)init;
 - (nullable instancetype)initWithPersistenceType:(FMDBPersistenceType)persistenceType;  // only for testing!
 - (nullable instancetype)initWithDatabaseFilePath:(nullable NSString *)path;  // only for testing!
+- (nullable instancetype)initWithDatabaseFilePath:(nullable NSString *)path
+                                          profile:(nonnull NiFiFMDBDatabaseProfile *)profile;  // only for testing!
 @end
 
 #endif /* NiFiSiteToSiteDatabaseFMDB_h */
@@ -63,6 +63,26 @@
 @property (nonatomic, retain, readwrite, nonnull)NSNumber *preferredBatchCount;  // defaults to 100 data packets
 @property (nonatomic, retain, readwrite, nonnull)NSNumber *preferredBatchSize;   // defaults to 1 MB
 @property (nonatomic, retain, readwrite, nonnull)NSObject <NiFiDataPacketPrioritizer> *dataPacketPrioritizer; // defaults to NiFiNoOpDataPacketPrioritizer
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *drainWorkerCount;     // defaults to 1. processOrError: runs this many workers in parallel, each sending
+                                                                               // one batch (to the least busy peer), so a call sends up to this many batches
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *enqueueDurabilityWindow; // defaults to 0 seconds, which commits every enqueue before it completes. When set above 0,
+                                                                               // enqueued packets are staged in memory and committed to the local buffer database
+                                                                               // in groups, at most this long after being enqueued. Packets not yet committed are
+                                                                               // lost if the app exits. Commit errors are reported by -[NiFiQueuedSiteToSiteClient flushOrError:]
+                                                                               // and +[NiFiSiteToSiteService flushQueuedPacketsWithConfig:completionHandler:]
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *enqueueGroupCommitCount; // defaults to 500 data packets. Staged packets are committed as soon as this many are staged
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *maxQueuedPacketLatency; // defaults to 10 seconds. When the drain scheduler is running, a drain is triggered
+                                                                               // at most this long after a packet is enqueued, even if no full batch is queued
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *storeEncodedDataPackets; // defaults to NO. If YES, enqueued packets are stored already encoded in the
+                                                                               // site-to-site wire format, so sending a batch only concatenates the stored bytes
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *adaptiveBatchSizing; // defaults to NO. If YES, the batch count and size start at preferredBatchCount and
+                                                                               // preferredBatchSize and are tuned from the measured throughput of each transaction:
+                                                                               // increased additively while throughput holds up, halved when it drops or a
+                                                                               // transaction fails, within the min/max bounds below
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *minBatchCount;        // defaults to 10 data packets, only used with adaptiveBatchSizing
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *maxBatchCount;        // defaults to 1000 data packets, only used with adaptiveBatchSizing
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *minBatchSize;         // defaults to 64 KB, only used with adaptiveBatchSizing
+@property (nonatomic, retain, readwrite, nonnull)NSNumber *maxBatchSize;         // defaults to 16 MB, only used with adaptiveBatchSizing
 @end
 
 
@@ -71,6 +91,8 @@
 @property (nonatomic, readonly) NSUInteger queuedPacketCount;
 @property (nonatomic, readonly) NSUInteger queuedPacketSizeBytes;
 @property (nonatomic, readonly) BOOL isFull;
+@property (nonatomic, readonly) NSUInteger batchCount;     // batch limits currently used to send queued packets,
+@property (nonatomic, readonly) NSUInteger batchSizeBytes; // which change over time with adaptiveBatchSizing
 
 @end
 
@@ -83,7 +105,20 @@
 - (void) enqueueDataPackets:(nonnull NSArray *)dataPackets error:(NSError *_Nullable *_Nullable)error;
 - (void) processOrError:(NSError *_Nullable *_Nullable)error;
 - (void) cleanupOrError:(NSError *_Nullable *_Nullable)error;
+- (void) flushOrError:(NSError *_Nullable *_Nullable)error; // commits any staged packets to the local buffer database now
 - (nullable NiFiSiteToSiteQueueStatus *) queueStatusOrError:(NSError *_Nullable *_Nullable)error;
+- (NSUInteger) currentBatchCount; // the batch limits used for the next batch, see adaptiveBatchSizing
+- (NSUInteger) currentBatchSize;
+
+// Drains the queue in the background without the app calling processOrError: on a timer.
+// A drain (cleanup, then process) starts as soon as a full batch (preferredBatchCount or preferredBatchSize) is enqueued through this client,
+// or maxQueuedPacketLatency after a packet is enqueued, whichever comes first. Triggers that arrive during a drain are coalesced into one
+// more drain, and drains run back to back while a full batch or more is queued. No timer is armed while the queue is empty.
+// completionHandler, if not nil, is called with the queue status after each drain.
+- (void) startDrainSchedulerWithCompletionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                                     NSError *_Nullable error))completionHandler;
+- (void) stopDrainScheduler; // a drain that is in progress is completed
+- (BOOL) isDrainSchedulerRunning;
 
 @end
 
@@ -116,6 +151,18 @@
                      completionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
                                                           NSError *_Nullable error))completionHandler;
 
++ (void)flushQueuedPacketsWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
+                   completionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                        NSError *_Nullable error))completionHandler;
+
+// Starts a drain scheduler (see -[NiFiQueuedSiteToSiteClient startDrainSchedulerWithCompletionHandler:]) for the config object,
+// which packets enqueued with the same config object trigger. Replaces any periodic calls to processQueuedPacketsWithConfig:.
++ (void)startDrainSchedulerWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
+                    completionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                         NSError *_Nullable error))completionHandler;
+
++ (void)stopDrainSchedulerWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config;
+
 @end
 
 
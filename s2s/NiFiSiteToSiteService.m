@@ -64,6 +64,16 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_MAX_PACKET_COUNT = 10000L;
 static const int QUEUED_S2S_CONFIG_DEFAULT_MAX_PACKET_SIZE = 100L * 1024L * 1024L; // 100 MB
 static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_COUNT = 100L;
 static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
+static const int QUEUED_S2S_CONFIG_DEFAULT_DRAIN_WORKER_COUNT = 1L;
+static const NSTimeInterval QUEUED_S2S_CONFIG_DEFAULT_ENQUEUE_DURABILITY_WINDOW = 0.0; // write-through
+static const int QUEUED_S2S_CONFIG_DEFAULT_ENQUEUE_GROUP_COMMIT_COUNT = 500L;
+static const NSTimeInterval QUEUED_S2S_CONFIG_DEFAULT_MAX_PACKET_LATENCY = 10.0; // 10 seconds
+static const BOOL QUEUED_S2S_CONFIG_DEFAULT_STORE_ENCODED_DATA_PACKETS = NO;
+static const BOOL QUEUED_S2S_CONFIG_DEFAULT_ADAPTIVE_BATCH_SIZING = NO;
+static const int QUEUED_S2S_CONFIG_DEFAULT_MIN_BATCH_COUNT = 10L;
+static const int QUEUED_S2S_CONFIG_DEFAULT_MAX_BATCH_COUNT = 1000L;
+static const int QUEUED_S2S_CONFIG_DEFAULT_MIN_BATCH_SIZE = 64L * 1024L; // 64 KB
+static const int QUEUED_S2S_CONFIG_DEFAULT_MAX_BATCH_SIZE = 16L * 1024L * 1024L; // 16 MB
 
 @implementation NiFiQueuedSiteToSiteClientConfig
 
@@ -75,6 +85,16 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
         _preferredBatchCount = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_BATCH_COUNT];
         _preferredBatchSize = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE];
         _dataPacketPrioritizer = [[NiFiNoOpDataPacketPrioritizer alloc] init];
+        _drainWorkerCount = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_DRAIN_WORKER_COUNT];
+        _enqueueDurabilityWindow = [NSNumber numberWithDouble:QUEUED_S2S_CONFIG_DEFAULT_ENQUEUE_DURABILITY_WINDOW];
+        _enqueueGroupCommitCount = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_ENQUEUE_GROUP_COMMIT_COUNT];
+        _maxQueuedPacketLatency = [NSNumber numberWithDouble:QUEUED_S2S_CONFIG_DEFAULT_MAX_PACKET_LATENCY];
+        _storeEncodedDataPackets = [NSNumber numberWithBool:QUEUED_S2S_CONFIG_DEFAULT_STORE_ENCODED_DATA_PACKETS];
+        _adaptiveBatchSizing = [NSNumber numberWithBool:QUEUED_S2S_CONFIG_DEFAULT_ADAPTIVE_BATCH_SIZING];
+        _minBatchCount = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_MIN_BATCH_COUNT];
+        _maxBatchCount = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_MAX_BATCH_COUNT];
+        _minBatchSize = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_MIN_BATCH_SIZE];
+        _maxBatchSize = [NSNumber numberWithInteger:QUEUED_S2S_CONFIG_DEFAULT_MAX_BATCH_SIZE];
     }
     return self;
 }
@@ -88,31 +108,146 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
 @property (nonatomic, readwrite) NSUInteger queuedPacketCount;
 @property (nonatomic, readwrite) NSUInteger queuedPacketSizeBytes;
 @property (nonatomic, readwrite) BOOL isFull;
+@property (nonatomic, readwrite) NSUInteger batchCount;
+@property (nonatomic, readwrite) NSUInteger batchSizeBytes;
 @end
 
 @implementation NiFiSiteToSiteQueueStatus : NSObject
 @end
 
 
+/********** AdaptiveBatchSizer Implementation **********/
+
+// weight of the latest transaction in the throughput average
+static const double BATCH_THROUGHPUT_EWMA_ALPHA = 0.3;
+// a batch whose throughput is below this fraction of the average counts as a drop
+static const double BATCH_THROUGHPUT_DROP_THRESHOLD = 0.8;
+
+/* Tunes the batch limits with AIMD: each full batch that keeps throughput (bytes per second of transaction duration)
+ * within BATCH_THROUGHPUT_DROP_THRESHOLD of its moving average grows the limits by a tenth of their initial values,
+ * and a drop in throughput or a failed transaction halves them. Batches that are cut short by an empty queue
+ * say nothing about the limits, so they are not counted. */
+@interface NiFiAdaptiveBatchSizer : NSObject
+@property (atomic, readonly) NSUInteger batchCount;
+@property (atomic, readonly) NSUInteger batchSize;
++ (nonnull instancetype)sharedBatchSizerForConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config;
+- (nonnull instancetype)initWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config;
+- (void)recordBatchWithPacketCount:(NSUInteger)packetCount byteSize:(NSUInteger)byteSize duration:(NSTimeInterval)duration;
+- (void)recordFailure;
+@end
+
+@implementation NiFiAdaptiveBatchSizer {
+    NSUInteger _minCount, _maxCount, _countIncrement;
+    NSUInteger _minSize, _maxSize, _sizeIncrement;
+    double _averageThroughput; // bytes per second, 0 until a full batch completes
+}
+
+/* Shared by every queued client created with the same config object, so tuning carries over
+ * between calls to the NiFiSiteToSiteService class methods, which create a client per call. */
++ (nonnull instancetype)sharedBatchSizerForConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
+    static NSMapTable *sharedBatchSizers = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedBatchSizers = [NSMapTable mapTableWithKeyOptions:(NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality)
+                                                  valueOptions:NSPointerFunctionsStrongMemory];
+    });
+    @synchronized(sharedBatchSizers) {
+        NiFiAdaptiveBatchSizer *batchSizer = [sharedBatchSizers objectForKey:config];
+        if (!batchSizer) {
+            batchSizer = [[self alloc] initWithConfig:config];
+            [sharedBatchSizers setObject:batchSizer forKey:config];
+        }
+        return batchSizer;
+    }
+}
+
+- (nonnull instancetype)initWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
+    self = [super init];
+    if (self) {
+        _minCount = MAX(1, [config.minBatchCount unsignedIntegerValue]);
+        _maxCount = MAX(_minCount, [config.maxBatchCount unsignedIntegerValue]);
+        _minSize = MAX(1, [config.minBatchSize unsignedIntegerValue]);
+        _maxSize = MAX(_minSize, [config.maxBatchSize unsignedIntegerValue]);
+        _batchCount = MIN(MAX([config.preferredBatchCount unsignedIntegerValue], _minCount), _maxCount);
+        _batchSize = MIN(MAX([config.preferredBatchSize unsignedIntegerValue], _minSize), _maxSize);
+        _countIncrement = MAX(1, _batchCount / 10);
+        _sizeIncrement = MAX(1, _batchSize / 10);
+        _averageThroughput = 0.0;
+    }
+    return self;
+}
+
+- (void)recordBatchWithPacketCount:(NSUInteger)packetCount byteSize:(NSUInteger)byteSize duration:(NSTimeInterval)duration {
+    @synchronized(self) {
+        BOOL fullBatch = packetCount >= _batchCount || byteSize >= _batchSize;
+        if (!fullBatch || duration <= 0.0) {
+            return;
+        }
+        double throughput = byteSize / duration;
+        if (_averageThroughput > 0.0 && throughput < BATCH_THROUGHPUT_DROP_THRESHOLD * _averageThroughput) {
+            [self decrease];
+        } else {
+            _batchCount = MIN(_batchCount + _countIncrement, _maxCount);
+            _batchSize = MIN(_batchSize + _sizeIncrement, _maxSize);
+        }
+        _averageThroughput = _averageThroughput > 0.0 ?
+            BATCH_THROUGHPUT_EWMA_ALPHA * throughput + (1.0 - BATCH_THROUGHPUT_EWMA_ALPHA) * _averageThroughput :
+            throughput;
+    }
+}
+
+- (void)recordFailure {
+    @synchronized(self) {
+        [self decrease];
+    }
+}
+
+/* Must be called while synchronized on self */
+- (void)decrease {
+    _batchCount = MAX(_batchCount / 2, _minCount);
+    _batchSize = MAX(_batchSize / 2, _minSize);
+}
+
+@end
+
+
 /********** QueuedSiteToSiteClient Implementation **********/
 
 @interface NiFiQueuedSiteToSiteClient()
 
 @property NiFiQueuedSiteToSiteClientConfig *config;
 @property NiFiSiteToSiteDatabase *database;
+@property (nonatomic, nullable) NiFiSiteToSiteClient *siteToSiteClient; // defaults to the shared client for config
+@property (nonatomic, nullable) NiFiAdaptiveBatchSizer *batchSizer; // nil unless the config enables adaptiveBatchSizing
+@property (nonatomic, nonnull) dispatch_queue_t drainQueue; // runs scheduled drains, one at a time
+@property (atomic, copy, nullable) void (^drainCompletionHandler)(NiFiSiteToSiteQueueStatus *_Nullable status, NSError *_Nullable error);
 
 @end
 
 
-@implementation NiFiQueuedSiteToSiteClient
+@implementation NiFiQueuedSiteToSiteClient {
+    // drain scheduler state, guarded by @synchronized(self)
+    BOOL _drainSchedulerRunning;
+    BOOL _drainScheduled;           // a drain is queued or running
+    BOOL _drainRequested;           // a trigger arrived while a drain was scheduled
+    BOOL _drainDeadlineArmed;
+    NSUInteger _drainDeadlineGeneration; // incremented to cancel an armed deadline
+    NSUInteger _estimatedQueuedCount;    // packets queued as of the last drain, plus those enqueued since
+    NSUInteger _estimatedQueuedSize;
+}
 
 + (nonnull instancetype)clientWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
     return [[self alloc] initWithConfig:config];
 }
 
 - (instancetype)initWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
+    NSTimeInterval durabilityWindow = config.enqueueDurabilityWindow ? [config.enqueueDurabilityWindow doubleValue] : 0.0;
+    NiFiSiteToSiteDatabase *database = durabilityWindow > 0.0 ?
+        [NiFiBufferedSiteToSiteDatabase sharedDatabaseWithDurabilityWindow:durabilityWindow
+                                                    groupCommitPacketCount:[config.enqueueGroupCommitCount unsignedIntegerValue]] :
+        [NiFiSiteToSiteDatabase sharedDatabase];
     return [self initWithConfig:config
-                       database:[NiFiSiteToSiteDatabase sharedDatabase]];
+                       database:database];
 }
 
 - (nullable instancetype)initWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
@@ -122,6 +257,9 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     if (self != nil) {
         _config = config;
         _database = database;
+        _siteToSiteClient = nil;
+        _batchSizer = [config.adaptiveBatchSizing boolValue] ? [NiFiAdaptiveBatchSizer sharedBatchSizerForConfig:config] : nil;
+        _drainQueue = dispatch_queue_create("org.apache.nifi.s2s.queue.drain", DISPATCH_QUEUE_SERIAL);
     }
     return self;
 }
@@ -136,11 +274,14 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
         return;
     }
     
+    BOOL encoded = [_config.storeEncodedDataPackets boolValue];
+    NSUInteger entitiesSize = 0;
     NSMutableArray *entitiesToInsert = [[NSMutableArray alloc] initWithCapacity:[dataPackets count]];
     for (NiFiDataPacket *packet in dataPackets) {
         NSError *entityConversionError = nil;
         NiFiQueuedDataPacketEntity *queuedPacketEntity = [NiFiQueuedDataPacketEntity entityWithDataPacket:packet
                                                                                         packetPrioritizer:_config.dataPacketPrioritizer
+                                                                                                  encoded:encoded
                                                                                                     error:&entityConversionError];
         if (entityConversionError) {
             NSLog(@"Error enqueing data packet to local buffer database. %@", entityConversionError.localizedDescription);
@@ -150,71 +291,183 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
             return;
         }
         [entitiesToInsert addObject:queuedPacketEntity];
+        entitiesSize += [queuedPacketEntity.estimatedSize unsignedIntegerValue];
+    }
+    NSError *insertError = nil;
+    [_database insertQueuedDataPackets:entitiesToInsert error:&insertError];
+    if (insertError) {
+        if (error) {
+            *error = insertError;
+        }
+        return;
     }
-    [_database insertQueuedDataPackets:entitiesToInsert error:error];
+    [self didEnqueuePacketCount:[entitiesToInsert count] size:entitiesSize];
 }
 
 - (void) processOrError:(NSError *_Nullable *_Nullable)error {
     
+    NSUInteger workerCount = _config.drainWorkerCount ? [_config.drainWorkerCount unsignedIntegerValue] : 1;
+    if (workerCount <= 1) {
+        [self processBatchOrError:error];
+        return;
+    }
+    
+    // Each worker claims and sends one batch, as a single call does, so the worker count only changes how many batches
+    // a call sends in parallel. Batches are disjoint as createBatchWithTransactionId is atomic.
+    // Workers hold no thread while waiting on the peer, so only this call waits, however many workers there are.
+    dispatch_group_t workers = dispatch_group_create();
+    __block NSError *firstWorkerError = nil;
+    for (NSUInteger i = 0; i < workerCount; i++) {
+        dispatch_group_enter(workers);
+        [self processBatchWithCompletionHandler:^(BOOL sent, NSError *workerError) {
+            if (workerError) {
+                @synchronized(workers) {
+                    if (!firstWorkerError) {
+                        firstWorkerError = workerError;
+                    }
+                }
+            }
+            dispatch_group_leave(workers);
+        }];
+    }
+    dispatch_group_wait(workers, DISPATCH_TIME_FOREVER);
+    
+    if (firstWorkerError && error) {
+        *error = firstWorkerError;
+    }
+}
+
+/* Claims and sends one batch of queued packets. Returns YES if a batch was sent. */
+- (BOOL) processBatchOrError:(NSError *_Nullable *_Nullable)error {
+    dispatch_semaphore_t batchProcessed = dispatch_semaphore_create(0);
+    __block BOOL batchSent = NO;
+    __block NSError *batchError = nil;
+    [self processBatchWithCompletionHandler:^(BOOL sent, NSError *processError) {
+        batchSent = sent;
+        batchError = processError;
+        dispatch_semaphore_signal(batchProcessed);
+    }];
+    dispatch_semaphore_wait(batchProcessed, DISPATCH_TIME_FOREVER);
+    
+    if (batchError && error) {
+        *error = batchError;
+    }
+    return batchSent;
+}
+
+/* Claims and sends one batch of queued packets, then calls the completion handler with YES if a batch was sent.
+ * No thread waits while the transaction is created and confirmed, for transactions that support that. */
+- (void) processBatchWithCompletionHandler:(void (^_Nonnull)(BOOL sent, NSError *_Nullable error))completionHandler {
+    
     // Check for work to do (non-zero queued packet count)
     NSError *dbError;
     NSUInteger queuedPacketCount = [_database countQueuedDataPacketsOrError:&dbError];
     if (!dbError && queuedPacketCount == 0) {
+        completionHandler(NO, nil);
         return;
     }
     
-    // create a site-to-site client and initiate a trasaction with the nifi peer
+    // get the long-lived site-to-site client for this config and initiate a trasaction with the nifi peer
     // we need the server-generated transaction id to continue with the db operation
-    NiFiSiteToSiteClient *client = [NiFiSiteToSiteClient clientWithConfig:_config];
-    id transaction = [client createTransaction];
-    if (!transaction || ![transaction transactionId]) {
-        if (error) {
-            *error = [NSError errorWithDomain:NiFiErrorDomain
-                                         code:NiFiErrorSiteToSiteClientCouldNotCreateTransaction
-                                     userInfo:nil];
+    NiFiSiteToSiteClient *client = _siteToSiteClient ?: [NiFiSiteToSiteClient sharedClientWithConfig:_config];
+    // peers whose destination is full are skipped, so this only pauses draining once every peer is backing off
+    [client createTransactionWithCompletionHandler:^(NSObject <NiFiTransaction> *transaction) {
+        if (!transaction || ![transaction transactionId]) {
+            completionHandler(NO, [NSError errorWithDomain:NiFiErrorDomain
+                                                      code:[client isBackingOff] ?
+                                                             NiFiErrorSiteToSiteClientDestinationFull :
+                                                             NiFiErrorSiteToSiteClientCouldNotCreateTransaction
+                                                  userInfo:nil]);
+            return;
         }
-        return;
-    }
+        // the handler may run on the URL session's delegate queue, which must not be blocked by database work
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self sendBatchWithTransaction:transaction completionHandler:completionHandler];
+        });
+    }];
+}
+
+- (void) sendBatchWithTransaction:(nonnull NSObject <NiFiTransaction> *)transaction
+                completionHandler:(void (^_Nonnull)(BOOL sent, NSError *_Nullable error))completionHandler {
     NSString *transactionId = [transaction transactionId];
     
     // use the server-generated transaction id to mark packets for transmission
+    NSError *dbError;
+    NiFiAdaptiveBatchSizer *batchSizer = _batchSizer;
+    NSUInteger batchCount = batchSizer ? batchSizer.batchCount : [_config.preferredBatchCount unsignedIntegerValue];
+    NSUInteger batchSize = batchSizer ? batchSizer.batchSize : [_config.preferredBatchSize unsignedIntegerValue];
     [_database createBatchWithTransactionId:transactionId
-                                 countLimit:[_config.preferredBatchCount unsignedIntegerValue]
-                              byteSizeLimit:[_config.preferredBatchSize unsignedIntegerValue]
+                                 countLimit:batchCount
+                              byteSizeLimit:batchSize
                                       error:&dbError];
     
     if (dbError) {
-        NSLog(@"Encountered error with domain='%@' code='%ld", [*error domain], (long)[*error code]);
-        if (error) {
-            *error = dbError;
-        }
+        NSLog(@"Encountered error with domain='%@' code='%ld", [dbError domain], (long)[dbError code]);
+        [transaction cancel];
+        completionHandler(NO, dbError);
         return;
     }
     
     // now send the data to the nifi peer in a transaction
-    NSError *transactionError;
-    NSArray<NiFiQueuedDataPacketEntity *> *entitiesToSend = [_database getPacketsWithTransactionId:transactionId];
-    if ([entitiesToSend count] > 0) {
-        for (NiFiQueuedDataPacketEntity *entity in entitiesToSend) {
+    // packets are fed to the transaction as they are read, so the batch is never held in memory as entities or data packets.
+    // Packets stored in the wire format are sent as stored, unless the transaction can only take data packets.
+    __block NSUInteger sentPacketCount = 0;
+    __block NSUInteger sentPacketBytes = 0;
+    BOOL canSendEncodedData = [transaction isKindOfClass:[NiFiTransaction class]];
+    BOOL readSucceeded = [_database enumeratePacketsWithTransactionId:transactionId usingBlock:^(NiFiQueuedDataPacketEntity *entity) {
+        if (entity.encodedCrc && entity.content && canSendEncodedData) {
+            [(NiFiTransaction *)transaction sendEncodedData:entity.content
+                                                crcChecksum:(uint32_t)[entity.encodedCrc unsignedIntValue]
+                                            dataPacketCount:1];
+        } else {
             [transaction sendData:[entity dataPacket]];
         }
-        [transaction confirmAndCompleteOrError:&transactionError];
-    } else {
+        sentPacketCount++;
+        sentPacketBytes += [entity.estimatedSize unsignedIntegerValue];
+    } error:&dbError];
+    if (!readSucceeded) {
+        NSLog(@"Encountered error with domain='%@' code='%ld", [dbError domain], (long)[dbError code]);
+        [transaction cancel];
+        [_database markPacketsForRetryWithTransactionId:transactionId];
+        completionHandler(NO, dbError);
+        return;
+    }
+    if (sentPacketCount == 0) {
         // nothing to do, perhaps another task/thread cleared the queue
         [transaction cancel];
+        completionHandler(NO, nil);
+        return;
     }
     
-    // if the transaction completed, remove the queued packets from the DB, otherwise, mark them for retry. 
-    if (transactionError) {
-        NSLog(@"Encountered error with domain='%@' code='%ld", [*error domain], (long)[*error code]);
-        if (error) {
-            *error = transactionError;
+    void (^didConfirm)(NiFiTransactionResult *, NSError *) = ^(NiFiTransactionResult *transactionResult, NSError *transactionError) {
+        if (!transactionResult && !transactionError) {
+            transactionError = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteTransaction userInfo:nil];
         }
-        [_database markPacketsForRetryWithTransactionId:transactionId];
-        return;
+        if (transactionError) {
+            [batchSizer recordFailure];
+        } else {
+            [batchSizer recordBatchWithPacketCount:sentPacketCount byteSize:sentPacketBytes duration:transactionResult.duration];
+        }
+        // the handler may run on the URL session's delegate queue, which must not be blocked by database work
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            // if the transaction completed, remove the queued packets from the DB, otherwise, mark them for retry.
+            if (transactionError) {
+                NSLog(@"Encountered error with domain='%@' code='%ld", [transactionError domain], (long)[transactionError code]);
+                [_database markPacketsForRetryWithTransactionId:transactionId];
+                completionHandler(NO, transactionError);
+            } else {
+                // successfully sent data packets; clear them from the queue
+                [_database deletePacketsWithTransactionId:transactionId];
+                completionHandler(YES, nil);
+            }
+        });
+    };
+    if ([transaction isKindOfClass:[NiFiTransaction class]]) {
+        [(NiFiTransaction *)transaction confirmAndCompleteWithCompletionHandler:didConfirm];
     } else {
-        // successfully sent data packets; clear them from the queue
-        [_database deletePacketsWithTransactionId:transactionId];
+        NSError *transactionError = nil;
+        NiFiTransactionResult *transactionResult = [transaction confirmAndCompleteOrError:&transactionError];
+        didConfirm(transactionResult, transactionError);
     }
 }
 
@@ -223,13 +476,35 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     // delete expired packets
     [_database ageOffExpiredQueuedDataPacketsOrError:error];
     
+    // truncation is only needed once a limit has been crossed; a limit of 0 means no limit
+    NSUInteger maxCount = _config.maxQueuedPacketCount ? [_config.maxQueuedPacketCount unsignedIntegerValue] : 0;
+    NSUInteger maxBytes = _config.maxQueuedPacketSize ? [_config.maxQueuedPacketSize unsignedIntegerValue] : 0;
+    if (!maxCount && !maxBytes) {
+        return;
+    }
+    NSError *dbError = nil;
+    NSUInteger queuedPacketCount = [_database countQueuedDataPacketsOrError:&dbError];
+    NSUInteger queuedPacketSizeBytes = dbError ? 0 : [_database sumSizeQueuedDataPacketsOrError:&dbError];
+    if (dbError) {
+        if (error) {
+            *error = dbError;
+        }
+        return;
+    }
+    
     // delete lowest priority packets over row count limit
-    NSInteger maxCount = _config.maxQueuedPacketCount ? [_config.maxQueuedPacketCount integerValue] : 0;
-    [_database truncateQueuedDataPacketsMaxRows:maxCount error:error];
+    if (maxCount && queuedPacketCount > maxCount) {
+        [_database truncateQueuedDataPacketsMaxRows:maxCount error:error];
+    }
     
     // delete lowest priority packets over the packet byte size limit
-    NSInteger maxBytes = _config.maxQueuedPacketSize ? [_config.maxQueuedPacketSize integerValue] : 0;
-    [_database truncateQueuedDataPacketsMaxBytes:maxBytes error:error];
+    if (maxBytes && queuedPacketSizeBytes > maxBytes) {
+        [_database truncateQueuedDataPacketsMaxBytes:maxBytes error:error];
+    }
+}
+
+- (void) flushOrError:(NSError *_Nullable *_Nullable)error {
+    [_database flushOrError:error];
 }
 
 - (nullable NiFiSiteToSiteQueueStatus *) queueStatusOrError:(NSError *_Nullable *_Nullable)error {
@@ -252,27 +527,183 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
         return nil;
     }
     
+    status.batchCount = [self currentBatchCount];
+    status.batchSizeBytes = [self currentBatchSize];
+    
     status.isFull = FALSE;
     if (self.config.maxQueuedPacketCount && [self.config.maxQueuedPacketCount integerValue]) {
         status.isFull = status.queuedPacketCount >= [self.config.maxQueuedPacketCount integerValue] ? YES : NO;
     }
     if(!status.isFull) {
         if (self.config.maxQueuedPacketSize && [self.config.maxQueuedPacketSize integerValue]) {
-            NSUInteger averageSize = [_database averageSizeQueuedDataPacketsOrError:&dbError];
-            if (!dbError) {
-                status.isFull =
-                    status.queuedPacketSizeBytes >= [self.config.maxQueuedPacketSize integerValue] - averageSize ?
-                    YES : NO;
-            } else {
-                if (error) {
-                    *error = dbError;
-                }
-            }
+            NSUInteger averageSize = status.queuedPacketCount ? status.queuedPacketSizeBytes / status.queuedPacketCount : 0;
+            status.isFull =
+                status.queuedPacketSizeBytes >= [self.config.maxQueuedPacketSize integerValue] - averageSize ?
+                YES : NO;
         }
     }
     return status;
 }
 
+- (NSUInteger) currentBatchCount {
+    NiFiAdaptiveBatchSizer *batchSizer = _batchSizer;
+    return batchSizer ? batchSizer.batchCount : [_config.preferredBatchCount unsignedIntegerValue];
+}
+
+- (NSUInteger) currentBatchSize {
+    NiFiAdaptiveBatchSizer *batchSizer = _batchSizer;
+    return batchSizer ? batchSizer.batchSize : [_config.preferredBatchSize unsignedIntegerValue];
+}
+
+// MARK: Drain scheduler
+
+- (void) startDrainSchedulerWithCompletionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                                     NSError *_Nullable error))completionHandler {
+    self.drainCompletionHandler = completionHandler;
+    @synchronized(self) {
+        if (_drainSchedulerRunning) {
+            return;
+        }
+        _drainSchedulerRunning = YES;
+    }
+    // the first drain finds out what was queued before the scheduler started
+    [self triggerDrain];
+}
+
+- (void) stopDrainScheduler {
+    @synchronized(self) {
+        _drainSchedulerRunning = NO;
+        _drainRequested = NO;
+        [self cancelDrainDeadline];
+    }
+    self.drainCompletionHandler = nil;
+}
+
+- (BOOL) isDrainSchedulerRunning {
+    @synchronized(self) {
+        return _drainSchedulerRunning;
+    }
+}
+
+- (BOOL) isFullBatchWithCount:(NSUInteger)count size:(NSUInteger)size {
+    NSUInteger batchCount = [self currentBatchCount];
+    NSUInteger batchSize = [self currentBatchSize];
+    return (batchCount && count >= batchCount) || (batchSize && size >= batchSize);
+}
+
+- (void) didEnqueuePacketCount:(NSUInteger)count size:(NSUInteger)size {
+    BOOL fullBatch;
+    @synchronized(self) {
+        if (!_drainSchedulerRunning) {
+            return;
+        }
+        _estimatedQueuedCount += count;
+        _estimatedQueuedSize += size;
+        fullBatch = [self isFullBatchWithCount:_estimatedQueuedCount size:_estimatedQueuedSize];
+        if (!fullBatch) {
+            [self armDrainDeadline];
+        }
+    }
+    if (fullBatch) {
+        [self triggerDrain];
+    }
+}
+
+/* Must be called while synchronized on self. Does nothing if a deadline is already armed, so the deadline is for the oldest undrained packet. */
+- (void) armDrainDeadline {
+    if (_drainDeadlineArmed) {
+        return;
+    }
+    _drainDeadlineArmed = YES;
+    NSUInteger generation = ++_drainDeadlineGeneration;
+    NSTimeInterval latency = _config.maxQueuedPacketLatency ?
+            [_config.maxQueuedPacketLatency doubleValue] : QUEUED_S2S_CONFIG_DEFAULT_MAX_PACKET_LATENCY;
+    __weak NiFiQueuedSiteToSiteClient *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(latency * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [weakSelf drainDeadlinePassedWithGeneration:generation];
+    });
+}
+
+/* Must be called while synchronized on self */
+- (void) cancelDrainDeadline {
+    _drainDeadlineArmed = NO;
+    _drainDeadlineGeneration++;
+}
+
+- (void) drainDeadlinePassedWithGeneration:(NSUInteger)generation {
+    @synchronized(self) {
+        if (!_drainDeadlineArmed || generation != _drainDeadlineGeneration) {
+            return; // canceled, or superseded by a later deadline
+        }
+    }
+    [self triggerDrain];
+}
+
+- (void) triggerDrain {
+    @synchronized(self) {
+        if (!_drainSchedulerRunning) {
+            return;
+        }
+        [self cancelDrainDeadline];
+        if (_drainScheduled) {
+            _drainRequested = YES; // coalesced into one more drain after the current one
+            return;
+        }
+        _drainScheduled = YES;
+    }
+    dispatch_async(_drainQueue, ^{
+        [self runScheduledDrain];
+    });
+}
+
+/* Runs on the drain queue */
+- (void) runScheduledDrain {
+    NiFiSiteToSiteQueueStatus *status = nil;
+    NSError *error = nil;
+    BOOL backlog = NO;
+    do {
+        @synchronized(self) {
+            _drainRequested = NO;
+            _estimatedQueuedCount = 0;
+            _estimatedQueuedSize = 0;
+        }
+        error = nil;
+        [self cleanupOrError:&error];
+        if (!error) {
+            [self processOrError:&error];
+        }
+        status = error ? nil : [self queueStatusOrError:&error];
+        void (^completionHandler)(NiFiSiteToSiteQueueStatus *, NSError *) = self.drainCompletionHandler;
+        if (completionHandler) {
+            completionHandler(status, error);
+        }
+        backlog = status && [self isFullBatchWithCount:status.queuedPacketCount size:status.queuedPacketSizeBytes];
+    } while (!error && backlog && [self isDrainSchedulerRunning]);
+    
+    BOOL drainAgain = NO;
+    @synchronized(self) {
+        _drainScheduled = NO;
+        if (status) {
+            // packets enqueued during the drain may or may not be included in status, so keep the larger estimate
+            _estimatedQueuedCount = MAX(_estimatedQueuedCount, status.queuedPacketCount);
+            _estimatedQueuedSize = MAX(_estimatedQueuedSize, status.queuedPacketSizeBytes);
+        }
+        if (_drainSchedulerRunning) {
+            if (_drainRequested && !error) {
+                drainAgain = YES;
+            } else if (error || status.queuedPacketCount > 0) {
+                // a partial batch, or a batch that could not be sent, is drained once the deadline passes
+                [self armDrainDeadline];
+            }
+        }
+        _drainRequested = NO;
+    }
+    if (drainAgain) {
+        [self triggerDrain];
+    }
+}
+
 @end
 
 
@@ -297,7 +728,7 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
         NiFiTransactionResult *result = nil;
         NSError *error = nil;
         
-        NiFiSiteToSiteClient *s2sClient = [NiFiSiteToSiteClient clientWithConfig:config];
+        NiFiSiteToSiteClient *s2sClient = [NiFiSiteToSiteClient sharedClientWithConfig:config];
         id transaction = [s2sClient createTransaction];
         if (transaction) {
             for (NiFiDataPacket *packet in packets) {
@@ -334,7 +765,7 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
         NiFiSiteToSiteQueueStatus *status = nil;
         NSError *error = nil;
-        NiFiQueuedSiteToSiteClient *s2sClient = [NiFiQueuedSiteToSiteClient clientWithConfig:config];
+        NiFiQueuedSiteToSiteClient *s2sClient = [[self class] queuedClientWithConfig:config];
         [s2sClient enqueueDataPackets:packets error:&error];
         if (!error) {
             [s2sClient cleanupOrError:&error];
@@ -352,7 +783,7 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
         NiFiSiteToSiteQueueStatus *status = nil;
         NSError *error = nil;
-        NiFiQueuedSiteToSiteClient *s2sClient = [NiFiQueuedSiteToSiteClient clientWithConfig:config];
+        NiFiQueuedSiteToSiteClient *s2sClient = [[self class] queuedClientWithConfig:config];
         [s2sClient cleanupOrError:&error];
         if (!error) {
             [s2sClient processOrError:&error];
@@ -370,7 +801,7 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
         NiFiSiteToSiteQueueStatus *status = nil;
         NSError *error = nil;
-        NiFiQueuedSiteToSiteClient *s2sClient = [NiFiQueuedSiteToSiteClient clientWithConfig:config];
+        NiFiQueuedSiteToSiteClient *s2sClient = [[self class] queuedClientWithConfig:config];
         [s2sClient cleanupOrError:&error];
         if (!error) {
             status = [s2sClient queueStatusOrError:&error];
@@ -379,6 +810,67 @@ static const int QUEUED_S2S_CONFIG_DEFAULT_BATCH_SIZE = 1024L * 1024L; // 1 MB
     });
 }
 
++ (void)flushQueuedPacketsWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
+                   completionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                        NSError *_Nullable error))completionHandler {
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^{
+        NiFiSiteToSiteQueueStatus *status = nil;
+        NSError *error = nil;
+        NiFiQueuedSiteToSiteClient *s2sClient = [[self class] queuedClientWithConfig:config];
+        [s2sClient flushOrError:&error];
+        if (!error) {
+            status = [s2sClient queueStatusOrError:&error];
+        }
+        completionHandler(status, error);
+    });
+}
+
++ (void)startDrainSchedulerWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
+                    completionHandler:(void (^_Nullable)(NiFiSiteToSiteQueueStatus *_Nullable status,
+                                                         NSError *_Nullable error))completionHandler {
+    NSMapTable *schedulingClients = [[self class] schedulingClients];
+    NiFiQueuedSiteToSiteClient *s2sClient = nil;
+    @synchronized(schedulingClients) {
+        s2sClient = [schedulingClients objectForKey:config];
+        if (!s2sClient) {
+            s2sClient = [NiFiQueuedSiteToSiteClient clientWithConfig:config];
+            [schedulingClients setObject:s2sClient forKey:config];
+        }
+    }
+    [s2sClient startDrainSchedulerWithCompletionHandler:completionHandler];
+}
+
++ (void)stopDrainSchedulerWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
+    NSMapTable *schedulingClients = [[self class] schedulingClients];
+    NiFiQueuedSiteToSiteClient *s2sClient = nil;
+    @synchronized(schedulingClients) {
+        s2sClient = [schedulingClients objectForKey:config];
+        [schedulingClients removeObjectForKey:config];
+    }
+    [s2sClient stopDrainScheduler];
+}
+
+/* Clients with a running drain scheduler, keyed by the identity of their config object */
++ (nonnull NSMapTable *)schedulingClients {
+    static NSMapTable *schedulingClients = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        schedulingClients = [NSMapTable mapTableWithKeyOptions:(NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality)
+                                                  valueOptions:NSPointerFunctionsStrongMemory];
+    });
+    return schedulingClients;
+}
+
+/* The client with a running drain scheduler for config, so that it sees packets enqueued with config, or else a new client */
++ (nonnull NiFiQueuedSiteToSiteClient *)queuedClientWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config {
+    NSMapTable *schedulingClients = [[self class] schedulingClients];
+    NiFiQueuedSiteToSiteClient *s2sClient = nil;
+    @synchronized(schedulingClients) {
+        s2sClient = [schedulingClients objectForKey:config];
+    }
+    return s2sClient ?: [NiFiQueuedSiteToSiteClient clientWithConfig:config];
+}
+
 @end
 
 
@@ -34,6 +34,10 @@
 
 @interface NiFiSiteToSiteUtil : NSObject
 + (nonnull NSString *)NiFiTransactionStateToString:(NiFiTransactionState)state;
+
+// A salted SHA-256 digest of a username and password, for keys of in-memory caches, so that they do not hold the password.
+// The salt is random per process, so digests are only comparable within the process that made them.
++ (nonnull NSString *)digestForUsername:(nullable NSString *)username password:(nullable NSString *)password;
 @end
 
 #endif /* NiFiSiteToSiteUtil_h */
@@ -16,6 +16,7 @@
  */
 
 #import <Foundation/Foundation.h>
+#import <CommonCrypto/CommonDigest.h>
 #import "NiFiSiteToSiteUtil.h"
 
 @implementation NiFiSiteToSiteUtil
@@ -42,4 +43,31 @@
     }
 }
 
++ (nonnull NSString *)digestForUsername:(nullable NSString *)username password:(nullable NSString *)password {
+    static NSData *salt = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSMutableData *randomBytes = [NSMutableData dataWithLength:16];
+        arc4random_buf(randomBytes.mutableBytes, randomBytes.length);
+        salt = randomBytes;
+    });
+    
+    // the lengths are included, so that moving characters between the username and password changes the digest
+    NSMutableData *input = [NSMutableData dataWithData:salt];
+    for (NSString *value in @[username ?: @"", password ?: @""]) {
+        NSData *valueData = [value dataUsingEncoding:NSUTF8StringEncoding];
+        uint64_t length = valueData.length;
+        [input appendBytes:&length length:sizeof(length)];
+        [input appendData:valueData];
+    }
+    
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(input.bytes, (CC_LONG)input.length, digest);
+    NSMutableString *digestString = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++) {
+        [digestString appendFormat:@"%02x", digest[i]];
+    }
+    return digestString;
+}
+
 @end
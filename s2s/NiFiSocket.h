@@ -46,6 +46,12 @@
 
 - (void) disconnect;
 
+- (BOOL) isConnected;
+
+// Connected, and the remote end has not closed or reset the connection, nor sent data that was not read.
+// Checks the socket without reading from it or blocking, so it is cheap enough to call before reusing an idle connection.
+- (BOOL) isAlive;
+
 - (void) writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout error:(NSError *_Nullable *_Nullable)error;
 
 - (void) writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout callback:(void (^_Nullable)(NSError *_Nullable))callback;
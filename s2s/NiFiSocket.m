@@ -18,34 +18,18 @@
 @import CocoaAsyncSocket;
 # import "NiFiSocket.h"
 # import "NiFiError.h"
+# import <pthread.h>
+# import <sys/socket.h>
+# import <errno.h>
 
-@interface Tag : NSObject
-+ (nonnull instancetype) tagWithLongValue:(long)value;
-+ (NSString *) keyForTagLongValue:(long)value;
-@property NSString *key;
-@property long longValue;
-@end
 
-@implementation Tag
-+ (instancetype) tagWithLongValue:(long)value {
-    Tag *tag = [[self alloc] init];
-    tag.key = [self keyForTagLongValue:value];
-    tag.longValue = value;
-    return tag;
+@interface NiFiSocket() <GCDAsyncSocketDelegate> {
+    pthread_mutex_t _callbackLock; // guards the tag counter and callback tables, as delegate callbacks arrive on a concurrent queue
 }
-
-+ (NSString *) keyForTagLongValue:(long)value {
-    return [NSString stringWithFormat:@"%li", value];
-}
-@end
-
-
-@interface NiFiSocket() <GCDAsyncSocketDelegate>
 @property (nonatomic) GCDAsyncSocket *socket;
 @property (nonatomic) long nextTagValue;
-@property (nonatomic) Tag *nextTag;
-@property NSMutableDictionary<NSString *, void (^)(NSData *, NSError *)> *readCallbackForTag;
-@property NSMutableDictionary<NSString *, void (^)(NSError *)> *writeCallbackForTag;
+@property NSMutableDictionary<NSNumber *, void (^)(NSData *, NSError *)> *readCallbackForTag;
+@property NSMutableDictionary<NSNumber *, void (^)(NSError *)> *writeCallbackForTag;
 @end
 
 
@@ -59,6 +43,7 @@
 - (instancetype) initWithAsyncSocket:(GCDAsyncSocket *)socket {
     self = [super init];
     if (self) {
+        pthread_mutex_init(&_callbackLock, NULL);
         _nextTagValue = 0L;
         _readCallbackForTag = [NSMutableDictionary dictionary];
         _writeCallbackForTag = [NSMutableDictionary dictionary];
@@ -72,32 +57,31 @@
 -(void)dealloc {
     [self.socket setDelegate:nil];
     [self.socket disconnectAfterReadingAndWriting];
+    pthread_mutex_destroy(&_callbackLock);
 }
 
 // MARK: Private functions
 
-- (void) nextTagValue:(long)value {
-    @throw [NSException
-            exceptionWithName:NSInternalInconsistencyException
-            reason:[NSString stringWithFormat:@"nextTagValue is read only. Cannot call %@", NSStringFromSelector(_cmd)]
-            userInfo:nil];
-}
-
-- (long) nextTagValue {
-    @synchronized(self) {
-        if (_nextTagValue == LONG_MAX) {
-            _nextTagValue = LONG_MIN;
-        } else {
-            _nextTagValue++;
+/* Returns a new tag, unique across reads and writes in progress, and stores the callback under it.
+ * Tags are keyed by NSNumber, which represents small integers without an allocation. */
+- (long) uniqueTagForReadCallback:(void (^)(NSData *, NSError *))readCallback
+                    writeCallback:(void (^)(NSError *))writeCallback {
+    pthread_mutex_lock(&_callbackLock);
+    _nextTagValue = (_nextTagValue == LONG_MAX) ? LONG_MIN : _nextTagValue + 1;
+    long tag = _nextTagValue;
+    NSNumber *key = @(tag);
+    // assert Tag is not in use, which could only happen if we wrapped-around all long values.
+    BOOL isTagInUse = (_readCallbackForTag[key] != nil || _writeCallbackForTag[key] != nil);
+    if (!isTagInUse) {
+        if (readCallback) {
+            _readCallbackForTag[key] = readCallback;
+        }
+        if (writeCallback) {
+            _writeCallbackForTag[key] = writeCallback;
         }
-        return _nextTagValue;
     }
-}
-
-- (Tag *) uniqueTag {
-    Tag *tag = [Tag tagWithLongValue:[self nextTagValue]];
-    // assert Tag is not in use, which could only happen if we wrapped-around all long values.
-    if ([self isTagInUse:tag]) {
+    pthread_mutex_unlock(&_callbackLock);
+    if (isTagInUse) {
         @throw [NSException
                 exceptionWithName:NSInternalInconsistencyException
                 reason:[NSString stringWithFormat:@"%@: nextTagValue has overflown. Cannot generate a unique tag.", NSStringFromSelector(_cmd)]
@@ -105,13 +89,41 @@
     }
     return tag;
 }
-        
-- (BOOL) isTagInUse:(Tag *)tag {
-    return ([self.readCallbackForTag objectForKey:tag.key] != nil);
+
+/* Removes and returns the callback for the tag, so that it is invoked at most once. */
+- (void (^)(NSData *, NSError *)) removeReadCallbackWithTag:(long)tag {
+    pthread_mutex_lock(&_callbackLock);
+    NSNumber *key = @(tag);
+    void (^readCallback)(NSData *, NSError *) = _readCallbackForTag[key];
+    [_readCallbackForTag removeObjectForKey:key];
+    pthread_mutex_unlock(&_callbackLock);
+    return readCallback;
 }
 
-- (void) destroyTag:(Tag *)tag {
-    [self.readCallbackForTag removeObjectForKey:tag.key];
+- (void (^)(NSError *)) removeWriteCallbackWithTag:(long)tag {
+    pthread_mutex_lock(&_callbackLock);
+    NSNumber *key = @(tag);
+    void (^writeCallback)(NSError *) = _writeCallbackForTag[key];
+    [_writeCallbackForTag removeObjectForKey:key];
+    pthread_mutex_unlock(&_callbackLock);
+    return writeCallback;
+}
+
+/* Fails every read and write in progress, as none of them will get a delegate callback once the socket disconnects. */
+- (void) failAllCallbacksWithError:(NSError *)error {
+    pthread_mutex_lock(&_callbackLock);
+    NSArray *readCallbacks = [_readCallbackForTag allValues];
+    NSArray *writeCallbacks = [_writeCallbackForTag allValues];
+    [_readCallbackForTag removeAllObjects];
+    [_writeCallbackForTag removeAllObjects];
+    pthread_mutex_unlock(&_callbackLock);
+    
+    for (void (^readCallback)(NSData *, NSError *) in readCallbacks) {
+        readCallback(nil, error);
+    }
+    for (void (^writeCallback)(NSError *) in writeCallbacks) {
+        writeCallback(error);
+    }
 }
 
 // MARK: GCDAsyncSocket Wrapper Functions
@@ -135,27 +147,50 @@
 - (void) disconnect {
     [self.socket disconnectAfterReadingAndWriting];
     self.socket.delegate = nil;
+    // without a delegate, reads and writes in progress would never complete
+    [self failAllCallbacksWithError:[NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorUnknown userInfo:nil]];
+}
+
+- (BOOL) isConnected {
+    return [self.socket isConnected];
+}
+
+- (BOOL) isAlive {
+    if (![self.socket isConnected]) {
+        return NO;
+    }
+    __block BOOL alive = NO;
+    GCDAsyncSocket *asyncSocket = self.socket;
+    [asyncSocket performBlock:^{
+        int fd = [asyncSocket socketFD]; // only accessible from within performBlock:
+        if (fd < 0) {
+            return;
+        }
+        // Peeking leaves any data in place. An idle, open connection has nothing to read, which is reported as EAGAIN.
+        // A return of 0 is the remote end closing the connection, and an error such as ECONNRESET is the connection reset.
+        char byte;
+        ssize_t result = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        alive = (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }];
+    return alive;
 }
 
 - (void) writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout callback:(void (^_Nullable)(NSError *_Nullable))callback {
-    Tag *tag = [self uniqueTag];
-    [self.writeCallbackForTag setValue:callback forKey:tag.key];
-    [self.socket writeData:data withTimeout:timeout tag:tag.longValue];
+    long tag = [self uniqueTagForReadCallback:nil writeCallback:callback];
+    [self.socket writeData:data withTimeout:timeout tag:tag];
     // The callback will be invoked from the didWriteData:tag: GCDAsyncSocketDelegate function
 }
 
 - (void) writeData:(nullable NSData *)data withTimeout:(NSTimeInterval)timeout error:(NSError *_Nullable *_Nullable)error {
-    __block BOOL callbackExecuted = NO;
+    // Every write completes with a delegate callback, a timeout, or a disconnect, so it is safe to wait without a limit
+    dispatch_semaphore_t completed = dispatch_semaphore_create(0);
     __block NSError *outerError = nil;
     
     [self writeData:data withTimeout:timeout callback:^(NSError *_Nullable error) {
         outerError = error;
-        callbackExecuted = YES;
+        dispatch_semaphore_signal(completed);
     }];
-    
-    while (!callbackExecuted) {
-        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
-    }
+    dispatch_semaphore_wait(completed, DISPATCH_TIME_FOREVER);
     
     if (error && outerError) {
         *error = outerError;
@@ -164,25 +199,21 @@
 
 - (void) readDataWithTimeout:(NSTimeInterval)timeout callback:(void (^)(NSData *, NSError *))callback {
     // store callback by tag for later
-    Tag *tag = [self uniqueTag];
-    [self.readCallbackForTag setValue:callback forKey:tag.key];
-    [self.socket readDataWithTimeout:timeout tag:tag.longValue];
+    long tag = [self uniqueTagForReadCallback:callback writeCallback:nil];
+    [self.socket readDataWithTimeout:timeout tag:tag];
 }
 
 - (NSData *) readDataWithTimeout:(NSTimeInterval)timeout error:(NSError **)error {
-    __block BOOL callbackExecuted = NO;
+    dispatch_semaphore_t completed = dispatch_semaphore_create(0);
     __block NSData *outerData = nil;
     __block NSError *outerError = nil;
     
     [self readDataWithTimeout:timeout callback:^(NSData *data, NSError *error) {
         outerData = data;
         outerError = error;
-        callbackExecuted = YES;
+        dispatch_semaphore_signal(completed);
     }];
-    
-    while (!callbackExecuted) {
-        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
-    }
+    dispatch_semaphore_wait(completed, DISPATCH_TIME_FOREVER);
     
     if (error && outerError) {
         *error = outerError;
@@ -193,27 +224,22 @@
 
 - (void) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout callback:(void (^)(NSData *, NSError *))callback {
     // store callback by tag for later
-    Tag *tag = [self uniqueTag];
-    [self.readCallbackForTag setValue:callback forKey:tag.key];
-    [self.socket readDataToLength:length withTimeout:timeout tag:tag.longValue];
+    long tag = [self uniqueTagForReadCallback:callback writeCallback:nil];
+    [self.socket readDataToLength:length withTimeout:timeout tag:tag];
     // The callback will be invoked from the didReadData:tag: GCDAsyncSocketDelegate function
 }
 
 - (NSData *) readDataToLength:(NSUInteger)length withTimeout:(NSTimeInterval)timeout error:(NSError **)error {
-
-    __block BOOL callbackExecuted = NO;
+    dispatch_semaphore_t completed = dispatch_semaphore_create(0);
     __block NSData *outerData = nil;
     __block NSError *outerError = nil;
     
     [self readDataToLength:length withTimeout:timeout callback:^(NSData *data, NSError *error) {
         outerData = data;
         outerError = error;
-        callbackExecuted = YES;
+        dispatch_semaphore_signal(completed);
     }];
-    
-    while (!callbackExecuted) {
-        [[NSRunLoop currentRunLoop] runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
-    }
+    dispatch_semaphore_wait(completed, DISPATCH_TIME_FOREVER);
     
     if (error && outerError) {
         *error = outerError;
@@ -242,12 +268,10 @@
 //          [data base64EncodedStringWithOptions:0],
 //          [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding]);
     
-    Tag *tag = [Tag tagWithLongValue:tagLongValue];
-    void (^readCallback)(NSData *, NSError *) = [self.readCallbackForTag objectForKey:tag.key];
+    void (^readCallback)(NSData *, NSError *) = [self removeReadCallbackWithTag:tagLongValue];
     if (readCallback) {
         readCallback(data, nil);
     }
-    [self destroyTag:tag];
 }
 
 - (void)socket:(GCDAsyncSocket *)sender didReadPartialDataOfLength:(NSUInteger)partialLength tag:(long)tag {
@@ -256,27 +280,22 @@
 
 - (NSTimeInterval)socket:(GCDAsyncSocket *)sender shouldTimeoutReadWithTag:(long)tagLongValue elapsed:(NSTimeInterval)elapsed bytesDone:(NSUInteger)length {
     // NSLog(@"Received call to %@", NSStringFromSelector(_cmd));
-    Tag *tag = [Tag tagWithLongValue:tagLongValue];
-    
     NSError *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorTimeout userInfo:nil];
     
-    void (^readCallback)(NSData *, NSError *) = [self.readCallbackForTag objectForKey:tag.key];
+    void (^readCallback)(NSData *, NSError *) = [self removeReadCallbackWithTag:tagLongValue];
     if (readCallback) {
         readCallback(nil, error);
     }
-    [self destroyTag:tag];
     return 0.0; // signal to the calling GCDAsyncSocketImpl that we do not want to extend the timeout
 }
 
 - (void)socket:(GCDAsyncSocket *)sender didWriteDataWithTag:(long)tagLongValue {
     // NSLog(@"Received call to %@", NSStringFromSelector(_cmd));
     
-    Tag *tag = [Tag tagWithLongValue:tagLongValue];
-    void (^writeCallback)(NSError *) = [self.writeCallbackForTag objectForKey:tag.key];
+    void (^writeCallback)(NSError *) = [self removeWriteCallbackWithTag:tagLongValue];
     if (writeCallback) {
         writeCallback(nil);
     }
-    [self destroyTag:tag];
 }
 
 - (void)socket:(GCDAsyncSocket *)sender didWritePartialDataOfLength:(NSUInteger)partialLength tag:(long)tag {
@@ -285,15 +304,12 @@
 
 - (NSTimeInterval)socket:(GCDAsyncSocket *)sender shouldTimeoutWriteWithTag:(long)tagLongValue elapsed:(NSTimeInterval)elapsed bytesDone:(NSUInteger)length {
     // NSLog(@"Received call to %@", NSStringFromSelector(_cmd));
-    Tag *tag = [Tag tagWithLongValue:tagLongValue];
-    
     NSError *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorTimeout userInfo:nil];
     
-    void (^writeCallback)(NSError *) = [self.writeCallbackForTag objectForKey:tag.key];
+    void (^writeCallback)(NSError *) = [self removeWriteCallbackWithTag:tagLongValue];
     if (writeCallback) {
         writeCallback(error);
     }
-    [self destroyTag:tag];
     return 0.0; // signal to the calling GCDAsyncSocketImpl that we do not want to extend the timeout
 }
 
@@ -307,6 +323,7 @@
 
 - (void)socketDidDisconnect:(GCDAsyncSocket *)sock withError:(NSError *)err {
     // NSLog(@"Received call to %@", NSStringFromSelector(_cmd));
+    [self failAllCallbacksWithError:err ?: [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorUnknown userInfo:nil]];
 }
 
 
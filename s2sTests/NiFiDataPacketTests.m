@@ -17,6 +17,7 @@
 
 #import <Foundation/Foundation.h>
 #import <XCTest/XCTest.h>
+#import <zlib.h>
 #import "NiFiSiteToSiteClient.h"
 
 
@@ -113,4 +114,203 @@
     [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
 }
 
+- (void)testStreamingEncoderMatchesBufferedEncoder {
+    NSDictionary *attributes = @{ @"key1": @"value1", @"key2": @"välue2" };
+    NSMutableData *content = [NSMutableData dataWithLength:10000];
+    for (NSUInteger i = 0; i < content.length; i++) {
+        ((uint8_t *)content.mutableBytes)[i] = (uint8_t)(i % 251);
+    }
+    
+    NiFiDataPacketEncoder *bufferedEncoder = [[NiFiDataPacketEncoder alloc] init];
+    NiFiDataPacketEncoder *streamingEncoder = [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:64];
+    XCTAssertFalse([bufferedEncoder isStreaming]);
+    XCTAssertTrue([streamingEncoder isStreaming]);
+    for (int i = 0; i < 3; i++) {
+        [bufferedEncoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:attributes data:content]];
+        [streamingEncoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:attributes data:content]];
+    }
+    [bufferedEncoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:attributes data:nil]];
+    [streamingEncoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:attributes data:nil]];
+    
+    XCTAssertEqual([bufferedEncoder getDataPacketCount], [streamingEncoder getDataPacketCount]);
+    XCTAssertEqual([bufferedEncoder getEncodedDataByteLength], [streamingEncoder getEncodedDataByteLength]);
+    
+    NSMutableData *streamedData = [NSMutableData data];
+    __block NSUInteger maxChunkLength = 0;
+    BOOL success = [streamingEncoder enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) {
+        maxChunkLength = MAX(maxChunkLength, chunk.length);
+        [streamedData appendData:chunk];
+        return YES;
+    } error:nil];
+    
+    XCTAssertTrue(success);
+    XCTAssertLessThanOrEqual(maxChunkLength, 64);
+    XCTAssertTrue([streamedData isEqualToData:[bufferedEncoder getEncodedData]]);
+    XCTAssertEqual([bufferedEncoder getEncodedDataCrcChecksum], [streamingEncoder getEncodedDataCrcChecksum]);
+    
+    // streaming output can only be consumed once
+    NSError *error = nil;
+    XCTAssertFalse([streamingEncoder enumerateEncodedDataChunksUsingBlock:^BOOL(NSData *chunk) { return YES; } error:&error]);
+    XCTAssertNotNil(error);
+}
+
+- (void)testStreamingEncoderFileDataPacket {
+    NSString *fileName = [NSString stringWithFormat:@"%@_%@", [[NSProcessInfo processInfo] globallyUniqueString], @"testfile3.txt"];
+    NSString *filePath = [NSTemporaryDirectory() stringByAppendingPathComponent:fileName];
+    NSData *data = [@"test file data packet content" dataUsingEncoding:NSUTF8StringEncoding];
+    [data writeToFile:filePath atomically:YES];
+    
+    NiFiDataPacketEncoder *bufferedEncoder = [[NiFiDataPacketEncoder alloc] init];
+    [bufferedEncoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:@{} data:data]];
+    
+    NiFiDataPacketEncoder *streamingEncoder = [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:8];
+    [streamingEncoder appendDataPacket:[NiFiDataPacket dataPacketWithFileAtPath:filePath]];
+    
+    NSData *streamedData = [streamingEncoder getEncodedData];
+    XCTAssertTrue([streamedData isEqualToData:[bufferedEncoder getEncodedData]]);
+    XCTAssertEqual([bufferedEncoder getEncodedDataCrcChecksum], [streamingEncoder getEncodedDataCrcChecksum]);
+    
+    [[NSFileManager defaultManager] removeItemAtPath:filePath error:nil];
+}
+
+- (void)testCrc32MatchesZlib {
+    NSMutableData *data = [NSMutableData dataWithLength:4099];
+    uint8_t *bytes = data.mutableBytes;
+    for (NSUInteger i = 0; i < data.length; i++) {
+        bytes[i] = (uint8_t)(i * 31 + 7);
+    }
+    // cover unaligned starting offsets and lengths that are not a multiple of the word size
+    for (NSUInteger offset = 0; offset < 9; offset++) {
+        for (NSUInteger length = 0; length < 70; length++) {
+            uint32_t expected = (uint32_t)crc32(0L, bytes + offset, (uInt)length);
+            XCTAssertEqual(expected, NiFiCrc32Update(0, bytes + offset, length));
+        }
+    }
+    XCTAssertEqual((uint32_t)crc32(0L, bytes, (uInt)data.length), NiFiCrc32Update(0, bytes, data.length));
+    
+    // incremental updates match a single pass
+    uint32_t crc = NiFiCrc32Update(0, bytes, 1000);
+    crc = NiFiCrc32Update(crc, bytes + 1000, data.length - 1000);
+    XCTAssertEqual((uint32_t)crc32(0L, bytes, (uInt)data.length), crc);
+    
+    // combining the checksums of two pieces matches the checksum of the whole
+    uint32_t crc1 = NiFiCrc32Update(0, bytes, 1234);
+    uint32_t crc2 = NiFiCrc32Update(0, bytes + 1234, data.length - 1234);
+    XCTAssertEqual((uint32_t)crc32(0L, bytes, (uInt)data.length), NiFiCrc32Combine(crc1, crc2, data.length - 1234));
+}
+
+- (void)testEncoderCrcIsIncremental {
+    NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+    XCTAssertEqual(0, [encoder getEncodedDataCrcChecksum]);
+    for (int i = 0; i < 10; i++) {
+        NSString *content = [NSString stringWithFormat:@"Packet %d, with non-ASCII content: éè", i];
+        [encoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:@{ @"index": [@(i) stringValue] }
+                                                                 data:[content dataUsingEncoding:NSUTF8StringEncoding]]];
+        NSData *encodedData = [encoder getEncodedData];
+        XCTAssertEqual(crc32(0L, encodedData.bytes, (uInt)encodedData.length), [encoder getEncodedDataCrcChecksum]);
+    }
+}
+
+- (void)testAppendEncodedDataCombinesCrc {
+    NiFiDataPacket *packet1 = [NiFiDataPacket dataPacketWithString:@"first packet"];
+    NiFiDataPacket *packet2 = [NiFiDataPacket dataPacketWithString:@"second packet"];
+    
+    NiFiDataPacketEncoder *expectedEncoder = [[NiFiDataPacketEncoder alloc] init];
+    [expectedEncoder appendDataPacket:packet1];
+    [expectedEncoder appendDataPacket:packet2];
+    
+    NiFiDataPacketEncoder *preEncoder = [[NiFiDataPacketEncoder alloc] init];
+    [preEncoder appendDataPacket:packet2];
+    
+    NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+    [encoder appendDataPacket:packet1];
+    [encoder appendEncodedData:[preEncoder getEncodedData]
+                   crcChecksum:(uint32_t)[preEncoder getEncodedDataCrcChecksum]
+               dataPacketCount:[preEncoder getDataPacketCount]];
+    
+    XCTAssertTrue([[expectedEncoder getEncodedData] isEqualToData:[encoder getEncodedData]]);
+    XCTAssertEqual([expectedEncoder getEncodedDataCrcChecksum], [encoder getEncodedDataCrcChecksum]);
+    XCTAssertEqual(2, [encoder getDataPacketCount]);
+}
+
+- (void)testStreamingEncoderAppendEncodedDataAsSegment {
+    NiFiDataPacket *packet1 = [NiFiDataPacket dataPacketWithString:@"first packet"];
+    NiFiDataPacket *packet2 = [NiFiDataPacket dataPacketWithString:@"second packet, encoded ahead of time"];
+    
+    NiFiDataPacketEncoder *expectedEncoder = [[NiFiDataPacketEncoder alloc] init];
+    [expectedEncoder appendDataPacket:packet1];
+    [expectedEncoder appendDataPacket:packet2];
+    [expectedEncoder appendDataPacket:packet1];
+    
+    NiFiDataPacketEncoder *preEncoder = [[NiFiDataPacketEncoder alloc] init];
+    [preEncoder appendDataPacket:packet2];
+    
+    // the encoded data is kept as its own segment between the encoded headers, not appended to the pending header bytes
+    NiFiDataPacketEncoder *streamingEncoder = [[NiFiDataPacketEncoder alloc] initWithStreamingChunkSize:8];
+    [streamingEncoder appendDataPacket:packet1];
+    [streamingEncoder appendEncodedData:[preEncoder getEncodedData]
+                            crcChecksum:(uint32_t)[preEncoder getEncodedDataCrcChecksum]
+                        dataPacketCount:[preEncoder getDataPacketCount]];
+    [streamingEncoder appendDataPacket:packet1];
+    XCTAssertEqual(3, [streamingEncoder getDataPacketCount]);
+    XCTAssertEqual([expectedEncoder getEncodedDataByteLength], [streamingEncoder getEncodedDataByteLength]);
+    
+    XCTAssertTrue([[expectedEncoder getEncodedData] isEqualToData:[streamingEncoder getEncodedData]]);
+    XCTAssertEqual([expectedEncoder getEncodedDataCrcChecksum], [streamingEncoder getEncodedDataCrcChecksum]);
+}
+
+- (void)testEncodeAndDecodeSingleDataPacket {
+    NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key1": @"value1", @"clé": @"valeur é" }
+                                                                 data:[@"Test Data" dataUsingEncoding:NSUTF8StringEncoding]];
+    
+    // the bytes and checksum are exactly what appending the packet to a batch would add
+    uint32_t crcChecksum = 0;
+    NSData *encodedData = [NiFiDataPacketEncoder encodeDataPacket:packet crcChecksum:&crcChecksum];
+    NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+    [encoder appendDataPacket:packet];
+    XCTAssertEqualObjects([encoder getEncodedData], encodedData);
+    XCTAssertEqual([encoder getEncodedDataCrcChecksum], crcChecksum);
+    
+    NiFiDataPacket *decodedPacket = [NiFiDataPacketEncoder decodeDataPacket:encodedData];
+    XCTAssertNotNil(decodedPacket);
+    XCTAssertEqualObjects(packet.attributes, decodedPacket.attributes);
+    XCTAssertEqualObjects(packet.data, decodedPacket.data);
+    
+    // incomplete or trailing bytes are rejected rather than misread
+    XCTAssertNil([NiFiDataPacketEncoder decodeDataPacket:[encodedData subdataWithRange:NSMakeRange(0, encodedData.length - 1)]]);
+    NSMutableData *trailingData = [encodedData mutableCopy];
+    [trailingData appendBytes:"x" length:1];
+    XCTAssertNil([NiFiDataPacketEncoder decodeDataPacket:trailingData]);
+}
+
+- (void)testPerformanceZlibCrc32 {
+    NSData *data = [NSMutableData dataWithLength:16 * 1024 * 1024];
+    [self measureBlock:^{
+        uLong crc = crc32(0L, data.bytes, (uInt)data.length);
+        XCTAssertNotEqual(0, crc);
+    }];
+}
+
+- (void)testPerformanceNiFiCrc32 {
+    NSData *data = [NSMutableData dataWithLength:16 * 1024 * 1024];
+    [self measureBlock:^{
+        uint32_t crc = NiFiCrc32Update(0, data.bytes, data.length);
+        XCTAssertNotEqual(0, crc);
+    }];
+}
+
+- (void)testPerformanceEncoderCrcLookup {
+    NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+    NSData *content = [NSMutableData dataWithLength:64 * 1024];
+    for (int i = 0; i < 256; i++) {
+        [encoder appendDataPacket:[NiFiDataPacket dataPacketWithAttributes:@{} data:content]];
+    }
+    [self measureBlock:^{
+        // checksum is maintained as packets are appended, so repeated lookups do not rescan the 16MB batch
+        for (int i = 0; i < 1000; i++) {
+            [encoder getEncodedDataCrcChecksum];
+        }
+    }];
+}
+
 @end
@@ -45,6 +45,22 @@
 @end
 
 
+@interface MockCountingURLSession : MockURLSession
+@property (readwrite) NSUInteger requestCount;
+@end
+
+
+// Completes each request after a delay, on a background queue, like a server round trip
+@interface MockDelayedURLSession : MockCountingURLSession
+@property (readwrite) NSTimeInterval delay;
+@end
+
+
+@interface NiFiHttpRestApiClient()
+- (void)addAuthTokenHeaderToRequest:(NSMutableURLRequest **)request error:(NSError **)error;
+@end
+
+
 @implementation MockResponse
 // properties will be auto-synthesized
 @end
@@ -86,6 +102,34 @@
 @end
 
 
+@implementation MockCountingURLSession
+
+- (NSURLSessionDataTask *_Null_unspecified)dataTaskWithRequest:(NSURLRequest *_Null_unspecified)request
+                                             completionHandler:(void (^_Null_unspecified)(NSData *_Nullable data, NSURLResponse *_Nullable response, NSError *_Nullable error))completionHandler {
+    @synchronized(self) {
+        self.requestCount++;
+    }
+    return [super dataTaskWithRequest:request completionHandler:completionHandler];
+}
+
+@end
+
+
+@implementation MockDelayedURLSession
+
+- (NSURLSessionDataTask *_Null_unspecified)dataTaskWithRequest:(NSURLRequest *_Null_unspecified)request
+                                             completionHandler:(void (^_Null_unspecified)(NSData *_Nullable data, NSURLResponse *_Nullable response, NSError *_Nullable error))completionHandler {
+    NSTimeInterval delay = self.delay;
+    return [super dataTaskWithRequest:request completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_SEC), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            completionHandler(data, response, error);
+        });
+    }];
+}
+
+@end
+
+
 @implementation NiFiHttpRestApiClientTests
 
 - (void)setUp {
@@ -148,6 +192,164 @@
     XCTAssertTrue([tr.lastResponseMessage isEqualToString:@"Handshake properties are valid, and port is running. A transaction is created:8966b23c-1495-4c9e-9050-c0a2306122ce"]);
 }
 
-@end
+- (void)testAuthTokenSharedAcrossClients {
+    // unique host, as the auth token cache is shared by the whole process
+    NSString *host = [[[NSUUID UUID] UUIDString] lowercaseString];
+    NSURL *baseApiURL = [NSURL URLWithString:[NSString stringWithFormat:@"https://%@:8443/nifi-api", host]];
+    NSString *jwt = @"eyJhbGciOiJIUzI1NiJ9.eyJzdWIiOiJ1c2VyIiwiaWF0IjoxNTAwMDAwMDAwLCJleHAiOjE1MDAwMDM2MDB9.signature";
+    
+    MockResponse *mockResponse = [[MockResponse alloc] init];
+    mockResponse.response = [[NSHTTPURLResponse alloc] initWithURL:baseApiURL
+                                                        statusCode:201L
+                                                       HTTPVersion:@"1.1"
+                                                      headerFields:@{ @"Content-Type": @"text/plain" }];
+    mockResponse.data = [jwt dataUsingEncoding:NSUTF8StringEncoding];
+    MockCountingURLSession *mockURLSession = [[MockCountingURLSession alloc] initWithResponse:mockResponse];
+    NSURLCredential *credential = [NSURLCredential credentialWithUser:@"user"
+                                                             password:@"password"
+                                                          persistence:NSURLCredentialPersistenceNone];
+    
+    for (int i = 0; i < 3; i++) {
+        NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:baseApiURL
+                                                                             clientCredential:credential
+                                                                                   urlSession:mockURLSession];
+        NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:baseApiURL];
+        NSError *error = nil;
+        [restApiClient addAuthTokenHeaderToRequest:&request error:&error];
+        XCTAssertNil(error);
+        XCTAssertTrue([[request valueForHTTPHeaderField:@"Authorization"] isEqualToString:[@"Bearer " stringByAppendingString:jwt]]);
+    }
+    XCTAssertEqual(1, mockURLSession.requestCount);
+}
+
+- (void)testAuthTokenNotSharedAcrossPasswords {
+    // unique host, as the auth token cache is shared by the whole process
+    NSString *host = [[[NSUUID UUID] UUIDString] lowercaseString];
+    NSURL *baseApiURL = [NSURL URLWithString:[NSString stringWithFormat:@"https://%@:8443/nifi-api", host]];
+    NSString *jwt = @"eyJhbGciOiJIUzI1NiJ9.eyJzdWIiOiJ1c2VyIiwiaWF0IjoxNTAwMDAwMDAwLCJleHAiOjE1MDAwMDM2MDB9.signature";
+    
+    MockResponse *mockResponse = [[MockResponse alloc] init];
+    mockResponse.response = [[NSHTTPURLResponse alloc] initWithURL:baseApiURL
+                                                        statusCode:201L
+                                                       HTTPVersion:@"1.1"
+                                                      headerFields:@{ @"Content-Type": @"text/plain" }];
+    mockResponse.data = [jwt dataUsingEncoding:NSUTF8StringEncoding];
+    MockCountingURLSession *mockURLSession = [[MockCountingURLSession alloc] initWithResponse:mockResponse];
+    
+    // a client with a stale password must fetch its own token, rather than use one fetched with the current password
+    for (NSString *password in @[@"password", @"stale-password"]) {
+        NSURLCredential *credential = [NSURLCredential credentialWithUser:@"user"
+                                                                 password:password
+                                                              persistence:NSURLCredentialPersistenceNone];
+        NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:baseApiURL
+                                                                             clientCredential:credential
+                                                                                   urlSession:mockURLSession];
+        NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:baseApiURL];
+        [restApiClient addAuthTokenHeaderToRequest:&request error:nil];
+    }
+    XCTAssertEqual(2, mockURLSession.requestCount);
+}
 
+- (void)testSiteToSiteInfoSharedAndCached {
+    // unique host, as the site-to-site info cache is shared by the whole process
+    NSString *host = [[[NSUUID UUID] UUIDString] lowercaseString];
+    NSURL *baseApiURL = [NSURL URLWithString:[NSString stringWithFormat:@"http://%@:8080/nifi-api", host]];
+    
+    MockResponse *mockResponse = [[MockResponse alloc] init];
+    mockResponse.response = [[NSHTTPURLResponse alloc] initWithURL:baseApiURL
+                                                        statusCode:200L
+                                                       HTTPVersion:@"1.1"
+                                                      headerFields:@{ @"Content-Type": @"application/json" }];
+    mockResponse.data = [@"{\"controller\":{\"remoteSiteListeningPort\":8081,\"inputPorts\":[]}}" dataUsingEncoding:NSUTF8StringEncoding];
+    MockDelayedURLSession *mockURLSession = [[MockDelayedURLSession alloc] initWithResponse:mockResponse];
+    mockURLSession.delay = 0.2;
+    
+    // concurrent lookups share one request
+    XCTestExpectation *completed = [self expectationWithDescription:@"site-to-site info looked up"];
+    completed.expectedFulfillmentCount = 10;
+    for (int i = 0; i < 10; i++) {
+        NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:baseApiURL
+                                                                             clientCredential:nil
+                                                                                   urlSession:mockURLSession];
+        restApiClient.siteToSiteInfoCacheTTL = 60.0;
+        [restApiClient getSiteToSiteInfoWithCompletionHandler:^(NSDictionary *siteToSiteInfo, NSError *error) {
+            XCTAssertNil(error);
+            XCTAssertEqualObjects(siteToSiteInfo[@"controller"][@"remoteSiteListeningPort"], @8081);
+            [completed fulfill];
+        }];
+    }
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    XCTAssertEqual(1, mockURLSession.requestCount);
+    
+    // later lookups are served from the cache until it is invalidated
+    NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:baseApiURL
+                                                                         clientCredential:nil
+                                                                               urlSession:mockURLSession];
+    restApiClient.siteToSiteInfoCacheTTL = 60.0;
+    NSError *error = nil;
+    XCTAssertNotNil([restApiClient getSiteToSiteInfoOrError:&error]);
+    XCTAssertNil(error);
+    XCTAssertEqual(1, mockURLSession.requestCount);
+    
+    [restApiClient invalidateCachedSiteToSiteInfo];
+    XCTAssertNotNil([restApiClient getSiteToSiteInfoOrError:&error]);
+    XCTAssertNil(error);
+    XCTAssertEqual(2, mockURLSession.requestCount);
+}
 
+- (MockResponse *)mockTransactionCreatedResponseWithTransactionUrl:(NSString *)transactionURL {
+    MockResponse *mockResponse = [[MockResponse alloc] init];
+    mockResponse.response = [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:transactionURL]
+                                                        statusCode:201L
+                                                       HTTPVersion:@"1.1"
+                                                      headerFields:@{ @"Content-Type": @"application/json",
+                                                                      @"Location": transactionURL,
+                                                                      @"x-location-uri-intent": @"transaction-url",
+                                                                      @"x-nifi-site-to-site-protocol-version": @"1",
+                                                                      @"x-nifi-site-to-site-server-transaction-ttl": @"30" }];
+    mockResponse.data = [@"{\"flowFileSent\":0,\"responseCode\":1,\"message\":\"A transaction is created\"}" dataUsingEncoding:NSUTF8StringEncoding];
+    mockResponse.error = nil;
+    return mockResponse;
+}
+
+- (void)testInitiateSendTransactionToPortIdWithCompletionHandler {
+    NSString *transactionURL = @"http://testhostname:8080/nifi-api/data-transfer/input-ports/port/transactions/8966b23c-1495-4c9e-9050-c0a2306122ce";
+    MockDelayedURLSession *mockURLSession = [[MockDelayedURLSession alloc] initWithResponse:[self mockTransactionCreatedResponseWithTransactionUrl:transactionURL]];
+    mockURLSession.delay = 0.1;
+    NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:[NSURL URLWithString:@"http://testhostname:8080/nifi-api"]
+                                                                         clientCredential:nil
+                                                                               urlSession:mockURLSession];
+    
+    XCTestExpectation *completed = [self expectationWithDescription:@"transaction created"];
+    [restApiClient initiateSendTransactionToPortId:@"port" completionHandler:^(NiFiTransactionResource *tr, NSError *error) {
+        XCTAssertNil(error);
+        XCTAssertTrue([tr.transactionId isEqualToString:@"8966b23c-1495-4c9e-9050-c0a2306122ce"]);
+        XCTAssertEqual(tr.serverSideTtl, 30);
+        [completed fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+}
+
+- (void)testManyRequestsInFlightWithCompletionHandler {
+    // Far more requests than GCD has worker threads, each taking 0.5 seconds.
+    // Were a thread blocked per request, they would take several times longer to all complete.
+    NSUInteger requestCount = 500;
+    NSString *transactionURL = @"http://testhostname:8080/nifi-api/data-transfer/input-ports/port/transactions/8966b23c-1495-4c9e-9050-c0a2306122ce";
+    MockDelayedURLSession *mockURLSession = [[MockDelayedURLSession alloc] initWithResponse:[self mockTransactionCreatedResponseWithTransactionUrl:transactionURL]];
+    mockURLSession.delay = 0.5;
+    NiFiHttpRestApiClient *restApiClient = [[NiFiHttpRestApiClient alloc] initWithBaseUrl:[NSURL URLWithString:@"http://testhostname:8080/nifi-api"]
+                                                                         clientCredential:nil
+                                                                               urlSession:mockURLSession];
+    
+    XCTestExpectation *completed = [self expectationWithDescription:@"all transactions created"];
+    completed.expectedFulfillmentCount = requestCount;
+    for (NSUInteger i = 0; i < requestCount; i++) {
+        [restApiClient initiateSendTransactionToPortId:@"port" completionHandler:^(NiFiTransactionResource *tr, NSError *error) {
+            XCTAssertNotNil(tr);
+            [completed fulfill];
+        }];
+    }
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+}
+
+@end
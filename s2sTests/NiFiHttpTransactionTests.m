@@ -29,6 +29,9 @@
 @interface MockHttpRestApiClient : NiFiHttpRestApiClient
 @property NSInteger dataPacketsSentCount;
 @property NSInteger ttlExtensionCallCount;
+@property NSInteger serverCrcOffset; // added to the CRC the mock server returns, so a non-zero offset is a CRC mismatch
+@property (nullable) NSError *endTransactionError; // if set, ending the transaction fails with this error
+@property (nonnull) NSMutableArray<NSNumber *> *endTransactionResponseCodes;
 - (nonnull instancetype) initWithBaseUrl:(nonnull NSURL *)baseUrl;
 @end
 
@@ -40,6 +43,8 @@
     if (self) {
         _ttlExtensionCallCount = 0;
         _dataPacketsSentCount = 0;
+        _serverCrcOffset = 0;
+        _endTransactionResponseCodes = [NSMutableArray array];
     }
     return self;
 }
@@ -59,6 +64,14 @@
     return returnVal;
 }
 
+- (void)initiateSendTransactionToPortId:(nonnull NSString *)portId
+                      completionHandler:(void (^_Nonnull)(NiFiTransactionResource *_Nullable transactionResource, NSError *_Nullable error))completionHandler {
+    NiFiTransactionResource *transactionResource = [self initiateSendTransactionToPortId:portId error:nil];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        completionHandler(transactionResource, nil);
+    });
+}
+
 - (nullable NSString *)getPortIdForPortName:(nonnull NSString *)portName
                                       error:(NSError *_Nullable *_Nullable)error {
     return @"12345678-1234-1234-1234-1234567890abc";
@@ -68,17 +81,39 @@
     _ttlExtensionCallCount++;
 }
 
+- (void)extendTTLForTransaction:(nonnull NSString *)transactionUrl
+              completionHandler:(void (^_Nonnull)(NSError *_Nullable error))completionHandler {
+    _ttlExtensionCallCount++;
+    completionHandler(nil);
+}
+
 - (NSInteger)sendFlowFiles:(nonnull NiFiDataPacketEncoder *)dataPacketEncoder
            withTransaction:(nonnull NiFiTransactionResource *)transactionResource
                      error:(NSError *_Nullable *_Nullable)error {
     [dataPacketEncoder getEncodedData];
     _dataPacketsSentCount += [dataPacketEncoder getDataPacketCount];
-    return [dataPacketEncoder getEncodedDataCrcChecksum];
+    return [dataPacketEncoder getEncodedDataCrcChecksum] + _serverCrcOffset;
+}
+
+- (void)sendFlowFiles:(nonnull NiFiDataPacketEncoder *)dataPacketEncoder
+      withTransaction:(nonnull NiFiTransactionResource *)transactionResource
+    completionHandler:(void (^_Nonnull)(NSInteger serverCrc, NSError *_Nullable error))completionHandler {
+    NSInteger serverCrc = [self sendFlowFiles:dataPacketEncoder withTransaction:transactionResource error:nil];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        completionHandler(serverCrc, nil);
+    });
 }
 
 - (nullable NiFiTransactionResult *)endTransaction:(nonnull NSString *)transactionUrl
                                       responseCode:(NiFiTransactionResponseCode)responseCode
                                              error:(NSError *_Nullable *_Nullable)error {
+    [_endTransactionResponseCodes addObject:@(responseCode)];
+    if (_endTransactionError) {
+        if (error) {
+            *error = _endTransactionError;
+        }
+        return nil;
+    }
     NiFiTransactionResult *returnVal = [[NiFiTransactionResult alloc] initWithResponseCode:responseCode
                                                                     dataPacketsTransferred:_dataPacketsSentCount
                                                                                    message:nil
@@ -86,6 +121,16 @@
     return returnVal;
 }
 
+- (void)endTransaction:(nonnull NSString *)transactionUrl
+          responseCode:(NiFiTransactionResponseCode)responseCode
+     completionHandler:(void (^_Nonnull)(NiFiTransactionResult *_Nullable transactionResult, NSError *_Nullable error))completionHandler {
+    NSError *endError = nil;
+    NiFiTransactionResult *transactionResult = [self endTransaction:transactionUrl responseCode:responseCode error:&endError];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        completionHandler(transactionResult, endError);
+    });
+}
+
 @end
 
 
@@ -110,6 +155,63 @@
     XCTAssertEqual(1, [transactionRsult dataPacketsTransferred]);
 }
 
+- (void)testHttpTransactionWithCompletionHandlers {
+    
+    NSURL *baseURL = [NSURL URLWithString:@"http://hostname:port/nifi-api"];
+    MockHttpRestApiClient *mockApiClient = [[MockHttpRestApiClient alloc] initWithBaseUrl:baseURL];
+    
+    NiFiHttpTransaction *transaction = [self createTransactionWithCompletionHandlerUsingApiClient:mockApiClient];
+    XCTAssertNotNil(transaction);
+    XCTAssertEqual(TRANSACTION_STARTED, [transaction transactionState]);
+    
+    [transaction sendData:[NiFiDataPacket dataPacketWithAttributes:@{@"packetNumber": @"1"}
+                                                              data:[@"Data Packet 1" dataUsingEncoding:NSUTF8StringEncoding]]];
+    
+    NSError *transactionError = nil;
+    NiFiTransactionResult *transactionResult = [self confirmAndCompleteWithCompletionHandler:transaction error:&transactionError];
+    XCTAssertNil(transactionError);
+    XCTAssertEqual(1, [transactionResult dataPacketsTransferred]);
+    XCTAssertEqual(TRANSACTION_COMPLETED, [transaction transactionState]);
+    XCTAssertEqualObjects(@[@(CONFIRM_TRANSACTION)], mockApiClient.endTransactionResponseCodes);
+}
+
+- (void)testHttpTransactionWithCompletionHandlersCrcMismatch {
+    
+    NSURL *baseURL = [NSURL URLWithString:@"http://hostname:port/nifi-api"];
+    MockHttpRestApiClient *mockApiClient = [[MockHttpRestApiClient alloc] initWithBaseUrl:baseURL];
+    mockApiClient.serverCrcOffset = 1;
+    
+    NiFiHttpTransaction *transaction = [self createTransactionWithCompletionHandlerUsingApiClient:mockApiClient];
+    [transaction sendData:[NiFiDataPacket dataPacketWithAttributes:@{@"packetNumber": @"1"}
+                                                              data:[@"Data Packet 1" dataUsingEncoding:NSUTF8StringEncoding]]];
+    
+    // the transaction is ended as a bad checksum rather than confirmed, so the server discards the flow files
+    NSError *transactionError = nil;
+    NiFiTransactionResult *transactionResult = [self confirmAndCompleteWithCompletionHandler:transaction error:&transactionError];
+    XCTAssertNil(transactionResult);
+    XCTAssertNotNil(transactionError);
+    XCTAssertEqual(TRANSACTION_ERROR, [transaction transactionState]);
+    XCTAssertEqualObjects(@[@(BAD_CHECKSUM)], mockApiClient.endTransactionResponseCodes);
+}
+
+- (void)testHttpTransactionWithCompletionHandlersEndTransactionError {
+    
+    NSURL *baseURL = [NSURL URLWithString:@"http://hostname:port/nifi-api"];
+    MockHttpRestApiClient *mockApiClient = [[MockHttpRestApiClient alloc] initWithBaseUrl:baseURL];
+    mockApiClient.endTransactionError = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+    
+    NiFiHttpTransaction *transaction = [self createTransactionWithCompletionHandlerUsingApiClient:mockApiClient];
+    [transaction sendData:[NiFiDataPacket dataPacketWithAttributes:@{@"packetNumber": @"1"}
+                                                              data:[@"Data Packet 1" dataUsingEncoding:NSUTF8StringEncoding]]];
+    
+    NSError *transactionError = nil;
+    NiFiTransactionResult *transactionResult = [self confirmAndCompleteWithCompletionHandler:transaction error:&transactionError];
+    XCTAssertNil(transactionResult);
+    XCTAssertEqualObjects(mockApiClient.endTransactionError, transactionError);
+    XCTAssertEqual(TRANSACTION_ERROR, [transaction transactionState]);
+    XCTAssertEqualObjects(@[@(CONFIRM_TRANSACTION)], mockApiClient.endTransactionResponseCodes);
+}
+
 - (void)testHttpTransactionKeepAlives {
     
     NSURL *baseURL = [NSURL URLWithString:@"http://hostname:port/nifi-api"];
@@ -123,5 +225,55 @@
     XCTAssertTrue(mockApiClient.ttlExtensionCallCount >= floor((double)MOCK_SERVER_SIDE_TRANSACTION_TTL / (double)sleepIntervalSeconds));
 }
 
+- (void)testHttpTransactionKeepAlivesStopWhenCanceled {
+    
+    NSURL *baseURL = [NSURL URLWithString:@"http://hostname:port/nifi-api"];
+    MockHttpRestApiClient *mockApiClient = [[MockHttpRestApiClient alloc] initWithBaseUrl:baseURL];
+    MockHttpRestApiClient *otherMockApiClient = [[MockHttpRestApiClient alloc] initWithBaseUrl:baseURL];
+    
+    NiFiHttpTransaction *transaction = [[NiFiHttpTransaction alloc] initWithPortId:@"testportid" httpRestApiClient:mockApiClient];
+    NiFiHttpTransaction *otherTransaction = [[NiFiHttpTransaction alloc] initWithPortId:@"testportid" httpRestApiClient:otherMockApiClient];
+    [transaction cancel];
+    
+    // the canceled transaction is dropped right away, while the other keeps being extended
+    sleep(MOCK_SERVER_SIDE_TRANSACTION_TTL);
+    XCTAssertEqual(0, mockApiClient.ttlExtensionCallCount);
+    XCTAssertGreaterThanOrEqual(otherMockApiClient.ttlExtensionCallCount, 1);
+    [otherTransaction cancel];
+}
+
+// MARK: Helper functions
+
+- (nullable NiFiHttpTransaction *)createTransactionWithCompletionHandlerUsingApiClient:(nonnull MockHttpRestApiClient *)apiClient {
+    XCTestExpectation *created = [self expectationWithDescription:@"transaction created"];
+    __block NiFiHttpTransaction *createdTransaction = nil;
+    [NiFiHttpTransaction transactionWithPortId:@"testportid"
+                             httpRestApiClient:apiClient
+                                          peer:nil
+                             completionHandler:^(NiFiHttpTransaction *transaction, NSError *error) {
+        createdTransaction = transaction;
+        [created fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    return createdTransaction;
+}
+
+- (nullable NiFiTransactionResult *)confirmAndCompleteWithCompletionHandler:(nonnull NiFiHttpTransaction *)transaction
+                                                                     error:(NSError *_Nullable *_Nullable)error {
+    XCTestExpectation *completed = [self expectationWithDescription:@"transaction completed"];
+    __block NiFiTransactionResult *completedResult = nil;
+    __block NSError *completedError = nil;
+    [transaction confirmAndCompleteWithCompletionHandler:^(NiFiTransactionResult *transactionResult, NSError *transactionError) {
+        completedResult = transactionResult;
+        completedError = transactionError;
+        [completed fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    if (error) {
+        *error = completedError;
+    }
+    return completedResult;
+}
+
 @end
 
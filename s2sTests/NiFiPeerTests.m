@@ -17,6 +17,7 @@
 
 #import <XCTest/XCTest.h>
 #import "NiFiSiteToSite.h"
+#import "NiFiPeerSelector.h"
 
 @interface NiFiPeerTests : XCTestCase
 @end
@@ -155,4 +156,138 @@
     XCTAssertEqual(NSOrderedDescending, [peer1 compare:peer2]);
 }
 
+- (void)testHasFailedWithinInterval {
+    NSURL *url = [NSURL URLWithString:@"https://example.com:8443"];
+    NiFiPeer *peer = [NiFiPeer peerWithUrl:url];
+    XCTAssertFalse([peer hasFailedWithinInterval:10.0]);
+    
+    [peer markFailure];
+    XCTAssertTrue([peer hasFailedWithinInterval:10.0]);
+    
+    peer.lastFailure = [NSDate timeIntervalSinceReferenceDate] - 20.0; // cool-down has passed
+    XCTAssertFalse([peer hasFailedWithinInterval:10.0]);
+}
+
+- (void)testRecordTransactionDuration {
+    NSURL *url = [NSURL URLWithString:@"https://example.com:8443"];
+    NiFiPeer *peer = [NiFiPeer peerWithUrl:url];
+    XCTAssertEqual(peer.averageTransactionDuration, 0.0);
+    
+    [peer recordTransactionDuration:1.0 dataPacketCount:5];
+    XCTAssertEqualWithAccuracy(peer.averageTransactionDuration, 1.0, 0.0001); // first sample is the average
+    XCTAssertEqual(peer.flowFileCount, 5);
+    
+    [peer recordTransactionDuration:2.0 dataPacketCount:5];
+    XCTAssertGreaterThan(peer.averageTransactionDuration, 1.0);
+    XCTAssertLessThan(peer.averageTransactionDuration, 2.0);
+    XCTAssertEqual(peer.flowFileCount, 10);
+}
+
+- (void)testMarkDestinationFullBacksOffExponentiallyWithJitter {
+    NSURL *url = [NSURL URLWithString:@"https://example.com:8443"];
+    NiFiPeer *peer = [NiFiPeer peerWithUrl:url];
+    XCTAssertFalse([peer isBackingOff]);
+    
+    // each interval is between half and all of a ceiling that doubles, up to the max
+    NSTimeInterval expectedCeilings[] = {1.0, 2.0, 4.0, 8.0, 10.0, 10.0};
+    for (int i = 0; i < 6; i++) {
+        NSTimeInterval backoff = [peer markDestinationFullWithInitialBackoff:1.0 maxBackoff:10.0];
+        XCTAssertGreaterThanOrEqual(backoff, expectedCeilings[i] / 2.0);
+        XCTAssertLessThanOrEqual(backoff, expectedCeilings[i]);
+        XCTAssertTrue([peer isBackingOff]);
+    }
+    XCTAssertEqual(peer.consecutiveBackoffCount, 6);
+    
+    peer.backoffUntil = [NSDate timeIntervalSinceReferenceDate] - 1.0; // backoff has passed
+    XCTAssertFalse([peer isBackingOff]);
+}
+
+- (void)testClearBackoff {
+    NSURL *url = [NSURL URLWithString:@"https://example.com:8443"];
+    NiFiPeer *peer = [NiFiPeer peerWithUrl:url];
+    [peer markDestinationFullWithInitialBackoff:1.0 maxBackoff:10.0];
+    [peer markDestinationFullWithInitialBackoff:1.0 maxBackoff:10.0];
+    XCTAssertTrue([peer isBackingOff]);
+    
+    [peer clearBackoff];
+    XCTAssertFalse([peer isBackingOff]);
+    XCTAssertEqual(peer.consecutiveBackoffCount, 0);
+    
+    // the next report starts again from the initial interval
+    XCTAssertLessThanOrEqual([peer markDestinationFullWithInitialBackoff:1.0 maxBackoff:10.0], 1.0);
+}
+
+- (NSArray<NiFiPeer *> *)peersWithHosts:(NSArray<NSString *> *)hosts {
+    NSMutableArray<NiFiPeer *> *peers = [NSMutableArray arrayWithCapacity:hosts.count];
+    for (NSString *host in hosts) {
+        [peers addObject:[NiFiPeer peerWithUrl:[NSURL URLWithString:[NSString stringWithFormat:@"https://%@:8443", host]]]];
+    }
+    return peers;
+}
+
+- (void)testLeastLoadedPeerSelector {
+    NSArray<NiFiPeer *> *peers = [self peersWithHosts:@[@"a.example.com", @"b.example.com", @"c.example.com"]];
+    NSCountedSet *activeTransactionCounts = [NSCountedSet set];
+    NSObject <NiFiPeerSelector> *selector = [NiFiPeerSelector peerSelectorWithStrategy:PEER_SELECTION_LEAST_LOADED];
+    
+    // With no transactions in progress, the peer with the fewest flow files is selected
+    peers[0].flowFileCount = 20;
+    peers[1].flowFileCount = 10;
+    peers[2].flowFileCount = 30;
+    XCTAssertEqual(peers[1], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+    
+    // Transactions in progress spread load to other peers
+    [activeTransactionCounts addObject:[peers[1] peerKey]];
+    XCTAssertEqual(peers[0], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+    [activeTransactionCounts addObject:[peers[0] peerKey]];
+    XCTAssertEqual(peers[2], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+}
+
+- (void)testPeerSelectorsIgnorePastFailures {
+    // a failure only keeps a peer out of selection during the cooldown, after which it competes on load alone
+    for (NSNumber *strategy in @[@(PEER_SELECTION_LEAST_LOADED), @(PEER_SELECTION_LATENCY_AWARE)]) {
+        NSArray<NiFiPeer *> *peers = [self peersWithHosts:@[@"a.example.com", @"b.example.com"]];
+        NSObject <NiFiPeerSelector> *selector = [NiFiPeerSelector peerSelectorWithStrategy:[strategy intValue]];
+        peers[0].lastFailure = [NSDate timeIntervalSinceReferenceDate] - 3600.0;
+        XCTAssertEqual(peers[0], [selector selectPeerFromPeers:peers activeTransactionCounts:[NSCountedSet set]]);
+        
+        peers[0].flowFileCount = 10;
+        XCTAssertEqual(peers[1], [selector selectPeerFromPeers:peers activeTransactionCounts:[NSCountedSet set]]);
+    }
+}
+
+- (void)testRoundRobinPeerSelector {
+    NSArray<NiFiPeer *> *peers = [self peersWithHosts:@[@"a.example.com", @"b.example.com", @"c.example.com"]];
+    NSCountedSet *activeTransactionCounts = [NSCountedSet set];
+    NSObject <NiFiPeerSelector> *selector = [NiFiPeerSelector peerSelectorWithStrategy:PEER_SELECTION_ROUND_ROBIN];
+    
+    NSCountedSet *selectedPeerKeys = [NSCountedSet set];
+    for (int i = 0; i < 9; i++) {
+        [selectedPeerKeys addObject:[[selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts] peerKey]];
+    }
+    for (NiFiPeer *peer in peers) {
+        XCTAssertEqual(3, [selectedPeerKeys countForObject:[peer peerKey]]);
+    }
+}
+
+- (void)testLatencyAwarePeerSelector {
+    NSArray<NiFiPeer *> *peers = [self peersWithHosts:@[@"a.example.com", @"b.example.com"]];
+    NSCountedSet *activeTransactionCounts = [NSCountedSet set];
+    NSObject <NiFiPeerSelector> *selector = [NiFiPeerSelector peerSelectorWithStrategy:PEER_SELECTION_LATENCY_AWARE];
+    
+    // A peer without a completed transaction is tried first
+    [peers[0] recordTransactionDuration:0.1 dataPacketCount:1];
+    XCTAssertEqual(peers[1], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+    
+    // Then the faster peer is preferred...
+    [peers[1] recordTransactionDuration:0.3 dataPacketCount:1];
+    XCTAssertEqual(peers[0], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+    
+    // ...until enough transactions are in progress there that the slower peer would finish sooner
+    [activeTransactionCounts addObject:[peers[0] peerKey]];
+    [activeTransactionCounts addObject:[peers[0] peerKey]];
+    [activeTransactionCounts addObject:[peers[0] peerKey]];
+    XCTAssertEqual(peers[1], [selector selectPeerFromPeers:peers activeTransactionCounts:activeTransactionCounts]);
+}
+
 @end
@@ -17,10 +17,40 @@
 
 #import <XCTest/XCTest.h>
 #import "NiFiSiteToSite.h"
+#import "NiFiSiteToSiteConfig.h"
+#import "NiFiHttpRestApiClient.h"
 
 @interface NiFiSiteToSiteClientTests : XCTestCase
 @end
 
+
+// Mocks implemented in NiFiHttpRestApiClientTests.m
+@interface MockResponse : NSObject
+@property NSData *data;
+@property NSURLResponse *response;
+@property NSError *error;
+@end
+
+@interface MockURLSession : NSURLSession<NSURLSessionProtocol>
+- (instancetype)initWithResponse:(MockResponse *)response;
+@end
+
+@interface MockCountingURLSession : MockURLSession
+@property (readwrite) NSUInteger requestCount;
+@end
+
+@interface MockDelayedURLSession : MockCountingURLSession
+@property (readwrite) NSTimeInterval delay;
+@end
+
+
+// Private to the cluster clients in NiFiSiteToSiteClient.m
+@interface NiFiSiteToSiteClient (Testing)
+- (nonnull NSArray<NiFiSiteToSiteClient *> *)clusterClients;
+- (void)setUrlSession:(nullable NSURLSession *)urlSession;
+- (BOOL)isPeerUpdateInFlight;
+@end
+
 @implementation NiFiSiteToSiteClientTests
 
 - (void)setUp {
@@ -91,4 +121,103 @@
     XCTAssertNotNil(client);
 }
 
+- (void)testSharedClientRegistry {
+    NSURL *nifiUrl = [NSURL URLWithString:@"https://example.com:8080"];
+    NiFiSiteToSiteClientConfig *s2sConfig = [NiFiSiteToSiteClientConfig configWithRemoteCluster:[NiFiSiteToSiteRemoteClusterConfig configWithUrl:nifiUrl]];
+    s2sConfig.portName = @"From iOS";
+    NiFiSiteToSiteClientConfig *equivalentConfig = [NiFiSiteToSiteClientConfig configWithRemoteCluster:[NiFiSiteToSiteRemoteClusterConfig configWithUrl:nifiUrl]];
+    equivalentConfig.portName = @"From iOS";
+    NiFiSiteToSiteClientConfig *otherConfig = [NiFiSiteToSiteClientConfig configWithRemoteCluster:[NiFiSiteToSiteRemoteClusterConfig configWithUrl:nifiUrl]];
+    otherConfig.portName = @"Another Port";
+    
+    NiFiSiteToSiteClient *client = [NiFiSiteToSiteClient sharedClientWithConfig:s2sConfig];
+    XCTAssertNotNil(client);
+    XCTAssertTrue(client == [NiFiSiteToSiteClient sharedClientWithConfig:s2sConfig]);
+    XCTAssertTrue(client == [NiFiSiteToSiteClient sharedClientWithConfig:equivalentConfig]);
+    XCTAssertFalse(client == [NiFiSiteToSiteClient sharedClientWithConfig:otherConfig]);
+}
+
+- (void)testSharedClientRegistryKey {
+    NSURL *nifiUrl = [NSURL URLWithString:@"https://example.com:8443"];
+    NiFiSiteToSiteClientConfig *(^configWithPassword)(NSString *) = ^(NSString *password) {
+        NiFiSiteToSiteRemoteClusterConfig *clusterConfig = [NiFiSiteToSiteRemoteClusterConfig configWithUrl:nifiUrl];
+        clusterConfig.username = @"user";
+        clusterConfig.password = password;
+        clusterConfig.urlSessionConfiguration = [NSURLSessionConfiguration defaultSessionConfiguration]; // a new object each time
+        NiFiSiteToSiteClientConfig *s2sConfig = [NiFiSiteToSiteClientConfig configWithRemoteCluster:clusterConfig];
+        s2sConfig.portName = @"From iOS";
+        return s2sConfig;
+    };
+    NiFiSiteToSiteClientConfig *s2sConfig = configWithPassword(@"secret-password");
+    
+    // equal session configurations and credentials share a client, without the key holding the password
+    XCTAssertEqualObjects([s2sConfig clientRegistryKey], [configWithPassword(@"secret-password") clientRegistryKey]);
+    XCTAssertEqualObjects([s2sConfig clientRegistryKey], [[s2sConfig copy] clientRegistryKey]);
+    XCTAssertFalse([[s2sConfig clientRegistryKey] containsString:@"secret-password"]);
+    XCTAssertNotEqualObjects([s2sConfig clientRegistryKey], [configWithPassword(@"another-password") clientRegistryKey]);
+    
+    NiFiSiteToSiteClientConfig *longTimeoutConfig = configWithPassword(@"secret-password");
+    longTimeoutConfig.remoteClusters[0].urlSessionConfiguration.timeoutIntervalForRequest = 300.0;
+    XCTAssertNotEqualObjects([s2sConfig clientRegistryKey], [longTimeoutConfig clientRegistryKey]);
+    
+    NiFiSiteToSiteClient *client = [NiFiSiteToSiteClient sharedClientWithConfig:s2sConfig];
+    XCTAssertTrue(client == [NiFiSiteToSiteClient sharedClientWithConfig:configWithPassword(@"secret-password")]);
+}
+
+- (void)testCreateTransactionDoesNotWaitForPeerUpdate {
+    // unique host, as site-to-site info and auth tokens are cached for the whole process
+    NSString *host = [[[NSUUID UUID] UUIDString] lowercaseString];
+    NSURL *nifiUrl = [NSURL URLWithString:[NSString stringWithFormat:@"http://%@:8080", host]];
+    NiFiSiteToSiteClientConfig *s2sConfig = [NiFiSiteToSiteClientConfig configWithRemoteCluster:[NiFiSiteToSiteRemoteClusterConfig configWithUrl:nifiUrl]];
+    s2sConfig.portId = @"82f79eb6-015c-1000-d191-ee1ef23b1a74";
+    s2sConfig.peerUpdateRetryInterval = 60.0;
+    NiFiSiteToSiteClient *client = [NiFiSiteToSiteClient clientWithConfig:s2sConfig];
+    
+    // the peer list is refreshed through the client's own session, which answers slowly, with an error
+    MockResponse *peersResponse = [[MockResponse alloc] init];
+    peersResponse.response = [[NSHTTPURLResponse alloc] initWithURL:nifiUrl statusCode:500L HTTPVersion:@"1.1" headerFields:@{}];
+    MockDelayedURLSession *peersURLSession = [[MockDelayedURLSession alloc] initWithResponse:peersResponse];
+    peersURLSession.delay = 2.0;
+    [[client clusterClients][0] setUrlSession:peersURLSession];
+    
+    MockResponse *transactionResponse = [[MockResponse alloc] init];
+    NSString *transactionURL = [NSString stringWithFormat:@"http://%@:8080/nifi-api/data-transfer/input-ports/%@/transactions/8966b23c-1495-4c9e-9050-c0a2306122ce", host, s2sConfig.portId];
+    transactionResponse.response = [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:transactionURL]
+                                                               statusCode:201L
+                                                              HTTPVersion:@"1.1"
+                                                             headerFields:@{ @"Content-Type": @"application/json",
+                                                                             @"Location": transactionURL,
+                                                                             @"x-location-uri-intent": @"transaction-url",
+                                                                             @"x-nifi-site-to-site-protocol-version": @"1",
+                                                                             @"x-nifi-site-to-site-server-transaction-ttl": @"30" }];
+    transactionResponse.data = [@"{\"flowFileSent\":0,\"responseCode\":1,\"message\":\"A transaction is created\"}" dataUsingEncoding:NSUTF8StringEncoding];
+    MockURLSession *transactionURLSession = [[MockURLSession alloc] initWithResponse:transactionResponse];
+    
+    // a transaction is created from the initial peer list while the refresh is in flight
+    NSDate *start = [NSDate date];
+    XCTAssertNotNil([client createTransactionWithURLSession:transactionURLSession]);
+    XCTAssertNotNil([client createTransactionWithURLSession:transactionURLSession]);
+    XCTAssertLessThan([[NSDate date] timeIntervalSinceDate:start], 1.0);
+    XCTAssertTrue([[client clusterClients][0] isPeerUpdateInFlight]);
+    
+    // the refresh request is sent from a background queue, so it may not have been sent yet
+    NSPredicate *refreshSent = [NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return peersURLSession.requestCount == 1;
+    }];
+    [self expectationForPredicate:refreshSent evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:1.0 handler:nil];
+    XCTAssertEqual(1, peersURLSession.requestCount);
+    
+    // once the refresh has failed, it is not retried before peerUpdateRetryInterval, and transactions still do not wait
+    NSPredicate *refreshFinished = [NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return ![[client clusterClients][0] isPeerUpdateInFlight];
+    }];
+    [self expectationForPredicate:refreshFinished evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    start = [NSDate date];
+    XCTAssertNotNil([client createTransactionWithURLSession:transactionURLSession]);
+    XCTAssertLessThan([[NSDate date] timeIntervalSinceDate:start], 1.0);
+    XCTAssertEqual(1, peersURLSession.requestCount);
+}
+
 @end
@@ -18,6 +18,53 @@
 #import <Foundation/Foundation.h>
 #import <XCTest/XCTest.h>
 #import "NiFiSiteToSiteDatabaseFMDB.h"
+#import "NiFiDataPacket.h"
+#import "NiFiError.h"
+
+
+/* Fails inserts of poisoned entities, or of every entity while failAllWrites is set */
+@interface FailingFMDBSiteToSiteDatabase : NiFiFMDBSiteToSiteDatabase
+@property (atomic) BOOL failAllWrites;
+@property (atomic, nonnull) NSMutableSet *poisonedEntities;
+@end
+
+@implementation FailingFMDBSiteToSiteDatabase
+
+- (nullable instancetype)initWithPersistenceType:(FMDBPersistenceType)persistenceType {
+    self = [super initWithPersistenceType:persistenceType];
+    if (self) {
+        _failAllWrites = NO;
+        _poisonedEntities = [NSMutableSet set];
+    }
+    return self;
+}
+
+- (BOOL)shouldFailEntities:(NSArray *)entities error:(NSError *_Nullable *_Nullable)error {
+    BOOL shouldFail = self.failAllWrites;
+    @synchronized(self.poisonedEntities) {
+        for (id entity in entities) {
+            shouldFail = shouldFail || [self.poisonedEntities containsObject:entity];
+        }
+    }
+    if (shouldFail && error) {
+        *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteDatabaseWriteFailed userInfo:nil];
+    }
+    return shouldFail;
+}
+
+- (void)insertQueuedDataPacket:(NiFiQueuedDataPacketEntity *)entity error:(NSError *_Nullable *_Nullable)error {
+    if (![self shouldFailEntities:@[entity] error:error]) {
+        [super insertQueuedDataPacket:entity error:error];
+    }
+}
+
+- (void)insertQueuedDataPackets:(NSArray *)entities error:(NSError *_Nullable *_Nullable)error {
+    if (![self shouldFailEntities:entities error:error]) {
+        [super insertQueuedDataPackets:entities error:error];
+    }
+}
+
+@end
 
 
 @interface NiFiSiteToSiteDatabaseTests : XCTestCase
@@ -162,6 +209,73 @@
     XCTAssertEqual(1, [_db countQueuedDataPacketsOrError:nil]);
 }
 
+- (void)testDatabaseQueueSummaryTracksInsertsAndDeletes {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    
+    NSUInteger expectedSize = 0;
+    NSMutableArray *entities = [NSMutableArray array];
+    for (int i = 1; i <= 10; i++) {
+        NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"} data:[NSMutableData dataWithLength:i * 10]];
+        NiFiQueuedDataPacketEntity *entity = [NiFiQueuedDataPacketEntity entityWithDataPacket:packet packetPrioritizer:prioritizer error:nil];
+        expectedSize += [entity.estimatedSize unsignedIntegerValue];
+        [entities addObject:entity];
+    }
+    [_db insertQueuedDataPackets:entities error:nil];
+    XCTAssertEqual(10, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(expectedSize, [_db sumSizeQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(expectedSize / 10, [_db averageSizeQueuedDataPacketsOrError:nil]);
+    
+    // claiming and releasing packets does not change the totals
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [_db createBatchWithTransactionId:transactionId countLimit:4 byteSizeLimit:0 error:nil];
+    [_db markPacketsForRetryWithTransactionId:transactionId];
+    XCTAssertEqual(10, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(expectedSize, [_db sumSizeQueuedDataPacketsOrError:nil]);
+    
+    // deleting sent packets reduces the totals
+    [_db createBatchWithTransactionId:transactionId countLimit:4 byteSizeLimit:0 error:nil];
+    for (NiFiQueuedDataPacketEntity *entity in [_db getPacketsWithTransactionId:transactionId]) {
+        expectedSize -= [entity.estimatedSize unsignedIntegerValue];
+    }
+    [_db deletePacketsWithTransactionId:transactionId];
+    XCTAssertEqual(6, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(expectedSize, [_db sumSizeQueuedDataPacketsOrError:nil]);
+    
+    // truncation reduces the totals
+    [_db truncateQueuedDataPacketsMaxRows:2 error:nil];
+    XCTAssertEqual(2, [_db countQueuedDataPacketsOrError:nil]);
+    expectedSize = 0;
+    [_db createBatchWithTransactionId:transactionId countLimit:0 byteSizeLimit:0 error:nil];
+    for (NiFiQueuedDataPacketEntity *entity in [_db getPacketsWithTransactionId:transactionId]) {
+        expectedSize += [entity.estimatedSize unsignedIntegerValue];
+    }
+    XCTAssertEqual(expectedSize, [_db sumSizeQueuedDataPacketsOrError:nil]);
+    
+    [_db deletePacketsWithTransactionId:transactionId];
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(0, [_db sumSizeQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(0, [_db averageSizeQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testPerformanceQueueSummaryWithDeepQueue {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:120.0];
+    
+    NSMutableArray *entities = [NSMutableArray array];
+    for (int i = 1; i <= 100000; i++) {
+        NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"}
+                                                                     data:[@"Test Data" dataUsingEncoding:NSUTF8StringEncoding]];
+        [entities addObject:[NiFiQueuedDataPacketEntity entityWithDataPacket:packet packetPrioritizer:prioritizer error:nil]];
+    }
+    [_db insertQueuedDataPackets:entities error:nil];
+    
+    [self measureBlock:^{
+        for (int i = 0; i < 1000; i++) {
+            [self.db countQueuedDataPacketsOrError:nil];
+            [self.db sumSizeQueuedDataPacketsOrError:nil];
+        }
+    }];
+}
+
 - (void)testDatabaseTransactionBatchingCount {
     NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
     
@@ -268,8 +382,61 @@
     XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
 }
 
+- (void)testDatabaseTransactionBatchingMixedSizes {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    
+    NSMutableArray<NSNumber *> *entitySizes = [NSMutableArray array];
+    for (int i = 1; i <= 10; i++) {
+        NSMutableData *data = [NSMutableData dataWithLength:(i % 2 ? 10 : 1000)];
+        NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"} data:data];
+        NiFiQueuedDataPacketEntity *entity = [NiFiQueuedDataPacketEntity entityWithDataPacket:packet packetPrioritizer:prioritizer error:nil];
+        [entitySizes addObject:entity.estimatedSize];
+        [_db insertQueuedDataPacket:entity error:nil];
+    }
+    
+    // the packet that crosses the size limit is included in the batch
+    NSString *transactionId1 = @"12345678-1234-1234-1234-123456789abc";
+    NSUInteger sizeLimit = [entitySizes[0] unsignedIntegerValue] + 1;
+    [_db createBatchWithTransactionId:transactionId1 countLimit:0 byteSizeLimit:sizeLimit error:nil];
+    XCTAssertEqual(2, [[_db getPacketsWithTransactionId:transactionId1] count]);
+    
+    // the count limit applies when it is reached before the size limit
+    NSString *transactionId2 = @"22345678-1234-1234-1234-123456789abd";
+    [_db createBatchWithTransactionId:transactionId2 countLimit:3 byteSizeLimit:INT_MAX error:nil];
+    XCTAssertEqual(3, [[_db getPacketsWithTransactionId:transactionId2] count]);
+    
+    // the size limit applies when it is reached before the count limit
+    NSString *transactionId3 = @"32345678-1234-1234-1234-123456789abe";
+    sizeLimit = [entitySizes[5] unsignedIntegerValue] + [entitySizes[6] unsignedIntegerValue];
+    [_db createBatchWithTransactionId:transactionId3 countLimit:5 byteSizeLimit:sizeLimit error:nil];
+    XCTAssertEqual(2, [[_db getPacketsWithTransactionId:transactionId3] count]);
+    
+    XCTAssertEqual(10, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testPerformanceCreateBatchWithLargePackets {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:120.0];
+    
+    NSMutableArray *entities = [NSMutableArray array];
+    for (int i = 1; i <= 2000; i++) {
+        NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"}
+                                                                     data:[NSMutableData dataWithLength:64 * 1024]];
+        [entities addObject:[NiFiQueuedDataPacketEntity entityWithDataPacket:packet packetPrioritizer:prioritizer error:nil]];
+    }
+    [_db insertQueuedDataPackets:entities error:nil];
+    
+    // claim and release small batches from the front of a deep queue of large packets
+    [self measureBlock:^{
+        for (int i = 0; i < 100; i++) {
+            NSString *transactionId = [[NSUUID UUID] UUIDString];
+            [self.db createBatchWithTransactionId:transactionId countLimit:100 byteSizeLimit:1024 * 1024 error:nil];
+            [self.db markPacketsForRetryWithTransactionId:transactionId];
+        }
+    }];
+}
+
 - (void)testDatabaseLargeTransaction {
-    int largePacketCount = 10000; // purposefully set to something much larger than NiFiFMDBSiteToSiteDatabase's DATABASE_BATCH_SIZE
+    int largePacketCount = 10000; // purposefully set to something much larger than a typical batch
     
     NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:120.0];
     
@@ -290,6 +457,403 @@
 }
     
 
+- (void)testDatabaseEnumeratePacketsAcrossPages {
+    // several pages worth of packets, with ties on priority and created time so that every part of the sort order is used to page
+    NSMutableArray *entities = [NSMutableArray array];
+    for (int i = 0; i < 150; i++) {
+        NiFiQueuedDataPacketEntity *entity = [self testEntity];
+        entity.priority = @(i % 3);
+        entity.createdAtMillisSinceReferenceDate = @(i % 2);
+        [entities addObject:entity];
+    }
+    [_db insertQueuedDataPackets:entities error:nil];
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [_db createBatchWithTransactionId:transactionId countLimit:140 byteSizeLimit:0 error:nil];
+    
+    NSMutableArray *enumeratedPacketIds = [NSMutableArray array];
+    NSError *error = nil;
+    BOOL success = [_db enumeratePacketsWithTransactionId:transactionId usingBlock:^(NiFiQueuedDataPacketEntity *entity) {
+        XCTAssertNotNil([entity dataPacket]);
+        [enumeratedPacketIds addObject:entity.packetId];
+    } error:&error];
+    XCTAssertTrue(success);
+    XCTAssertNil(error);
+    XCTAssertEqualObjects([[_db getPacketsWithTransactionId:transactionId] valueForKey:@"packetId"], enumeratedPacketIds);
+    XCTAssertEqual(140, [enumeratedPacketIds count]);
+}
+
+- (NiFiQueuedDataPacketEntity *)testEntity {
+    NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"}
+                                                                 data:[@"Test Data" dataUsingEncoding:NSUTF8StringEncoding]];
+    return [NiFiQueuedDataPacketEntity entityWithDataPacket:packet
+                                          packetPrioritizer:[NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0]
+                                                      error:nil];
+}
+
+- (void)testBufferedDatabaseStagesUntilFlush {
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:_db
+                                                                                         durabilityWindow:60.0
+                                                                                   groupCommitPacketCount:100];
+    NiFiQueuedDataPacketEntity *entity = [self testEntity];
+    for (int i = 0; i < 10; i++) {
+        [bufferedDb insertQueuedDataPacket:entity error:nil];
+    }
+    
+    // staged packets are counted, but not yet written
+    XCTAssertEqual(10, [bufferedDb stagedPacketCount]);
+    XCTAssertEqual(10, [bufferedDb countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(10 * [entity.estimatedSize unsignedIntegerValue], [bufferedDb sumSizeQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+    
+    NSError *error = nil;
+    [bufferedDb flushOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(0, [bufferedDb stagedPacketCount]);
+    XCTAssertEqual(10, [bufferedDb countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(10, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testBufferedDatabaseBatchingFlushesFirst {
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:_db
+                                                                                         durabilityWindow:60.0
+                                                                                   groupCommitPacketCount:100];
+    for (int i = 0; i < 10; i++) {
+        [bufferedDb insertQueuedDataPacket:[self testEntity] error:nil];
+    }
+    
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [bufferedDb createBatchWithTransactionId:transactionId countLimit:5 byteSizeLimit:0 error:nil];
+    XCTAssertEqual(0, [bufferedDb stagedPacketCount]);
+    XCTAssertEqual(5, [[bufferedDb getPacketsWithTransactionId:transactionId] count]);
+    
+    [bufferedDb deletePacketsWithTransactionId:transactionId];
+    XCTAssertEqual(5, [bufferedDb countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testBufferedDatabaseGroupCommitTriggers {
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:_db
+                                                                                         durabilityWindow:0.2
+                                                                                   groupCommitPacketCount:10];
+    
+    // reaching the group commit count triggers a commit without waiting for the durability window
+    NSMutableArray *entities = [NSMutableArray array];
+    for (int i = 0; i < 10; i++) {
+        [entities addObject:[self testEntity]];
+    }
+    [bufferedDb insertQueuedDataPackets:entities error:nil];
+    NSPredicate *committed = [NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return [self.db countQueuedDataPacketsOrError:nil] == 10;
+    }];
+    [self expectationForPredicate:committed evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:0.1 handler:nil];
+    
+    // fewer packets are committed once the durability window has passed
+    [bufferedDb insertQueuedDataPacket:[self testEntity] error:nil];
+    XCTAssertEqual(1, [bufferedDb stagedPacketCount]);
+    NSPredicate *committedAfterWindow = [NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return [self.db countQueuedDataPacketsOrError:nil] == 11;
+    }];
+    [self expectationForPredicate:committedAfterWindow evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:2.0 handler:nil];
+    XCTAssertEqual(0, [bufferedDb stagedPacketCount]);
+}
+
+- (void)testBufferedDatabaseRetriesFailedWrite {
+    FailingFMDBSiteToSiteDatabase *failingDb = [[FailingFMDBSiteToSiteDatabase alloc] initWithPersistenceType:PERSISTENT_TEMPORARY];
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:failingDb
+                                                                                         durabilityWindow:0.2
+                                                                                   groupCommitPacketCount:10];
+    failingDb.failAllWrites = YES;
+    for (int i = 0; i < 5; i++) {
+        [bufferedDb insertQueuedDataPacket:[self testEntity] error:nil];
+    }
+    NSError *error = nil;
+    [bufferedDb flushOrError:&error];
+    XCTAssertNotNil(error);
+    XCTAssertEqual(5, [bufferedDb stagedPacketCount]);
+    
+    // packets left staged by a failed write are retried after the durability window, without further inserts
+    failingDb.failAllWrites = NO;
+    NSPredicate *committed = [NSPredicate predicateWithBlock:^BOOL(id object, NSDictionary *bindings) {
+        return [failingDb countQueuedDataPacketsOrError:nil] == 5;
+    }];
+    [self expectationForPredicate:committed evaluatedWithObject:self handler:nil];
+    [self waitForExpectationsWithTimeout:2.0 handler:nil];
+    XCTAssertEqual(0, [bufferedDb stagedPacketCount]);
+}
+
+- (void)testBufferedDatabasePoisonedEntityFailsAlone {
+    FailingFMDBSiteToSiteDatabase *failingDb = [[FailingFMDBSiteToSiteDatabase alloc] initWithPersistenceType:PERSISTENT_TEMPORARY];
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:failingDb
+                                                                                         durabilityWindow:60.0
+                                                                                   groupCommitPacketCount:100];
+    NiFiQueuedDataPacketEntity *poisonedEntity = [self testEntity];
+    [failingDb.poisonedEntities addObject:poisonedEntity];
+    [bufferedDb insertQueuedDataPacket:[self testEntity] error:nil];
+    [bufferedDb insertQueuedDataPacket:poisonedEntity error:nil];
+    [bufferedDb insertQueuedDataPacket:[self testEntity] error:nil];
+    
+    // the other packets are written, and the poisoned one is dropped instead of failing every later flush
+    NSError *error = nil;
+    [bufferedDb flushOrError:&error];
+    XCTAssertNotNil(error);
+    XCTAssertEqual(0, [bufferedDb stagedPacketCount]);
+    XCTAssertEqual(2, [failingDb countQueuedDataPacketsOrError:nil]);
+    
+    error = nil;
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [bufferedDb createBatchWithTransactionId:transactionId countLimit:5 byteSizeLimit:0 error:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(2, [[bufferedDb getPacketsWithTransactionId:transactionId] count]);
+}
+
+- (void)measureInsertSinglePacketsWithDatabase:(NiFiSiteToSiteDatabase *)db {
+    NiFiQueuedDataPacketEntity *entity = [self testEntity];
+    [self measureBlock:^{
+        for (int i = 0; i < 1000; i++) {
+            [db insertQueuedDataPacket:entity error:nil];
+        }
+        [db flushOrError:nil];
+    }];
+}
+
+- (void)testPerformanceInsertSinglePacketsWriteThrough {
+    [self measureInsertSinglePacketsWithDatabase:_db];
+}
+
+- (void)testPerformanceInsertSinglePacketsGroupCommit {
+    NiFiBufferedSiteToSiteDatabase *bufferedDb = [[NiFiBufferedSiteToSiteDatabase alloc] initWithDatabase:_db
+                                                                                         durabilityWindow:0.1
+                                                                                   groupCommitPacketCount:500];
+    [self measureInsertSinglePacketsWithDatabase:bufferedDb];
+}
+
+/* Removes a database file along with its WAL sidecars, so a WAL left by an earlier run can't satisfy assertions */
+- (void)removeDatabaseFilesAtPath:(NSString *)path {
+    for (NSString *suffix in @[@"", @"-wal", @"-shm"]) {
+        [[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:suffix] error:nil];
+    }
+}
+
+- (void)testDatabaseProfilePragmas {
+    NSString *testDbPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nifi_sitetosite_profile_test.db"];
+    [self removeDatabaseFilesAtPath:testDbPath];
+    NiFiSiteToSiteDatabase *db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithDatabaseFilePath:testDbPath
+                                                                                     profile:[NiFiFMDBDatabaseProfile defaultProfile]];
+    XCTAssertNotNil(db);
+    
+    // the database works as usual with WAL and cached statements
+    for (int i = 0; i < 10; i++) {
+        [db insertQueuedDataPacket:[self testEntity] error:nil];
+    }
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [db createBatchWithTransactionId:transactionId countLimit:5 byteSizeLimit:0 error:nil];
+    [db deletePacketsWithTransactionId:transactionId];
+    XCTAssertEqual(5, [db countQueuedDataPacketsOrError:nil]);
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[testDbPath stringByAppendingString:@"-wal"]]);
+    
+    db = nil;
+    [self removeDatabaseFilesAtPath:testDbPath];
+}
+
+/* Enqueue and drain throughput against an on-disk database opened with the given profile */
+- (void)measureEnqueueAndDrainWithProfile:(NiFiFMDBDatabaseProfile *)profile {
+    NSString *testDbPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nifi_sitetosite_profile_benchmark.db"];
+    [self removeDatabaseFilesAtPath:testDbPath];
+    NiFiSiteToSiteDatabase *db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithDatabaseFilePath:testDbPath profile:profile];
+    NiFiQueuedDataPacketEntity *entity = [self testEntity];
+    
+    [self measureBlock:^{
+        // enqueue: one transaction per packet, as with write-through enqueues
+        for (int i = 0; i < 500; i++) {
+            [db insertQueuedDataPacket:entity error:nil];
+        }
+        // drain: claim, read and delete batches until the queue is empty
+        while ([db countQueuedDataPacketsOrError:nil] > 0) {
+            NSString *transactionId = [[NSUUID UUID] UUIDString];
+            [db createBatchWithTransactionId:transactionId countLimit:25 byteSizeLimit:0 error:nil];
+            [db getPacketsWithTransactionId:transactionId];
+            [db deletePacketsWithTransactionId:transactionId];
+        }
+    }];
+    
+    db = nil;
+    [self removeDatabaseFilesAtPath:testDbPath];
+}
+
+- (void)testPerformanceEnqueueAndDrainLegacyProfile {
+    [self measureEnqueueAndDrainWithProfile:[NiFiFMDBDatabaseProfile legacyProfile]];
+}
+
+- (void)testPerformanceEnqueueAndDrainDefaultProfile {
+    [self measureEnqueueAndDrainWithProfile:[NiFiFMDBDatabaseProfile defaultProfile]];
+}
+
+- (void)testDatabaseExternalContentStore {
+    NSString *testDbPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nifi_sitetosite_content_test.db"];
+    NSString *contentStorePath = [testDbPath stringByAppendingString:@"-content"];
+    NiFiSiteToSiteDatabase *db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithDatabaseFilePath:testDbPath];
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    
+    NSMutableData *largeContent = [NSMutableData dataWithLength:256 * 1024];
+    ((uint8_t *)largeContent.mutableBytes)[0] = 42;
+    NiFiDataPacket *largePacket = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"} data:largeContent];
+    NiFiDataPacket *smallPacket = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"}
+                                                                      data:[@"Test Data" dataUsingEncoding:NSUTF8StringEncoding]];
+    
+    // two packets with the same large content share one stored file; small content stays in the database
+    NSString *transactionId1 = @"12345678-1234-1234-1234-123456789abc";
+    NSString *transactionId2 = @"22345678-1234-1234-1234-123456789abd";
+    [db insertQueuedDataPacket:[NiFiQueuedDataPacketEntity entityWithDataPacket:largePacket packetPrioritizer:prioritizer error:nil] error:nil];
+    [db insertQueuedDataPacket:[NiFiQueuedDataPacketEntity entityWithDataPacket:smallPacket packetPrioritizer:prioritizer error:nil] error:nil];
+    [db createBatchWithTransactionId:transactionId1 countLimit:0 byteSizeLimit:0 error:nil];
+    [db insertQueuedDataPacket:[NiFiQueuedDataPacketEntity entityWithDataPacket:largePacket packetPrioritizer:prioritizer error:nil] error:nil];
+    [db createBatchWithTransactionId:transactionId2 countLimit:0 byteSizeLimit:0 error:nil];
+    XCTAssertEqual(1, [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:contentStorePath error:nil] count]);
+    
+    NSArray<NiFiQueuedDataPacketEntity *> *transaction1Packets = [db getPacketsWithTransactionId:transactionId1];
+    XCTAssertEqual(2, [transaction1Packets count]);
+    NSUInteger externalCount = 0;
+    for (NiFiQueuedDataPacketEntity *entity in transaction1Packets) {
+        if (entity.contentRef) {
+            externalCount++;
+            XCTAssertEqualObjects(largeContent, [entity dataPacket].data);
+        } else {
+            XCTAssertEqualObjects(smallPacket.data, [entity dataPacket].data);
+        }
+    }
+    XCTAssertEqual(1, externalCount);
+    
+    // the stored file is removed only once no queued packet references it
+    [db deletePacketsWithTransactionId:transactionId1];
+    XCTAssertEqual(1, [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:contentStorePath error:nil] count]);
+    XCTAssertEqualObjects(largeContent, [[db getPacketsWithTransactionId:transactionId2][0] dataPacket].data);
+    [db deletePacketsWithTransactionId:transactionId2];
+    XCTAssertEqual(0, [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:contentStorePath error:nil] count]);
+    
+    db = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:testDbPath error:nil];
+    [[NSFileManager defaultManager] removeItemAtPath:contentStorePath error:nil];
+}
+
+- (void)testDatabaseExternalContentMissingOrOrphaned {
+    NSString *testDbPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nifi_sitetosite_content_missing_test.db"];
+    NSString *contentStorePath = [testDbPath stringByAppendingString:@"-content"];
+    [self removeDatabaseFilesAtPath:testDbPath];
+    [[NSFileManager defaultManager] removeItemAtPath:contentStorePath error:nil];
+    NiFiSiteToSiteDatabase *db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithDatabaseFilePath:testDbPath];
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    NiFiDataPacket *largePacket = [NiFiDataPacket dataPacketWithAttributes:@{ @"key": @"value"}
+                                                                      data:[NSMutableData dataWithLength:256 * 1024]];
+    [db insertQueuedDataPacket:[NiFiQueuedDataPacketEntity entityWithDataPacket:largePacket packetPrioritizer:prioritizer error:nil] error:nil];
+    NSArray<NSString *> *contentRefs = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:contentStorePath error:nil];
+    XCTAssertEqual(1, [contentRefs count]);
+    
+    // content without a row, e.g., left by a crash before the insert committed, is removed when the database is opened
+    NSString *orphanedContentPath = [contentStorePath stringByAppendingPathComponent:@"orphaned"];
+    [[@"Orphaned Data" dataUsingEncoding:NSUTF8StringEncoding] writeToFile:orphanedContentPath atomically:YES];
+    db = nil;
+    db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithDatabaseFilePath:testDbPath];
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:orphanedContentPath]);
+    XCTAssertEqualObjects(contentRefs, [[NSFileManager defaultManager] contentsOfDirectoryAtPath:contentStorePath error:nil]);
+    
+    // a packet whose content is missing fails the batch instead of being sent empty, and is removed so later batches can proceed
+    [[NSFileManager defaultManager] removeItemAtPath:[contentStorePath stringByAppendingPathComponent:contentRefs[0]] error:nil];
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [db createBatchWithTransactionId:transactionId countLimit:0 byteSizeLimit:0 error:nil];
+    __block NSUInteger enumeratedCount = 0;
+    NSError *error = nil;
+    BOOL success = [db enumeratePacketsWithTransactionId:transactionId usingBlock:^(NiFiQueuedDataPacketEntity *entity) {
+        enumeratedCount++;
+    } error:&error];
+    XCTAssertFalse(success);
+    XCTAssertNotNil(error);
+    XCTAssertEqual(0, enumeratedCount);
+    XCTAssertEqual(0, [db countQueuedDataPacketsOrError:nil]);
+    
+    db = nil;
+    [self removeDatabaseFilesAtPath:testDbPath];
+    [[NSFileManager defaultManager] removeItemAtPath:contentStorePath error:nil];
+}
+
+- (void)testDatabaseEncodedDataPackets {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:@{ @"key1": @"value1"}
+                                                                 data:[@"Test Data" dataUsingEncoding:NSUTF8StringEncoding]];
+    
+    NiFiQueuedDataPacketEntity *encodedEntity = [NiFiQueuedDataPacketEntity entityWithDataPacket:packet
+                                                                               packetPrioritizer:prioritizer
+                                                                                         encoded:YES
+                                                                                           error:nil];
+    XCTAssertNil(encodedEntity.attributes);
+    XCTAssertNotNil(encodedEntity.encodedCrc);
+    XCTAssertEqual(encodedEntity.content.length, [encodedEntity.estimatedSize unsignedIntegerValue]);
+    
+    // encoded and JSON rows can be queued side by side
+    [_db insertQueuedDataPacket:encodedEntity error:nil];
+    [_db insertQueuedDataPacket:[NiFiQueuedDataPacketEntity entityWithDataPacket:packet packetPrioritizer:prioritizer error:nil] error:nil];
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [_db createBatchWithTransactionId:transactionId countLimit:0 byteSizeLimit:0 error:nil];
+    NSArray<NiFiQueuedDataPacketEntity *> *packets = [_db getPacketsWithTransactionId:transactionId];
+    XCTAssertEqual(2, [packets count]);
+    
+    NSUInteger encodedCount = 0;
+    for (NiFiQueuedDataPacketEntity *entity in packets) {
+        if (entity.encodedCrc) {
+            encodedCount++;
+            XCTAssertEqualObjects(encodedEntity.encodedCrc, entity.encodedCrc);
+            XCTAssertEqualObjects(encodedEntity.content, entity.content);
+        }
+        // either way, the packet can still be read back
+        XCTAssertEqualObjects(packet.attributes, [entity dataPacket].attributes);
+        XCTAssertEqualObjects(packet.data, [entity dataPacket].data);
+    }
+    XCTAssertEqual(1, encodedCount);
+}
+
+/* Reads a claimed batch and encodes it for sending, with packets queued either as JSON attributes or pre-encoded */
+- (void)measureReadAndEncodeBatchWithEncodedEntities:(BOOL)encoded {
+    NSObject <NiFiDataPacketPrioritizer> *prioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    NSMutableDictionary *attributes = [NSMutableDictionary dictionary];
+    for (int i = 0; i < 10; i++) {
+        attributes[[NSString stringWithFormat:@"attribute.%d", i]] = [[NSUUID UUID] UUIDString];
+    }
+    NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithAttributes:attributes data:[NSMutableData dataWithLength:1024]];
+    NiFiQueuedDataPacketEntity *entity = [NiFiQueuedDataPacketEntity entityWithDataPacket:packet
+                                                                        packetPrioritizer:prioritizer
+                                                                                  encoded:encoded
+                                                                                    error:nil];
+    NSMutableArray *entities = [NSMutableArray arrayWithCapacity:1000];
+    for (int i = 0; i < 1000; i++) {
+        [entities addObject:entity];
+    }
+    [_db insertQueuedDataPackets:entities error:nil];
+    NSString *transactionId = @"12345678-1234-1234-1234-123456789abc";
+    [_db createBatchWithTransactionId:transactionId countLimit:0 byteSizeLimit:0 error:nil];
+    
+    [self measureBlock:^{
+        NiFiDataPacketEncoder *encoder = [[NiFiDataPacketEncoder alloc] init];
+        for (NiFiQueuedDataPacketEntity *queuedEntity in [self.db getPacketsWithTransactionId:transactionId]) {
+            if (queuedEntity.encodedCrc) {
+                [encoder appendEncodedData:queuedEntity.content
+                               crcChecksum:(uint32_t)[queuedEntity.encodedCrc unsignedIntValue]
+                           dataPacketCount:1];
+            } else {
+                [encoder appendDataPacket:[queuedEntity dataPacket]];
+            }
+        }
+        XCTAssertEqual(1000, [encoder getDataPacketCount]);
+    }];
+}
+
+- (void)testPerformanceReadAndEncodeBatchJSONEntities {
+    [self measureReadAndEncodeBatchWithEncodedEntities:NO];
+}
+
+- (void)testPerformanceReadAndEncodeBatchEncodedEntities {
+    [self measureReadAndEncodeBatchWithEncodedEntities:YES];
+}
+
 - (void)testDatabaseMultiHandle {
     NSString *testDbPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"nifi_sitetosite_test.db"];
     
@@ -0,0 +1,414 @@
+/*
+ * Copyright 2017 Hortonworks, Inc.
+ * All rights reserved.
+ *
+ *   Hortonworks, Inc. licenses this file to you under the Apache License, Version 2.0
+ *   (the "License"); you may not use this file except in compliance with
+ *   the License. You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ *
+ * See the associated NOTICE file for additional information regarding copyright ownership.
+ */
+
+#import <Foundation/Foundation.h>
+#import <XCTest/XCTest.h>
+#import "NiFiSiteToSiteService.h"
+#import "NiFiSiteToSiteTransaction.h"
+#import "NiFiSiteToSiteDatabaseFMDB.h"
+#import "NiFiError.h"
+
+
+// MARK: - Stub cluster
+
+/* A transaction that accepts every packet, taking a fixed time to confirm to simulate a round trip to a NiFi node. */
+@interface StubTransaction : NSObject <NiFiTransaction>
+@property (nonatomic, retain) NSString *transactionId;
+@property (nonatomic) NiFiTransactionState transactionState;
+@property (nonatomic) NSTimeInterval latency;
+@property (nonatomic) uint64_t dataPacketCount;
+@property (nonatomic) BOOL fails; // if YES, confirming fails as if the peer could not be reached
+@end
+
+@implementation StubTransaction
+
+- (instancetype)initWithLatency:(NSTimeInterval)latency {
+    self = [super init];
+    if (self) {
+        _transactionId = [[NSUUID UUID] UUIDString];
+        _transactionState = TRANSACTION_STARTED;
+        _latency = latency;
+        _dataPacketCount = 0;
+    }
+    return self;
+}
+
+- (void)sendData:(nonnull NiFiDataPacket *)data {
+    _dataPacketCount++;
+    _transactionState = DATA_EXCHANGED;
+}
+
+- (void)cancel {
+    _transactionState = TRANSACTION_CANCELED;
+}
+
+- (void)error {
+    _transactionState = TRANSACTION_ERROR;
+}
+
+- (nullable NiFiTransactionResult *)confirmAndCompleteOrError:(NSError *_Nullable *_Nullable)error {
+    [NSThread sleepForTimeInterval:_latency];
+    if (_fails) {
+        _transactionState = TRANSACTION_ERROR;
+        if (error) {
+            *error = [NSError errorWithDomain:NiFiErrorDomain code:NiFiErrorSiteToSiteTransaction userInfo:nil];
+        }
+        return nil;
+    }
+    _transactionState = TRANSACTION_COMPLETED;
+    return [[NiFiTransactionResult alloc] initWithResponseCode:TRANSACTION_FINISHED
+                                        dataPacketsTransferred:_dataPacketCount
+                                                       message:nil
+                                                      duration:_latency];
+}
+
+- (nullable NiFiPeer *)getPeer {
+    return nil;
+}
+
+@end
+
+
+@interface StubSiteToSiteClient : NiFiSiteToSiteClient
+@property (nonatomic) NSTimeInterval transactionLatency;
+@property (atomic) NSUInteger transactionCount;
+@property (atomic) BOOL backingOff; // simulates every peer reporting its destination is full
+@property (atomic) BOOL failTransactions;
+@end
+
+@implementation StubSiteToSiteClient
+
+- (nullable NSObject <NiFiTransaction> *)createTransaction {
+    if (self.backingOff) {
+        return nil;
+    }
+    @synchronized(self) {
+        self.transactionCount++;
+    }
+    StubTransaction *transaction = [[StubTransaction alloc] initWithLatency:_transactionLatency];
+    transaction.fails = self.failTransactions;
+    return transaction;
+}
+
+- (BOOL)isBackingOff {
+    return self.backingOff;
+}
+
+@end
+
+
+// MARK: - NiFiQueuedSiteToSiteClient expose private interface methods for testing
+
+@interface NiFiQueuedSiteToSiteClient()
+@property NiFiQueuedSiteToSiteClientConfig *config;
+@property (nonatomic, nullable) NiFiSiteToSiteClient *siteToSiteClient;
+- (nullable instancetype)initWithConfig:(nonnull NiFiQueuedSiteToSiteClientConfig *)config
+                               database:(nonnull NiFiSiteToSiteDatabase *)database;
+@end
+
+
+// MARK: - NiFiSiteToSiteServiceTests
+
+@interface NiFiSiteToSiteServiceTests : XCTestCase
+@property NiFiSiteToSiteDatabase *db;
+@end
+
+@implementation NiFiSiteToSiteServiceTests
+
+- (void)setUp {
+    [super setUp];
+    _db = [[NiFiFMDBSiteToSiteDatabase alloc] initWithPersistenceType:PERSISTENT_TEMPORARY];
+}
+
+- (void)tearDown {
+    _db = nil; // will clear the underlying FMDB temporary database, which is deleted at dealloc
+    [super tearDown];
+}
+
+- (NiFiQueuedSiteToSiteClient *)queuedClientWithWorkerCount:(NSUInteger)workerCount
+                                                 stubClient:(StubSiteToSiteClient *)stubClient {
+    NiFiQueuedSiteToSiteClientConfig *config = [[NiFiQueuedSiteToSiteClientConfig alloc] init];
+    config.preferredBatchCount = @10;
+    config.drainWorkerCount = @(workerCount);
+    config.dataPacketPrioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    NiFiQueuedSiteToSiteClient *queuedClient = [[NiFiQueuedSiteToSiteClient alloc] initWithConfig:config database:_db];
+    queuedClient.siteToSiteClient = stubClient;
+    return queuedClient;
+}
+
+- (void)enqueuePacketCount:(NSUInteger)count withClient:(NiFiQueuedSiteToSiteClient *)queuedClient {
+    NSMutableArray *packets = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) {
+        [packets addObject:[NiFiDataPacket dataPacketWithString:[NSString stringWithFormat:@"Data Packet %lu", (unsigned long)i]]];
+    }
+    [queuedClient enqueueDataPackets:packets error:nil];
+}
+
+- (void)testProcessSingleWorkerSendsOneBatch {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    [self enqueuePacketCount:25 withClient:queuedClient];
+
+    NSError *error = nil;
+    [queuedClient processOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(1, stubClient.transactionCount);
+    XCTAssertEqual(15, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testProcessParallelWorkersSendOneBatchEach {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:4 stubClient:stubClient];
+    [self enqueuePacketCount:95 withClient:queuedClient];
+
+    NSError *error = nil;
+    [queuedClient processOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(4, stubClient.transactionCount);
+    XCTAssertEqual(55, [_db countQueuedDataPacketsOrError:nil]);
+    
+    for (int i = 0; i < 2; i++) {
+        [queuedClient processOrError:&error];
+        XCTAssertNil(error);
+    }
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertGreaterThanOrEqual(stubClient.transactionCount, 10); // 10 batches, plus any that found the queue empty
+}
+
+- (void)testProcessEncodedDataPackets {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    queuedClient.config.storeEncodedDataPackets = @YES;
+    [self enqueuePacketCount:5 withClient:queuedClient];
+    
+    // the stub transaction only takes data packets, so the stored bytes are decoded for it
+    NSError *error = nil;
+    [queuedClient processOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(1, stubClient.transactionCount);
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testProcessPausesWhileEveryPeerIsBackingOff {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:4 stubClient:stubClient];
+    [self enqueuePacketCount:25 withClient:queuedClient];
+    
+    stubClient.backingOff = YES;
+    NSError *error = nil;
+    [queuedClient processOrError:&error];
+    XCTAssertNotNil(error);
+    XCTAssertEqual(NiFiErrorSiteToSiteClientDestinationFull, error.code);
+    XCTAssertEqual(0, stubClient.transactionCount);
+    XCTAssertEqual(25, [_db countQueuedDataPacketsOrError:nil]);
+    
+    // draining resumes once a peer is no longer backing off
+    stubClient.backingOff = NO;
+    error = nil;
+    [queuedClient processOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testAdaptiveBatchSizing {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    stubClient.transactionLatency = 0.01; // fixed duration, so throughput grows with the batch
+    NiFiQueuedSiteToSiteClientConfig *config = [[NiFiQueuedSiteToSiteClientConfig alloc] init];
+    config.preferredBatchCount = @10;
+    config.dataPacketPrioritizer = [NiFiNoOpDataPacketPrioritizer prioritizerWithFixedTTL:60.0];
+    config.adaptiveBatchSizing = @YES;
+    config.minBatchCount = @5;
+    config.maxBatchCount = @14;
+    NiFiQueuedSiteToSiteClient *queuedClient = [[NiFiQueuedSiteToSiteClient alloc] initWithConfig:config database:_db];
+    queuedClient.siteToSiteClient = stubClient;
+    [self enqueuePacketCount:200 withClient:queuedClient];
+    XCTAssertEqual(10, [queuedClient currentBatchCount]);
+    
+    // each full batch grows the batch by a tenth of the preferred count, up to the max
+    NSError *error = nil;
+    for (int i = 0; i < 5; i++) {
+        [queuedClient processOrError:&error];
+        XCTAssertNil(error);
+    }
+    XCTAssertEqual(14, [queuedClient currentBatchCount]);
+    XCTAssertEqual(200 - (10 + 11 + 12 + 13 + 14), [_db countQueuedDataPacketsOrError:nil]);
+    
+    // a failed transaction halves it
+    stubClient.failTransactions = YES;
+    [queuedClient processOrError:&error];
+    XCTAssertNotNil(error);
+    XCTAssertEqual(7, [queuedClient currentBatchCount]);
+    
+    NiFiSiteToSiteQueueStatus *status = [queuedClient queueStatusOrError:nil];
+    XCTAssertEqual(7, status.batchCount);
+    XCTAssertGreaterThan(status.batchSizeBytes, 0);
+}
+
+- (void)testDrainSchedulerDrainsFullBatchWithoutWaitingForDeadline {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    queuedClient.config.maxQueuedPacketLatency = @60.0;
+    
+    XCTestExpectation *drained = [self expectationWithDescription:@"queue drained"];
+    __block BOOL fulfilled = NO;
+    [queuedClient startDrainSchedulerWithCompletionHandler:^(NiFiSiteToSiteQueueStatus *status, NSError *error) {
+        XCTAssertNil(error);
+        if (!fulfilled && stubClient.transactionCount > 0 && status.queuedPacketCount == 0) {
+            fulfilled = YES; // completion handlers are called from the drain queue, one at a time
+            [drained fulfill];
+        }
+    }];
+    [self enqueuePacketCount:30 withClient:queuedClient]; // three full batches, drained back to back
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    [queuedClient stopDrainScheduler];
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+}
+
+- (void)testDrainSchedulerDrainsPartialBatchAtDeadline {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    queuedClient.config.maxQueuedPacketLatency = @0.5;
+    
+    // wait for the initial drain, which finds the queue empty, so that it does not pick up the packets enqueued below
+    XCTestExpectation *initialDrain = [self expectationWithDescription:@"initial drain"];
+    __block BOOL fulfilled = NO;
+    [queuedClient startDrainSchedulerWithCompletionHandler:^(NiFiSiteToSiteQueueStatus *status, NSError *error) {
+        if (!fulfilled) {
+            fulfilled = YES;
+            [initialDrain fulfill];
+        }
+    }];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+    
+    [self enqueuePacketCount:3 withClient:queuedClient];
+    [NSThread sleepForTimeInterval:0.1];
+    XCTAssertEqual(3, [_db countQueuedDataPacketsOrError:nil]); // not a full batch, so it waits for the deadline
+    
+    NSDate *timeout = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while ([_db countQueuedDataPacketsOrError:nil] > 0 && [timeout timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.05];
+    }
+    XCTAssertEqual(0, [_db countQueuedDataPacketsOrError:nil]);
+    XCTAssertEqual(1, stubClient.transactionCount); // the empty queue was not drained with a transaction
+    
+    [queuedClient stopDrainScheduler];
+    XCTAssertFalse([queuedClient isDrainSchedulerRunning]);
+}
+
+- (void)measureProcessWithWorkerCount:(NSUInteger)workerCount {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    stubClient.transactionLatency = 0.02; // 20ms round trip per batch
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:workerCount stubClient:stubClient];
+    [self measureMetrics:[[self class] defaultPerformanceMetrics] automaticallyStartMeasuring:NO forBlock:^{
+        [self enqueuePacketCount:400 withClient:queuedClient];
+        [self startMeasuring];
+        NSError *error = nil;
+        do {
+            [queuedClient processOrError:&error];
+        } while (!error && [self.db countQueuedDataPacketsOrError:nil] > 0);
+        [self stopMeasuring];
+        XCTAssertNil(error);
+    }];
+}
+
+- (void)testPerformanceProcessOneWorker {
+    [self measureProcessWithWorkerCount:1];
+}
+
+- (void)testPerformanceProcessFourWorkers {
+    [self measureProcessWithWorkerCount:4];
+}
+
+- (void)testCleanupTruncatesOnlyWhenLimitCrossed {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    [self enqueuePacketCount:20 withClient:queuedClient];
+    
+    // a limit of 0 means no limit
+    queuedClient.config.maxQueuedPacketCount = @0;
+    queuedClient.config.maxQueuedPacketSize = @0;
+    NSError *error = nil;
+    [queuedClient cleanupOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(20, [_db countQueuedDataPacketsOrError:nil]);
+    
+    queuedClient.config.maxQueuedPacketCount = @20;
+    [queuedClient cleanupOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(20, [_db countQueuedDataPacketsOrError:nil]);
+    
+    queuedClient.config.maxQueuedPacketCount = @15;
+    [queuedClient cleanupOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(15, [_db countQueuedDataPacketsOrError:nil]);
+    
+    NSUInteger averageSize = [_db averageSizeQueuedDataPacketsOrError:nil];
+    queuedClient.config.maxQueuedPacketSize = @(10 * averageSize);
+    [queuedClient cleanupOrError:&error];
+    XCTAssertNil(error);
+    XCTAssertEqualWithAccuracy(10, [_db countQueuedDataPacketsOrError:nil], 1); // packet sizes differ slightly
+}
+
+/* Measures the enqueue path used by NiFiSiteToSiteService (enqueue, cleanup, status) against a queue already holding queuedRowCount packets */
+- (void)measureEnqueueWithQueuedRowCount:(NSUInteger)queuedRowCount {
+    StubSiteToSiteClient *stubClient = [[StubSiteToSiteClient alloc] init];
+    NiFiQueuedSiteToSiteClient *queuedClient = [self queuedClientWithWorkerCount:1 stubClient:stubClient];
+    queuedClient.config.maxQueuedPacketCount = @(2 * queuedRowCount);
+    queuedClient.config.maxQueuedPacketSize = @(1024L * 1024L * 1024L);
+    
+    NiFiQueuedDataPacketEntity *entity = [NiFiQueuedDataPacketEntity entityWithDataPacket:[NiFiDataPacket dataPacketWithString:@"Data Packet"]
+                                                                        packetPrioritizer:queuedClient.config.dataPacketPrioritizer
+                                                                                    error:nil];
+    NSUInteger chunkSize = MIN(queuedRowCount, 10000);
+    NSMutableArray *chunk = [NSMutableArray arrayWithCapacity:chunkSize];
+    for (NSUInteger i = 0; i < chunkSize; i++) {
+        [chunk addObject:entity];
+    }
+    for (NSUInteger inserted = 0; inserted < queuedRowCount; inserted += chunkSize) {
+        [_db insertQueuedDataPackets:chunk error:nil];
+    }
+    
+    NiFiDataPacket *packet = [NiFiDataPacket dataPacketWithString:@"Data Packet"];
+    [self measureBlock:^{
+        for (int i = 0; i < 100; i++) {
+            NSError *error = nil;
+            [queuedClient enqueueDataPacket:packet error:&error];
+            [queuedClient cleanupOrError:&error];
+            [queuedClient queueStatusOrError:&error];
+            XCTAssertNil(error);
+        }
+    }];
+}
+
+- (void)testPerformanceEnqueueWith10kQueuedRows {
+    [self measureEnqueueWithQueuedRowCount:10000];
+}
+
+- (void)testPerformanceEnqueueWith100kQueuedRows {
+    [self measureEnqueueWithQueuedRowCount:100000];
+}
+
+- (void)testPerformanceEnqueueWith1MQueuedRows {
+    // inserting a million rows takes minutes, so this only runs when asked for, e.g., in a scheme's environment variables
+    if (![[NSProcessInfo processInfo].environment[@"NIFI_S2S_LARGE_PERFORMANCE_TESTS"] boolValue]) {
+        NSLog(@"Skipping %@. Set NIFI_S2S_LARGE_PERFORMANCE_TESTS=1 to run it.", NSStringFromSelector(_cmd));
+        return;
+    }
+    [self measureEnqueueWithQueuedRowCount:1000000];
+}
+
+@end
@@ -16,13 +16,21 @@
  */
 
 #import <XCTest/XCTest.h>
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <unistd.h>
 #import "NiFiSocket.h"
+#import "NiFiSiteToSite.h"
+#import "NiFiSiteToSiteClient.h"
+#import "NiFiError.h"
 
 // MARK: - GCDAsyncSocket Mock
 
 @protocol GCDAsyncSocketDelegateProtocol <NSObject>
 - (void)socket:(id)sender didWriteDataWithTag:(long)tag;
 - (void)socket:(id)sender didReadData:(NSData *)data withTag:(long)tag;
+- (NSTimeInterval)socket:(id)sender shouldTimeoutReadWithTag:(long)tag elapsed:(NSTimeInterval)elapsed bytesDone:(NSUInteger)length;
+- (void)socketDidDisconnect:(id)sock withError:(NSError *)err;
 @end
 
 @protocol GCDAsyncSocketProtocol <NSObject>
@@ -36,6 +44,7 @@
 @interface MockGCDAsyncSocket : NSObject <GCDAsyncSocketProtocol>
 @property id delegate;
 @property NSMutableDictionary<NSString *, NSNumber *> *callCountPerSelector;
+- (void) incrementCallCountForSelectorString:(NSString *)sel;
 @end
 
 @implementation MockGCDAsyncSocket
@@ -88,6 +97,166 @@
 @end
 
 
+/* Answers each read with the next of a list of responses, as a server would, and times out reads once they run out. */
+@interface MockScriptedGCDAsyncSocket : MockGCDAsyncSocket
+@property NSMutableArray<NSData *> *responses;
+@property NSMutableArray<NSData *> *writes;
+- (instancetype)initWithResponses:(NSArray<NSData *> *)responses;
+@end
+
+@implementation MockScriptedGCDAsyncSocket
+
+- (instancetype)initWithResponses:(NSArray<NSData *> *)responses {
+    self = [super init];
+    if (self) {
+        _responses = [responses mutableCopy];
+        _writes = [NSMutableArray array];
+    }
+    return self;
+}
+
+- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag {
+    [self.writes addObject:data];
+    [super writeData:data withTimeout:timeout tag:tag];
+}
+
+- (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag {
+    [self incrementCallCountForSelectorString:NSStringFromSelector(_cmd)];
+    if (self.responses.count == 0) {
+        [self.delegate socket:self shouldTimeoutReadWithTag:tag elapsed:timeout bytesDone:0];
+        return;
+    }
+    NSData *response = self.responses[0];
+    [self.responses removeObjectAtIndex:0];
+    [self.delegate socket:self didReadData:response withTag:tag];
+}
+
+@end
+
+
+/* Holds writes without completing them, as a socket whose peer is not reading would, until the test completes them. */
+@interface MockHeldWritesGCDAsyncSocket : MockScriptedGCDAsyncSocket
+- (NSUInteger)heldWriteCount;
+- (void)completeHeldWritesWithError:(nullable NSError *)error; // a non-nil error fails them as a disconnect would
+@end
+
+@implementation MockHeldWritesGCDAsyncSocket {
+    NSMutableArray<NSNumber *> *_heldWriteTags;
+}
+
+- (instancetype)initWithResponses:(NSArray<NSData *> *)responses {
+    self = [super initWithResponses:responses];
+    if (self) {
+        _heldWriteTags = [NSMutableArray array];
+    }
+    return self;
+}
+
+// writes arrive on the transaction's thread while the test completes them, so the call counts are not updated here
+- (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag {
+    @synchronized(self) {
+        [self.writes addObject:data];
+        [_heldWriteTags addObject:@(tag)];
+    }
+}
+
+- (NSUInteger)heldWriteCount {
+    @synchronized(self) {
+        return _heldWriteTags.count;
+    }
+}
+
+- (void)completeHeldWritesWithError:(nullable NSError *)error {
+    id<GCDAsyncSocketDelegateProtocol> delegate = self.delegate;
+    NSArray<NSNumber *> *heldWriteTags;
+    @synchronized(self) {
+        heldWriteTags = [_heldWriteTags copy];
+        [_heldWriteTags removeAllObjects];
+    }
+    if (error) {
+        [delegate socketDidDisconnect:self withError:error];
+        return;
+    }
+    for (NSNumber *tag in heldWriteTags) {
+        [delegate socket:self didWriteDataWithTag:[tag longValue]];
+    }
+}
+
+@end
+
+
+
+// MARK: - Loopback Echo Server
+
+/* Accepts one connection on an ephemeral loopback port, and writes back everything it reads, until the client disconnects.
+ * Without echo, it closes the connection as soon as it is accepted, like a server closing an idle connection. */
+@interface LoopbackEchoServer : NSObject
+@property (readonly) uint16_t port;
+- (instancetype)initWithEcho:(BOOL)echo;
+@end
+
+@implementation LoopbackEchoServer {
+    int _listenFd;
+}
+
+- (instancetype)init {
+    return [self initWithEcho:YES];
+}
+
+- (instancetype)initWithEcho:(BOOL)echo {
+    self = [super init];
+    if (self) {
+        _listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_len = sizeof(addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addrLen = sizeof(addr);
+        if (_listenFd < 0 ||
+                bind(_listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+                listen(_listenFd, 1) != 0 ||
+                getsockname(_listenFd, (struct sockaddr *)&addr, &addrLen) != 0) {
+            if (_listenFd >= 0) {
+                close(_listenFd);
+            }
+            return nil;
+        }
+        _port = ntohs(addr.sin_port);
+        
+        int listenFd = _listenFd;
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            int connectionFd = accept(listenFd, NULL, NULL);
+            if (connectionFd < 0) {
+                return;
+            }
+            char buffer[4096];
+            ssize_t readCount;
+            while (echo && (readCount = read(connectionFd, buffer, sizeof(buffer))) > 0) {
+                ssize_t writtenCount = 0;
+                while (writtenCount < readCount) {
+                    ssize_t written = write(connectionFd, buffer + writtenCount, readCount - writtenCount);
+                    if (written <= 0) {
+                        break;
+                    }
+                    writtenCount += written;
+                }
+            }
+            close(connectionFd);
+        });
+    }
+    return self;
+}
+
+- (void)dealloc {
+    shutdown(_listenFd, SHUT_RDWR);
+    close(_listenFd);
+}
+
+@end
+
+
 
 // MARK: - NiFiSocket expose private interface methods for testing
 
@@ -95,6 +264,35 @@
 - (nullable instancetype) initWithAsyncSocket:(NSObject<GCDAsyncSocketProtocol> *)socket;
 @end
 
+@interface NiFiSocketConnection : NSObject
+- (nonnull instancetype) initWithSocket:(nonnull NiFiSocket *)socket peer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId;
+@end
+
+@interface NiFiSocketTransaction()
+@property (nonatomic, retain, readwrite, nullable) NiFiSocketConnection *connection;
+@property (nonatomic, nullable) dispatch_semaphore_t writeQueueSlots;
+@property (nonatomic, weak, readwrite, nullable) NiFiSocketConnectionPool *connectionPool;
+- (instancetype) initWithPeer:(NiFiPeer *)peer;
+- (NiFiSocket *) socket;
+- (void) setSocket:(NiFiSocket *)socket;
++ (nonnull NSData *) javaUTFDataForString:(nonnull NSString*)str;
+- (nullable NiFiTransactionResult *)endTransactionWithResponseCode:(NiFiTransactionResponseCode)responseCode
+                                                             error:(NSError *_Nullable *_Nullable)error;
+- (BOOL) drainWriteQueueOrError:(NSError *_Nullable *_Nullable)error;
+- (NSInteger) negotiateVersionForResource:(NSString *)resourceKey
+                      prioritizedVersions:(NSInteger[])prioritizedVersions
+                                      len:(NSInteger)versionsLength;
++ (NSInteger) cachedVersionForResource:(nonnull NSString *)resourceKey peer:(nonnull NiFiPeer *)peer;
++ (void) cacheVersion:(NSInteger)version forResource:(nonnull NSString *)resourceKey peer:(nonnull NiFiPeer *)peer;
+@end
+
+@interface NiFiSocketConnectionPool : NSObject
+@property (nonatomic, retain, nonnull) NSMutableDictionary<NSString *, NSMutableArray<NiFiSocketConnection *> *> *idleConnections;
+- (nonnull instancetype) initWithIdleExpiration:(NSTimeInterval)idleExpiration timeout:(NSTimeInterval)timeout;
+- (nullable NiFiSocketConnection *) checkOutConnectionForPeer:(nonnull NiFiPeer *)peer portId:(nonnull NSString *)portId;
+- (void) checkInConnection:(nonnull NiFiSocketConnection *)connection;
+@end
+
 
 
 // MARK: - NiFiSocketTests
@@ -169,6 +367,24 @@
     }];
 }
 
+- (void)testMultipleOutstandingWritesAsync {
+    MockGCDAsyncSocket *asyncSocket = [[MockGCDAsyncSocket alloc] init];
+    NiFiSocket *socket = [[NiFiSocket alloc] initWithAsyncSocket:asyncSocket];
+    
+    [socket connectToHost:@"localhost" onPort:0 error:nil];
+    XCTAssertNotNil(socket);
+    
+    __block NSUInteger callbackCount = 0;
+    for (int i = 0; i < 3; i++) {
+        [socket writeData:[@"Data" dataUsingEncoding:NSUTF8StringEncoding] withTimeout:0.1 callback:^(NSError *error) {
+            XCTAssertNil(error);
+            callbackCount++;
+        }];
+    }
+    XCTAssertEqual(3, callbackCount);
+    XCTAssertTrue([asyncSocket.callCountPerSelector[@"writeData:withTimeout:tag:"] isEqualToNumber:@3]);
+}
+
 - (void)testReadData {
     MockGCDAsyncSocket *asyncSocket = [[MockGCDAsyncSocket alloc] init];
     NiFiSocket *socket = [[NiFiSocket alloc] initWithAsyncSocket:asyncSocket];
@@ -207,7 +423,317 @@
     XCTAssertTrue([asyncSocket.callCountPerSelector[@"readDataWithTimeout:tag:"] isEqualToNumber:@1]);
 }
 
+- (void)testPerformanceBlockingWriteOverhead {
+    // Per-call overhead of the blocking API: the mock completes each write immediately
+    MockGCDAsyncSocket *asyncSocket = [[MockGCDAsyncSocket alloc] init];
+    NiFiSocket *socket = [[NiFiSocket alloc] initWithAsyncSocket:asyncSocket];
+    [socket connectToHost:@"localhost" onPort:0 error:nil];
+    NSData *data = [@"Data" dataUsingEncoding:NSUTF8StringEncoding];
+    
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            [socket writeData:data withTimeout:1.0 error:nil];
+        }
+    }];
+}
 
+- (void)testPerformanceLoopbackRequestResponse {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] init];
+    XCTAssertNotNil(server);
+    
+    NiFiSocket *socket = [NiFiSocket socket];
+    NSError *error = nil;
+    XCTAssertTrue([socket connectToHost:@"127.0.0.1" onPort:server.port error:&error]);
+    NSData *request = [@"ping" dataUsingEncoding:NSUTF8StringEncoding];
+    
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            NSError *roundTripError = nil;
+            [socket writeData:request withTimeout:5.0 error:&roundTripError];
+            NSData *response = [socket readDataToLength:request.length withTimeout:5.0 error:&roundTripError];
+            XCTAssertNil(roundTripError);
+            XCTAssertEqualObjects(request, response);
+        }
+    }];
+    
+    [socket disconnect];
+}
+
+- (void)testDisconnectCompletesPendingRead {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] init];
+    XCTAssertNotNil(server);
+    
+    NiFiSocket *socket = [NiFiSocket socket];
+    XCTAssertTrue([socket connectToHost:@"127.0.0.1" onPort:server.port error:nil]);
+    
+    // nothing was written, so the echo server sends nothing and the read can only end by disconnecting
+    XCTestExpectation *readCompleted = [self expectationWithDescription:@"read completed"];
+    [socket readDataWithTimeout:30.0 callback:^(NSData *data, NSError *error) {
+        XCTAssertNil(data);
+        XCTAssertNotNil(error);
+        [readCompleted fulfill];
+    }];
+    [socket disconnect];
+    [self waitForExpectationsWithTimeout:5.0 handler:nil];
+}
+
+// MARK: - Connection pool
+
+- (NiFiSocket *)socketConnectedToServer:(LoopbackEchoServer *)server {
+    NiFiSocket *socket = [NiFiSocket socket];
+    XCTAssertTrue([socket connectToHost:@"127.0.0.1" onPort:server.port error:nil]);
+    // the connection is established asynchronously
+    for (int i = 0; i < 200 && ![socket isConnected]; i++) {
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    XCTAssertTrue([socket isConnected]);
+    return socket;
+}
+
+- (NiFiPeer *)peerForServer:(LoopbackEchoServer *)server {
+    return [NiFiPeer peerWithUrl:[NSURL URLWithString:@"http://127.0.0.1:8080"] rawPort:@(server.port) rawIsSecure:NO];
+}
+
+- (void)testIsAlive {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] init];
+    NiFiSocket *socket = [self socketConnectedToServer:server];
+    XCTAssertTrue([socket isAlive]);
+    [socket disconnect];
+}
+
+- (void)testConnectionPoolReusesConnection {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] init];
+    NiFiSocket *socket = [self socketConnectedToServer:server];
+    NiFiPeer *peer = [self peerForServer:server];
+    NiFiSocketConnectionPool *pool = [[NiFiSocketConnectionPool alloc] initWithIdleExpiration:10.0 timeout:1.0];
+    NiFiSocketConnection *connection = [[NiFiSocketConnection alloc] initWithSocket:socket peer:peer portId:@"port"];
+    
+    [pool checkInConnection:connection];
+    XCTAssertNil([pool checkOutConnectionForPeer:peer portId:@"another port"]);
+    XCTAssertTrue(connection == [pool checkOutConnectionForPeer:peer portId:@"port"]);
+    XCTAssertNil([pool checkOutConnectionForPeer:peer portId:@"port"]); // not handed out again until it is checked in
+    
+    [socket disconnect];
+}
+
+- (void)testConnectionPoolEvictsIdleConnections {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] init];
+    NiFiSocket *socket = [self socketConnectedToServer:server];
+    NiFiPeer *peer = [self peerForServer:server];
+    NiFiSocketConnectionPool *pool = [[NiFiSocketConnectionPool alloc] initWithIdleExpiration:0.1 timeout:1.0];
+    
+    [pool checkInConnection:[[NiFiSocketConnection alloc] initWithSocket:socket peer:peer portId:@"port"]];
+    [NSThread sleepForTimeInterval:0.3];
+    XCTAssertNil([pool checkOutConnectionForPeer:peer portId:@"port"]);
+}
+
+- (void)testConnectionPoolDiscardsConnectionClosedByServer {
+    LoopbackEchoServer *server = [[LoopbackEchoServer alloc] initWithEcho:NO];
+    NiFiSocket *socket = [self socketConnectedToServer:server];
+    NiFiPeer *peer = [self peerForServer:server];
+    NiFiSocketConnectionPool *pool = [[NiFiSocketConnectionPool alloc] initWithIdleExpiration:10.0 timeout:1.0];
+    
+    [pool checkInConnection:[[NiFiSocketConnection alloc] initWithSocket:socket peer:peer portId:@"port"]];
+    [NSThread sleepForTimeInterval:0.3]; // the server closes the connection while it is idle in the pool
+    XCTAssertNil([pool checkOutConnectionForPeer:peer portId:@"port"]);
+}
+
+// MARK: - Version negotiation
+
+static NSData *ResourceOkResponse(void) {
+    Byte response[] = {20};
+    return [NSData dataWithBytes:response length:1];
+}
+
+static NSData *DifferentResourceVersionResponse(uint8_t maxVersion) {
+    Byte response[] = {21, 0, 0, 0, maxVersion};
+    return [NSData dataWithBytes:response length:5];
+}
+
+static NSData *AbortResponse(void) {
+    Byte response[] = {255};
+    return [NSData dataWithBytes:response length:1];
+}
+
+/* The version requested by a negotiation request, which ends with the version as a big endian int32 */
+static uint32_t RequestedVersion(NSData *request) {
+    uint32_t version;
+    [request getBytes:&version range:NSMakeRange(request.length - 4, 4)];
+    return CFSwapInt32BigToHost(version);
+}
+
+// negotiated versions are cached by peer host, so each test uses its own
+- (NiFiPeer *)uniquePeer {
+    NSString *host = [[[NSUUID UUID] UUIDString] lowercaseString];
+    return [NiFiPeer peerWithUrl:[NSURL URLWithString:[NSString stringWithFormat:@"http://%@:8080", host]] rawPort:@8081 rawIsSecure:NO];
+}
 
+- (NiFiSocketTransaction *)transactionWithPeer:(NiFiPeer *)peer asyncSocket:(MockScriptedGCDAsyncSocket *)asyncSocket {
+    NiFiSocketTransaction *transaction = [[NiFiSocketTransaction alloc] initWithPeer:peer];
+    [transaction setSocket:[[NiFiSocket alloc] initWithAsyncSocket:asyncSocket]];
+    transaction.config = [NiFiSiteToSiteClientConfig configWithRemoteCluster:[NiFiSiteToSiteRemoteClusterConfig configWithUrl:peer.url]];
+    return transaction;
+}
+
+- (void)testNegotiatedVersionIsTriedFirstOnNextConnection {
+    NiFiPeer *peer = [self uniquePeer];
+    NSInteger versions[] = {6, 5, 4};
+    
+    MockScriptedGCDAsyncSocket *firstSocket = [[MockScriptedGCDAsyncSocket alloc] initWithResponses:@[DifferentResourceVersionResponse(5), ResourceOkResponse()]];
+    NiFiSocketTransaction *firstTransaction = [self transactionWithPeer:peer asyncSocket:firstSocket];
+    XCTAssertEqual(5, [firstTransaction negotiateVersionForResource:@"SocketFlowFileProtocol" prioritizedVersions:versions len:3]);
+    XCTAssertEqual(2, firstSocket.writes.count);
+    XCTAssertEqual(5, RequestedVersion(firstSocket.writes[1])); // the server's max version is tried next
+    XCTAssertEqual(5, [NiFiSocketTransaction cachedVersionForResource:@"SocketFlowFileProtocol" peer:peer]);
+    
+    // the next connection to the peer asks for the negotiated version straight away, and agrees in one round trip
+    MockScriptedGCDAsyncSocket *secondSocket = [[MockScriptedGCDAsyncSocket alloc] initWithResponses:@[ResourceOkResponse()]];
+    NiFiSocketTransaction *secondTransaction = [self transactionWithPeer:peer asyncSocket:secondSocket];
+    XCTAssertEqual(5, [secondTransaction negotiateVersionForResource:@"SocketFlowFileProtocol" prioritizedVersions:versions len:3]);
+    XCTAssertEqual(1, secondSocket.writes.count);
+    XCTAssertEqual(5, RequestedVersion(secondSocket.writes[0]));
+    
+    // other resources are negotiated separately
+    XCTAssertEqual(-1, [NiFiSocketTransaction cachedVersionForResource:@"StandardFlowFileCodec" peer:peer]);
+}
+
+- (void)testNegotiatedVersionCacheInvalidatedOnDifferentResourceVersion {
+    NiFiPeer *peer = [self uniquePeer];
+    NSInteger versions[] = {6, 5, 4};
+    [NiFiSocketTransaction cacheVersion:6 forResource:@"SocketFlowFileProtocol" peer:peer];
+    
+    // the peer was downgraded, and the connection fails before another version is agreed
+    MockScriptedGCDAsyncSocket *asyncSocket = [[MockScriptedGCDAsyncSocket alloc] initWithResponses:@[DifferentResourceVersionResponse(5)]];
+    NiFiSocketTransaction *transaction = [self transactionWithPeer:peer asyncSocket:asyncSocket];
+    XCTAssertEqual(-1, [transaction negotiateVersionForResource:@"SocketFlowFileProtocol" prioritizedVersions:versions len:3]);
+    XCTAssertEqual(6, RequestedVersion(asyncSocket.writes[0]));
+    XCTAssertEqual(-1, [NiFiSocketTransaction cachedVersionForResource:@"SocketFlowFileProtocol" peer:peer]);
+}
+
+- (void)testNegotiatedVersionCacheInvalidatedOnAbort {
+    NiFiPeer *peer = [self uniquePeer];
+    NSInteger versions[] = {6, 5, 4};
+    [NiFiSocketTransaction cacheVersion:5 forResource:@"SocketFlowFileProtocol" peer:peer];
+    
+    MockScriptedGCDAsyncSocket *asyncSocket = [[MockScriptedGCDAsyncSocket alloc] initWithResponses:@[AbortResponse()]];
+    NiFiSocketTransaction *transaction = [self transactionWithPeer:peer asyncSocket:asyncSocket];
+    XCTAssertEqual(-1, [transaction negotiateVersionForResource:@"SocketFlowFileProtocol" prioritizedVersions:versions len:3]);
+    XCTAssertEqual(5, RequestedVersion(asyncSocket.writes[0]));
+    XCTAssertEqual(-1, [NiFiSocketTransaction cachedVersionForResource:@"SocketFlowFileProtocol" peer:peer]);
+}
+
+// MARK: - Connection reuse after a transaction
+
+static NSData *TransactionResponse(NiFiTransactionResponseCode responseCode) {
+    Byte response[] = {'R', 'C', responseCode, 0, 0}; // followed by an empty message
+    return [NSData dataWithBytes:response length:5];
+}
+
+/* Ends a transaction on a pooled connection, with the server answering the given response code, and returns the socket */
+- (MockScriptedGCDAsyncSocket *)endTransactionWithServerResponseCode:(NiFiTransactionResponseCode)responseCode
+                                                                pool:(NiFiSocketConnectionPool *)pool {
+    NiFiPeer *peer = [self uniquePeer];
+    MockScriptedGCDAsyncSocket *asyncSocket = [[MockScriptedGCDAsyncSocket alloc] initWithResponses:@[TransactionResponse(responseCode)]];
+    NiFiSocketTransaction *transaction = [self transactionWithPeer:peer asyncSocket:asyncSocket];
+    transaction.connectionPool = pool;
+    transaction.connection = [[NiFiSocketConnection alloc] initWithSocket:transaction.socket peer:peer portId:@"port"];
+    XCTAssertNotNil([transaction endTransactionWithResponseCode:CONFIRM_TRANSACTION error:nil]);
+    return asyncSocket;
+}
+
+- (void)testConnectionPooledOnlyAfterTransactionFinished {
+    NiFiSocketConnectionPool *pool = [[NiFiSocketConnectionPool alloc] initWithIdleExpiration:10.0 timeout:1.0];
+    
+    MockScriptedGCDAsyncSocket *finishedSocket = [self endTransactionWithServerResponseCode:TRANSACTION_FINISHED pool:pool];
+    XCTAssertEqual(1, pool.idleConnections.count);
+    XCTAssertNil(finishedSocket.callCountPerSelector[@"disconnectAfterReadingAndWriting"]);
+    
+    [self endTransactionWithServerResponseCode:TRANSACTION_FINISHED_BUT_DESTINATION_FULL pool:pool];
+    XCTAssertEqual(2, pool.idleConnections.count);
+    
+    // any other answer leaves the connection in an unknown state, so it is shut down instead
+    MockScriptedGCDAsyncSocket *badChecksumSocket = [self endTransactionWithServerResponseCode:BAD_CHECKSUM pool:pool];
+    XCTAssertEqual(2, pool.idleConnections.count);
+    XCTAssertEqualObjects([NiFiSocketTransaction javaUTFDataForString:@"SHUTDOWN"], [badChecksumSocket.writes lastObject]);
+    XCTAssertEqualObjects(@1, badChecksumSocket.callCountPerSelector[@"disconnectAfterReadingAndWriting"]);
+}
+
+// MARK: - Pipelined writes
+
+static NiFiDataPacket *TestDataPacket(NSUInteger packetNumber) {
+    return [NiFiDataPacket dataPacketWithAttributes:@{@"packetNumber": [NSString stringWithFormat:@"%lu", (unsigned long)packetNumber]}
+                                               data:[@"Data Packet" dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+/* A transaction that pipelines data packets to the socket, with at most queueDepth writes outstanding */
+- (NiFiSocketTransaction *)pipeliningTransactionWithAsyncSocket:(MockScriptedGCDAsyncSocket *)asyncSocket
+                                                     queueDepth:(NSUInteger)queueDepth
+                                                        timeout:(NSTimeInterval)timeout {
+    NiFiSocketTransaction *transaction = [self transactionWithPeer:[self uniquePeer] asyncSocket:asyncSocket];
+    transaction.config.socketWriteQueueDepth = queueDepth;
+    transaction.config.timeout = timeout;
+    dispatch_semaphore_t writeQueueSlots = dispatch_semaphore_create(0);
+    for (NSUInteger i = 0; i < queueDepth; i++) {
+        dispatch_semaphore_signal(writeQueueSlots);
+    }
+    transaction.writeQueueSlots = writeQueueSlots;
+    return transaction;
+}
+
+- (void)testPipelinedWritesBlockAtQueueDepth {
+    MockHeldWritesGCDAsyncSocket *asyncSocket = [[MockHeldWritesGCDAsyncSocket alloc] initWithResponses:@[]];
+    NiFiSocketTransaction *transaction = [self pipeliningTransactionWithAsyncSocket:asyncSocket queueDepth:2 timeout:5.0];
+    
+    XCTestExpectation *allSent = [self expectationWithDescription:@"all data packets sent"];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for (NSUInteger i = 0; i < 3; i++) {
+            [transaction sendData:TestDataPacket(i)];
+        }
+        [allSent fulfill];
+    });
+    
+    // the third packet waits for a slot, as two writes are outstanding
+    [NSThread sleepForTimeInterval:0.3];
+    XCTAssertEqual(2, [asyncSocket heldWriteCount]);
+    
+    [asyncSocket completeHeldWritesWithError:nil];
+    [self waitForExpectationsWithTimeout:2.0 handler:nil];
+    XCTAssertEqual(1, [asyncSocket heldWriteCount]);
+    XCTAssertEqual(3, asyncSocket.writes.count);
+    
+    [asyncSocket completeHeldWritesWithError:nil];
+    XCTAssertTrue([transaction drainWriteQueueOrError:nil]);
+}
+
+- (void)testPipelinedWriteErrorReturnedFromConfirm {
+    MockHeldWritesGCDAsyncSocket *asyncSocket = [[MockHeldWritesGCDAsyncSocket alloc] initWithResponses:@[]];
+    NiFiSocketTransaction *transaction = [self pipeliningTransactionWithAsyncSocket:asyncSocket queueDepth:2 timeout:5.0];
+    
+    [transaction sendData:TestDataPacket(1)];
+    NSError *socketError = [NSError errorWithDomain:NSPOSIXErrorDomain code:ECONNRESET userInfo:nil];
+    [asyncSocket completeHeldWritesWithError:socketError];
+    
+    // the error is reported when the transaction is confirmed, before the transaction is finished on the wire
+    NSError *error = nil;
+    XCTAssertNil([transaction confirmAndCompleteOrError:&error]);
+    XCTAssertEqualObjects(socketError, error);
+    XCTAssertEqual(TRANSACTION_ERROR, [transaction transactionState]);
+    XCTAssertEqual(1, asyncSocket.writes.count);
+}
+
+- (void)testPipelinedWriteDrainTimesOut {
+    MockHeldWritesGCDAsyncSocket *asyncSocket = [[MockHeldWritesGCDAsyncSocket alloc] initWithResponses:@[]];
+    NiFiSocketTransaction *transaction = [self pipeliningTransactionWithAsyncSocket:asyncSocket queueDepth:2 timeout:0.2];
+    
+    // the write is never completed, as if the peer stopped reading
+    [transaction sendData:TestDataPacket(1)];
+    
+    NSError *error = nil;
+    XCTAssertNil([transaction confirmAndCompleteOrError:&error]);
+    XCTAssertEqualObjects(NiFiErrorDomain, error.domain);
+    XCTAssertEqual(NiFiErrorTimeout, error.code);
+    XCTAssertEqual(TRANSACTION_ERROR, [transaction transactionState]);
+    XCTAssertEqual(1, asyncSocket.writes.count);
+}
 
 @end